@@ -0,0 +1,199 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "async_writer.h"
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
+// the writer re-checks the ring at least this often if a wakeup is missed
+#define PCM_ASYNC_WRITER_POLL_MS (10)
+
+static uint64 asyncWriterNowUs()
+{
+#ifdef _MSC_VER
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return uint64(double(now.QuadPart) * 1e6 / double(freq.QuadPart));
+#elif defined(__linux__) || defined(__FreeBSD__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64(ts.tv_sec) * 1000000ULL + uint64(ts.tv_nsec) / 1000ULL;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return uint64(tv.tv_sec) * 1000000ULL + uint64(tv.tv_usec);
+#endif
+}
+
+static inline void asyncWriterBarrier()
+{
+#ifdef _MSC_VER
+    MemoryBarrier();
+#else
+    __sync_synchronize();
+#endif
+}
+
+#ifdef _MSC_VER
+DWORD WINAPI AsyncSnapshotWriterProc(LPVOID writer)
+{
+    ((AsyncSnapshotWriter *)writer)->run();
+    return 0;
+}
+#else
+void * AsyncSnapshotWriterProc(void * writer)
+{
+    ((AsyncSnapshotWriter *)writer)->run();
+    return NULL;
+}
+#endif
+
+AsyncSnapshotWriter::AsyncSnapshotWriter(Formatter formatter_, void * context_, uint32 capacity, double maxLatency_) :
+    formatter(formatter_),
+    context(context_),
+    ring(capacity ? capacity : 1),
+    head(0),
+    tail(0),
+    dropped(0),
+    written(0),
+    late(0),
+    maxLatency(uint64(maxLatency_ * 1e6)),
+    stop(false)
+{
+#ifdef _MSC_VER
+    wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+    thread = CreateThread(NULL, 0, AsyncSnapshotWriterProc, this, 0, NULL);
+    if (thread == NULL)
+    {
+        std::cerr << "Can not start the output writer thread" << std::endl;
+        CloseHandle(wakeup);
+        throw std::exception();
+    }
+#else
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&wakeup, NULL);
+    if (pthread_create(&thread, NULL, AsyncSnapshotWriterProc, this) != 0)
+    {
+        std::cerr << "Can not start the output writer thread" << std::endl;
+        pthread_cond_destroy(&wakeup);
+        pthread_mutex_destroy(&mutex);
+        throw std::exception();
+    }
+#endif
+}
+
+AsyncSnapshotWriter::~AsyncSnapshotWriter()
+{
+    stop = true;
+    signal();
+#ifdef _MSC_VER
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CloseHandle(wakeup);
+#else
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&mutex);
+#endif
+    if (dropped || late) report(std::cerr);
+}
+
+SnapshotRecord * AsyncSnapshotWriter::acquire()
+{
+    if (head - tail >= ring.size())
+    {
+        ++dropped;
+        return NULL;
+    }
+    return &ring[head % ring.size()];
+}
+
+void AsyncSnapshotWriter::publish()
+{
+    ring[head % ring.size()].queued = asyncWriterNowUs();
+    asyncWriterBarrier(); // the record is complete before the writer can see it
+    head = head + 1;
+    signal();
+}
+
+void AsyncSnapshotWriter::report(std::ostream & out) const
+{
+    out << "Output writer: " << written << " records written, " << dropped << " dropped (ring of " << ring.size()
+        << " full), " << late << " written more than " << double(maxLatency) / 1e6 << " s after the sample" << std::endl;
+}
+
+void AsyncSnapshotWriter::signal()
+{
+    // never blocks the sampling thread: a wakeup lost in a race is caught by the polling of wait()
+#ifdef _MSC_VER
+    SetEvent(wakeup);
+#else
+    pthread_cond_signal(&wakeup);
+#endif
+}
+
+void AsyncSnapshotWriter::wait()
+{
+#ifdef _MSC_VER
+    WaitForSingleObject(wakeup, PCM_ASYNC_WRITER_POLL_MS);
+#else
+    struct timespec deadline;
+#if defined(__linux__) || defined(__FreeBSD__)
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    deadline.tv_sec = tv.tv_sec;
+    deadline.tv_nsec = tv.tv_usec * 1000;
+#endif
+    deadline.tv_nsec += PCM_ASYNC_WRITER_POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_nsec -= 1000000000L;
+        ++deadline.tv_sec;
+    }
+    pthread_mutex_lock(&mutex);
+    if (head == tail && !stop) pthread_cond_timedwait(&wakeup, &mutex, &deadline);
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void AsyncSnapshotWriter::run()
+{
+    uint64 reportedDrops = 0;
+    while (true)
+    {
+        const bool stopping = stop;
+        while (tail != head)
+        {
+            asyncWriterBarrier(); // read the record after seeing head
+            const SnapshotRecord & record = ring[tail % ring.size()];
+            if (asyncWriterNowUs() - record.queued > maxLatency) ++late;
+            formatter(record, context);
+            ++written;
+            asyncWriterBarrier(); // done with the record before the slot is released
+            tail = tail + 1;
+        }
+        if (dropped != reportedDrops)
+        {
+            reportedDrops = dropped;
+            report(std::cerr);
+        }
+        if (stopping) return; // everything published before the stop is written
+        wait();
+    }
+}
@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_ASYNC_WRITER_H
+#define CPUCounters_ASYNC_WRITER_H
+
+/*!     \file async_writer.h
+        \brief Output stage decoupled from the sampling thread
+
+        The sampling thread copies the counter states of an interval into a slot of a single-producer/
+        single-consumer ring and continues. A writer thread takes the records from the ring and calls the
+        formatter, which does the formatting and the (buffered) output. If the ring is full the record is
+        dropped: the sampling thread never waits for the output.
+*/
+
+#include "cpucounters.h"
+#include <iostream>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define PCM_ASYNC_WRITER_CAPACITY (256)
+
+//! \brief Counter states of one interval
+struct SnapshotRecord
+{
+    uint32 line;            // PCM::PCMLine programmed in the interval
+    uint64 start, end;      // invariant TSC when the counters were read (see TSCCalibration)
+    CounterSnapshot before, after;
+    uint64 queued;          // set by the writer: when the record was published, in microseconds
+};
+
+//! \brief Writes the records of the sampling thread in a thread of its own
+class AsyncSnapshotWriter
+{
+public:
+    //! \brief Formats and writes one record, called in the writer thread
+    typedef void (*Formatter)(const SnapshotRecord & record, void * context);
+
+    /*! \brief Starts the writer thread
+        \param formatter_ called for every record in the order of publishing
+        \param context_ passed to the formatter
+        \param capacity number of records the ring can hold
+        \param maxLatency_ records written later than this (in seconds) after they were published are counted as late
+        throws std::exception if the thread can not be started
+    */
+    AsyncSnapshotWriter(Formatter formatter_, void * context_, uint32 capacity = PCM_ASYNC_WRITER_CAPACITY, double maxLatency_ = 1.);
+    //! \brief Writes the remaining records, stops the thread and reports the dropped and late records to std::cerr
+    ~AsyncSnapshotWriter();
+
+    /*! \brief Returns the free slot to fill (sampling thread)
+        \return NULL if the ring is full, the record is counted as dropped then
+    */
+    SnapshotRecord * acquire();
+    //! \brief Hands the slot returned by acquire() over to the writer thread
+    void publish();
+
+    uint64 getWritten() const { return written; }
+    uint64 getDropped() const { return dropped; }
+    uint64 getLate() const { return late; }
+    void report(std::ostream & out) const;
+
+private:
+    Formatter formatter;
+    void * context;
+    std::vector<SnapshotRecord> ring;
+    volatile uint32 head;       // records published, written by the sampling thread only
+    volatile uint32 tail;       // records written, written by the writer thread only
+    volatile uint64 dropped;    // sampling thread only
+    uint64 written, late;       // writer thread only
+    uint64 maxLatency;          // in microseconds
+    volatile bool stop;
+#ifdef _MSC_VER
+    HANDLE thread;
+    HANDLE wakeup;              // auto-reset event
+    friend DWORD WINAPI AsyncSnapshotWriterProc(LPVOID writer);
+#else
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    friend void * AsyncSnapshotWriterProc(void * writer);
+#endif
+
+    void run();
+    void wait();
+    void signal();
+
+    AsyncSnapshotWriter();                      // forbidden
+    AsyncSnapshotWriter(AsyncSnapshotWriter &); // forbidden
+};
+
+#endif
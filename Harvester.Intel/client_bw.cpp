@@ -56,6 +56,11 @@ uint64 ClientBW::getImcWrites()
 
 ClientBW::~ClientBW() {}
 
+int32 ClientBW::deviceAccess(RegisterAccess &)
+{
+   return -1;
+}
+
 
 #elif __APPLE__
 
@@ -97,6 +102,11 @@ ClientBW::~ClientBW() {
 	PCIDriver_unmapMemory((uint8_t*)mmapAddr);
 }
 
+int32 ClientBW::deviceAccess(RegisterAccess &)
+{
+	return -1;
+}
+
 
 #elif (defined __FreeBSD__)
 
@@ -118,6 +128,11 @@ uint64 ClientBW::getImcWrites()
 
 ClientBW::~ClientBW() {}
 
+int32 ClientBW::deviceAccess(RegisterAccess &)
+{
+   return -1;
+}
+
 
 #else
 
@@ -126,10 +141,12 @@ ClientBW::~ClientBW() {}
 
 ClientBW::ClientBW() :
     fd(-1),
-    mmapAddr(NULL)
+    mmapAddr(NULL),
+    startAddr(0)
 {
-    int handle = ::open("/dev/mem", O_RDONLY);
-    if (handle < 0) throw std::exception();
+    const bool usesDevices = RegisterAccessBackend::get()->usesDevices();
+    int handle = usesDevices ? ::open("/dev/mem", O_RDONLY) : -1;
+    if (usesDevices && handle < 0) throw std::exception();
     fd = handle;
 
     PciHandleM imcHandle(0,0,0,0); // memory controller device coordinates: domain 0, bus 0, device 0, function 0
@@ -141,8 +158,9 @@ ClientBW::ClientBW() :
        std::cerr <<"ERROR: imcbar is zero." << std::endl;
        throw std::exception();
     }
-    uint64 startAddr = imcbar & (~(4096-1)); // round down to 4K
+    startAddr = imcbar & (~(4096-1)); // round down to 4K
     // std::cout << "DEBUG: startAddr="<<std::hex << startAddr <<std::endl;
+    if (!usesDevices) return;
     mmapAddr = (char*) mmap(NULL, PCM_CLIENT_IMC_MMAP_SIZE, PROT_READ, MAP_SHARED , fd, startAddr);
 
     if(mmapAddr == MAP_FAILED)
@@ -155,12 +173,31 @@ ClientBW::ClientBW() :
 
 uint64 ClientBW::getImcReads()
 {
-   return *((uint32*)(mmapAddr + PCM_CLIENT_IMC_DRAM_DATA_READS));
+   RegisterAccess a(RegisterAccess::MMIO_READ32, startAddr, PCM_CLIENT_IMC_DRAM_DATA_READS);
+   RegisterAccessBackend::get()->access(this, a);
+   return a.value[0];
 }
 
 uint64 ClientBW::getImcWrites()
 {
-   return *((uint32*)(mmapAddr + PCM_CLIENT_IMC_DRAM_DATA_WRITES));
+   RegisterAccess a(RegisterAccess::MMIO_READ32, startAddr, PCM_CLIENT_IMC_DRAM_DATA_WRITES);
+   RegisterAccessBackend::get()->access(this, a);
+   return a.value[0];
+}
+
+int32 ClientBW::deviceAccess(RegisterAccess & a)
+{
+   switch (a.type)
+   {
+   case RegisterAccess::MMIO_READ32:
+      a.value[0] = *((uint32*)(mmapAddr + a.address));
+      return sizeof(uint32);
+   case RegisterAccess::MMIO_READ64:
+      a.value[0] = *((uint64*)(mmapAddr + a.address));
+      return sizeof(uint64);
+   default:
+      return -1;
+   }
 }
 
 ClientBW::~ClientBW()
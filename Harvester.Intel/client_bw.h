@@ -22,6 +22,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 #include "types.h"
+#include "register_backend.h"
 
 #ifdef _MSC_VER
 #include "windows.h"
@@ -33,13 +34,15 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #define PCM_CLIENT_IMC_DRAM_DATA_READS  (0x5050)
 #define PCM_CLIENT_IMC_DRAM_DATA_WRITES (0x5054)
 #define PCM_CLIENT_IMC_MMAP_SIZE        (0x6000)
+#define PCM_CLIENT_IMC_MAX_LINES_PER_SECOND (1000000000.) // 64-byte lines, above the peak bandwidth of the client memory controllers
 
 
-class ClientBW
+class ClientBW : public RegisterDevice
 {
 #ifdef __linux__
     int32 fd;
     char * mmapAddr;
+    uint64 startAddr;
 #endif
 #ifdef __APPLE__
     char * mmapAddr;
@@ -51,6 +54,8 @@ public:
    uint64 getImcReads();
    uint64 getImcWrites();
 
+   int32 deviceAccess(RegisterAccess & a);
+
    ~ClientBW();
 };
 
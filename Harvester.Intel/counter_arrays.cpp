@@ -0,0 +1,261 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "counter_arrays.h"
+#include "cpucounters.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PCM_COUNTER_ARRAYS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PCM_COUNTER_ARRAYS_SSE2
+#endif
+
+// the arrays are padded to a multiple of the widest vector (4 x 64 bit)
+#define PCM_COUNTER_ARRAYS_PADDING (4)
+
+void CoreCounterArrays::resize(uint32 numCores_)
+{
+    const uint32 stride_ = (numCores_ + PCM_COUNTER_ARRAYS_PADDING - 1) & ~(PCM_COUNTER_ARRAYS_PADDING - 1);
+    if (numCores_ == numCores && stride_ == stride) return;
+    numCores = numCores_;
+    stride = stride_;
+    data.assign(NUM_COUNTERS * stride, 0);
+}
+
+void CoreCounterArrays::load(const CoreCounterState * states, uint32 numStates)
+{
+    resize(numStates);
+    for (uint32 i = 0; i < numCores; ++i)
+    {
+        const CoreCounterState & s = states[i];
+        data[INST_RETIRED_ANY * stride + i] = s.InstRetiredAny;
+        data[CPU_CLK_UNHALTED_THREAD * stride + i] = s.CpuClkUnhaltedThread;
+        data[CPU_CLK_UNHALTED_REF * stride + i] = s.CpuClkUnhaltedRef;
+        for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j)
+            data[(EVENT0 + j) * stride + i] = s.Event[j];
+        data[INVARIANT_TSC * stride + i] = s.InvariantTSC;
+        data[C3_RESIDENCY * stride + i] = s.C3Residency;
+        data[C6_RESIDENCY * stride + i] = s.C6Residency;
+        data[C7_RESIDENCY * stride + i] = s.C7Residency;
+    }
+}
+
+void CoreCounterArrays::load(const std::vector<CoreCounterState> & states)
+{
+    load(states.empty() ? NULL : &states[0], (uint32)states.size());
+}
+
+void CoreCounterArrays::computeDelta(const CoreCounterArrays & before, const CoreCounterArrays & after)
+{
+    resize(after.numCores);
+    if (data.empty()) return;
+    const uint64 * a = &after.data[0];
+    const uint64 * b = &before.data[0];
+    uint64 * d = &data[0];
+    const size_t n = data.size(); // all counters in one pass, the padding is zero in both inputs
+    size_t i = 0;
+#if defined(PCM_COUNTER_ARRAYS_AVX2)
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                                 _mm256_loadu_si256((const __m256i *)(b + i))));
+#elif defined(PCM_COUNTER_ARRAYS_SSE2)
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_si128((__m128i *)(d + i), _mm_sub_epi64(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                           _mm_loadu_si128((const __m128i *)(b + i))));
+#endif
+    for (; i < n; ++i)
+        d[i] = a[i] - b[i];
+}
+
+void CoreMetricArrays::resize(uint32 numCores_)
+{
+    if (numCores_ == numCores && data.size() == NUM_METRICS * numCores_) return;
+    numCores = numCores_;
+    data.assign(NUM_METRICS * numCores, 0.);
+}
+
+// reference implementation, follows the template functions in cpucounters.h
+static void computeMetricsScalar(const CoreCounterArrays & d, CoreMetricArrays & m, bool atom, CoreCounterArrays::Counter tlbMissEvent, uint32 begin, uint32 end)
+{
+    const uint64 * inst = d[CoreCounterArrays::INST_RETIRED_ANY];
+    const uint64 * clk = d[CoreCounterArrays::CPU_CLK_UNHALTED_THREAD];
+    const uint64 * ref = d[CoreCounterArrays::CPU_CLK_UNHALTED_REF];
+    const uint64 * tsc = d[CoreCounterArrays::INVARIANT_TSC];
+    const uint64 * e0 = d[CoreCounterArrays::EVENT0];
+    const uint64 * e1 = d[CoreCounterArrays::EVENT1];
+    const uint64 * e2 = d[CoreCounterArrays::EVENT2];
+    const uint64 * e3 = d[CoreCounterArrays::EVENT3];
+    const uint64 * tlb = d[tlbMissEvent];
+
+    for (uint32 i = begin; i < end; ++i)
+    {
+        const int64 clocks = (int64)clk[i];
+        const int64 ref_clocks = (int64)ref[i];
+        const int64 timer_clocks = (int64)tsc[i];
+
+        m[CoreMetricArrays::IPC][i] = clocks ? double(inst[i]) / double(clocks) : -1;
+        m[CoreMetricArrays::EXEC_USAGE][i] = timer_clocks ? double(inst[i]) / double(timer_clocks) : -1;
+        m[CoreMetricArrays::RELATIVE_FREQUENCY][i] = timer_clocks ? double(clocks) / double(timer_clocks) : -1;
+        m[CoreMetricArrays::ACTIVE_RELATIVE_FREQUENCY][i] = ref_clocks ? double(clocks) / double(ref_clocks) : -1;
+        m[CoreMetricArrays::CYCLES_LOST_TLB_MISSES][i] = clocks ? (double(tlb[i]) * 30) / double(clocks) : -1;
+        if (atom)
+        {
+            m[CoreMetricArrays::CYCLES_LOST_L3_MISSES][i] = -1;
+            m[CoreMetricArrays::CYCLES_LOST_L2_MISSES][i] = -1;
+            m[CoreMetricArrays::L3_HIT_RATIO][i] = -1;
+            m[CoreMetricArrays::L2_HIT_RATIO][i] = e1[i] ? 1. - (double(e0[i]) / double(e1[i])) : 1;
+        }
+        else
+        {
+            m[CoreMetricArrays::CYCLES_LOST_L3_MISSES][i] = clocks ? 180. * double(e0[i]) / double(clocks) : -1;
+            m[CoreMetricArrays::CYCLES_LOST_L2_MISSES][i] = clocks ? (35. * double(e1[i]) + 74. * double(e2[i])) / double(clocks) : -1;
+            const uint64 l3All = e2[i] + e1[i] + e0[i];
+            m[CoreMetricArrays::L3_HIT_RATIO][i] = l3All ? double(e1[i] + e2[i]) / double(l3All) : 1;
+            const uint64 l2All = e3[i] + e2[i] + e1[i] + e0[i];
+            m[CoreMetricArrays::L2_HIT_RATIO][i] = l2All ? double(e3[i]) / double(l2All) : 1;
+        }
+    }
+}
+
+#if defined(PCM_COUNTER_ARRAYS_AVX2) || defined(PCM_COUNTER_ARRAYS_SSE2)
+
+/*
+   The vector kernel converts the 64-bit deltas to double with the 2^52 bias trick which is exact
+   only for small values. Blocks with a delta >= 2^49 (e.g. a wrapped counter, a "negative" delta)
+   are computed with the scalar code, so the results are always the same as the scalar ones.
+*/
+#define PCM_COUNTER_ARRAYS_LARGE_BITS (0xFFFE000000000000ULL)
+#define PCM_COUNTER_ARRAYS_BIAS (0x4330000000000000ULL) // 2^52 as double
+
+#if defined(PCM_COUNTER_ARRAYS_AVX2)
+struct MetricVector
+{
+    enum { WIDTH = 4 };
+    typedef __m256i ivec;
+    typedef __m256d dvec;
+    static ivec load(const uint64 * p) { return _mm256_loadu_si256((const __m256i *)p); }
+    static ivec add(ivec a, ivec b) { return _mm256_add_epi64(a, b); }
+    static ivec bitOr(ivec a, ivec b) { return _mm256_or_si256(a, b); }
+    static bool small(ivec a) { return _mm256_testz_si256(a, _mm256_set1_epi64x((long long)PCM_COUNTER_ARRAYS_LARGE_BITS)) != 0; }
+    static dvec toDouble(ivec a)
+    {
+        const __m256i bias = _mm256_set1_epi64x((long long)PCM_COUNTER_ARRAYS_BIAS);
+        return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(a, bias)), _mm256_castsi256_pd(bias));
+    }
+    static dvec set(double v) { return _mm256_set1_pd(v); }
+    static dvec add(dvec a, dvec b) { return _mm256_add_pd(a, b); }
+    static dvec sub(dvec a, dvec b) { return _mm256_sub_pd(a, b); }
+    static dvec mul(dvec a, dvec b) { return _mm256_mul_pd(a, b); }
+    static dvec div(dvec a, dvec b) { return _mm256_div_pd(a, b); }
+    static dvec isZero(dvec a) { return _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_EQ_OQ); }
+    static dvec select(dvec mask, dvec a, dvec b) { return _mm256_blendv_pd(b, a, mask); } // mask ? a : b
+    static void store(double * p, dvec a) { _mm256_storeu_pd(p, a); }
+};
+#else
+struct MetricVector
+{
+    enum { WIDTH = 2 };
+    typedef __m128i ivec;
+    typedef __m128d dvec;
+    static ivec load(const uint64 * p) { return _mm_loadu_si128((const __m128i *)p); }
+    static ivec add(ivec a, ivec b) { return _mm_add_epi64(a, b); }
+    static ivec bitOr(ivec a, ivec b) { return _mm_or_si128(a, b); }
+    static bool small(ivec a)
+    {
+        const __m128i large = _mm_and_si128(a, _mm_set1_epi64x((long long)PCM_COUNTER_ARRAYS_LARGE_BITS));
+        return _mm_movemask_epi8(_mm_cmpeq_epi32(large, _mm_setzero_si128())) == 0xFFFF;
+    }
+    static dvec toDouble(ivec a)
+    {
+        const __m128i bias = _mm_set1_epi64x((long long)PCM_COUNTER_ARRAYS_BIAS);
+        return _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(a, bias)), _mm_castsi128_pd(bias));
+    }
+    static dvec set(double v) { return _mm_set1_pd(v); }
+    static dvec add(dvec a, dvec b) { return _mm_add_pd(a, b); }
+    static dvec sub(dvec a, dvec b) { return _mm_sub_pd(a, b); }
+    static dvec mul(dvec a, dvec b) { return _mm_mul_pd(a, b); }
+    static dvec div(dvec a, dvec b) { return _mm_div_pd(a, b); }
+    static dvec isZero(dvec a) { return _mm_cmpeq_pd(a, _mm_setzero_pd()); }
+    static dvec select(dvec mask, dvec a, dvec b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+    static void store(double * p, dvec a) { _mm_storeu_pd(p, a); }
+};
+#endif
+
+// returns the number of cores computed (a multiple of the vector width)
+static uint32 computeMetricsVector(const CoreCounterArrays & d, CoreMetricArrays & m, bool atom, CoreCounterArrays::Counter tlbMissEvent)
+{
+    typedef MetricVector V;
+    const uint32 n = d.size();
+    const V::dvec minusOne = V::set(-1.), one = V::set(1.);
+    uint32 i = 0;
+    for (; i + V::WIDTH <= n; i += V::WIDTH)
+    {
+        const V::ivec inst = V::load(d[CoreCounterArrays::INST_RETIRED_ANY] + i);
+        const V::ivec clk = V::load(d[CoreCounterArrays::CPU_CLK_UNHALTED_THREAD] + i);
+        const V::ivec ref = V::load(d[CoreCounterArrays::CPU_CLK_UNHALTED_REF] + i);
+        const V::ivec tsc = V::load(d[CoreCounterArrays::INVARIANT_TSC] + i);
+        const V::ivec e0 = V::load(d[CoreCounterArrays::EVENT0] + i);
+        const V::ivec e1 = V::load(d[CoreCounterArrays::EVENT1] + i);
+        const V::ivec e2 = V::load(d[CoreCounterArrays::EVENT2] + i);
+        const V::ivec e3 = V::load(d[CoreCounterArrays::EVENT3] + i);
+        const V::ivec tlb = V::load(d[tlbMissEvent] + i);
+
+        if (!V::small(V::bitOr(V::bitOr(V::bitOr(inst, clk), V::bitOr(ref, tsc)), V::bitOr(V::bitOr(e0, e1), V::bitOr(V::bitOr(e2, e3), tlb)))))
+        {
+            computeMetricsScalar(d, m, atom, tlbMissEvent, i, i + V::WIDTH);
+            continue;
+        }
+
+        const V::dvec fInst = V::toDouble(inst), fClk = V::toDouble(clk), fRef = V::toDouble(ref), fTsc = V::toDouble(tsc);
+        const V::dvec fE0 = V::toDouble(e0), fE1 = V::toDouble(e1), fE2 = V::toDouble(e2), fE3 = V::toDouble(e3);
+        const V::dvec clkZero = V::isZero(fClk), tscZero = V::isZero(fTsc);
+
+        V::store(m[CoreMetricArrays::IPC] + i, V::select(clkZero, minusOne, V::div(fInst, fClk)));
+        V::store(m[CoreMetricArrays::EXEC_USAGE] + i, V::select(tscZero, minusOne, V::div(fInst, fTsc)));
+        V::store(m[CoreMetricArrays::RELATIVE_FREQUENCY] + i, V::select(tscZero, minusOne, V::div(fClk, fTsc)));
+        V::store(m[CoreMetricArrays::ACTIVE_RELATIVE_FREQUENCY] + i, V::select(V::isZero(fRef), minusOne, V::div(fClk, fRef)));
+        V::store(m[CoreMetricArrays::CYCLES_LOST_TLB_MISSES] + i, V::select(clkZero, minusOne, V::div(V::mul(V::toDouble(tlb), V::set(30.)), fClk)));
+        if (atom)
+        {
+            V::store(m[CoreMetricArrays::CYCLES_LOST_L3_MISSES] + i, minusOne);
+            V::store(m[CoreMetricArrays::CYCLES_LOST_L2_MISSES] + i, minusOne);
+            V::store(m[CoreMetricArrays::L3_HIT_RATIO] + i, minusOne);
+            V::store(m[CoreMetricArrays::L2_HIT_RATIO] + i, V::select(V::isZero(fE1), one, V::sub(one, V::div(fE0, fE1))));
+        }
+        else
+        {
+            V::store(m[CoreMetricArrays::CYCLES_LOST_L3_MISSES] + i, V::select(clkZero, minusOne, V::div(V::mul(V::set(180.), fE0), fClk)));
+            V::store(m[CoreMetricArrays::CYCLES_LOST_L2_MISSES] + i, V::select(clkZero, minusOne,
+                     V::div(V::add(V::mul(V::set(35.), fE1), V::mul(V::set(74.), fE2)), fClk)));
+            const V::ivec l3All = V::add(V::add(e2, e1), e0);
+            const V::dvec fL3All = V::toDouble(l3All);
+            V::store(m[CoreMetricArrays::L3_HIT_RATIO] + i, V::select(V::isZero(fL3All), one, V::div(V::toDouble(V::add(e1, e2)), fL3All)));
+            const V::dvec fL2All = V::toDouble(V::add(l3All, e3));
+            V::store(m[CoreMetricArrays::L2_HIT_RATIO] + i, V::select(V::isZero(fL2All), one, V::div(fE3, fL2All)));
+        }
+    }
+    return i;
+}
+#endif
+
+void CoreMetricArrays::compute(const CoreCounterArrays & delta, bool atom, CoreCounterArrays::Counter tlbMissEvent)
+{
+    resize(delta.size());
+    uint32 i = 0;
+#if defined(PCM_COUNTER_ARRAYS_AVX2) || defined(PCM_COUNTER_ARRAYS_SSE2)
+    i = computeMetricsVector(delta, *this, atom, tlbMissEvent);
+#endif
+    computeMetricsScalar(delta, *this, atom, tlbMissEvent, i, numCores);
+}
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_COUNTER_ARRAYS_H
+#define CPUCounters_COUNTER_ARRAYS_H
+
+/*!     \file counter_arrays.h
+        \brief Structure-of-arrays layout of the core counter states and kernels computing the per-core metrics of all cores in one pass
+
+        The kernels use AVX2 or SSE2 if the compiler targets them (__AVX2__, __SSE2__, x64) and scalar code otherwise.
+        The results are the same as the ones of the corresponding template functions in cpucounters.h
+        (getIPC, getL3CacheHitRatio, getCyclesLostDueL3CacheMisses, etc.).
+*/
+
+#include "types.h"
+#include <vector>
+
+class CoreCounterState;
+
+//! \brief Counters of all cores, one contiguous array per counter
+class CoreCounterArrays
+{
+public:
+    enum Counter {
+        INST_RETIRED_ANY = 0,
+        CPU_CLK_UNHALTED_THREAD,
+        CPU_CLK_UNHALTED_REF,
+        EVENT0,                 // L3Miss, ArchLLCMiss on Atom
+        EVENT1,                 // L3UnsharedHit, ArchLLCRef on Atom
+        EVENT2,                 // L2HitM
+        EVENT3,                 // L2Hit
+        EVENT4,                 // counters 4-7 are programmed only with Intel(r) Hyper-Threading off
+        EVENT5,
+        EVENT6,
+        EVENT7,
+        INVARIANT_TSC,
+        C3_RESIDENCY,
+        C6_RESIDENCY,
+        C7_RESIDENCY,
+        NUM_COUNTERS
+    };
+
+    CoreCounterArrays(uint32 numCores_ = 0) : numCores(0), stride(0)
+    {
+        resize(numCores_);
+    }
+
+    //! \brief Allocates the arrays (the only allocation, reuse the object between intervals)
+    void resize(uint32 numCores_);
+
+    //! \brief Transposes the core counter states into the arrays (resizes if needed)
+    void load(const CoreCounterState * states, uint32 numStates);
+    void load(const std::vector<CoreCounterState> & states);
+
+    uint32 size() const { return numCores; }
+
+    uint64 * operator [] (Counter c) { return &data[c * stride]; }
+    const uint64 * operator [] (Counter c) const { return &data[c * stride]; }
+
+    /*! \brief Computes after - before for all counters of all cores
+        \param before arrays with the same number of cores
+        \param after arrays with the same number of cores
+    */
+    void computeDelta(const CoreCounterArrays & before, const CoreCounterArrays & after);
+
+private:
+    uint32 numCores;
+    uint32 stride;              // number of cores rounded up to the vector width, the padding is zero
+    std::vector<uint64> data;   // NUM_COUNTERS * stride
+};
+
+//! \brief Derived metrics of all cores, one contiguous array per metric
+class CoreMetricArrays
+{
+public:
+    enum Metric {
+        IPC = 0,                    // getIPC
+        EXEC_USAGE,                 // getExecUsage
+        RELATIVE_FREQUENCY,         // getRelativeFrequency
+        ACTIVE_RELATIVE_FREQUENCY,  // getActiveRelativeFrequency
+        CYCLES_LOST_L3_MISSES,      // getCyclesLostDueL3CacheMisses
+        CYCLES_LOST_L2_MISSES,      // getCyclesLostDueL2CacheMisses
+        CYCLES_LOST_TLB_MISSES,     // getCyclesLostDueTLBMisses
+        L3_HIT_RATIO,               // getL3CacheHitRatio
+        L2_HIT_RATIO,               // getL2CacheHitRatio
+        NUM_METRICS
+    };
+
+    CoreMetricArrays(uint32 numCores_ = 0) : numCores(0)
+    {
+        resize(numCores_);
+    }
+
+    void resize(uint32 numCores_);
+
+    uint32 size() const { return numCores; }
+
+    double * operator [] (Metric m) { return &data[m * numCores]; }
+    const double * operator [] (Metric m) const { return &data[m * numCores]; }
+
+    /*! \brief Computes all metrics of all cores from counter deltas
+        \param delta counter deltas (see CoreCounterArrays::computeDelta)
+        \param atom true for Intel(r) Atom(tm) processors (metrics that are not supported there are -1)
+        \param tlbMissEvent counter with the DTLB miss events for CYCLES_LOST_TLB_MISSES (EVENT4 in the PCM::TLB_CACHE_LINE mode)
+    */
+    void compute(const CoreCounterArrays & delta, bool atom, CoreCounterArrays::Counter tlbMissEvent = CoreCounterArrays::EVENT0);
+
+private:
+    uint32 numCores;
+    std::vector<double> data;   // NUM_METRICS * numCores
+};
+
+#endif
@@ -0,0 +1,261 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "counter_history.h"
+
+// the first column of a sample is its duration, followed by the core and the socket columns
+static inline uint32 historyColumns(uint32 numCores, uint32 numSockets, uint32 numEvents)
+{
+    return 1 + numCores * (CounterHistorySample::EVENT0 + numEvents) + numSockets * CounterHistorySample::SOCKET_COLUMNS;
+}
+
+static void putBits(std::vector<uint64> & bits, uint64 & size, uint64 value, uint32 n)
+{
+    if (n == 0) return;
+    if (n < 64) value &= (1ULL << n) - 1ULL;
+    const uint32 offset = uint32(size % 64);
+    if (offset == 0) bits.push_back(0);
+    bits.back() |= value << offset;
+    if (offset + n > 64) bits.push_back(value >> (64 - offset));
+    size += n;
+}
+
+static uint64 getBits(const std::vector<uint64> & bits, uint64 & pos, uint32 n)
+{
+    if (n == 0) return 0;
+    const size_t word = size_t(pos / 64);
+    const uint32 offset = uint32(pos % 64);
+    uint64 value = bits[word] >> offset;
+    if (offset + n > 64) value |= bits[word + 1] << (64 - offset);
+    pos += n;
+    return (n == 64) ? value : (value & ((1ULL << n) - 1ULL));
+}
+
+// delta-of-delta as zigzag: small changes in either direction get few significant bits
+static inline void putDelta(std::vector<uint64> & bits, uint64 & size, uint64 delta, uint64 last)
+{
+    const int64 dod = int64(delta - last);
+    const uint64 z = (uint64(dod) << 1) ^ uint64(dod >> 63);
+    if (z == 0)
+    {
+        putBits(bits, size, 0, 1);
+        return;
+    }
+    uint32 n = 64;
+    while (((z >> (n - 1)) & 1ULL) == 0) --n;
+    putBits(bits, size, 1ULL | (uint64(n - 1) << 1), 7);
+    putBits(bits, size, z, n - 1); // the leading 1 is implied
+}
+
+static inline uint64 getDelta(const std::vector<uint64> & bits, uint64 & pos, uint64 last)
+{
+    if (getBits(bits, pos, 1) == 0) return last;
+    const uint32 n = uint32(getBits(bits, pos, 6)) + 1;
+    const uint64 z = getBits(bits, pos, n - 1) | (1ULL << (n - 1));
+    const int64 dod = int64(z >> 1) ^ -int64(z & 1ULL);
+    return last + uint64(dod);
+}
+
+CounterHistory::CounterHistory(PCM * m_, double retention_, uint32 samplesPerBlock_) :
+    m(m_),
+    numCores(m_->getNumCores()),
+    numSockets(m_->getNumSockets()),
+    samplesPerBlock(samplesPerBlock_ ? samplesPerBlock_ : 1),
+    calibration(m_->calibrateTSC()),
+    retention(uint64(retention_ * double(calibration.frequency))),
+    numSamples(0),
+    previousTSC(0),
+    previousGeneration(0),
+    havePrevious(false)
+{
+#ifdef _MSC_VER
+    InitializeCriticalSection(&mutex);
+#else
+    pthread_mutex_init(&mutex, NULL);
+#endif
+}
+
+CounterHistory::~CounterHistory()
+{
+    for (size_t i = 0; i < blocks.size(); ++i) delete blocks[i];
+#ifdef _MSC_VER
+    DeleteCriticalSection(&mutex);
+#else
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+void CounterHistory::lock() const
+{
+#ifdef _MSC_VER
+    EnterCriticalSection(&mutex);
+#else
+    pthread_mutex_lock(&mutex);
+#endif
+}
+
+void CounterHistory::unlock() const
+{
+#ifdef _MSC_VER
+    LeaveCriticalSection(&mutex);
+#else
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void CounterHistory::add(uint64 tsc, uint32 generation, const CounterSnapshot & snapshot)
+{
+    lock();
+    if (!havePrevious || generation != previousGeneration || tsc <= previousTSC ||
+        snapshot.cores.size() != numCores || snapshot.sockets.size() != numSockets)
+    {
+        // the deltas across a reprogramming of the counters are meaningless, only remember the states
+        previous = snapshot;
+        previousTSC = tsc;
+        previousGeneration = generation;
+        havePrevious = (snapshot.cores.size() == numCores && snapshot.sockets.size() == numSockets);
+        unlock();
+        return;
+    }
+
+    const uint32 numEvents = m->getNumCustomCoreEventsUsed();
+    const uint32 columns = historyColumns(numCores, numSockets, numEvents);
+    Block * block = blocks.empty() ? NULL : blocks.back();
+    if (block == NULL || block->samples == samplesPerBlock || block->generation != generation || block->numEvents != numEvents)
+    {
+        if (block) std::vector<uint64>(block->bits).swap(block->bits); // release the spare capacity of the closed block
+        block = new Block();
+        block->start = previousTSC;
+        block->generation = generation;
+        block->numEvents = numEvents;
+        block->samples = 0;
+        block->size = 0;
+        blocks.push_back(block);
+        lastDeltas.assign(columns, 0);
+    }
+
+    deltas.resize(columns);
+    uint64 * d = &deltas[0];
+    *d++ = tsc - previousTSC;
+    for (uint32 i = 0; i < numCores; ++i)
+    {
+        const CoreCounterState & b = previous.cores[i], & a = snapshot.cores[i];
+        *d++ = getInstructionsRetired(b, a);
+        *d++ = getCycles(b, a);
+        *d++ = getRefCycles(b, a);
+        for (uint32 e = 0; e < numEvents; ++e) *d++ = getNumberOfCustomEvents(e, b, a);
+    }
+    for (uint32 s = 0; s < numSockets; ++s)
+    {
+        const SocketCounterState & b = previous.sockets[s], & a = snapshot.sockets[s];
+        *d++ = getBytesReadFromMC(b, a);
+        *d++ = getBytesWrittenToMC(b, a);
+        *d++ = getConsumedEnergy(b, a);
+        *d++ = getDRAMConsumedEnergy(b, a);
+    }
+
+    for (uint32 c = 0; c < columns; ++c)
+    {
+        putDelta(block->bits, block->size, deltas[c], lastDeltas[c]);
+        lastDeltas[c] = deltas[c];
+    }
+    block->end = tsc;
+    ++block->samples;
+    ++numSamples;
+
+    // the open block is always kept
+    while (blocks.size() > 1 && blocks.front()->end + retention < tsc)
+    {
+        numSamples -= blocks.front()->samples;
+        delete blocks.front();
+        blocks.pop_front();
+    }
+
+    previous = snapshot;
+    previousTSC = tsc;
+    unlock();
+}
+
+void CounterHistory::decode(const Block & block, uint64 from, uint64 to, uint64 bucket, std::vector<CounterHistorySample> & result, uint32 & count) const
+{
+    const uint32 coreColumns = CounterHistorySample::EVENT0 + block.numEvents;
+    const uint32 columns = historyColumns(numCores, numSockets, block.numEvents);
+    std::vector<uint64> last(columns, 0);
+    uint64 pos = 0;
+    uint64 start = block.start;
+
+    for (uint32 i = 0; i < block.samples; ++i)
+    {
+        for (uint32 c = 0; c < columns; ++c) last[c] = getDelta(block.bits, pos, last[c]);
+        const uint64 end = start + last[0];
+        if (end > from && start < to)
+        {
+            CounterHistorySample * sample = count ? &result[count - 1] : NULL;
+            const bool merge = bucket && sample && sample->generation == block.generation && sample->numEvents == block.numEvents &&
+                (sample->start > from ? (sample->start - from) / bucket : 0) == (start > from ? (start - from) / bucket : 0);
+            if (merge)
+            {
+                for (uint32 c = 0; c < sample->cores.size(); ++c) sample->cores[c] += last[1 + c];
+                for (uint32 c = 0; c < sample->sockets.size(); ++c) sample->sockets[c] += last[1 + numCores * coreColumns + c];
+                sample->end = end;
+                ++sample->samples;
+            }
+            else
+            {
+                if (count == result.size()) result.push_back(CounterHistorySample());
+                sample = &result[count++];
+                sample->start = start;
+                sample->end = end;
+                sample->generation = block.generation;
+                sample->numEvents = block.numEvents;
+                sample->samples = 1;
+                sample->cores.assign(last.begin() + 1, last.begin() + 1 + numCores * coreColumns);
+                sample->sockets.assign(last.begin() + 1 + numCores * coreColumns, last.end());
+            }
+        }
+        start = end;
+    }
+}
+
+uint32 CounterHistory::query(uint64 from, uint64 to, uint64 bucket, std::vector<CounterHistorySample> & result) const
+{
+    uint32 count = 0;
+    lock();
+    for (size_t b = 0; b < blocks.size(); ++b)
+    {
+        const Block & block = *blocks[b];
+        if (block.samples == 0 || block.end <= from || block.start >= to) continue;
+        decode(block, from, to, bucket, result, count);
+    }
+    unlock();
+    result.resize(count);
+    return count;
+}
+
+uint64 CounterHistory::getNumSamples() const
+{
+    lock();
+    const uint64 result = numSamples;
+    unlock();
+    return result;
+}
+
+uint64 CounterHistory::getMemoryUsage() const
+{
+    lock();
+    uint64 result = 0;
+    for (size_t b = 0; b < blocks.size(); ++b)
+        result += sizeof(Block) + blocks[b]->bits.capacity() * sizeof(uint64);
+    unlock();
+    return result;
+}
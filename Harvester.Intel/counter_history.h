@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_COUNTER_HISTORY_H
+#define CPUCounters_COUNTER_HISTORY_H
+
+/*!     \file counter_history.h
+        \brief Compressed in-memory history of the counter deltas (see PCM::enableCounterHistory)
+
+        Every snapshot read with PCM::getAllCounterStates(CounterSnapshot &) adds a sample: the duration and the
+        deltas to the previous snapshot per core and per socket. The samples are kept in blocks of up to
+        samplesPerBlock samples. Within a block every column is stored as the difference of its delta to the
+        delta of the previous sample (delta-of-delta), zigzag encoded and bit packed:
+
+            '0'                             the delta did not change
+            '1' + 6 bits n-1 + n-1 bits     n significant bits, the leading 1 is implied
+
+        A block decodes on its own, blocks older than the retention are dropped as a whole. A new block is
+        started when the core counters are reprogrammed (see PCM::getProgramGeneration), so all samples of a
+        block count the same events.
+*/
+
+#include "cpucounters.h"
+#include <deque>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define PCM_HISTORY_SAMPLES_PER_BLOCK (256)
+
+//! \brief Counter deltas of one interval, or of several consecutive intervals summed up (see CounterHistory::query)
+struct CounterHistorySample
+{
+    uint64 start, end;              // invariant TSC, see CounterHistory::getCalibration
+    uint32 generation;              // PCM::getProgramGeneration() of the interval
+    uint32 numEvents;               // general purpose counter columns per core
+    uint32 samples;                 // intervals summed up
+    std::vector<uint64> cores;      // numCores x getCoreColumns()
+    std::vector<uint64> sockets;    // numSockets x SOCKET_COLUMNS
+
+    //! \brief Core columns
+    enum CoreColumn
+    {
+        INSTRUCTIONS,
+        CYCLES,
+        REF_CYCLES,
+        EVENT0                      // EVENT0 + i is the general purpose counter i
+    };
+    //! \brief Socket columns (the energy is in the units of PCM::getJoulesPerEnergyUnit)
+    enum SocketColumn
+    {
+        MC_READ_BYTES,
+        MC_WRITTEN_BYTES,
+        PACKAGE_ENERGY,
+        DRAM_ENERGY,
+        SOCKET_COLUMNS
+    };
+
+    uint32 getCoreColumns() const { return EVENT0 + numEvents; }
+    uint64 getCore(uint32 core, uint32 column) const { return cores[core * getCoreColumns() + column]; }
+    uint64 getSocket(uint32 socket, uint32 column) const { return sockets[socket * SOCKET_COLUMNS + column]; }
+};
+
+//! \brief Keeps the counter deltas of the last seconds, thread-safe
+class CounterHistory
+{
+public:
+    /*! \brief Creates an empty history
+        \param m PCM instance (initialized)
+        \param retention seconds of history to keep
+        \param samplesPerBlock samples compressed together, the unit in which old samples are dropped
+    */
+    CounterHistory(PCM * m, double retention, uint32 samplesPerBlock = PCM_HISTORY_SAMPLES_PER_BLOCK);
+    ~CounterHistory();
+
+    /*! \brief Adds the deltas to the previous snapshot
+        \param tsc invariant TSC when the snapshot was read
+        \param generation PCM::getProgramGeneration() when the snapshot was read, no sample is added if it changed
+        \param snapshot counter states
+    */
+    void add(uint64 tsc, uint32 generation, const CounterSnapshot & snapshot);
+
+    /*! \brief Returns the samples of a time range
+        \param from,to invariant TSC, the samples that overlap [from, to) are returned
+        \param bucket if not 0 the samples are summed up into intervals of this many TSC ticks starting at from,
+               samples of different generations are never summed up
+        \param result the samples in time order (return parameter)
+        \return number of samples returned
+    */
+    uint32 query(uint64 from, uint64 to, uint64 bucket, std::vector<CounterHistorySample> & result) const;
+
+    //! \brief Converts the TSC of the samples into time
+    const TSCCalibration & getCalibration() const { return calibration; }
+    //! \brief Number of samples kept
+    uint64 getNumSamples() const;
+    //! \brief Bytes allocated for the compressed samples
+    uint64 getMemoryUsage() const;
+
+private:
+    struct Block
+    {
+        uint64 start, end;          // start of the first and end of the last sample
+        uint32 generation, numEvents, samples;
+        std::vector<uint64> bits;   // packed columns, sample by sample
+        uint64 size;                // in bits
+    };
+
+    PCM * m;
+    uint32 numCores, numSockets;
+    uint32 samplesPerBlock;
+    TSCCalibration calibration;
+    uint64 retention;               // in TSC ticks
+    std::deque<Block *> blocks;
+    uint64 numSamples;
+    CounterSnapshot previous;
+    uint64 previousTSC;
+    uint32 previousGeneration;
+    bool havePrevious;
+    std::vector<uint64> deltas, lastDeltas; // of the current and the previous sample of the open block
+#ifdef _MSC_VER
+    mutable CRITICAL_SECTION mutex;
+#else
+    mutable pthread_mutex_t mutex;
+#endif
+
+    void lock() const;
+    void unlock() const;
+    void decode(const Block & block, uint64 from, uint64 to, uint64 bucket, std::vector<CounterHistorySample> & result, uint32 & count) const;
+
+    CounterHistory();                   // forbidden
+    CounterHistory(CounterHistory &);   // forbidden
+};
+
+#endif
@@ -0,0 +1,391 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "counter_trace.h"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#pragma warning(disable : 4996) // for fopen
+#endif
+
+namespace {
+
+void putU32(std::vector<unsigned char> & out, uint32 v)
+{
+    for (int i = 0; i < 4; ++i) out.push_back((unsigned char)(v >> (8 * i)));
+}
+
+void putU64(std::vector<unsigned char> & out, uint64 v)
+{
+    for (int i = 0; i < 8; ++i) out.push_back((unsigned char)(v >> (8 * i)));
+}
+
+void putVarint(std::vector<unsigned char> & out, uint64 v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((unsigned char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((unsigned char)v);
+}
+
+bool readU32(FILE * f, uint32 & v)
+{
+    unsigned char b[4];
+    if (fread(b, 1, 4, f) != 4) return false;
+    v = b[0] | (uint32(b[1]) << 8) | (uint32(b[2]) << 16) | (uint32(b[3]) << 24);
+    return true;
+}
+
+bool readU64(FILE * f, uint64 & v)
+{
+    uint32 lo, hi;
+    if (!readU32(f, lo) || !readU32(f, hi)) return false;
+    v = lo | (uint64(hi) << 32);
+    return true;
+}
+
+uint32 getU32(const unsigned char * p)
+{
+    return p[0] | (uint32(p[1]) << 8) | (uint32(p[2]) << 16) | (uint32(p[3]) << 24);
+}
+
+// returns false if the varint runs past end
+bool getVarint(const unsigned char * & p, const unsigned char * end, uint64 & v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        const unsigned char b = *p++;
+        v |= uint64(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+} // namespace
+
+CounterTraceWriter::CounterTraceWriter(PCM * m_, const char * path, const TSCCalibration & calibration, uint32 rowsPerChunk_) :
+    m(m_), file(NULL), rowsPerChunk(rowsPerChunk_ ? rowsPerChunk_ : 1), rows(0), lastStart(calibration.tsc)
+{
+    header.numCores = m->getNumCores();
+    header.numSockets = m->getNumSockets();
+    header.qpiLinksPerSocket = (uint32)m->getQPILinksPerSocket();
+    header.numEvents = m->getMaxCustomCoreEvents();
+    header.cpuModel = m->getCPUModel();
+    header.nominalFrequency = m->getNominalFrequency();
+    header.calibration = calibration;
+    for (uint32 i = 0; i < header.numCores; ++i)
+        header.socketOfCore.push_back(m->getSocketId(i));
+
+    file = fopen(path, "wb");
+    if (!file)
+    {
+        std::cerr << "Can not create the trace file " << path << std::endl;
+        throw std::exception();
+    }
+
+    buffer.clear();
+    putU32(buffer, PCM_TRACE_MAGIC);
+    putU32(buffer, PCM_TRACE_VERSION);
+    putU32(buffer, header.numCores);
+    putU32(buffer, header.numSockets);
+    putU32(buffer, header.qpiLinksPerSocket);
+    putU32(buffer, header.numEvents);
+    putU32(buffer, (uint32)header.cpuModel);
+    putU64(buffer, header.nominalFrequency);
+    putU64(buffer, header.calibration.frequency);
+    putU64(buffer, header.calibration.tsc);
+    putU64(buffer, header.calibration.monotonicRaw);
+    putU64(buffer, header.calibration.realtime);
+    for (uint32 i = 0; i < header.numCores; ++i)
+        putU32(buffer, header.socketOfCore[i]);
+    fwrite(&buffer[0], 1, buffer.size(), file);
+
+    columns.resize((size_t)header.getNumColumns() * rowsPerChunk);
+}
+
+CounterTraceWriter::~CounterTraceWriter()
+{
+    if (file)
+    {
+        flush();
+        fclose(file);
+    }
+}
+
+CounterTraceLine CounterTraceWriter::getProgrammedLine(PCM * m, uint32 line, const char * name)
+{
+    CounterTraceLine l;
+    l.line = line;
+    l.name = name;
+    for (uint32 i = 0; i < m->getNumCustomCoreEventsUsed(); ++i)
+        l.events.push_back(m->getCoreEventDescription(i));
+    return l;
+}
+
+void CounterTraceWriter::describeLine(const CounterTraceLine & l)
+{
+    if (l.line < described.size() && described[l.line]) return;
+    if (l.line >= described.size()) described.resize(l.line + 1, false);
+    described[l.line] = true;
+
+    // the rows buffered so far were counted with the lines described before
+    flush();
+
+    const uint32 numEvents = (std::min)((uint32)l.events.size(), header.numEvents);
+    const uint32 nameLength = (uint32)l.name.size();
+    buffer.clear();
+    putU32(buffer, PCM_TRACE_LINE_RECORD);
+    putU32(buffer, 4 + 4 + 8 * numEvents + 4 + nameLength);
+    putU32(buffer, l.line);
+    putU32(buffer, numEvents);
+    for (uint32 i = 0; i < numEvents; ++i)
+    {
+        putU32(buffer, (uint32)l.events[i].event_number);
+        putU32(buffer, (uint32)l.events[i].umask_value);
+    }
+    putU32(buffer, nameLength);
+    buffer.insert(buffer.end(), l.name.begin(), l.name.end());
+    fwrite(&buffer[0], 1, buffer.size(), file);
+}
+
+void CounterTraceWriter::write(uint32 line, uint64 start, uint64 end, const CounterSnapshot & before, const CounterSnapshot & after)
+{
+    uint64 * c = &columns[rows];
+    const uint32 stride = rowsPerChunk;
+    // the start is stored as the difference to the previous row, the first row of a chunk to the calibration
+    c[0] = start - (rows == 0 ? header.calibration.tsc : lastStart); c += stride;
+    lastStart = start;
+    c[0] = end - start; c += stride;
+    c[0] = line; c += stride;
+
+    for (uint32 i = 0; i < header.numCores; ++i)
+    {
+        const CoreCounterState & b = before.cores[i], & a = after.cores[i];
+        c[0] = getInstructionsRetired(b, a); c += stride;
+        c[0] = getCycles(b, a); c += stride;
+        c[0] = getRefCycles(b, a); c += stride;
+        c[0] = getInvariantTSC(b, a); c += stride;
+        for (uint32 e = 0; e < header.numEvents; ++e)
+        {
+            c[0] = getNumberOfCustomEvents(e, b, a); c += stride;
+        }
+    }
+    for (uint32 s = 0; s < header.numSockets; ++s)
+    {
+        c[0] = getBytesReadFromMC(before.sockets[s], after.sockets[s]); c += stride;
+        c[0] = getBytesWrittenToMC(before.sockets[s], after.sockets[s]); c += stride;
+    }
+    for (uint32 s = 0; s < header.numSockets; ++s)
+        for (uint32 l = 0; l < header.qpiLinksPerSocket; ++l)
+        {
+            c[0] = getIncomingQPILinkBytes(s, l, before.system, after.system); c += stride;
+            c[0] = getOutgoingQPILinkBytes(s, l, before.system, after.system); c += stride;
+        }
+
+    if (++rows == rowsPerChunk) flush();
+}
+
+void CounterTraceWriter::flush()
+{
+    if (rows == 0) return;
+
+    const uint32 numColumns = header.getNumColumns();
+    buffer.clear();
+    putU32(buffer, PCM_TRACE_CHUNK_RECORD);
+    putU32(buffer, 0); // payload size, patched below
+    putU32(buffer, rows);
+    putU32(buffer, numColumns);
+    for (uint32 col = 0; col < numColumns; ++col)
+    {
+        const uint64 * c = &columns[(size_t)col * rowsPerChunk];
+        for (uint32 r = 0; r < rows; ++r)
+            putVarint(buffer, c[r]);
+    }
+    const uint32 payload = (uint32)buffer.size() - 8;
+    for (int i = 0; i < 4; ++i) buffer[4 + i] = (unsigned char)(payload >> (8 * i));
+    fwrite(&buffer[0], 1, buffer.size(), file);
+    fflush(file);
+    rows = 0;
+}
+
+CounterTraceReader::CounterTraceReader(const char * path) : file(NULL), rows(0), row(0), start(0), corrupt(false)
+{
+    file = fopen(path, "rb");
+    if (!file)
+    {
+        std::cerr << "Can not open the trace file " << path << std::endl;
+        throw std::exception();
+    }
+    uint32 magic = 0, version = 0, cpuModel = 0;
+    bool ok = readU32(file, magic) && magic == PCM_TRACE_MAGIC && readU32(file, version);
+    if (ok && version != PCM_TRACE_VERSION)
+    {
+        std::cerr << path << " has the trace format version " << version << ", supported is " << PCM_TRACE_VERSION << std::endl;
+        ok = false;
+    }
+    ok = ok &&
+        readU32(file, header.numCores) &&
+        readU32(file, header.numSockets) &&
+        readU32(file, header.qpiLinksPerSocket) &&
+        readU32(file, header.numEvents) &&
+        readU32(file, cpuModel) &&
+        readU64(file, header.nominalFrequency) &&
+        readU64(file, header.calibration.frequency) &&
+        readU64(file, header.calibration.tsc) &&
+        readU64(file, header.calibration.monotonicRaw) &&
+        readU64(file, header.calibration.realtime) &&
+        header.calibration.frequency > 0 &&
+        header.numEvents <= PCM_MAX_CORE_GEN_COUNTERS;
+    header.cpuModel = (int32)cpuModel;
+    for (uint32 i = 0; ok && i < header.numCores; ++i)
+    {
+        uint32 socket = 0;
+        ok = readU32(file, socket);
+        header.socketOfCore.push_back(socket);
+    }
+    if (!ok)
+    {
+        std::cerr << path << " is not a counter trace" << std::endl;
+        fclose(file);
+        throw std::exception();
+    }
+}
+
+CounterTraceReader::~CounterTraceReader()
+{
+    fclose(file);
+}
+
+const CounterTraceLine * CounterTraceReader::getLine(uint32 line) const
+{
+    for (size_t i = 0; i < lines.size(); ++i)
+        if (lines[i].line == line) return &lines[i];
+    return NULL;
+}
+
+std::string CounterTraceReader::getColumnName(uint32 column) const
+{
+    static const char * coreNames[] = { "INST", "CYCLES", "REF_CYCLES", "TSC" };
+    static const char * socketNames[] = { "MC_READ_BYTES", "MC_WRITTEN_BYTES" };
+    static const char * qpiNames[] = { "QPI_IN_BYTES", "QPI_OUT_BYTES" };
+    static const char * rowNames[] = { "START_TSC", "DURATION_TSC", "LINE" };
+    std::ostringstream name;
+
+    if (column < 3) return rowNames[column];
+    column -= 3;
+    const uint32 coreColumns = header.getCoreColumns();
+    if (column < header.numCores * coreColumns)
+    {
+        const uint32 c = column % coreColumns;
+        name << "CORE" << column / coreColumns << '.';
+        if (c < CounterTraceHeader::EVENT0) name << coreNames[c];
+        else name << "EVENT" << (c - CounterTraceHeader::EVENT0);
+        return name.str();
+    }
+    column -= header.numCores * coreColumns;
+    if (column < header.numSockets * CounterTraceHeader::SOCKET_COLUMNS)
+    {
+        name << "SKT" << column / CounterTraceHeader::SOCKET_COLUMNS << '.' << socketNames[column % CounterTraceHeader::SOCKET_COLUMNS];
+        return name.str();
+    }
+    column -= header.numSockets * CounterTraceHeader::SOCKET_COLUMNS;
+    const uint32 link = column / CounterTraceHeader::QPI_COLUMNS;
+    name << "SKT" << link / header.qpiLinksPerSocket << ".LINK" << link % header.qpiLinksPerSocket << '.' << qpiNames[column % CounterTraceHeader::QPI_COLUMNS];
+    return name.str();
+}
+
+bool CounterTraceReader::readChunk()
+{
+    uint32 type = 0, size = 0;
+    bool inRecord = false; // a record was started but not read completely
+    std::vector<unsigned char> payload;
+    while (readU32(file, type))
+    {
+        inRecord = true;
+        if (!readU32(file, size)) break;
+        payload.resize(size);
+        if (size && fread(&payload[0], 1, size, file) != size) break;
+        const unsigned char * p = size ? &payload[0] : NULL, * end = p + size;
+
+        if (type == PCM_TRACE_LINE_RECORD)
+        {
+            if (size < 12) break;
+            CounterTraceLine l;
+            l.line = getU32(p);
+            const uint32 numEvents = getU32(p + 4);
+            if (size < 12 + 8 * uint64(numEvents)) break;
+            p += 8;
+            for (uint32 i = 0; i < numEvents; ++i, p += 8)
+            {
+                PCM::CustomCoreEventDescription e;
+                e.event_number = (int32)getU32(p);
+                e.umask_value = (int32)getU32(p + 4);
+                l.events.push_back(e);
+            }
+            const uint32 nameLength = getU32(p);
+            p += 4;
+            if (uint64(end - p) < nameLength) break;
+            l.name.assign((const char *)p, nameLength);
+            lines.push_back(l);
+        }
+        else if (type == PCM_TRACE_CHUNK_RECORD)
+        {
+            if (size < 8) break;
+            rows = getU32(p);
+            const uint32 numColumns = getU32(p + 4);
+            p += 8;
+            if (rows == 0) break; // not written by CounterTraceWriter::flush
+            if (numColumns != header.getNumColumns() || uint64(rows) * numColumns > uint64(end - p)) break;
+            columns.resize((size_t)rows * numColumns);
+            bool ok = true;
+            for (size_t i = 0; ok && i < columns.size(); ++i)
+                ok = getVarint(p, end, columns[i]);
+            if (!ok) break;
+            row = 0;
+            return true;
+        }
+        // records of unknown type are skipped
+        inRecord = false;
+    }
+    if (!feof(file) || inRecord) corrupt = true;
+    rows = row = 0;
+    return false;
+}
+
+bool CounterTraceReader::next(CounterTraceRow & r)
+{
+    if (row == rows && !readChunk()) return false;
+
+    const uint64 * c = &columns[row];
+    const uint32 stride = rows;
+    start = ((row == 0) ? header.calibration.tsc : start) + c[0];
+    c += stride;
+    r.start = start;
+    r.end = start + c[0]; c += stride;
+    r.line = (uint32)c[0]; c += stride;
+
+    r.cores.resize((size_t)header.numCores * header.getCoreColumns());
+    for (size_t i = 0; i < r.cores.size(); ++i, c += stride) r.cores[i] = c[0];
+    r.sockets.resize((size_t)header.numSockets * CounterTraceHeader::SOCKET_COLUMNS);
+    for (size_t i = 0; i < r.sockets.size(); ++i, c += stride) r.sockets[i] = c[0];
+    r.qpi.resize((size_t)header.numSockets * header.qpiLinksPerSocket * CounterTraceHeader::QPI_COLUMNS);
+    for (size_t i = 0; i < r.qpi.size(); ++i, c += stride) r.qpi[i] = c[0];
+
+    ++row;
+    return true;
+}
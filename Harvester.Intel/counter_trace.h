@@ -0,0 +1,187 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_COUNTER_TRACE_H
+#define CPUCounters_COUNTER_TRACE_H
+
+/*!     \file counter_trace.h
+        \brief Compact binary trace of the raw counter deltas (written by pcm.x --trace, decoded by pcm-trace.x)
+
+        The file starts with a header describing the topology, followed by records. A line record
+        describes the events programmed in the general purpose counters for one PCM::PCMLine, a chunk
+        record holds up to rowsPerChunk intervals (rows) stored column by column:
+
+            start, duration, line                       one value per row (invariant TSC ticks)
+            per core: instructions, cycles, reference cycles, invariant TSC, event 0..numEvents-1
+            per socket: bytes read from / written to the memory controller
+            per socket and QPI link: incoming and outgoing bytes
+
+        All values are unsigned LEB128 varints. The start of the first row of a chunk is relative to the TSC
+        of the calibration in the header, the start of the other rows is the difference to the previous row.
+        The counter values are the exact 64-bit deltas of the interval, nothing is rounded.
+        Multi-byte fields of the header and the record headers are little endian.
+*/
+
+#include "cpucounters.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define PCM_TRACE_MAGIC (0x54524350)        // "PCRT"
+#define PCM_TRACE_VERSION (2)
+#define PCM_TRACE_LINE_RECORD (0x454e494c)  // "LINE"
+#define PCM_TRACE_CHUNK_RECORD (0x4b4e4843) // "CHNK"
+#define PCM_TRACE_ROWS_PER_CHUNK (256)
+
+//! \brief Topology and counter layout of a trace
+struct CounterTraceHeader
+{
+    uint32 numCores, numSockets, qpiLinksPerSocket;
+    uint32 numEvents;           // general purpose counter columns per core
+    int32 cpuModel;
+    uint64 nominalFrequency;    // in Hz
+    TSCCalibration calibration; // converts the TSC of the rows into CLOCK_MONOTONIC_RAW and CLOCK_REALTIME
+    std::vector<uint32> socketOfCore;
+
+    //! \brief Core columns
+    enum CoreColumn
+    {
+        INSTRUCTIONS,
+        CYCLES,
+        REF_CYCLES,
+        INVARIANT_TSC,
+        EVENT0,                 // EVENT0 + i is the general purpose counter i
+    };
+    //! \brief Socket columns
+    enum SocketColumn
+    {
+        MC_READ_BYTES,
+        MC_WRITTEN_BYTES,
+        SOCKET_COLUMNS
+    };
+    //! \brief QPI link columns
+    enum QPIColumn
+    {
+        QPI_INCOMING_BYTES,
+        QPI_OUTGOING_BYTES,
+        QPI_COLUMNS
+    };
+
+    uint32 getCoreColumns() const { return EVENT0 + numEvents; }
+    uint32 getNumColumns() const { return 3 + numCores * getCoreColumns() + numSockets * SOCKET_COLUMNS + numSockets * qpiLinksPerSocket * QPI_COLUMNS; }
+};
+
+//! \brief Events programmed for one line
+struct CounterTraceLine
+{
+    uint32 line;                // PCM::PCMLine
+    std::string name;
+    std::vector<PCM::CustomCoreEventDescription> events; // general purpose counters 0, 1, ...
+};
+
+//! \brief One interval of a trace
+struct CounterTraceRow
+{
+    uint64 start, end;          // invariant TSC when the counters were read, see CounterTraceHeader::calibration
+    uint32 line;                // PCM::PCMLine programmed in the interval
+    std::vector<uint64> cores;  // numCores x getCoreColumns()
+    std::vector<uint64> sockets;// numSockets x SOCKET_COLUMNS
+    std::vector<uint64> qpi;    // numSockets x qpiLinksPerSocket x QPI_COLUMNS
+};
+
+//! \brief Writes the counter deltas of the intervals into a trace file
+class CounterTraceWriter
+{
+public:
+    /*! \brief Creates the file and writes the header
+        \param m PCM instance (initialized)
+        \param path file name
+        \param calibration the TSC of the rows is converted into time with it (see PCM::calibrateTSC)
+        \param rowsPerChunk rows buffered and written together
+        throws std::exception if the file can not be created
+    */
+    CounterTraceWriter(PCM * m, const char * path, const TSCCalibration & calibration, uint32 rowsPerChunk = PCM_TRACE_ROWS_PER_CHUNK);
+    ~CounterTraceWriter(); // writes the last chunk and closes the file
+
+    //! \brief Returns the events currently programmed in the general purpose counters as the description of a line
+    static CounterTraceLine getProgrammedLine(PCM * m, uint32 line, const char * name);
+
+    /*! \brief Records the events of a line
+
+        Only the first call for a line writes a record, call it before the first row of the line.
+    */
+    void describeLine(const CounterTraceLine & line);
+
+    /*! \brief Adds an interval
+        \param line PCM::PCMLine programmed in the interval
+        \param start invariant TSC when the before states were read
+        \param end invariant TSC when the after states were read
+    */
+    void write(uint32 line, uint64 start, uint64 end, const CounterSnapshot & before, const CounterSnapshot & after);
+
+    //! \brief Writes the buffered rows
+    void flush();
+
+private:
+    PCM * m;
+    FILE * file;
+    CounterTraceHeader header;
+    uint32 rowsPerChunk;
+    uint32 rows;                    // rows in the buffer
+    uint64 lastStart;
+    std::vector<uint64> columns;    // getNumColumns() x rowsPerChunk, column-major
+    std::vector<bool> described;    // by line
+    std::vector<unsigned char> buffer;
+
+    CounterTraceWriter(CounterTraceWriter &); // forbidden
+};
+
+//! \brief Reads a trace file row by row
+class CounterTraceReader
+{
+public:
+    //! throws std::exception if the file can not be opened or is not a trace
+    CounterTraceReader(const char * path);
+    ~CounterTraceReader();
+
+    const CounterTraceHeader & getHeader() const { return header; }
+
+    //! \brief Lines described so far (the description of a line precedes its first row)
+    const std::vector<CounterTraceLine> & getLines() const { return lines; }
+    //! \brief Description of a line, NULL if it was not described
+    const CounterTraceLine * getLine(uint32 line) const;
+
+    //! \brief Name of a column of CounterTraceRow, in the order of the file
+    std::string getColumnName(uint32 column) const;
+
+    /*! \brief Decodes the next row
+        \return false at the end of the file or if the file is truncated or corrupt (see isCorrupt())
+    */
+    bool next(CounterTraceRow & row);
+    bool isCorrupt() const { return corrupt; }
+
+private:
+    FILE * file;
+    CounterTraceHeader header;
+    std::vector<CounterTraceLine> lines;
+    std::vector<uint64> columns;    // decoded chunk, column-major
+    uint32 rows, row;               // rows in the decoded chunk, next row
+    uint64 start;                   // of the last row
+    bool corrupt;
+
+    bool readChunk();
+
+    CounterTraceReader(CounterTraceReader &); // forbidden
+};
+
+#endif
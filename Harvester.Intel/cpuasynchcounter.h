@@ -21,11 +21,20 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 
 /*!     \file cpuasynchcounter.h
         \brief Implementation of a POSIX thread that periodically saves the current state of counters and exposes them to other threads
+
+        The update thread publishes the states through two buffers protected by sequence counters (seqlock):
+        it fills the buffer that is not published and then publishes it. Readers never block, they retry only
+        if the buffer they read was rewritten meanwhile (i.e. if a read takes longer than a sampling period).
+        The buffers are allocated once in the constructor and only overwritten in place afterwards, so a
+        reader racing with the update thread may copy torn values (and retries) but never freed memory.
 */
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
 #include "cpucounters.h"
+#include "utils.h"
 
 #define DELAY 1 // in seconds
 
@@ -37,20 +46,79 @@ void * UpdateCounters(void *);
 class AsynchronCounterState {
     PCM * m;
 
-    CoreCounterState * cstates1, * cstates2;
-    SocketCounterState * skstates1, * skstates2;
-    SystemCounterState sstate1, sstate2;
+    // a pair of consecutive snapshots, the arrays are never reallocated
+    struct Buffer
+    {
+        CoreCounterState * cstates1, * cstates2;
+        SocketCounterState * skstates1, * skstates2;
+        SystemCounterState sstate1, sstate2;
+        CoreGroupCounterState * groups1[PCM_AGGREGATION_LEVELS], * groups2[PCM_AGGREGATION_LEVELS];
+        volatile uint32 seq;    // odd while the buffer is written
+    };
+    Buffer buffers[2];
+    uint32 numCores, numSockets;
+    uint32 numGroups[PCM_AGGREGATION_LEVELS];
+    volatile uint32 published;  // index of the buffer the readers use
+    volatile uint64 epoch;      // number of published updates
+    CounterSnapshot latest;     // used by the update thread only
+    double period;              // in seconds
 
     pthread_t UpdateThread;
-    pthread_mutex_t CounterMutex;
+    volatile bool stop;         // asks the update thread to exit
 
     friend void * UpdateCounters(void *);
 
-//	AsynchronCounterState(const& AsynchronCounterState); //unimplemeted
-//	const& AsynchronCounterState operator=(const& AsynchronCounterState); //unimplemented
+    AsynchronCounterState(const AsynchronCounterState &); // forbidden
+
+    const Buffer & beginRead(uint32 & seq) const
+    {
+        while (true)
+        {
+            const Buffer & b = buffers[__atomic_load_n(&published, __ATOMIC_ACQUIRE)];
+            seq = __atomic_load_n(&b.seq, __ATOMIC_ACQUIRE);
+            if ((seq & 1) == 0) return b;
+            __asm__ __volatile__ ("pause" ::: "memory");
+        }
+    }
+
+    bool endRead(const Buffer & b, uint32 seq) const
+    {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&b.seq, __ATOMIC_RELAXED) == seq;
+    }
+
+    // called by the update thread only
+    void publish()
+    {
+        m->getAllCounterStates(latest);
+
+        const Buffer & current = buffers[published];
+        const uint32 next = 1 - published;
+        Buffer & b = buffers[next];
+
+        __atomic_store_n(&b.seq, b.seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        std::copy(current.cstates2, current.cstates2 + numCores, b.cstates1);
+        std::copy(latest.cores.begin(), latest.cores.begin() + numCores, b.cstates2);
+        std::copy(current.skstates2, current.skstates2 + numSockets, b.skstates1);
+        std::copy(latest.sockets.begin(), latest.sockets.begin() + numSockets, b.skstates2);
+        b.sstate1.copyFrom(current.sstate2);
+        b.sstate2.copyFrom(latest.system);
+        for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+        {
+            std::copy(current.groups2[l], current.groups2[l] + numGroups[l], b.groups1[l]);
+            std::copy(latest.groups[l].begin(), latest.groups[l].begin() + numGroups[l], b.groups2[l]);
+        }
+        __atomic_store_n(&b.seq, b.seq + 1, __ATOMIC_RELEASE);
+
+        __atomic_store_n(&published, next, __ATOMIC_RELEASE);
+        __atomic_store_n(&epoch, epoch + 1, __ATOMIC_RELEASE);
+    }
 
 public:
-    AsynchronCounterState()
+    //! \param period_ sampling period in seconds
+    //! \param history seconds of counter history to keep (see PCM::enableCounterHistory), 0 keeps no history
+    AsynchronCounterState(double period_ = DELAY, double history = 0) : published(0), epoch(0), period(period_), stop(false)
     {
         m = PCM::getInstance();
         PCM::ErrorCode status = m->program();
@@ -59,34 +127,58 @@ public:
             cout << "\nCan not access CPU counters. Try to run pcm.x 1 to check the PMU access status.\n" << endl;
             exit(-1);
         }
-
-        cstates1 = new  CoreCounterState[m->getNumCores()];
-        cstates2 = new  CoreCounterState[m->getNumCores()];
-        skstates1 = new SocketCounterState[m->getNumSockets()];
-        skstates2 = new SocketCounterState[m->getNumSockets()];
-
-        for (uint32 i = 0; i < m->getNumCores(); ++i) {
-            cstates1[i] = getCoreCounterState(i);
-            cstates2[i] = getCoreCounterState(i);
-        }
-
-        for (uint32 i = 0; i < m->getNumSockets(); ++i) {
-            skstates1[i] = getSocketCounterState(i);
-            skstates2[i] = getSocketCounterState(i);
+        if (history > 0 && !m->enableCounterHistory(history))
+            cerr << "Can not keep the counter history" << endl;
+
+        m->getAllCounterStates(latest);
+        numCores = (uint32)latest.cores.size();
+        numSockets = (uint32)latest.sockets.size();
+        for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+            numGroups[l] = (uint32)latest.groups[l].size();
+        for (int i = 0; i < 2; ++i)
+        {
+            Buffer & b = buffers[i];
+            b.cstates1 = new CoreCounterState[numCores];
+            b.cstates2 = new CoreCounterState[numCores];
+            std::copy(latest.cores.begin(), latest.cores.end(), b.cstates1);
+            std::copy(latest.cores.begin(), latest.cores.end(), b.cstates2);
+            b.skstates1 = new SocketCounterState[numSockets];
+            b.skstates2 = new SocketCounterState[numSockets];
+            std::copy(latest.sockets.begin(), latest.sockets.end(), b.skstates1);
+            std::copy(latest.sockets.begin(), latest.sockets.end(), b.skstates2);
+            b.sstate1.copyFrom(latest.system);
+            b.sstate2.copyFrom(latest.system);
+            for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+            {
+                b.groups1[l] = new CoreGroupCounterState[numGroups[l]];
+                b.groups2[l] = new CoreGroupCounterState[numGroups[l]];
+                std::copy(latest.groups[l].begin(), latest.groups[l].end(), b.groups1[l]);
+                std::copy(latest.groups[l].begin(), latest.groups[l].end(), b.groups2[l]);
+            }
+            b.seq = 0;
         }
 
-        pthread_mutex_init(&CounterMutex, NULL);
         pthread_create(&UpdateThread, NULL, UpdateCounters, this);
     }
     ~AsynchronCounterState()
     {
-        pthread_cancel(UpdateThread);
-        pthread_mutex_destroy(&CounterMutex);
+        // the update thread finishes the current update (it may wait for the core samplers) and exits
+        __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+        pthread_join(UpdateThread, NULL);
+        for (int i = 0; i < 2; ++i)
+        {
+            Buffer & b = buffers[i];
+            delete [] b.cstates1;
+            delete [] b.cstates2;
+            delete [] b.skstates1;
+            delete [] b.skstates2;
+            for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+            {
+                delete [] b.groups1[l];
+                delete [] b.groups2[l];
+            }
+        }
 	m->cleanup();
-        delete[] cstates1;
-        delete[] cstates2;
-        delete[] skstates1;
-        delete[] skstates2;
     }
 
     uint32 getNumCores()
@@ -105,39 +197,91 @@ public:
         return m->getSocketId(c);
     }
 
+    //! \brief Sampling period in seconds
+    double getPeriod() const { return period; }
+
+    //! \brief Number of updates published so far, changes when new data arrived
+    uint64 getEpoch() const { return __atomic_load_n(&epoch, __ATOMIC_ACQUIRE); }
+
+    //! \brief Copies the states of the last period, consistent across the cores, sockets, groups and the system
+    void getStates(CounterSnapshot & before, CounterSnapshot & after)
+    {
+        before.cores.resize(numCores);
+        after.cores.resize(numCores);
+        before.sockets.resize(numSockets);
+        after.sockets.resize(numSockets);
+        for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+        {
+            before.groups[l].resize(numGroups[l]);
+            after.groups[l].resize(numGroups[l]);
+        }
+        uint32 seq;
+        do {
+            const Buffer & b = beginRead(seq);
+            std::copy(b.cstates1, b.cstates1 + numCores, before.cores.begin());
+            std::copy(b.skstates1, b.skstates1 + numSockets, before.sockets.begin());
+            before.system.copyFrom(b.sstate1);
+            std::copy(b.cstates2, b.cstates2 + numCores, after.cores.begin());
+            std::copy(b.skstates2, b.skstates2 + numSockets, after.sockets.begin());
+            after.system.copyFrom(b.sstate2);
+            for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+            {
+                std::copy(b.groups1[l], b.groups1[l] + numGroups[l], before.groups[l].begin());
+                std::copy(b.groups2[l], b.groups2[l] + numGroups[l], after.groups[l].begin());
+            }
+            if (endRead(b, seq)) break;
+        } while (true);
+    }
+
     template <typename T, T func(CoreCounterState const &, CoreCounterState const &)>
     T get(uint32 core)
     {
-        pthread_mutex_lock(&CounterMutex);
-        T value = func(cstates1[core], cstates2[core]);
-        pthread_mutex_unlock(&CounterMutex);
+        uint32 seq;
+        T value;
+        do {
+            const Buffer & b = beginRead(seq);
+            value = func(b.cstates1[core], b.cstates2[core]);
+            if (endRead(b, seq)) break;
+        } while (true);
         return value;
     }
 
     template <typename T, T func(SocketCounterState const &, SocketCounterState const &)>
     T getSocket(uint32 socket)
     {
-        pthread_mutex_lock(&CounterMutex);
-        T value = func(skstates1[socket], skstates2[socket]);
-        pthread_mutex_unlock(&CounterMutex);
+        uint32 seq;
+        T value;
+        do {
+            const Buffer & b = beginRead(seq);
+            value = func(b.skstates1[socket], b.skstates2[socket]);
+            if (endRead(b, seq)) break;
+        } while (true);
         return value;
     }
 
     template <typename T, T func(uint32, uint32, SystemCounterState const &, SystemCounterState const &)>
     T getSocket(uint32 socket, uint32 param)
     {
-        pthread_mutex_lock(&CounterMutex);
-        T value = func(socket, param, sstate1, sstate2);
-        pthread_mutex_unlock(&CounterMutex);
+        uint32 seq;
+        T value;
+        do {
+            const Buffer & b = beginRead(seq);
+            value = func(socket, param, b.sstate1, b.sstate2);
+            if (endRead(b, seq)) break;
+        } while (true);
         return value;
     }
 
     template <typename T, T func(SystemCounterState const &, SystemCounterState const &)>
     T getSystem()
     {
-        pthread_mutex_lock(&CounterMutex);
-        T value = func(sstate1, sstate2);
-        pthread_mutex_unlock(&CounterMutex);
+        uint32 seq;
+        T value;
+        do {
+            const Buffer & b = beginRead(seq);
+            value = func(b.sstate1, b.sstate2);
+            if (endRead(b, seq)) break;
+        } while (true);
         return value;
     }
 };
@@ -145,24 +289,12 @@ public:
 void * UpdateCounters(void * state)
 {
     AsynchronCounterState * s = (AsynchronCounterState *)state;
+    SamplingScheduler scheduler(s->period);
 
-    while (true) {
-        pthread_mutex_lock(&(s->CounterMutex));
-        for (uint32 core = 0; core < s->m->getNumCores(); ++core) {
-            s->cstates1[core] = s->cstates2[core];
-            s->cstates2[core] = s->m->getCoreCounterState(core);
-        }
-
-        for (uint32 socket = 0; socket < s->m->getNumSockets(); ++socket) {
-            s->skstates1[socket] = s->skstates2[socket];
-            s->skstates2[socket] = s->m->getSocketCounterState(socket);
-        }
-
-        s->sstate1 = s->sstate2;
-        s->sstate2 = s->m->getSystemCounterState();
-
-        pthread_mutex_unlock(&(s->CounterMutex));
-        sleep(1);
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        scheduler.wait();
+        if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) break;
+        s->publish();
     }
     return NULL;
 }
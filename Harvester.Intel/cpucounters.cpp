@@ -23,6 +23,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #ifdef INTELPCM_EXPORTS
 // Intelpcm.h includes cpucounters.h
 #include "Intelpcm.dll\Intelpcm.h"
@@ -32,22 +33,26 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include "msr.h"
 #include "pci.h"
 #include "types.h"
+#include "counter_history.h"
 
 #ifdef _MSC_VER
 #include <intrin.h>
 #include <windows.h>
-#include <algorithm>
 #include <tchar.h>
 #include "winring0/OlsApiInit.h"
 #else
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 
 #include <string.h>
 #include <limits>
 #include <map>
+#include <algorithm>
 
 #ifdef __APPLE__
 #include <sys/types.h>
@@ -146,6 +151,262 @@ public:
 
 PCM * PCM::instance = NULL;
 
+// nominal frequency calibration (when the processor does not report the frequency) and its per-boot cache
+// in a directory only root can write to (/run is cleared at boot)
+#define PCM_FREQUENCY_CALIBRATION_MS (10)
+#define PCM_CACHE_DIR "/run/pcm"
+#define PCM_NOMINAL_FREQUENCY_CACHE PCM_CACHE_DIR "/nominal-frequency"
+
+uint64 RDTSCP();
+static void readOSClocks(uint64 & monotonicRaw, uint64 & realtime);
+
+#ifdef __linux__
+// topology from sysfs and its per-boot cache (enabled with PCM_TOPOLOGY_CACHE=<file>)
+#define PCM_SYSFS_CPU "/sys/devices/system/cpu"
+#define PCM_SYSFS_NODE "/sys/devices/system/node"
+#define PCM_MSR_OPEN_THREADS (8)
+
+// first line of a (sysfs or proc) file without the line end, empty if it can not be read
+static std::string readFirstLine(const char * path)
+{
+    char buffer[4096] = { 0 };
+    FILE * f = fopen(path, "r");
+    if (!f) return std::string();
+    if (!fgets(buffer, sizeof(buffer), f)) buffer[0] = 0;
+    fclose(f);
+    std::string result(buffer);
+    while (!result.empty() && (result[result.size() - 1] == '\n' || result[result.size() - 1] == ' ')) result.erase(result.size() - 1);
+    return result;
+}
+
+static std::string readBootId()
+{
+    return readFirstLine("/proc/sys/kernel/random/boot_id");
+}
+
+static int32 readSysfsInt(const char * format, int32 id)
+{
+    char path[256];
+    snprintf(path, sizeof(path), format, id);
+    const std::string line = readFirstLine(path);
+    return line.empty() ? -1 : atoi(line.c_str());
+}
+
+// parses the kernel CPU list format, e.g. "0-3,8,10-11"
+static bool parseCPUList(const std::string & list, std::vector<int32> & result)
+{
+    result.clear();
+    const char * p = list.c_str();
+    while (*p)
+    {
+        char * end = NULL;
+        const long first = strtol(p, &end, 10);
+        if (end == p) return false;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return false;
+            p = end;
+        }
+        for (long c = first; c <= last; ++c) result.push_back(int32(c));
+        if (*p == ',') ++p;
+        else if (*p) return false;
+    }
+    return !result.empty();
+}
+
+// one pass over the present CPUs, the NUMA nodes are read per node (cpulist) instead of per CPU
+// the offline CPUs get an entry too: they are counted when they come online (see PCM::readOnlineCores)
+static bool readSysfsTopology(std::vector<TopologyEntry> & topology)
+{
+    std::vector<int32> cpus, online, siblings, offline;
+    if (!parseCPUList(readFirstLine(PCM_SYSFS_CPU "/online"), online)) return false;
+    if (!parseCPUList(readFirstLine(PCM_SYSFS_CPU "/present"), cpus)) cpus = online;
+
+    std::map<int32, int32> numaNodes; // os_id -> node
+    std::vector<int32> nodes, nodeCpus;
+    if (parseCPUList(readFirstLine(PCM_SYSFS_NODE "/online"), nodes))
+    {
+        for (size_t n = 0; n < nodes.size(); ++n)
+        {
+            char path[256];
+            snprintf(path, sizeof(path), PCM_SYSFS_NODE "/node%d/cpulist", nodes[n]);
+            if (!parseCPUList(readFirstLine(path), nodeCpus)) continue;
+            for (size_t c = 0; c < nodeCpus.size(); ++c) numaNodes[nodeCpus[c]] = nodes[n];
+        }
+    }
+    const bool haveL3 = readSysfsInt(PCM_SYSFS_CPU "/cpu%d/cache/index3/level", online[0]) == 3;
+
+    topology.clear();
+    topology.reserve(cpus.size());
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        char path[256];
+        TopologyEntry entry;
+        entry.os_id = cpus[i];
+        entry.socket = readSysfsInt(PCM_SYSFS_CPU "/cpu%d/topology/physical_package_id", entry.os_id);
+        entry.core_id = readSysfsInt(PCM_SYSFS_CPU "/cpu%d/topology/core_id", entry.os_id);
+        if (entry.socket < 0 || entry.core_id < 0)
+        {
+            // the kernel removes the topology of offline CPUs, it is guessed below
+            if (std::binary_search(online.begin(), online.end(), entry.os_id)) return false;
+            entry.socket = -1;
+            offline.push_back(int32(topology.size()));
+            for (size_t n = 0; n < nodes.size(); ++n)
+            {
+                snprintf(path, sizeof(path), PCM_SYSFS_CPU "/cpu%d/node%d", entry.os_id, nodes[n]);
+                if (access(path, F_OK) == 0) entry.numa_node = nodes[n];
+            }
+            topology.push_back(entry);
+            continue;
+        }
+
+        std::map<int32, int32>::const_iterator node = numaNodes.find(entry.os_id);
+        if (node != numaNodes.end()) entry.numa_node = node->second;
+
+        if (haveL3)
+        {
+            snprintf(path, sizeof(path), PCM_SYSFS_CPU "/cpu%d/cache/index3/shared_cpu_list", entry.os_id);
+            if (parseCPUList(readFirstLine(path), siblings)) entry.l3_id = siblings[0];
+        }
+
+        snprintf(path, sizeof(path), PCM_SYSFS_CPU "/cpu%d/topology/thread_siblings_list", entry.os_id);
+        if (parseCPUList(readFirstLine(path), siblings))
+            entry.thread_id = int32(std::find(siblings.begin(), siblings.end(), entry.os_id) - siblings.begin());
+
+        topology.push_back(entry);
+    }
+
+    // an offline CPU is taken as a separate core in the socket of the online CPUs of its NUMA node
+    int32 maxCoreId = 0, firstSocket = -1;
+    std::map<int32, int32> nodeSockets; // NUMA node -> socket
+    for (size_t i = 0; i < topology.size(); ++i)
+    {
+        if (topology[i].socket < 0) continue;
+        maxCoreId = (std::max)(maxCoreId, topology[i].core_id);
+        if (firstSocket < 0) firstSocket = topology[i].socket;
+        if (topology[i].numa_node >= 0 && nodeSockets.find(topology[i].numa_node) == nodeSockets.end())
+            nodeSockets[topology[i].numa_node] = topology[i].socket;
+    }
+    for (size_t o = 0; o < offline.size(); ++o)
+    {
+        TopologyEntry & entry = topology[offline[o]];
+        std::map<int32, int32>::const_iterator node = nodeSockets.find(entry.numa_node);
+        entry.socket = (node != nodeSockets.end()) ? node->second : firstSocket;
+        entry.core_id = maxCoreId + 1 + int32(o);
+        entry.thread_id = 0;
+    }
+    return true;
+}
+
+// the cache is valid for the boot and the sets of present and online CPUs it was written for
+static std::string topologyCacheKey()
+{
+    return readBootId() + " " + readFirstLine(PCM_SYSFS_CPU "/present") + " " + readFirstLine(PCM_SYSFS_CPU "/online");
+}
+
+// opens a cache file for reading only if it is a regular file (not a link) of the owner that nobody else can modify
+static FILE * openCacheFile(const char * path, uid_t owner)
+{
+    const int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != owner || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        close(fd);
+        return NULL;
+    }
+    FILE * f = fdopen(fd, "r");
+    if (!f) close(fd);
+    return f;
+}
+
+// writes a new temporary file next to the cache and renames it, readers never see a partial file
+// and an existing file or link at the temporary path is never followed or overwritten
+static void writeCacheFile(const char * path, const std::string & content)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) return;
+    const bool written = write(fd, content.data(), content.size()) == (ssize_t)content.size();
+    if (close(fd) == 0 && written && rename(tmp, path) == 0) return;
+    unlink(tmp);
+}
+
+static bool readTopologyCache(const char * path, std::vector<TopologyEntry> & topology)
+{
+    FILE * f = openCacheFile(path, geteuid());
+    if (!f) return false;
+    char line[4096];
+    bool valid = fgets(line, sizeof(line), f) && std::string(line) == topologyCacheKey() + "\n";
+    topology.clear();
+    while (valid && fgets(line, sizeof(line), f))
+    {
+        TopologyEntry entry;
+        valid = sscanf(line, "%d %d %d %d %d %d", &entry.os_id, &entry.socket, &entry.core_id,
+                       &entry.numa_node, &entry.l3_id, &entry.thread_id) == 6;
+        topology.push_back(entry);
+    }
+    fclose(f);
+    return valid && !topology.empty();
+}
+
+static void writeTopologyCache(const char * path, const std::vector<TopologyEntry> & topology)
+{
+    std::string content = topologyCacheKey() + "\n";
+    for (size_t i = 0; i < topology.size(); ++i)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%d %d %d %d %d %d\n", topology[i].os_id, topology[i].socket, topology[i].core_id,
+                 topology[i].numa_node, topology[i].l3_id, topology[i].thread_id);
+        content += line;
+    }
+    writeCacheFile(path, content);
+}
+#endif
+
+//! \brief Online state of the cores, kept by PCM::getAllCounterStates (see PCM::applyCoreHotplug)
+struct CoreHotplugState
+{
+    std::string onlineMask;                 // /sys/devices/system/cpu/online at the last check
+    std::vector<char> online;               // per core: online according to the mask
+    std::vector<char> readOk;               // per core: the last read succeeded (written by the sampler threads)
+    std::vector<uint32> generation;         // per core: number of times the core came back online
+    std::vector<CoreCounterState> carry;    // per core: added to the counters read, continues them across offline periods
+    std::vector<CoreCounterState> last;     // per core: last state returned
+    uint64 fixedCtrl;                       // IA32_CR_FIXED_CTR_CTRL written by PCM::program()
+
+    CoreHotplugState(int32 num_cores) :
+        online(num_cores, 1), readOk(num_cores, 1), generation(num_cores, 0), carry(num_cores), last(num_cores), fixedCtrl(0)
+    {
+    }
+
+    // the counters that continue across offline periods (not the TSC and the temperature)
+    static void add(BasicCounterState & a, const BasicCounterState & b)
+    {
+        a.InstRetiredAny += b.InstRetiredAny;
+        a.CpuClkUnhaltedThread += b.CpuClkUnhaltedThread;
+        a.CpuClkUnhaltedRef += b.CpuClkUnhaltedRef;
+        for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j) a.Event[j] += b.Event[j];
+        a.C3Residency += b.C3Residency;
+        a.C6Residency += b.C6Residency;
+        a.C7Residency += b.C7Residency;
+    }
+    static void subtract(BasicCounterState & a, const BasicCounterState & b)
+    {
+        a.InstRetiredAny -= b.InstRetiredAny;
+        a.CpuClkUnhaltedThread -= b.CpuClkUnhaltedThread;
+        a.CpuClkUnhaltedRef -= b.CpuClkUnhaltedRef;
+        for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j) a.Event[j] -= b.Event[j];
+        a.C3Residency -= b.C3Residency;
+        a.C6Residency -= b.C6Residency;
+        a.C7Residency -= b.C7Residency;
+    }
+};
+
 int bitCount(uint64 n)
 {
     int count = 0;
@@ -165,7 +426,12 @@ PCM * PCM::getInstance()
     SystemWideLock lock;
     if (instance) return instance;
 
-    return instance = new PCM();
+    uint64 start = 0, end = 0, realtime = 0;
+    readOSClocks(start, realtime);
+    instance = new PCM();
+    readOSClocks(end, realtime);
+    instance->initializationTime = double(end - start) / 1e9;
+    return instance;
 }
 
 uint32 build_bit_ui(int beg, int end)
@@ -291,15 +557,34 @@ union PCM_CPUID_INFO
         struct { int eax,ebx,ecx,edx; } reg ;
 };
 
+class CpuidDevice : public RegisterDevice
+{
+public:
+    int32 deviceAccess(RegisterAccess & a)
+    {
+        PCM_CPUID_INFO info;
+        #ifdef _MSC_VER
+        // version for Windows
+        __cpuid(info.array, (int)a.address);
+        #else
+        __asm__ __volatile__ ("cpuid" : \
+                              "=a" (info.reg.eax), "=b" (info.reg.ebx), "=c" (info.reg.ecx), "=d" (info.reg.edx) : "a" ((int)a.address));
+        #endif
+        a.value[0] = uint64(uint32(info.reg.eax)) | (uint64(uint32(info.reg.ebx)) << 32ULL);
+        a.value[1] = uint64(uint32(info.reg.ecx)) | (uint64(uint32(info.reg.edx)) << 32ULL);
+        return 0;
+    }
+};
+
 void pcm_cpuid(int leaf, PCM_CPUID_INFO & info)
 {
-    #ifdef _MSC_VER
-    // version for Windows
-    __cpuid(info.array, leaf);
-    #else
-    __asm__ __volatile__ ("cpuid" : \
-                          "=a" (info.reg.eax), "=b" (info.reg.ebx), "=c" (info.reg.ecx), "=d" (info.reg.edx) : "a" (leaf));
-    #endif	
+    static CpuidDevice cpuidDevice;
+    RegisterAccess a(RegisterAccess::CPUID, 0, (uint64)(uint32)leaf);
+    RegisterAccessBackend::get()->access(&cpuidDevice, a);
+    info.reg.eax = (int)(a.value[0] & 0xffffffffULL);
+    info.reg.ebx = (int)(a.value[0] >> 32ULL);
+    info.reg.ecx = (int)(a.value[1] & 0xffffffffULL);
+    info.reg.edx = (int)(a.value[1] >> 32ULL);
 }
 
 PCM::PCM() :
@@ -324,6 +609,8 @@ PCM::PCM() :
     perfmon_version(0),
     perfmon_config_anythread(1),
     nominal_frequency(0),
+    nominalFrequencySource(""),
+    initializationTime(0.),
     qpi_speed(0),
     pkgThermalSpecPower(-1),
     pkgMinimumPower(-1), 
@@ -333,9 +620,19 @@ PCM::PCM() :
     clientBW(NULL),
     clientImcReads(NULL),
     clientImcWrites(NULL),
-    mode(INVALID_MODE),
     disable_JKT_workaround(false),
-    canUsePerf(false)
+    mode(INVALID_MODE),
+    samplingMode(SERIAL_SAMPLING),
+    corePMUAccess(CORE_PMU_AUTO),
+    samplerPool(NULL),
+    history(NULL),
+    hotplug(NULL),
+    programGeneration(0),
+    jktWorkaroundEnabled(false),
+    aggregationLevels(0),
+    canUsePerf(false),
+    userRdpmcRequested(false),
+    userRdpmc(false)
 {
     int32 i = 0;
     char buffer[1024];
@@ -534,47 +831,66 @@ PCM::PCM() :
     socketIdMap_type socketIdMap;
 
 #ifdef __linux__
-    // open /proc/cpuinfo
-    FILE * f_cpuinfo = fopen("/proc/cpuinfo", "r");
-    if (!f_cpuinfo)
+    const char * topologyCache = getenv("PCM_TOPOLOGY_CACHE");
+    if (RegisterAccessBackend::get()->readTopology(topology))
     {
-        std::cout << "Can not open /proc/cpuinfo file." << std::endl;
-        return;
     }
-
-    while (0 != fgets(buffer, 1024, f_cpuinfo))
+    else if (topologyCache && readTopologyCache(topologyCache, topology))
     {
-        if (strncmp(buffer, "processor", sizeof("processor") - 1) == 0)
-        {
-            if (entry.os_id >= 0)
-            {
-                topology.push_back(entry);
-                if (entry.socket == 0 && entry.core_id == 0) ++threads_per_core;
-            }
-            sscanf(buffer, "processor\t: %d", &entry.os_id);
-            //std::cout << "os_core_id: "<<entry.os_id<< std::endl;
-            continue;
-        }
-        if (strncmp(buffer, "physical id", sizeof("physical id") - 1) == 0)
+        RegisterAccessBackend::get()->writeTopology(topology);
+    }
+    else if (readSysfsTopology(topology))
+    {
+        if (topologyCache) writeTopologyCache(topologyCache, topology);
+        RegisterAccessBackend::get()->writeTopology(topology);
+    }
+    else
+    {
+        // no sysfs: open /proc/cpuinfo
+        FILE * f_cpuinfo = fopen("/proc/cpuinfo", "r");
+        if (!f_cpuinfo)
         {
-            sscanf(buffer, "physical id\t: %d", &entry.socket);
-            //std::cout << "physical id: "<<entry.socket<< std::endl;
-            socketIdMap[entry.socket] = 0;
-            continue;
+            std::cout << "Can not open /proc/cpuinfo file." << std::endl;
+            return;
         }
-        if (strncmp(buffer, "core id", sizeof("core id") - 1) == 0)
+
+        while (0 != fgets(buffer, 1024, f_cpuinfo))
         {
-            sscanf(buffer, "core id\t: %d", &entry.core_id);
-            //std::cout << "core id: "<<entry.core_id<< std::endl;
-            continue;
+            if (strncmp(buffer, "processor", sizeof("processor") - 1) == 0)
+            {
+                if (entry.os_id >= 0) topology.push_back(entry);
+                sscanf(buffer, "processor\t: %d", &entry.os_id);
+                //std::cout << "os_core_id: "<<entry.os_id<< std::endl;
+                continue;
+            }
+            if (strncmp(buffer, "physical id", sizeof("physical id") - 1) == 0)
+            {
+                sscanf(buffer, "physical id\t: %d", &entry.socket);
+                //std::cout << "physical id: "<<entry.socket<< std::endl;
+                continue;
+            }
+            if (strncmp(buffer, "core id", sizeof("core id") - 1) == 0)
+            {
+                sscanf(buffer, "core id\t: %d", &entry.core_id);
+                //std::cout << "core id: "<<entry.core_id<< std::endl;
+                continue;
+            }
         }
+        if (entry.os_id >= 0) topology.push_back(entry);
+        fclose(f_cpuinfo);
+        RegisterAccessBackend::get()->writeTopology(topology);
     }
-    if (entry.os_id >= 0)
+
+    std::map<std::pair<int32, int32>, int32> threadsOfCore;
+    for (size_t t = 0; t < topology.size(); ++t)
     {
-        topology.push_back(entry);
-        if (entry.socket == 0 && entry.core_id == 0) ++threads_per_core;
+        if (topology[t].socket == 0 && topology[t].core_id == 0) ++threads_per_core;
+        socketIdMap[topology[t].socket] = 0;
+        // without sysfs the threads are numbered in the order of the OS ids
+        int32 & threads = threadsOfCore[std::make_pair(topology[t].socket, topology[t].core_id)];
+        if (topology[t].thread_id < 0) topology[t].thread_id = threads;
+        ++threads;
     }
-    fclose(f_cpuinfo);
 
 #elif defined(__FreeBSD__) 
 
@@ -699,6 +1015,16 @@ PCM::PCM() :
 #endif
         #endif //end of ifdef _MSC_VER
 
+    osIdToCore.clear();
+    for (i = 0; i < num_cores; ++i)
+    {
+        if (topology[i].os_id < 0) continue;
+        if (topology[i].os_id >= (int32)osIdToCore.size()) osIdToCore.resize(topology[i].os_id + 1, -1);
+        osIdToCore[topology[i].os_id] = i;
+    }
+
+    buildAggregationGroups();
+
     std::cout << "Num logical cores: " << num_cores << std::endl;
     std::cout << "Num sockets: " << num_sockets << std::endl;
     std::cout << "Threads per core: " << threads_per_core << std::endl;
@@ -711,16 +1037,24 @@ PCM::PCM() :
         std::cout << "Width of fixed counters: " << core_fixed_counter_width << " bits" << std::endl;
     }
 
-    socketRefCore.resize(num_sockets);
+    {
+        std::vector<char> online(num_cores, 1);
+#ifdef __linux__
+        if (RegisterAccessBackend::get()->usesDevices()) getOnlineCores(readFirstLine(PCM_SYSFS_CPU "/online"), online);
+#endif
+        chooseSocketRefCores(online);
+    }
 #ifndef __APPLE__
     MSR = new MsrHandle *[num_cores];
     
     try
     {
+        // MSR[i] is the device of the OS CPU topology[i].os_id (the OS ids can have gaps)
+        // only the first device is opened to check the access, the others are opened on the first
+        // access or all together in parallel by program() (see openMSR)
         for (i = 0; i < num_cores; ++i)
         {
-            MSR[i] = new MsrHandle(i);
-            socketRefCore[topology[i].socket] = i;
+            MSR[i] = new MsrHandle(topology[i].os_id, i != 0);
         }
     }
     catch (...)
@@ -742,36 +1076,18 @@ PCM::PCM() :
         std::cerr << "permissions for /dev/cpuctl* devices (the 'chown' command can help)." << std::endl;
                 #endif
     }
-#else
-    for(i = 0; i < num_cores; ++i)
-    {
-	socketRefCore[topology[i].socket] = i;
-    }
 #endif
     if (MSR)
     {
-        uint64 freq = 0;
-        MSR[0]->read(PLATFORM_INFO_ADDR, &freq);
-        const uint64 bus_freq = (
-                  cpu_model == SANDY_BRIDGE 
-               || cpu_model == JAKETOWN 
-               || cpu_model == IVY_BRIDGE
-               || cpu_model == HASWELL
-               ) ? (100000000ULL) : (133333333ULL);
-
-        nominal_frequency = ((freq >> 8) & 255) * bus_freq;
-
-        if(!nominal_frequency) 
-        	nominal_frequency = get_frequency_from_cpuid();
-
-        if(!nominal_frequency)
+        if (!computeNominalFrequency())
         {
                 std::cout << "Error: Can not detect core frequency." << std::endl;
 		destroyMSR();
 		return;
         }
 
-        std::cout << "Nominal core frequency: " << nominal_frequency << " Hz" << std::endl;
+        std::cout << "Nominal core frequency: " << nominal_frequency << " Hz (" << nominalFrequencySource << ")" << std::endl;
+        hotplug = new CoreHotplugState(num_cores);
     }
 
     if(packageEnergyMetricsAvailable() && MSR)
@@ -794,12 +1110,17 @@ PCM::PCM() :
         std::cout << "Package minimum power: "<< pkgMinimumPower << " Watt; ";
         std::cout << "Package maximum power: "<< pkgMaximumPower << " Watt; " << std::endl;
 
+        // the energy counters wrap after 2^32 units, at most every 2^32 * joulesPerEnergyUnit / (maximum power) seconds
+        // (the DRAM power is assumed not to exceed the package maximum, twice the thermal spec power if it is not reported)
+        const double maxPower = (pkgMaximumPower > 0) ? double(pkgMaximumPower) : 2. * double((std::max)(pkgThermalSpecPower, 1));
+        const double maxEnergyUnitsPerSecond = maxPower / joulesPerEnergyUnit;
+
         if(snb_energy_status.empty())
 	    for (i = 0; i < num_sockets; ++i)
-		snb_energy_status.push_back(new CounterWidthExtender(new CounterWidthExtender::MsrHandleCounter(MSR[socketRefCore[i]],MSR_PKG_ENERGY_STATUS)) );
+		snb_energy_status.push_back(new CounterWidthExtender(new CounterWidthExtender::MsrHandleCounter(MSR[socketRefCore[i]],MSR_PKG_ENERGY_STATUS), maxEnergyUnitsPerSecond) );
         if(dramEnergyMetricsAvailable() && jkt_dram_energy_status.empty())
             for (i = 0; i < num_sockets; ++i)
-                jkt_dram_energy_status.push_back(new CounterWidthExtender(new CounterWidthExtender::MsrHandleCounter(MSR[socketRefCore[i]],MSR_DRAM_ENERGY_STATUS)));
+                jkt_dram_energy_status.push_back(new CounterWidthExtender(new CounterWidthExtender::MsrHandleCounter(MSR[socketRefCore[i]],MSR_DRAM_ENERGY_STATUS), maxEnergyUnitsPerSecond));
      }
     if (cpu_model == JAKETOWN && MSR != NULL)
     {
@@ -837,8 +1158,8 @@ PCM::PCM() :
        try
        {
            clientBW = new ClientBW();
-           clientImcReads = new CounterWidthExtender(new CounterWidthExtender::ClientImcReadsCounter(clientBW));
-           clientImcWrites = new CounterWidthExtender(new CounterWidthExtender::ClientImcWritesCounter(clientBW)); 
+           clientImcReads = new CounterWidthExtender(new CounterWidthExtender::ClientImcReadsCounter(clientBW), PCM_CLIENT_IMC_MAX_LINES_PER_SECOND);
+           clientImcWrites = new CounterWidthExtender(new CounterWidthExtender::ClientImcWritesCounter(clientBW), PCM_CLIENT_IMC_MAX_LINES_PER_SECOND);
 
        } catch(...)
        {
@@ -852,10 +1173,53 @@ PCM::PCM() :
        }
     }
 #ifdef PCM_USE_PERF
-    canUsePerf = true;
     std::vector<int> dummy(PERF_MAX_COUNTERS, -1);
     perfEventHandle.resize(num_cores, dummy);
+    std::vector<perf_event_mmap_page *> noPages(PERF_MAX_COUNTERS, (perf_event_mmap_page *)NULL);
+    perfEventPage.resize(num_cores, noPages);
 #endif
+    buildCoreReadPlan();
+}
+
+void PCM::buildCoreReadPlan()
+{
+    coreReadPlan = CoreReadPlan();
+
+    if(!canUsePerf)
+    {
+        coreReadPlan.add(CoreReadPlan::INST_RETIRED_ANY, INST_RETIRED_ANY_ADDR);
+        coreReadPlan.add(CoreReadPlan::CPU_CLK_UNHALTED_THREAD, CPU_CLK_UNHALTED_THREAD_ADDR);
+        coreReadPlan.add(CoreReadPlan::CPU_CLK_UNHALTED_REF, CPU_CLK_UNHALTED_REF_ADDR);
+        switch (cpu_model)
+        {
+        case WESTMERE_EP:
+        case NEHALEM_EP:
+        case NEHALEM_EX:
+        case WESTMERE_EX:
+        case CLARKDALE:
+        case SANDY_BRIDGE:
+        case JAKETOWN:
+        case IVY_BRIDGE:
+        case HASWELL:
+            // PMC0-3 always (as before), PMC4-7 only if programmed (Intel(r) Hyper-Threading off)
+            for (uint32 j = 0; j < 4 || j < core_gen_counter_num_used; ++j)
+                coreReadPlan.add((CoreReadPlan::Slot)(CoreReadPlan::PMC0 + j), IA32_PMC0 + j);
+            break;
+        case ATOM:
+            coreReadPlan.add(CoreReadPlan::PMC0, IA32_PMC0);    // for Atom mapped to ArchLLCMiss field
+            coreReadPlan.add(CoreReadPlan::PMC1, IA32_PMC1);    // for Atom mapped to ArchLLCRef field
+            break;
+        }
+    }
+
+    if(cpu_model != ATOM) coreReadPlan.add(CoreReadPlan::INVARIANT_TSC, IA32_TIME_STAMP_COUNTER);
+
+    coreReadPlan.add(CoreReadPlan::CORE_C3_RESIDENCY, MSR_CORE_C3_RESIDENCY);
+    coreReadPlan.add(CoreReadPlan::CORE_C6_RESIDENCY, MSR_CORE_C6_RESIDENCY);
+    if(extendedCStateMetricsAvailable())
+        coreReadPlan.add(CoreReadPlan::CORE_C7_RESIDENCY, MSR_CORE_C7_RESIDENCY);
+
+    coreReadPlan.add(CoreReadPlan::THERM_STATUS, MSR_IA32_THERM_STATUS);
 }
 
 void PCM::enableJKTWorkaround(bool enable)
@@ -920,8 +1284,50 @@ bool PCM::checkModel()
     return true;
 }
 
+#ifdef __linux__
+struct MSROpenTask
+{
+    MsrHandle ** MSR;
+    int32 first, num_cores, step;
+};
+
+static void * openMSRThread(void * context)
+{
+    const MSROpenTask * task = (const MSROpenTask *)context;
+    for (int32 i = task->first; i < task->num_cores; i += task->step) task->MSR[i]->open();
+    return NULL;
+}
+#endif
+
+// opening /dev/cpu/*/msr costs a cross-CPU call per device, on large machines it is done by several threads
+void PCM::openMSR()
+{
+#ifdef __linux__
+    if (!MSR || !RegisterAccessBackend::get()->usesDevices()) return;
+    const int32 numThreads = (std::min)(int32(PCM_MSR_OPEN_THREADS), (num_cores + 15) / 16);
+    std::vector<MSROpenTask> tasks(numThreads);
+    std::vector<pthread_t> threads(numThreads);
+    std::vector<bool> started(numThreads, false);
+    for (int32 t = 0; t < numThreads; ++t)
+    {
+        tasks[t].MSR = MSR;
+        tasks[t].first = t;
+        tasks[t].num_cores = num_cores;
+        tasks[t].step = numThreads;
+        // the first task runs in this thread, as do the tasks of threads that can not be created
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, openMSRThread, &tasks[t]) == 0;
+    }
+    for (int32 t = 0; t < numThreads; ++t)
+        if (!started[t]) openMSRThread(&tasks[t]);
+    for (int32 t = 0; t < numThreads; ++t)
+        if (started[t]) pthread_join(threads[t], NULL);
+#endif
+}
+
 void PCM::destroyMSR()
 {
+        if (hotplug) delete hotplug;
+        hotplug = NULL;
         if (MSR)
         {
             for (int i = 0; i < num_cores; ++i)
@@ -936,27 +1342,35 @@ PCM::~PCM()
     SystemWideLock lock;
     if (instance)
     {
-        destroyMSR();
+        setSamplingMode(SERIAL_SAMPLING); // stops the sampler threads
+        disableCounterHistory();
 
-        if (jkt_uncore_pci)
-        {
-            for (int i = 0; i < num_sockets; ++i)
-                if (jkt_uncore_pci[i]) delete jkt_uncore_pci[i];
-            delete[] jkt_uncore_pci;
-        }
+        // the extenders are updated by the watchdog thread until they are deleted (unregistered),
+        // they must go before the MSR handles and the client bandwidth mapping they read
 	for (uint32 i = 0; i < snb_energy_status.size(); ++i)
 	{
 	    delete  snb_energy_status[i];
 	}
+        snb_energy_status.clear();
         for (uint32 i = 0; i < jkt_dram_energy_status.size(); ++i)
             delete jkt_dram_energy_status[i];
-	
-        instance = NULL;
-        
+        jkt_dram_energy_status.clear();
         if(clientImcReads) delete clientImcReads;
         clientImcReads = NULL;
         if(clientImcWrites) delete clientImcWrites;
         clientImcWrites = NULL;
+
+        destroyMSR();
+
+        if (jkt_uncore_pci)
+        {
+            for (int i = 0; i < num_sockets; ++i)
+                if (jkt_uncore_pci[i]) delete jkt_uncore_pci[i];
+            delete[] jkt_uncore_pci;
+        }
+	
+        instance = NULL;
+        
         if(clientBW) delete clientBW;
         clientBW = NULL;
     }
@@ -971,21 +1385,25 @@ class TemporalThreadAffinity  // speedup trick for Linux
 {
 #ifdef __linux__
     cpu_set_t old_affinity;
+    bool restore;
     TemporalThreadAffinity(); // forbiden
 
 public:
-    TemporalThreadAffinity(uint32 core_id)
+    // os_id: OS CPU number (TopologyEntry::os_id), not the core index
+    TemporalThreadAffinity(uint32 os_id) : restore(false)
     {
+        if (sched_getcpu() == (int)os_id) return; // already there (e.g. a pinned sampler thread)
+        restore = true;
         pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &old_affinity);
 
         cpu_set_t new_affinity;
         CPU_ZERO(&new_affinity);
-        CPU_SET(core_id, &new_affinity);
+        CPU_SET(os_id, &new_affinity);
         pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &new_affinity);
     }
     ~TemporalThreadAffinity()
     {
-        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &old_affinity);
+        if (restore) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &old_affinity);
     }
 #else // not implemented for windows or os x
     TemporalThreadAffinity(); // forbiden
@@ -995,132 +1413,480 @@ public:
 #endif
 };
 
-#ifdef PCM_USE_PERF
-perf_event_attr PCM_init_perf_event_attr()
-{
-    perf_event_attr e;
-    bzero(&e,sizeof(perf_event_attr));
-    e.type = -1; // must be set up later
-    e.size = sizeof(e);
-    e.config = -1; // must be set up later
-    e.sample_period = 0;
-    e.sample_type = 0;
-    e.read_format = PERF_FORMAT_GROUP; /* PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING |
-                          PERF_FORMAT_ID | PERF_FORMAT_GROUP ; */
-    e.disabled = 0;
-    e.inherit = 0;
-    e.pinned = 1;
-    e.exclusive = 0;
-    e.exclude_user = 0;
-    e.exclude_kernel = 0;
-    e.exclude_hv = 0;
-    e.exclude_idle = 0;
-    e.mmap = 0;
-    e.comm = 0;
-    e.freq = 0;
-    e.inherit_stat = 0;
-    e.enable_on_exec = 0;
-    e.task = 0;
-    e.watermark = 0;
-    e.wakeup_events = 0;
-    return e;
-}               
-#endif
+#ifdef __linux__
+void * CoreSamplerProc(void * worker);
 
-PCM::ErrorCode PCM::program(PCM::ProgramMode mode_, void * parameter_, PCM::PCMLine lineMode_)
-{
-    SystemWideLock lock;
-    if (!MSR) return PCM::MSRAccessDenied;
-    
-    ExtendedCustomCoreEventDescription * pExtDesc = (ExtendedCustomCoreEventDescription *)parameter_;
+/*! \brief Persistent sampler threads used by PCM::getAllCounterStates in the parallel sampling modes
 
-#ifdef PCM_USE_PERF
-    std::cout << "Trying to use Linux perf events..." << std::endl;
-    if(PERF_COUNT_HW_MAX <= PCM_PERF_COUNT_HW_REF_CPU_CYCLES)
+    Each worker is pinned to its core (or to the cores of its socket) and waits for the next epoch.
+    On a new epoch the workers meet on a short spin barrier and then read their cores at the same time
+    into the preallocated core states.
+*/
+class CoreSamplerPool
+{
+    struct Worker
     {
-        canUsePerf = false;
-        std::cout << "Can not use Linux perf because your Linux kernel does not support PERF_COUNT_HW_REF_CPU_CYCLES event. Falling-back to direct PMU programming." << std::endl;
-    }
-    if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->fixedCfg)
+        CoreSamplerPool * pool;
+        pthread_t thread;
+        cpu_set_t affinity;
+        std::vector<int32> cores;
+    };
+
+    PCM * pcm;
+    std::vector<Worker> workers;
+    std::vector<UncoreCounterState> packageStates; // package C state counters read on each core
+    CoreCounterState * coreStates;                 // destination of the current epoch
+
+    pthread_mutex_t mutex;
+    pthread_cond_t startCond;
+    pthread_cond_t doneCond;
+    uint64 epoch;
+    uint32 pending;
+    volatile uint32 arrived;
+    bool stop;
+
+    CoreSamplerPool();                    // forbidden
+    CoreSamplerPool(const CoreSamplerPool &); // forbidden
+
+    friend void * CoreSamplerProc(void * worker);
+
+    void run(Worker & w)
     {
-        canUsePerf = false;
-        std::cout << "Can not use Linux perf because non-standard fixed counter configuration requested. Falling-back to direct PMU programming." << std::endl;
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &w.affinity);
+        uint64 seen = 0;
+        while (true)
+        {
+            pthread_mutex_lock(&mutex);
+            while (epoch == seen && !stop) pthread_cond_wait(&startCond, &mutex);
+            if (stop)
+            {
+                pthread_mutex_unlock(&mutex);
+                return;
+            }
+            seen = epoch;
+            pthread_mutex_unlock(&mutex);
+
+            // wait (bounded) for the other workers so that all cores are read at the same time
+            __sync_fetch_and_add(&arrived, 1);
+            for (uint32 spin = 0; arrived < workers.size() && spin < (1 << 16); ++spin)
+                __asm__ __volatile__ ("pause" ::: "memory");
+
+            for (size_t i = 0; i < w.cores.size(); ++i)
+            {
+                const int32 core = w.cores[i];
+                pcm->readCoreState(core, coreStates[core], packageStates[core]);
+            }
+
+            pthread_mutex_lock(&mutex);
+            if (--pending == 0) pthread_cond_signal(&doneCond);
+            pthread_mutex_unlock(&mutex);
+        }
     }
-#endif
 
-    //std::cout << "Checking for other instances of PCM..." << std::endl;
-#ifdef _MSC_VER
-#if 1
-    numInstancesSemaphore = CreateSemaphore(NULL, 0, 1 << 20, L"Global\\Number of running Intel Processor Counter Monitor instances");
-    if (!numInstancesSemaphore)
+public:
+    CoreSamplerPool(PCM * pcm_, bool perSocket) :
+        pcm(pcm_), coreStates(NULL), epoch(0), pending(0), arrived(0), stop(false)
     {
-        std::cout << "Error in Windows function 'CreateSemaphore': " << GetLastError() << std::endl;
-        return PCM::UnknownError;
-    }
-    LONG prevValue = 0;
-    if (!ReleaseSemaphore(numInstancesSemaphore, 1, &prevValue))
+        const int32 num_cores = pcm->getNumCores();
+        packageStates.resize(num_cores);
+        workers.resize(perSocket ? pcm->getNumSockets() : num_cores);
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i].pool = this;
+            CPU_ZERO(&workers[i].affinity);
+        }
+        for (int32 core = 0; core < num_cores; ++core)
+        {
+            Worker & w = workers[perSocket ? pcm->topology[core].socket : core];
+            w.cores.push_back(core);
+            CPU_SET(pcm->topology[core].os_id, &w.affinity);
+        }
+
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&startCond, NULL);
+        pthread_cond_init(&doneCond, NULL);
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            if (pthread_create(&workers[i].thread, NULL, CoreSamplerProc, &workers[i]) != 0)
+            {
+                workers.resize(i); // join what has been started
+                shutdown();
+                throw std::exception();
+            }
+        }
+    }
+
+    ~CoreSamplerPool()
     {
-        std::cout << "Error in Windows function 'ReleaseSemaphore': " << GetLastError() << std::endl;
-        return PCM::UnknownError;
+        shutdown();
     }
-    if (prevValue > 0)  // already programmed since another instance exists
+
+    void shutdown()
     {
-        std::cout << "Number of PCM instances: " << (prevValue + 1) << std::endl;
-        return PCM::Success;
+        pthread_mutex_lock(&mutex);
+        stop = true;
+        pthread_cond_broadcast(&startCond);
+        pthread_mutex_unlock(&mutex);
+        for (size_t i = 0; i < workers.size(); ++i)
+            pthread_join(workers[i].thread, NULL);
+        workers.clear();
+        pthread_cond_destroy(&doneCond);
+        pthread_cond_destroy(&startCond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    //! reads all cores in parallel, socketStates receive the package C state counters
+    void sample(std::vector<CoreCounterState> & coreStates_, std::vector<SocketCounterState> & socketStates)
+    {
+        for (size_t core = 0; core < packageStates.size(); ++core)
+            packageStates[core] = UncoreCounterState();
+
+        pthread_mutex_lock(&mutex);
+        coreStates = &coreStates_[0];
+        arrived = 0;
+        pending = (uint32)workers.size();
+        ++epoch;
+        pthread_cond_broadcast(&startCond);
+        while (pending) pthread_cond_wait(&doneCond, &mutex);
+        pthread_mutex_unlock(&mutex);
+
+        for (size_t core = 0; core < packageStates.size(); ++core)
+            socketStates[pcm->topology[core].socket].UncoreCounterState::operator += (packageStates[core]);
     }
+};
+
+void * CoreSamplerProc(void * worker)
+{
+    CoreSamplerPool::Worker * w = (CoreSamplerPool::Worker *)worker;
+    w->pool->run(*w);
+    return NULL;
+}
 #endif
-#else // if linux or apple
-    numInstancesSemaphore = sem_open(PCM_NUM_INSTANCES_SEMAPHORE_NAME, O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO, 0);
-    if (SEM_FAILED == numInstancesSemaphore)
+
+bool PCM::setSamplingMode(PCM::SamplingMode mode_)
+{
+    if (mode_ == samplingMode) return true;
+#ifdef __linux__
+    if (samplerPool)
     {
-        if (EACCES == errno)
-            std::cout << "PCM Error, do not have permissions to open semaphores in /dev/shm/. Clean up them." << std::endl;
-        return PCM::UnknownError;
+        delete samplerPool;
+        samplerPool = NULL;
     }
-#ifndef __APPLE__
-    sem_post(numInstancesSemaphore);
-    int curValue = 0;
-    sem_getvalue(numInstancesSemaphore, &curValue);
-#else //if it is apple
-    uint32 curValue = PCM::incrementNumInstances();
-    sem_post(numInstancesSemaphore);
-#endif // end ifndef __APPLE__
+    samplingMode = SERIAL_SAMPLING;
+    if (mode_ == SERIAL_SAMPLING || !MSR) return mode_ == SERIAL_SAMPLING;
+    try
+    {
+        samplerPool = new CoreSamplerPool(this, mode_ == PER_SOCKET_SAMPLING);
+    }
+    catch (...)
+    {
+        std::cerr << "Can not start the sampler threads, falling back to serial sampling." << std::endl;
+        return false;
+    }
+    samplingMode = mode_;
+    return true;
+#else
+    return mode_ == SERIAL_SAMPLING;
+#endif
+}
 
-    if (curValue > 1)  // already programmed since another instance exists
+void PCM::readCoreState(int32 core, CoreCounterState & coreState, UncoreCounterState & packageState)
+{
+    if (hotplug && !hotplug->online[core])
     {
-        std::cout << "Number of PCM instances: " << curValue << std::endl;
-        if(!canUsePerf) return PCM::Success;
+        // the package counters are the same on all cores of the package, read them on one that is online
+        hotplug->readOk[core] = 0;
+        packageState.readAndAggregate(MSR[socketRefCore[topology[core].socket]]);
+        return;
     }
+    const bool ok = coreState.readAndAggregate(MSR[core]);
+    if (hotplug) hotplug->readOk[core] = ok ? 1 : 0;
+    packageState.readAndAggregate(MSR[core]); // read package C state counters
+}
 
-#endif // end ifdef _MSC_VER
+void PCM::readOnlineCores()
+{
+#ifdef __linux__
+    if (!RegisterAccessBackend::get()->usesDevices()) return; // the recorded cores are all online
+    const std::string mask = readFirstLine(PCM_SYSFS_CPU "/online");
+    if (mask.empty() || mask == hotplug->onlineMask) return;
+    hotplug->onlineMask = mask;
+    getOnlineCores(mask, hotplug->online);
+    chooseSocketRefCores(hotplug->online);
+#endif
+}
 
-#ifdef PCM_USE_PERF
-/* 
-numInst>1 &&  canUsePerf==false -> not reachable, already PMU programmed in another PCM instance
-numInst>1 &&  canUsePerf==true  -> perf programmed in different PCM, is not allowed 
-numInst<=1 && canUsePerf==false -> we are first, perf cannot be used, *check* if PMU busy
-numInst<=1 && canUsePerf==true -> we are first, perf will be used, *dont check*, this is now perf business
-*/
-    if(curValue > 1 && (canUsePerf == true))
+//! \brief Sets online[core] from a list of online OS CPUs (as in /sys/devices/system/cpu/online), keeps it if the list can not be parsed
+void PCM::getOnlineCores(const std::string & mask, std::vector<char> & online) const
+{
+#ifdef __linux__
+    std::vector<int32> cpus;
+    if (!parseCPUList(mask, cpus)) return;
+    std::vector<char> isOnline;
+    for (size_t i = 0; i < cpus.size(); ++i)
     {
-        std::cout << "Running several clients using the same counters is not posible with Linux perf. Recompile PCM without Linux Perf support to allow such usage. " << std::endl;
-        decrementInstanceSemaphore();
-        return PCM::UnknownError;
+        if (cpus[i] >= int32(isOnline.size())) isOnline.resize(cpus[i] + 1, 0);
+        isOnline[cpus[i]] = 1;
+    }
+    for (int32 core = 0; core < num_cores; ++core)
+    {
+        const int32 os_id = topology[core].os_id;
+        online[core] = (os_id < int32(isOnline.size())) ? isOnline[os_id] : 0;
     }
+#endif
+}
 
-    if((curValue <= 1) && (canUsePerf == false)) 
-#endif   
-    if (PMUinUse())
+//! \brief Reads the package counters of each socket on its first online core, moves the energy counters there
+void PCM::chooseSocketRefCores(const std::vector<char> & online)
+{
+    if (socketRefCore.size() != (size_t)num_sockets)
     {
-        decrementInstanceSemaphore();
-        return PCM::PMUBusy;
+        socketRefCore.resize(num_sockets);
+        for (int32 core = num_cores - 1; core >= 0; --core) socketRefCore[topology[core].socket] = core;
     }
+    for (int32 socket = 0; socket < num_sockets; ++socket)
+    {
+        int32 ref = -1;
+        for (int32 core = 0; core < num_cores && ref < 0; ++core)
+            if (topology[core].socket == socket && online[core]) ref = core;
+        if (ref < 0 || (uint32)ref == socketRefCore[socket]) continue; // keep the last choice if the whole package is offline
+        socketRefCore[socket] = ref;
+        if ((size_t)socket < snb_energy_status.size())
+            static_cast<CounterWidthExtender::MsrHandleCounter *>(snb_energy_status[socket]->getRawCounter())->setMsr(MSR[ref]);
+        if ((size_t)socket < jkt_dram_energy_status.size())
+            static_cast<CounterWidthExtender::MsrHandleCounter *>(jkt_dram_energy_status[socket]->getRawCounter())->setMsr(MSR[ref]);
+    }
+}
 
-    mode = mode_;
+void PCM::reprogramCore(int32 core)
+{
+    if (canUsePerf || coreEventSelect.empty()) return; // the PMU is not programmed by this instance through the MSRs
+
+    TemporalThreadAffinity tempThreadAffinity(topology[core].os_id); // speedup trick for Linux
+    MSR[core]->write(IA32_CR_PERF_GLOBAL_CTRL, 0);
+    MSR[core]->write(IA32_CR_FIXED_CTR_CTRL, hotplug->fixedCtrl);
+    for (uint32 j = 0; j < core_gen_counter_num_used; ++j)
+    {
+        MSR[core]->write(IA32_PMC0 + j, 0);
+        MSR[core]->write(IA32_PERFEVTSEL0_ADDR + j, coreEventSelect[core * PCM_MAX_CORE_GEN_COUNTERS + j]);
+    }
+    MSR[core]->write(IA32_CR_PERF_GLOBAL_CTRL, getCoreGlobalCtrlValue());
+}
+
+void PCM::applyCoreHotplug(std::vector<CoreCounterState> & coreStates)
+{
+    for (int32 core = 0; core < num_cores; ++core)
+    {
+        CoreCounterState & state = coreStates[core];
+        CoreCounterState & last = hotplug->last[core];
+        const bool backOnline = hotplug->readOk[core] && !last.Online;
+        if (backOnline)
+        {
+            // the PMU state of the core may be lost, program it again and continue from the last values
+            reprogramCore(core);
+            UncoreCounterState packageState;
+            state = CoreCounterState();
+            readCoreState(core, state, packageState);
+        }
+        if (!hotplug->readOk[core])
+        {
+            // offline: the counters stand still, only the time goes on
+            const CoreCounterState & ref = coreStates[socketRefCore[topology[core].socket]];
+            const uint64 tsc = (hotplug->readOk[socketRefCore[topology[core].socket]] && ref.InvariantTSC > last.InvariantTSC) ? ref.InvariantTSC : last.InvariantTSC;
+            state = last;
+            state.InvariantTSC = tsc;
+            state.Online = false;
+            last = state;
+            continue;
+        }
+        if (backOnline)
+        {
+            hotplug->carry[core] = last;
+            hotplug->subtract(hotplug->carry[core], state);
+            ++hotplug->generation[core];
+        }
+        hotplug->add(state, hotplug->carry[core]);
+        state.Online = true;
+        state.OnlineGeneration = hotplug->generation[core];
+        last = state;
+    }
+}
+
+bool PCM::isCoreOnline(uint32 core) const
+{
+    return core < (uint32)num_cores && (!hotplug || hotplug->last[core].isOnline());
+}
+
+#ifdef PCM_USE_PERF
+perf_event_attr PCM_init_perf_event_attr()
+{
+    perf_event_attr e;
+    bzero(&e,sizeof(perf_event_attr));
+    e.type = -1; // must be set up later
+    e.size = sizeof(e);
+    e.config = -1; // must be set up later
+    e.sample_period = 0;
+    e.sample_type = 0;
+    // one read of the group leader returns all counters and the times needed to scale multiplexed values
+    e.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    e.disabled = 0;
+    e.inherit = 0;
+    e.pinned = 1;
+    e.exclusive = 0;
+    e.exclude_user = 0;
+    e.exclude_kernel = 0;
+    e.exclude_hv = 0;
+    e.exclude_idle = 0;
+    e.mmap = 0;
+    e.comm = 0;
+    e.freq = 0;
+    e.inherit_stat = 0;
+    e.enable_on_exec = 0;
+    e.task = 0;
+    e.watermark = 0;
+    e.wakeup_events = 0;
+    return e;
+}               
+
+// checks that perf_event_open for system-wide hardware events is permitted (CAP_SYS_ADMIN or low perf_event_paranoid)
+bool PCM::perfEventsAvailable()
+{
+    perf_event_attr e = PCM_init_perf_event_attr();
+    e.type = PERF_TYPE_HARDWARE;
+    e.config = PCM_PERF_COUNT_HW_REF_CPU_CYCLES;
+    e.read_format = 0;
+    const int fd = syscall(SYS_perf_event_open, &e, -1, 0 /* core id */, -1 /* group leader */, 0);
+    if (fd < 0) return false;
+    ::close(fd);
+    return true;
+}
+
+bool PCM::openPerfEvent(int32 core, int32 pos, perf_event_attr & e, const char * name)
+{
+    const int32 os_id = topology[core].os_id;
+    const int leader = (pos == PERF_GROUP_LEADER_COUNTER) ? -1 : perfEventHandle[core][PERF_GROUP_LEADER_COUNTER];
+    if (pos != PERF_GROUP_LEADER_COUNTER && leader < 0) return true; // the core is offline, see below
+    perfEventHandle[core][pos] = syscall(SYS_perf_event_open, &e, -1, os_id /* cpu */, leader /* group leader */, 0);
+    if (perfEventHandle[core][pos] < 0)
+    {
+        // an offline core has no events, it is not counted (see readPerfData)
+        char path[256];
+        snprintf(path, sizeof(path), PCM_SYSFS_CPU "/cpu%d/online", os_id);
+        if (errno == ENODEV && readFirstLine(path) == "0") return true;
+        std::cout << "Linux Perf: Error on programming " << name << " on core " << core << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void PCM::closePerfEvents()
+{
+    for (int i = 0; i < (int)perfEventHandle.size(); ++i)
+        for (int c = 0; c < PERF_MAX_COUNTERS; ++c)
+        {
+            if (perfEventPage[i][c]) munmap(perfEventPage[i][c], getpagesize());
+            perfEventPage[i][c] = NULL;
+            if (perfEventHandle[i][c] >= 0) ::close(perfEventHandle[i][c]);
+            perfEventHandle[i][c] = -1;
+        }
+    userRdpmc = false;
+}
+
+bool PCM::mapPerfEventPages()
+{
+    const int32 nCounters = core_fixed_counter_num_used + core_gen_counter_num_used;
+    bool ok = true;
+    for (int i = 0; i < num_cores && ok; ++i)
+        for (int32 c = 0; c < nCounters && ok; ++c)
+        {
+            if (perfEventHandle[i][c] < 0) continue; // offline core
+            void * page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, perfEventHandle[i][c], 0);
+            if (page == MAP_FAILED)
+            {
+                std::cout << "Linux Perf: Can not map the event control page: " << strerror(errno) << std::endl;
+                ok = false;
+            }
+            else
+            {
+                perfEventPage[i][c] = (perf_event_mmap_page *)page;
+                ok = perfEventPage[i][c]->cap_user_rdpmc;
+                if (!ok) std::cout << "Linux Perf: user space rdpmc is not permitted (see /sys/bus/event_source/devices/cpu/rdpmc)" << std::endl;
+            }
+        }
+    if (ok) return true;
+
+    for (int i = 0; i < num_cores; ++i)
+        for (int c = 0; c < PERF_MAX_COUNTERS; ++c)
+        {
+            if (perfEventPage[i][c]) munmap(perfEventPage[i][c], getpagesize());
+            perfEventPage[i][c] = NULL;
+        }
+    return false;
+}
+
+static inline uint64 PCM_rdtscp(uint32 & aux)
+{
+    uint32 high = 0, low = 0;
+    asm volatile("rdtscp" : "=a" (low), "=d" (high), "=c" (aux));
+    return low + (uint64(high) << 32ULL);
+}
+
+static inline uint64 PCM_rdpmc(uint32 counter)
+{
+    uint32 high = 0, low = 0;
+    asm volatile("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+    return low + (uint64(high) << 32ULL);
+}
+
+/*
+   Reads the counters of the current core as described in linux/perf_event.h: the sequence
+   number of the control page detects a concurrent update of the page (the event was
+   rescheduled), the processor number in TSC_AUX detects a migration of the calling thread.
+*/
+bool PCM::readUserPerfData(uint32 & core, uint64 * outData, uint64 & tsc)
+{
+    uint32 aux = 0, auxAfter = 0;
+    tsc = PCM_rdtscp(aux);
+    const int32 index = getCoreIndex(aux & 0xfff); // Linux stores the node number in the bits above
+    if (index < 0) return false;
+    core = uint32(index);
+
+    const int32 nCounters = core_fixed_counter_num_used + core_gen_counter_num_used;
+    for (int32 c = 0; c < nCounters; ++c)
+    {
+        volatile perf_event_mmap_page * pc = perfEventPage[core][c];
+        if (!pc) return false;
+        uint32 seq;
+        uint64 count, enabled, running;
+        do
+        {
+            seq = pc->lock;
+            asm volatile("" ::: "memory");
+            const uint32 idx = pc->index;
+            if (idx == 0) return false; // the event is not active on the counters right now
+            enabled = pc->time_enabled;
+            running = pc->time_running;
+            const uint32 shift = 64 - pc->pmc_width;
+            count = pc->offset + (uint64)(((int64)(PCM_rdpmc(idx - 1) << shift)) >> shift);
+            asm volatile("" ::: "memory");
+        } while (pc->lock != seq);
+        // the event was multiplexed: the raw count would not match the scaled counts of readPerfData,
+        // the caller falls back to the read() system call
+        if (enabled != running) return false;
+        outData[c] = count;
+    }
+
+    PCM_rdtscp(auxAfter);
+    return auxAfter == aux;
+}
+#endif
+
+PCM::ErrorCode PCM::setCoreEvents(PCM::ProgramMode mode_, void * parameter_, PCM::PCMLine lineMode_)
+{
+    ExtendedCustomCoreEventDescription * pExtDesc = (ExtendedCustomCoreEventDescription *)parameter_;
 
-    
     // copy custom event descriptions
-    if (mode == CUSTOM_CORE_EVENTS)
+    if (mode_ == CUSTOM_CORE_EVENTS && lineMode_ != TLB_CACHE_LINE)
     {
         if (!parameter_)
 		{
@@ -1151,7 +1917,8 @@ numInst<=1 && canUsePerf==true -> we are first, perf will be used, *dont check*,
 				coreEventDesc[2] = pDesc[2];
 				core_gen_counter_num_used = 3;
 			}
-			core_gen_counter_num_used = 0;
+			else
+				core_gen_counter_num_used = 0;
 		}
 		else
 		{
@@ -1212,61 +1979,225 @@ numInst<=1 && canUsePerf==true -> we are first, perf will be used, *dont check*,
         }
     }
 
-    core_fixed_counter_num_used = 3;
-    
+    if (mode_ == CUSTOM_CORE_EVENTS && lineMode_ == TLB_CACHE_LINE)
+    {
+        // default events in the counters 0-3 (set above), custom events in the counters 4-7
+        if (!parameter_)
+        {
+            std::cout << "PCM Internal Error: data structure for custom event not initialized" << std::endl;
+            return PCM::UnknownError;
+        }
+        if (cpu_model == ATOM || getMaxCustomCoreEvents() < 8)
+        {
+            std::cout << "PCM Error: " << getMaxCustomCoreEvents() << " general purpose counters available, TLB_CACHE_LINE needs 8 (disable Intel(r) Hyper-Threading)" << std::endl;
+            return PCM::UnknownError;
+        }
+        CustomCoreEventDescription * pDesc = (CustomCoreEventDescription *)parameter_;
+        for (uint32 j = 0; j < 4; ++j)
+            coreEventDesc[4 + j] = pDesc[j];
+        core_gen_counter_num_used = 8;
+    }
+
     if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->gpCounterCfg)
     {
-        core_gen_counter_num_used = (std::min)(core_gen_counter_num_used,pExtDesc->nGPCounters);
+        // all programmable counters of the core can be used (8 with Intel(r) Hyper-Threading off)
+        core_gen_counter_num_used = (std::min)(getMaxCustomCoreEvents(), pExtDesc->nGPCounters);
     }
 
-    if(cpu_model == JAKETOWN)
+
+    return PCM::Success;
+}
+
+bool PCM::coreEventsNeedJKTWorkaround() const
+{
+    for(uint32 i = 0; i < core_gen_counter_num_used; ++i)
     {
-        bool enableWA = false;
-        for(uint32 i = 0; i< core_gen_counter_num_used; ++i)
+        if(coreEventDesc[i].event_number == MEM_LOAD_UOPS_LLC_HIT_RETIRED_XSNP_EVTNR)
+            return true;
+    }
+    return false;
+}
+
+void PCM::setDefaultEventSelectFields(EventSelectRegister & event_select_reg, const CustomCoreEventDescription & desc)
+{
+    event_select_reg.fields.event_select = desc.event_number;
+    event_select_reg.fields.umask = desc.umask_value;
+    event_select_reg.fields.usr = 1;
+    event_select_reg.fields.os = 1;
+    event_select_reg.fields.edge = 0;
+    event_select_reg.fields.pin_control = 0;
+    event_select_reg.fields.apic_int = 0;
+    event_select_reg.fields.any_thread = 0;
+    event_select_reg.fields.enable = 1;
+    event_select_reg.fields.invert = 0;
+    event_select_reg.fields.cmask = 0;
+    event_select_reg.fields.in_tx = 0;
+    event_select_reg.fields.in_txcp = 0;
+}
+
+uint64 PCM::getCoreGlobalCtrlValue() const
+{
+    // the programmable counters (4 as before, Atom has only 2, up to 8 if programmed) + 3 fixed counters
+    const uint32 nGen = (cpu_model == ATOM) ? 2 : (std::max)(4U, core_gen_counter_num_used);
+    uint64 value = (1ULL << 32) + (1ULL << 33) + (1ULL << 34);
+    for (uint32 j = 0; j < nGen; ++j)
+        value += (1ULL << j);
+    return value;
+}
+
+PCM::ErrorCode PCM::program(PCM::ProgramMode mode_, void * parameter_, PCM::PCMLine lineMode_)
+{
+    SystemWideLock lock;
+    if (!MSR) return PCM::MSRAccessDenied;
+    ++programGeneration;
+    openMSR();
+    
+    ExtendedCustomCoreEventDescription * pExtDesc = (ExtendedCustomCoreEventDescription *)parameter_;
+
+    // decide once how the core PMU is accessed, the rest of program() follows canUsePerf
+    canUsePerf = false;
+#ifdef PCM_USE_PERF
+    if (corePMUAccess == CORE_PMU_PERF || (corePMUAccess == CORE_PMU_AUTO && (!MSR[0]->isWritable() || userRdpmcRequested)))
+    {
+        std::cout << "Trying to use Linux perf events..." << std::endl;
+        const char * reason = NULL;
+        if(PERF_COUNT_HW_MAX <= PCM_PERF_COUNT_HW_REF_CPU_CYCLES)
+            reason = "your Linux kernel does not support PERF_COUNT_HW_REF_CPU_CYCLES event";
+        else if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->fixedCfg)
+            reason = "non-standard fixed counter configuration requested";
+        else if(!perfEventsAvailable())
+            reason = "perf_event_open is not permitted (CAP_SYS_ADMIN privileges needed)";
+
+        if (reason == NULL)
+            canUsePerf = true;
+        else if (corePMUAccess == CORE_PMU_PERF)
         {
-            if(coreEventDesc[i].event_number == MEM_LOAD_UOPS_LLC_HIT_RETIRED_XSNP_EVTNR)
-                enableWA = true;
+            std::cout << "Can not use Linux perf because " << reason << "." << std::endl;
+            return PCM::UnknownError;
         }
-        enableJKTWorkaround(enableWA); // this has a performance penalty on memory access
+        else
+            std::cout << "Can not use Linux perf because " << reason << ". Falling-back to direct PMU programming." << std::endl;
+    }
+#else
+    if (corePMUAccess == CORE_PMU_PERF)
+    {
+        std::cout << "Linux perf support is not compiled in (PCM_USE_PERF)." << std::endl;
+        return PCM::UnknownError;
     }
+#endif
+
+    //std::cout << "Checking for other instances of PCM..." << std::endl;
+#ifdef _MSC_VER
+#if 1
+    numInstancesSemaphore = CreateSemaphore(NULL, 0, 1 << 20, L"Global\\Number of running Intel Processor Counter Monitor instances");
+    if (!numInstancesSemaphore)
+    {
+        std::cout << "Error in Windows function 'CreateSemaphore': " << GetLastError() << std::endl;
+        return PCM::UnknownError;
+    }
+    LONG prevValue = 0;
+    if (!ReleaseSemaphore(numInstancesSemaphore, 1, &prevValue))
+    {
+        std::cout << "Error in Windows function 'ReleaseSemaphore': " << GetLastError() << std::endl;
+        return PCM::UnknownError;
+    }
+    if (prevValue > 0)  // already programmed since another instance exists
+    {
+        std::cout << "Number of PCM instances: " << (prevValue + 1) << std::endl;
+        return PCM::Success;
+    }
+#endif
+#else // if linux or apple
+    numInstancesSemaphore = sem_open(PCM_NUM_INSTANCES_SEMAPHORE_NAME, O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO, 0);
+    if (SEM_FAILED == numInstancesSemaphore)
+    {
+        if (EACCES == errno)
+            std::cout << "PCM Error, do not have permissions to open semaphores in /dev/shm/. Clean up them." << std::endl;
+        return PCM::UnknownError;
+    }
+#ifndef __APPLE__
+    sem_post(numInstancesSemaphore);
+    int curValue = 0;
+    sem_getvalue(numInstancesSemaphore, &curValue);
+#else //if it is apple
+    uint32 curValue = PCM::incrementNumInstances();
+    sem_post(numInstancesSemaphore);
+#endif // end ifndef __APPLE__
+
+    if (curValue > 1)  // already programmed since another instance exists
+    {
+        std::cout << "Number of PCM instances: " << curValue << std::endl;
+        if(!canUsePerf) return PCM::Success;
+    }
+
+#endif // end ifdef _MSC_VER
+
+#ifdef PCM_USE_PERF
+/* 
+numInst>1 &&  canUsePerf==false -> not reachable, already PMU programmed in another PCM instance
+numInst>1 &&  canUsePerf==true  -> perf programmed in different PCM, is not allowed 
+numInst<=1 && canUsePerf==false -> we are first, perf cannot be used, *check* if PMU busy
+numInst<=1 && canUsePerf==true -> we are first, perf will be used, *dont check*, this is now perf business
+*/
+    if(curValue > 1 && (canUsePerf == true))
+    {
+        std::cout << "Running several clients using the same counters is not posible with Linux perf. Use direct PMU programming (CORE_PMU_MSR) to allow such usage. " << std::endl;
+        decrementInstanceSemaphore();
+        return PCM::UnknownError;
+    }
+
+    if((curValue <= 1) && (canUsePerf == false)) 
+#endif   
+    if (PMUinUse())
+    {
+        decrementInstanceSemaphore();
+        return PCM::PMUBusy;
+    }
+
+    mode = mode_;
+
+    // copy custom event descriptions
+    const PCM::ErrorCode eventStatus = setCoreEvents(mode_, parameter_, lineMode_);
+    if (eventStatus != PCM::Success)
+    {
+        decrementInstanceSemaphore();
+        return eventStatus;
+    }
+
+    core_fixed_counter_num_used = 3;
+
+    if(cpu_model == JAKETOWN)
+    {
+        jktWorkaroundEnabled = coreEventsNeedJKTWorkaround();
+        enableJKTWorkaround(jktWorkaroundEnabled); // this has a performance penalty on memory access
+    }
+
+    coreEventSelect.assign(canUsePerf ? 0 : num_cores * PCM_MAX_CORE_GEN_COUNTERS, 0);
+    coreFixedCtrl.assign(canUsePerf ? 0 : num_cores, 0);
 
     // Version for linux/windows
     for (int i = 0; i < num_cores; ++i)
     {
         // program core counters
 
-        TemporalThreadAffinity tempThreadAffinity(i); // speedup trick for Linux
+        TemporalThreadAffinity tempThreadAffinity(topology[i].os_id); // speedup trick for Linux
 
       FixedEventControlRegister ctrl_reg;
 #ifdef PCM_USE_PERF      
-      int leader_counter = -1; 
       perf_event_attr e = PCM_init_perf_event_attr();
       if(canUsePerf)
       {
         e.type = PERF_TYPE_HARDWARE;
         e.config = (((long long unsigned)PERF_TYPE_HARDWARE)<<(64ULL-8ULL)) + PERF_COUNT_HW_INSTRUCTIONS;
-        if((perfEventHandle[i][PERF_INST_RETIRED_ANY_POS] = syscall(SYS_perf_event_open, &e, -1,
-                   i /* core id */, leader_counter /* group leader */ ,0 )) <= 0)
-        {
-          std::cout <<"Linux Perf: Error on programming INST_RETIRED_ANY: "<<strerror(errno)<< std::endl;
-          decrementInstanceSemaphore();
-          return PCM::UnknownError;
-        }
-        leader_counter = perfEventHandle[i][PERF_INST_RETIRED_ANY_POS];
+        bool ok = openPerfEvent(i, PERF_INST_RETIRED_ANY_POS, e, "INST_RETIRED_ANY");
         e.pinned = 0; // all following counter are not leaders, thus need not be pinned explicitly
         e.config = (((long long unsigned)PERF_TYPE_HARDWARE)<<(64ULL-8ULL)) + PERF_COUNT_HW_CPU_CYCLES;
-        if( (perfEventHandle[i][PERF_CPU_CLK_UNHALTED_THREAD_POS] = syscall(SYS_perf_event_open, &e, -1,
-                                                i /* core id */, leader_counter /* group leader */ ,0 )) <= 0)
-        {
-          std::cout <<"Linux Perf: Error on programming CPU_CLK_UNHALTED_THREAD: "<<strerror(errno)<< std::endl;
-          decrementInstanceSemaphore();
-          return PCM::UnknownError;
-        }
+        ok = ok && openPerfEvent(i, PERF_CPU_CLK_UNHALTED_THREAD_POS, e, "CPU_CLK_UNHALTED_THREAD");
         e.config = (((long long unsigned)PERF_TYPE_HARDWARE)<<(64ULL-8ULL)) + PCM_PERF_COUNT_HW_REF_CPU_CYCLES;
-        if((perfEventHandle[i][PERF_CPU_CLK_UNHALTED_REF_POS] = syscall(SYS_perf_event_open, &e, -1,
-                         i /* core id */, leader_counter /* group leader */ ,0 )) <= 0)
+        ok = ok && openPerfEvent(i, PERF_CPU_CLK_UNHALTED_REF_POS, e, "CPU_CLK_UNHALTED_REF");
+        if (!ok)
         {
-          std::cout <<"Linux Perf: Error on programming CPU_CLK_UNHALTED_REF: "<<strerror(errno)<< std::endl;
+          closePerfEvents();
           decrementInstanceSemaphore();
           return PCM::UnknownError;
         }
@@ -1278,7 +2209,103 @@ numInst<=1 && canUsePerf==true -> we are first, perf will be used, *dont check*,
         MSR[i]->write(IA32_CR_PERF_GLOBAL_CTRL, 0);
         MSR[i]->read(IA32_CR_FIXED_CTR_CTRL, &ctrl_reg.value);
 
-	
+        setFixedCtrlFields(ctrl_reg, mode_, parameter_);
+
+        MSR[i]->write(IA32_CR_FIXED_CTR_CTRL, ctrl_reg.value); 
+        coreFixedCtrl[i] = ctrl_reg.value;
+        if (hotplug) hotplug->fixedCtrl = ctrl_reg.value;
+      }
+
+        EventSelectRegister event_select_reg;
+
+        for (uint32 j = 0; j < core_gen_counter_num_used; ++j)
+        {
+            if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->gpCounterCfg)
+            {
+              event_select_reg = pExtDesc->gpCounterCfg[j];
+            }
+            else
+            {
+              MSR[i]->read(IA32_PERFEVTSEL0_ADDR + j, &event_select_reg.value); // read-only also safe for perf
+              setDefaultEventSelectFields(event_select_reg, coreEventDesc[j]);
+            }
+#ifdef PCM_USE_PERF            
+            if(canUsePerf)
+            {
+                e.type = PERF_TYPE_RAW;
+                e.config = (1ULL<<63ULL) + (((long long unsigned)PERF_TYPE_RAW)<<(64ULL-8ULL)) + event_select_reg.value;
+                if(!openPerfEvent(i, PERF_GEN_EVENT_0_POS + j, e, "generic event"))
+                {
+                        closePerfEvents();
+                        decrementInstanceSemaphore();
+                        return PCM::UnknownError;
+                }
+            }
+            else
+#endif              
+            {
+              MSR[i]->write(IA32_PMC0 + j, 0);
+              MSR[i]->write(IA32_PERFEVTSEL0_ADDR + j, event_select_reg.value);
+              coreEventSelect[i * PCM_MAX_CORE_GEN_COUNTERS + j] = event_select_reg.value;
+            }
+        }
+
+        if(!canUsePerf)
+        {
+          // start counting
+          MSR[i]->write(IA32_CR_PERF_GLOBAL_CTRL, getCoreGlobalCtrlValue());
+        }
+
+        // program uncore counters
+
+        if (cpu_model == NEHALEM_EP || cpu_model == WESTMERE_EP || cpu_model == CLARKDALE)
+        {
+            programNehalemEPUncore(i);
+        }
+        else if (cpu_model == NEHALEM_EX || cpu_model == WESTMERE_EX)
+        {
+            programBecktonUncore(i);
+        }
+    }
+    
+    buildCoreReadPlan();
+
+    if(canUsePerf)
+    {
+      std::cout << "Successfully programmed on-core PMU using Linux perf"<<std::endl;
+#ifdef PCM_USE_PERF
+      if (userRdpmcRequested)
+      {
+        userRdpmc = mapPerfEventPages();
+        if (userRdpmc) std::cout << "Core counters of the current core are read with user space rdpmc" << std::endl;
+      }
+#endif
+    }
+
+    if (cpu_model == JAKETOWN && jkt_uncore_pci)
+    {
+        for (int i = 0; i < num_sockets; ++i)
+        {
+            jkt_uncore_pci[i]->program();
+	    if(i==0) qpi_speed = jkt_uncore_pci[i]->computeQPISpeed();
+        }
+    }
+    
+    if(qpi_speed)
+    {
+       std::cout.precision(1);
+       std::cout << std::fixed;
+       std::cout << "Max QPI link speed: " << qpi_speed / (1e9) << " GBytes/second (" << qpi_speed / (2e9) << " GT/second)" << std::endl;
+    }
+
+    return PCM::Success;
+}
+
+// the fixed counter configuration of an EXT_CUSTOM_CORE_EVENTS description, otherwise all three fixed counters
+// count in the OS and the user mode of this thread
+void PCM::setFixedCtrlFields(FixedEventControlRegister & ctrl_reg, PCM::ProgramMode mode_, const void * parameter_)
+{
+    const ExtendedCustomCoreEventDescription * pExtDesc = (const ExtendedCustomCoreEventDescription *)parameter_;
 	if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->fixedCfg)
 	{
 	  ctrl_reg = *(pExtDesc->fixedCfg);
@@ -1300,101 +2327,98 @@ numInst<=1 && canUsePerf==true -> we are first, perf will be used, *dont check*,
 	  ctrl_reg.fields.any_thread2 = 0;
 	  ctrl_reg.fields.enable_pmi2 = 0;	
 	}
+}
 
-        MSR[i]->write(IA32_CR_FIXED_CTR_CTRL, ctrl_reg.value); 
-      }
+PCM::ErrorCode PCM::switchCoreEvents(PCM::ProgramMode mode_, void * parameter_, PCM::PCMLine lineMode_)
+{
+    if (!MSR) return PCM::MSRAccessDenied;
 
-        EventSelectRegister event_select_reg;
+    if (canUsePerf || coreEventSelect.empty())
+    {
+        // perf events can not be reconfigured in place, and the PMU is not programmed by this instance
+        // (cleanup() and program() take the system wide lock themselves)
+        cleanup();
+        return program(mode_, parameter_, lineMode_);
+    }
+
+    SystemWideLock lock;
+    ++programGeneration;
+
+    ExtendedCustomCoreEventDescription * pExtDesc = (ExtendedCustomCoreEventDescription *)parameter_;
+
+    const uint32 prev_gen_counter_num_used = core_gen_counter_num_used;
+    const uint64 prevGlobalCtrl = getCoreGlobalCtrlValue();
+
+    const PCM::ErrorCode eventStatus = setCoreEvents(mode_, parameter_, lineMode_);
+    if (eventStatus != PCM::Success)
+    {
+        core_gen_counter_num_used = prev_gen_counter_num_used;
+        return eventStatus;
+    }
+    mode = mode_;
+
+    const uint64 globalCtrl = getCoreGlobalCtrlValue();
+
+    for (int i = 0; i < num_cores; ++i)
+    {
+        uint64 * cachedEventSelect = &coreEventSelect[i * PCM_MAX_CORE_GEN_COUNTERS];
+        TemporalThreadAffinity tempThreadAffinity(topology[i].os_id); // speedup trick for Linux
+
+        // the fixed counters follow a changed fixed counter configuration, as with program()
+        FixedEventControlRegister ctrl_reg;
+        ctrl_reg.value = coreFixedCtrl[i];
+        setFixedCtrlFields(ctrl_reg, mode_, parameter_);
+        const bool fixedChanged = (ctrl_reg.value != coreFixedCtrl[i]);
+
+        if (globalCtrl != prevGlobalCtrl || fixedChanged)
+            MSR[i]->write(IA32_CR_PERF_GLOBAL_CTRL, 0);
+
+        if (fixedChanged)
+        {
+            MSR[i]->write(IA32_CR_FIXED_CTR_CTRL, ctrl_reg.value);
+            coreFixedCtrl[i] = ctrl_reg.value;
+            if (hotplug) hotplug->fixedCtrl = ctrl_reg.value;
+        }
 
-        for (uint32 j = 0; j < core_gen_counter_num_used; ++j)
+        for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j)
         {
-            if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->gpCounterCfg)
-            {
-              event_select_reg = pExtDesc->gpCounterCfg[j];
-            }
-            else
+            EventSelectRegister event_select_reg;
+            if (j >= core_gen_counter_num_used)
             {
-              MSR[i]->read(IA32_PERFEVTSEL0_ADDR + j, &event_select_reg.value); // read-only also safe for perf
-              
-              event_select_reg.fields.event_select = coreEventDesc[j].event_number;
-              event_select_reg.fields.umask = coreEventDesc[j].umask_value;
-              event_select_reg.fields.usr = 1;
-              event_select_reg.fields.os = 1;
-              event_select_reg.fields.edge = 0;
-              event_select_reg.fields.pin_control = 0;
-              event_select_reg.fields.apic_int = 0;
-              event_select_reg.fields.any_thread = 0;
-              event_select_reg.fields.enable = 1;
-              event_select_reg.fields.invert = 0;
-              event_select_reg.fields.cmask = 0;
-              event_select_reg.fields.in_tx = 0;
-              event_select_reg.fields.in_txcp = 0;
+                if (j >= prev_gen_counter_num_used) continue;
+                event_select_reg.value = 0; // stop the counter, as cleanup() + program() would
             }
-#ifdef PCM_USE_PERF            
-            if(canUsePerf)
+            else if(EXT_CUSTOM_CORE_EVENTS == mode_ && pExtDesc && pExtDesc->gpCounterCfg)
             {
-                e.type = PERF_TYPE_RAW;
-                e.config = (1ULL<<63ULL) + (((long long unsigned)PERF_TYPE_RAW)<<(64ULL-8ULL)) + event_select_reg.value;
-                if((perfEventHandle[i][PERF_GEN_EVENT_0_POS + j] = syscall(SYS_perf_event_open, &e, -1,
-                                                i /* core id */, leader_counter /* group leader */ ,0 )) <= 0)
-                {
-                        std::cout <<"Linux Perf: Error on programming generic event #"<< i <<" error: "<<strerror(errno)<< std::endl;
-                        decrementInstanceSemaphore();
-                        return PCM::UnknownError;
-                }
+                event_select_reg = pExtDesc->gpCounterCfg[j];
             }
             else
-#endif              
             {
-              MSR[i]->write(IA32_PMC0 + j, 0);
-              MSR[i]->write(IA32_PERFEVTSEL0_ADDR + j, event_select_reg.value);
+                event_select_reg.value = cachedEventSelect[j];
+                setDefaultEventSelectFields(event_select_reg, coreEventDesc[j]);
             }
-        }
 
-        if(!canUsePerf)
-        {
-          // start counting, enable all (4 programmable + 3 fixed) counters
-          uint64 value = (1ULL << 0) + (1ULL << 1) + (1ULL << 2) + (1ULL << 3) + (1ULL << 32) + (1ULL << 33) + (1ULL << 34);
+            if (event_select_reg.value == cachedEventSelect[j]) continue; // the same event keeps counting
 
-          if (cpu_model == ATOM)       // Atom has only 2 programmable counters
-              value = (1ULL << 0) + (1ULL << 1) + (1ULL << 32) + (1ULL << 33) + (1ULL << 34);
-
-          MSR[i]->write(IA32_CR_PERF_GLOBAL_CTRL, value);
+            MSR[i]->write(IA32_PERFEVTSEL0_ADDR + j, 0);
+            MSR[i]->write(IA32_PMC0 + j, 0);
+            if (event_select_reg.value)
+                MSR[i]->write(IA32_PERFEVTSEL0_ADDR + j, event_select_reg.value);
+            cachedEventSelect[j] = event_select_reg.value;
         }
 
-        // program uncore counters
-
-        if (cpu_model == NEHALEM_EP || cpu_model == WESTMERE_EP || cpu_model == CLARKDALE)
-        {
-            programNehalemEPUncore(i);
-        }
-        else if (cpu_model == NEHALEM_EX || cpu_model == WESTMERE_EX)
-        {
-            programBecktonUncore(i);
-        }
-    }
-    
-    if(canUsePerf)
-    {
-      std::cout << "Successfully programmed on-core PMU using Linux perf"<<std::endl;
+        if (globalCtrl != prevGlobalCtrl || fixedChanged)
+            MSR[i]->write(IA32_CR_PERF_GLOBAL_CTRL, globalCtrl);
     }
 
-    if (cpu_model == JAKETOWN && jkt_uncore_pci)
-    {
-        for (int i = 0; i < num_sockets; ++i)
-        {
-            jkt_uncore_pci[i]->program();
-	    if(i==0) qpi_speed = jkt_uncore_pci[i]->computeQPISpeed();
-        }
-    }
-    
-    if(qpi_speed)
+    if (cpu_model == JAKETOWN && coreEventsNeedJKTWorkaround() != jktWorkaroundEnabled)
     {
-       std::cout.precision(1);
-       std::cout << std::fixed;
-       std::cout << "Max QPI link speed: " << qpi_speed / (1e9) << " GBytes/second (" << qpi_speed / (2e9) << " GT/second)" << std::endl;
+        jktWorkaroundEnabled = !jktWorkaroundEnabled;
+        enableJKTWorkaround(jktWorkaroundEnabled);
     }
 
+    buildCoreReadPlan();
+
     return PCM::Success;
 }
 
@@ -1588,21 +2612,140 @@ void PCM::programBecktonUncore(int32 core)
             MSR[core]->write(U_MSR_PMON_GLOBAL_CTL, value);
 }
 
-uint64 RDTSC();
+// reads the TSC and the OS clocks at the same time: the tightest of a few attempts, the TSC in the middle of the clock reads
+static void readTSCAndClocks(int attempts, uint64 & tsc, uint64 & monotonicRaw, uint64 & realtime)
+{
+    uint64 bestWindow = (std::numeric_limits<uint64>::max)();
+    for (int i = 0; i < attempts; ++i)
+    {
+        uint64 m = 0, r = 0;
+        const uint64 before = RDTSCP();
+        readOSClocks(m, r);
+        const uint64 after = RDTSCP();
+        if (after - before < bestWindow)
+        {
+            bestWindow = after - before;
+            tsc = before + bestWindow / 2;
+            monotonicRaw = m;
+            realtime = r;
+        }
+    }
+}
 
-void PCM::computeNominalFrequency()
+uint64 PCM::calibrateNominalFrequency(uint32 ms)
 {
-   const int ref_core = 0;
-   uint64 before = 0, after = 0;
-   MSR[ref_core]->read(IA32_TIME_STAMP_COUNTER, &before);
-// sleep fo 100 ms
+    uint64 tscBefore = 0, nsBefore = 0, tscAfter = 0, nsAfter = 0, realtime = 0;
+    readTSCAndClocks(8, tscBefore, nsBefore, realtime);
 #ifdef _MSC_VER
-        Sleep(1000);
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+    readTSCAndClocks(8, tscAfter, nsAfter, realtime);
+    if (nsAfter <= nsBefore || tscAfter <= tscBefore) return 0;
+    return uint64(double(tscAfter - tscBefore) * 1e9 / double(nsAfter - nsBefore));
+}
+
+#ifdef __linux__
+// the calibrated frequency is valid until the next reboot (see readBootId)
+static uint64 readNominalFrequencyCache()
+{
+    const std::string bootId = readBootId();
+    if (bootId.empty()) return 0;
+    FILE * f = openCacheFile(PCM_NOMINAL_FREQUENCY_CACHE, 0);
+    if (!f) return 0;
+    char id[64] = { 0 };
+    unsigned long long freq = 0;
+    if (fscanf(f, "%63s %llu", id, &freq) != 2 || bootId != id) freq = 0;
+    fclose(f);
+    return freq;
+}
+
+static void writeNominalFrequencyCache(uint64 freq)
+{
+    const std::string bootId = readBootId();
+    if (bootId.empty() || geteuid() != 0) return;
+    // the directory must not be replaceable by other users
+    struct stat st;
+    if (mkdir(PCM_CACHE_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) return;
+    if (lstat(PCM_CACHE_DIR, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) return;
+    char content[128];
+    snprintf(content, sizeof(content), "%s %llu\n", bootId.c_str(), (unsigned long long)freq);
+    writeCacheFile(PCM_NOMINAL_FREQUENCY_CACHE, content);
+}
 #else
-        usleep(1000*1000);
+static uint64 readNominalFrequencyCache() { return 0; }
+static void writeNominalFrequencyCache(uint64) { }
 #endif
-   MSR[ref_core]->read(IA32_TIME_STAMP_COUNTER, &after);
-   nominal_frequency = after-before; 
+
+bool PCM::computeNominalFrequency()
+{
+    PCM_CPUID_INFO cpuinfo;
+    pcm_cpuid(0, cpuinfo);
+    const int max_cpuid = cpuinfo.array[0];
+
+    // TSC frequency = crystal clock * EBX / EAX, not all processors report the crystal clock (ECX)
+    if (max_cpuid >= 0x15)
+    {
+        pcm_cpuid(0x15, cpuinfo);
+        if (cpuinfo.array[0] && cpuinfo.array[1] && cpuinfo.array[2])
+        {
+            nominal_frequency = uint64(uint32(cpuinfo.array[2])) * uint64(uint32(cpuinfo.array[1])) / uint64(uint32(cpuinfo.array[0]));
+            nominalFrequencySource = "CPUID leaf 0x15";
+            return true;
+        }
+    }
+
+    // maximum non-turbo ratio times the bus clock
+    uint64 freq = 0;
+    MSR[0]->read(PLATFORM_INFO_ADDR, &freq);
+    const uint64 bus_freq = (
+              cpu_model == SANDY_BRIDGE 
+           || cpu_model == JAKETOWN 
+           || cpu_model == IVY_BRIDGE
+           || cpu_model == HASWELL
+           ) ? (100000000ULL) : (133333333ULL);
+    nominal_frequency = ((freq >> 8) & 255) * bus_freq;
+    if (nominal_frequency)
+    {
+        nominalFrequencySource = "MSR_PLATFORM_INFO";
+        return true;
+    }
+
+    // processor base frequency in MHz
+    if (max_cpuid >= 0x16)
+    {
+        pcm_cpuid(0x16, cpuinfo);
+        nominal_frequency = uint64(cpuinfo.array[0] & 0xffff) * 1000000ULL;
+        if (nominal_frequency)
+        {
+            nominalFrequencySource = "CPUID leaf 0x16";
+            return true;
+        }
+    }
+
+    nominal_frequency = get_frequency_from_cpuid();
+    if (nominal_frequency)
+    {
+        nominalFrequencySource = "processor brand string";
+        return true;
+    }
+
+    nominal_frequency = readNominalFrequencyCache();
+    if (nominal_frequency)
+    {
+        nominalFrequencySource = "calibration cached since boot";
+        return true;
+    }
+
+    nominal_frequency = calibrateNominalFrequency(PCM_FREQUENCY_CALIBRATION_MS);
+    if (nominal_frequency)
+    {
+        writeNominalFrequencyCache(nominal_frequency);
+        nominalFrequencySource = "calibration";
+        return true;
+    }
+    return false;
 }
 std::string PCM::getCPUBrandString()
 {
@@ -1773,10 +2916,7 @@ void PCM::cleanupPMU()
 #ifdef PCM_USE_PERF  
     if(canUsePerf)
     {
-      for (int i = 0; i < num_cores; ++i)
-        for(int c = 0; c < PERF_MAX_COUNTERS; ++c)
-            ::close(perfEventHandle[i][c]);
-      
+      closePerfEvents();
       return;
     }
 #endif    
@@ -1838,6 +2978,10 @@ void PCM::cleanup()
 
     if (decrementInstanceSemaphore())
         cleanupPMU();
+
+    coreEventSelect.clear();
+    coreFixedCtrl.clear();
+    ++programGeneration;
 }
 
 #ifdef __APPLE__
@@ -1949,9 +3093,15 @@ bool PCM::decrementInstanceSemaphore()
     return isLastInstance;
 }
 
+// multiplier * ticks / frequency without overflowing the product
+static uint64 scaleTicks(uint64 ticks, uint64 multiplier, uint64 frequency)
+{
+    return (ticks / frequency) * multiplier + ((ticks % frequency) * multiplier) / frequency;
+}
+
 uint64 PCM::getTickCount(uint64 multiplier, uint32 core)
 {
-    return (multiplier * getInvariantTSC(CoreCounterState(), getCoreCounterState(core))) / getNominalFrequency();
+    return scaleTicks(getInvariantTSC(CoreCounterState(), getCoreCounterState(core)), multiplier, getNominalFrequency());
 }
 
 uint64 RDTSC()
@@ -1997,7 +3147,44 @@ uint64 RDTSCP()
 
 uint64 PCM::getTickCountRDTSCP(uint64 multiplier)
 {
-	return (multiplier*RDTSCP())/getNominalFrequency();
+	return scaleTicks(RDTSCP(), multiplier, getNominalFrequency());
+}
+
+uint64 PCM::getTSC()
+{
+    return RDTSCP();
+}
+
+static void readOSClocks(uint64 & monotonicRaw, uint64 & realtime)
+{
+#ifdef _MSC_VER
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    monotonicRaw = uint64(now.QuadPart / freq.QuadPart) * 1000000000ULL + uint64(now.QuadPart % freq.QuadPart) * 1000000000ULL / uint64(freq.QuadPart);
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    // 100 ns units since 1601-01-01
+    realtime = ((uint64(ft.dwHighDateTime) << 32ULL) + ft.dwLowDateTime - 116444736000000000ULL) * 100ULL;
+#else
+    struct timespec ts;
+  #if defined(CLOCK_MONOTONIC_RAW)
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  #else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+  #endif
+    monotonicRaw = uint64(ts.tv_sec) * 1000000000ULL + uint64(ts.tv_nsec);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime = uint64(ts.tv_sec) * 1000000000ULL + uint64(ts.tv_nsec);
+#endif
+}
+
+TSCCalibration PCM::calibrateTSC()
+{
+    TSCCalibration result;
+    result.frequency = getNominalFrequency();
+    readTSCAndClocks(16, result.tsc, result.monotonicRaw, result.realtime);
+    return result;
 }
 
 SystemCounterState getSystemCounterState()
@@ -2024,35 +3211,53 @@ CoreCounterState getCoreCounterState(uint32 core)
     return result;
 }
 
+CoreCounterState getLocalCoreCounterState()
+{
+    PCM * inst = PCM::getInstance();
+    CoreCounterState result;
+    if (inst) result = inst->getLocalCoreCounterState();
+    return result;
+}
+
 #ifdef PCM_USE_PERF
-void PCM::readPerfData(uint32 core, std::vector<uint64> & outData)
+bool PCM::readPerfData(uint32 core, uint64 * outData)
 {
-    uint64 data[1 + PERF_MAX_COUNTERS];
-    const int32 bytes2read =  sizeof(uint64)*(1 + core_fixed_counter_num_used + core_gen_counter_num_used);
+    uint64 data[3 + PERF_MAX_COUNTERS];
+    const uint64 nCounters = core_fixed_counter_num_used + core_gen_counter_num_used;
+    const int32 bytes2read =  sizeof(uint64)*(3 + nCounters);
+    if (perfEventHandle[core][PERF_GROUP_LEADER_COUNTER] < 0) return false; // the core was offline at program()
     int result = ::read(perfEventHandle[core][PERF_GROUP_LEADER_COUNTER], data, bytes2read );
-    // data layout: nr counters; counter 0, counter 1, counter 2,...    
+    // data layout: nr counters; time enabled; time running; counter 0, counter 1, counter 2,...
     if(result != bytes2read)
     {
        std::cout << "Error while reading perf data. Result is "<< result << std::endl;
        std::cout << "Check if you run other competing Linux perf clients." << std::endl;
-    } else if(data[0] != core_fixed_counter_num_used + core_gen_counter_num_used)
+       return false;
+    }
+    if(data[0] != nCounters)
     {
        std::cout << "Number of counters read from perf is wrong. Elements read: "<< data[0] << std::endl;
+       return false;
     }
-    else
-    {  // copy all counters, they start from position 1 in data
-       std::copy((data + 1), (data + 1) + data[0], outData.begin());
+    const uint64 enabled = data[1], running = data[2];
+    for (uint64 c = 0; c < nCounters; ++c)
+    {
+        // scale the counts if the group was not scheduled all the time (multiplexing)
+        if (running == enabled)
+            outData[c] = data[3 + c];
+        else if (running)
+            outData[c] = uint64(double(data[3 + c]) * double(enabled) / double(running));
+        else
+            outData[c] = 0;
     }
+    return true;
 }
 #endif
 
-void BasicCounterState::readAndAggregate(MsrHandle * msr)
+bool BasicCounterState::readAndAggregate(MsrHandle * msr)
 {
     uint64 cInstRetiredAny = 0, cCpuClkUnhaltedThread = 0, cCpuClkUnhaltedRef = 0;
-    uint64 cL3Miss = 0;
-    uint64 cL3UnsharedHit = 0;
-    uint64 cL2HitM = 0;
-    uint64 cL2Hit = 0;
+    uint64 cEvent[PCM_MAX_CORE_GEN_COUNTERS] = {0};
     uint64 cInvariantTSC = 0;
     uint64 cC3Residency = 0;
     uint64 cC6Residency = 0;
@@ -2061,52 +3266,34 @@ void BasicCounterState::readAndAggregate(MsrHandle * msr)
     TemporalThreadAffinity tempThreadAffinity(msr->getCoreId()); // speedup trick for Linux
 
     PCM * m = PCM::getInstance();
-    uint32 cpu_model = m->getCPUModel();
+    const PCM::CoreReadPlan & plan = m->coreReadPlan;
+    uint64 values[PCM::CoreReadPlan::MAX_SLOTS];
+
+    // reading core PMU counters, TSC, core C state counters and temperature in one batch
+    const bool ok = msr->readBatch(plan.msr, values, plan.size) == int32(plan.size * sizeof(uint64));
 
-  // reading core PMU counters
 #ifdef PCM_USE_PERF
   if(m->canUsePerf)
   {
-    std::vector<uint64> perfData(PERF_MAX_COUNTERS, 0ULL);
-    m->readPerfData(msr->getCoreId(), perfData);
+    uint64 perfData[PERF_MAX_COUNTERS] = {0};
+    m->readPerfData(m->getCoreIndex(msr->getCoreId()), perfData);
     cInstRetiredAny =       perfData[PCM::PERF_INST_RETIRED_ANY_POS];
     cCpuClkUnhaltedThread = perfData[PCM::PERF_CPU_CLK_UNHALTED_THREAD_POS];
     cCpuClkUnhaltedRef =    perfData[PCM::PERF_CPU_CLK_UNHALTED_REF_POS];
-    cL3Miss =               perfData[PCM::PERF_GEN_EVENT_0_POS];
-    cL3UnsharedHit =        perfData[PCM::PERF_GEN_EVENT_1_POS];
-    cL2HitM =               perfData[PCM::PERF_GEN_EVENT_2_POS];
-    cL2Hit =                perfData[PCM::PERF_GEN_EVENT_3_POS];
+    for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j)
+        cEvent[j] =         perfData[PCM::PERF_GEN_EVENT_0_POS + j];
   }
   else
 #endif
   {
-    msr->read(INST_RETIRED_ANY_ADDR, &cInstRetiredAny);
-    msr->read(CPU_CLK_UNHALTED_THREAD_ADDR, &cCpuClkUnhaltedThread);
-    msr->read(CPU_CLK_UNHALTED_REF_ADDR, &cCpuClkUnhaltedRef);
-    switch (cpu_model)
-    {
-    case PCM::WESTMERE_EP:
-    case PCM::NEHALEM_EP:
-    case PCM::NEHALEM_EX:
-    case PCM::WESTMERE_EX:
-    case PCM::CLARKDALE:
-    case PCM::SANDY_BRIDGE:
-    case PCM::JAKETOWN:
-	case PCM::IVY_BRIDGE:
-    case PCM::HASWELL:
-        msr->read(IA32_PMC0, &cL3Miss);
-        msr->read(IA32_PMC1, &cL3UnsharedHit);
-        msr->read(IA32_PMC2, &cL2HitM);
-        msr->read(IA32_PMC3, &cL2Hit);
-        break;
-    case PCM::ATOM:
-        msr->read(IA32_PMC0, &cL3Miss);         // for Atom mapped to ArchLLCMiss field
-        msr->read(IA32_PMC1, &cL3UnsharedHit);  // for Atom mapped to ArchLLCRef field
-        break;
-    }
+    cInstRetiredAny =       plan.get(PCM::CoreReadPlan::INST_RETIRED_ANY, values);
+    cCpuClkUnhaltedThread = plan.get(PCM::CoreReadPlan::CPU_CLK_UNHALTED_THREAD, values);
+    cCpuClkUnhaltedRef =    plan.get(PCM::CoreReadPlan::CPU_CLK_UNHALTED_REF, values);
+    for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j) // for Atom PMC0/1 are mapped to ArchLLCMiss/ArchLLCRef fields
+        cEvent[j] =         plan.get((PCM::CoreReadPlan::Slot)(PCM::CoreReadPlan::PMC0 + j), values);
   }
 
-    if(cpu_model != PCM::ATOM) msr->read(IA32_TIME_STAMP_COUNTER, &cInvariantTSC);
+    if(m->getCPUModel() != PCM::ATOM) cInvariantTSC = plan.get(PCM::CoreReadPlan::INVARIANT_TSC, values);
     else
     {
 #ifdef _MSC_VER
@@ -2118,27 +3305,22 @@ void BasicCounterState::readAndAggregate(MsrHandle * msr)
 #endif
     }
 
-    // reading core C state counters
-    msr->read(MSR_CORE_C3_RESIDENCY, &cC3Residency);
-    msr->read(MSR_CORE_C6_RESIDENCY, &cC6Residency);
-    if(m->extendedCStateMetricsAvailable())
-        msr->read(MSR_CORE_C7_RESIDENCY, &cC7Residency);
-
-    // reading temperature
-    msr->read(MSR_IA32_THERM_STATUS, &thermStatus);
+    cC3Residency = plan.get(PCM::CoreReadPlan::CORE_C3_RESIDENCY, values);
+    cC6Residency = plan.get(PCM::CoreReadPlan::CORE_C6_RESIDENCY, values);
+    cC7Residency = plan.get(PCM::CoreReadPlan::CORE_C7_RESIDENCY, values);
+    thermStatus = plan.get(PCM::CoreReadPlan::THERM_STATUS, values);
 
     InstRetiredAny += m->extractCoreFixedCounterValue(cInstRetiredAny);
     CpuClkUnhaltedThread += m->extractCoreFixedCounterValue(cCpuClkUnhaltedThread);
     CpuClkUnhaltedRef += m->extractCoreFixedCounterValue(cCpuClkUnhaltedRef);
-    L3Miss += m->extractCoreGenCounterValue(cL3Miss);
-    L3UnsharedHit += m->extractCoreGenCounterValue(cL3UnsharedHit);
-    L2HitM += m->extractCoreGenCounterValue(cL2HitM);
-    L2Hit += m->extractCoreGenCounterValue(cL2Hit);
+    for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j)
+        Event[j] += m->extractCoreGenCounterValue(cEvent[j]);
     InvariantTSC += cInvariantTSC;
     C3Residency += cC3Residency;
     C6Residency += cC6Residency;
     C7Residency += cC7Residency;
     ThermalHeadroom = extractThermalHeadroom(thermStatus);
+    return ok; // false if the core is offline
 }
 
 PCM::ErrorCode PCM::programSNB_EP_PowerMetrics(int mc_profile, int pcu_profile, int * freq_bands)
@@ -2186,7 +3368,7 @@ PCM::ErrorCode PCM::programSNB_EP_PowerMetrics(int mc_profile, int pcu_profile,
       jkt_uncore_pci[i]->program_power_metrics(mc_profile);
 
       uint32 refCore = socketRefCore[i];
-      TemporalThreadAffinity tempThreadAffinity(refCore); // speedup trick for Linux
+      TemporalThreadAffinity tempThreadAffinity(topology[refCore].os_id); // speedup trick for Linux
 
        // freeze enable
       MSR[refCore]->write(PCU_MSR_PMON_BOX_CTL, PCU_MSR_PMON_BOX_CTL_FRZ_EN);
@@ -2286,16 +3468,19 @@ SystemCounterState PCM::getSystemCounterState()
         for (int32 core = 0; core < num_cores; ++core)
             result.readAndAggregate(MSR[core]);
 
+        const bool jktUncore = (JAKETOWN == cpu_model && jkt_uncore_pci);
         for (int32 s=0; s < num_sockets; s++)
         {
-            readAndAggregateUncoreMCCounters(s, result);
+            if (jktUncore) readJKTUncoreCounters(s, result, result);
+            else readAndAggregateUncoreMCCounters(s, result);
             readAndAggregateEnergyCounters(s, result);
         }
 
-        readQPICounters(result);
+        if (!jktUncore) readQPICounters(result);
 
         result.ThermalHeadroom = PCM_INVALID_THERMAL_HEADROOM; // not available for system
     }
+    RegisterAccessBackend::get()->endSample();
     return result;
 }
 
@@ -2318,7 +3503,7 @@ void PCM::readAndAggregateUncoreMCCounters(const uint32 socket, CounterStateType
     else
     {
         MsrHandle * msr = MSR[socketRefCore[socket]];
-        TemporalThreadAffinity tempThreadAffinity(socketRefCore[socket]); // speedup trick for Linux
+        TemporalThreadAffinity tempThreadAffinity(topology[socketRefCore[socket]].os_id); // speedup trick for Linux
         switch (cpu_model)
         {
             case PCM::WESTMERE_EP:
@@ -2364,6 +3549,24 @@ void PCM::readAndAggregateEnergyCounters(const uint32 socket, CounterStateType &
         result.DRAMEnergyStatus += jkt_dram_energy_status[socket]->read();
 }
 
+// the memory controller and QPI counters of a Jaketown socket in one pass over its uncore PCI devices
+template <class CounterStateType>
+void PCM::readJKTUncoreCounters(const uint32 socket, CounterStateType & result, SystemCounterState & systemState)
+{
+    JKT_Uncore_Pci::Counters c;
+    jkt_uncore_pci[socket]->readCounters(c);
+    for (uint32 i = 0; i < JKT_Uncore_Pci::Counters::MAX_IMC_CHANNELS; ++i)
+    {
+        result.UncMCNormalReads += c.imc[i][0];
+        result.UncMCFullWrites += c.imc[i][1];
+    }
+    for (uint32 port = 0; port < getQPILinksPerSocket() && port < JKT_Uncore_Pci::Counters::MAX_QPI_PORTS; ++port)
+    {
+        systemState.incomingQPIPackets[socket][port] = (c.qpi[port][0] + c.qpi[port][1]) / 8; // DRS + NCB data flits
+        systemState.outgoingQPIDataNonDataFlits[socket][port] = c.qpi[port][2];
+    }
+}
+
 void PCM::readQPICounters(SystemCounterState & result)
 {
         // read QPI counters
@@ -2376,7 +3579,7 @@ void PCM::readQPICounters(SystemCounterState & result)
 
                 if (!SocketProcessed[s])
                 {
-                    TemporalThreadAffinity tempThreadAffinity(core); // speedup trick for Linux
+                    TemporalThreadAffinity tempThreadAffinity(topology[core].os_id); // speedup trick for Linux
 
                     // incoming data responses from QPI link 0
                     MSR[core]->read(R_MSR_PMON_CTR1, &(result.incomingQPIPackets[s][0]));
@@ -2420,7 +3623,7 @@ void PCM::readQPICounters(SystemCounterState & result)
                 while (topology[SCore[1]].socket != 1) ++(SCore[1]);
                 for (int s = 0; s < 2; ++s)
                 {
-                    TemporalThreadAffinity tempThreadAffinity(SCore[s]); // speedup trick for Linux
+                    TemporalThreadAffinity tempThreadAffinity(topology[SCore[s]].os_id); // speedup trick for Linux
 
                     MSR[SCore[s]]->read(MSR_UNCORE_PMC0, &Total_Writes[s]);
                     MSR[SCore[s]]->read(MSR_UNCORE_PMC1, &Total_Reads[s]);
@@ -2505,34 +3708,131 @@ SocketCounterState PCM::getSocketCounterState(uint32 socket)
     return result;
 }
 
+template <class CounterStateType>
+static void resetCounterStates(std::vector<CounterStateType> & states, size_t size)
+{
+    if (states.size() != size) states.resize(size);
+    std::fill(states.begin(), states.end(), CounterStateType());
+}
+
+void PCM::buildAggregationGroups()
+{
+    for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+    {
+        // the groups are numbered in the order of (socket, id), unknown ids fall back to one group per socket
+        typedef std::map<std::pair<int32, int32>, int32> GroupMap;
+        GroupMap groups;
+        std::vector<std::pair<int32, int32> > keys(num_cores);
+        for (int32 core = 0; core < num_cores; ++core)
+        {
+            const TopologyEntry & t = topology[core];
+            int32 id = -1;
+            switch (l)
+            {
+            case PHYSICAL_CORE_LEVEL: id = t.core_id; break;
+            case L3_DOMAIN_LEVEL: id = t.l3_id; break;
+            case NUMA_NODE_LEVEL: id = t.numa_node; break;
+            }
+            keys[core] = std::make_pair(t.socket, id);
+            groups[keys[core]] = 0;
+        }
+        groupTopologyId[l].clear();
+        groupSocket[l].clear();
+        for (GroupMap::iterator g = groups.begin(); g != groups.end(); ++g)
+        {
+            g->second = (int32)groupSocket[l].size();
+            groupSocket[l].push_back((uint32)g->first.first);
+            groupTopologyId[l].push_back(g->first.second);
+        }
+        coreGroup[l].resize(num_cores);
+        for (int32 core = 0; core < num_cores; ++core) coreGroup[l][core] = groups[keys[core]];
+    }
+}
+
+const char * PCM::getAggregationLevelName(PCM::AggregationLevel level)
+{
+    switch (level)
+    {
+    case PHYSICAL_CORE_LEVEL: return "physical_core";
+    case L3_DOMAIN_LEVEL: return "l3_domain";
+    case NUMA_NODE_LEVEL: return "numa_node";
+    }
+    return "unknown";
+}
+
+bool PCM::parseAggregationLevels(const char * list, uint32 & levels)
+{
+    std::string rest(list);
+    while (!rest.empty())
+    {
+        const std::string::size_type comma = rest.find(',');
+        const std::string name = rest.substr(0, comma);
+        rest = (comma == std::string::npos) ? std::string() : rest.substr(comma + 1);
+        uint32 l = 0;
+        while (l < PCM_AGGREGATION_LEVELS && name != getAggregationLevelName((AggregationLevel)l)) ++l;
+        if (l == PCM_AGGREGATION_LEVELS)
+        {
+            std::cerr << "Unknown aggregation level " << name << std::endl;
+            return false;
+        }
+        levels |= 1U << l;
+    }
+    return true;
+}
+
 void PCM::getAllCounterStates(SystemCounterState & systemState, std::vector<SocketCounterState> & socketStates, std::vector<CoreCounterState> & coreStates)
 {
-    // clear and zero-initialize all inputs
-    systemState = SystemCounterState();
-    socketStates.clear();
-    socketStates.resize(num_sockets);
-    coreStates.clear();
-    coreStates.resize(num_cores);
+    getAllCounterStates(systemState, socketStates, coreStates, NULL);
+}
+
+void PCM::getAllCounterStates(SystemCounterState & systemState, std::vector<SocketCounterState> & socketStates, std::vector<CoreCounterState> & coreStates, std::vector<CoreGroupCounterState> * groupStates)
+{
+    // zero-initialize all inputs in place (no memory allocation if the caller reuses them)
+    systemState.reset();
+    resetCounterStates(socketStates, num_sockets);
+    resetCounterStates(coreStates, num_cores);
+    uint32 levels = 0;
+    for (uint32 l = 0; groupStates && l < PCM_AGGREGATION_LEVELS; ++l)
+    {
+        if (aggregationLevels & (1U << l))
+        {
+            resetCounterStates(groupStates[l], groupSocket[l].size());
+            levels |= 1U << l;
+        }
+        else
+            groupStates[l].clear(); // keeps the capacity
+    }
+    if (hotplug) readOnlineCores();
 
+#ifdef __linux__
+    if (samplerPool)
+        samplerPool->sample(coreStates, socketStates);
+    else
+#endif
     for (int32 core = 0; core < num_cores; ++core)
     {
         // read core counters
-        coreStates[core].readAndAggregate(MSR[core]);
-        socketStates[topology[core].socket].UncoreCounterState::readAndAggregate(MSR[core]); // read package C state counters
+        readCoreState(core, coreStates[core], socketStates[topology[core].socket]);
     }
 
+    const bool jktUncore = (JAKETOWN == cpu_model && jkt_uncore_pci);
     for (int32 s=0; s < num_sockets; ++s)
     {
-        readAndAggregateUncoreMCCounters(s, socketStates[s]);
+        if (jktUncore) readJKTUncoreCounters(s, socketStates[s], systemState);
+        else readAndAggregateUncoreMCCounters(s, socketStates[s]);
         readAndAggregateEnergyCounters(s, socketStates[s]);
         readPackageThermalHeadroom(s, socketStates[s]);
     }
 
-    readQPICounters(systemState);
+    if (!jktUncore) readQPICounters(systemState);
+
+    if (hotplug) applyCoreHotplug(coreStates);
 
     for (int32 core = 0; core < num_cores; ++core)
-    {   // aggregate core counters into sockets
+    {   // aggregate core counters into sockets and into the groups of the selected levels
         socketStates[topology[core].socket].accumulateCoreState(coreStates[core]);
+        for (uint32 l = 0; levels >> l; ++l)
+            if (levels & (1U << l)) groupStates[l][coreGroup[l][core]].accumulateCoreState(coreStates[core]);
     }
 
     for (int32 s = 0; s < num_sockets; ++s)
@@ -2540,6 +3840,35 @@ void PCM::getAllCounterStates(SystemCounterState & systemState, std::vector<Sock
         // aggregate socket uncore iMC, energy and package C state counters into system
         systemState.accumulateSocketState(socketStates[s]);
     }
+    RegisterAccessBackend::get()->endSample();
+}
+
+void PCM::getAllCounterStates(CounterSnapshot & snapshot)
+{
+    getAllCounterStates(snapshot.system, snapshot.sockets, snapshot.cores, snapshot.groups);
+    if (history) history->add(getTSC(), programGeneration, snapshot);
+}
+
+bool PCM::enableCounterHistory(double retention)
+{
+    disableCounterHistory();
+    if (retention <= 0. || !MSR) return false;
+    try
+    {
+        history = new CounterHistory(this, retention);
+    }
+    catch (...)
+    {
+        history = NULL;
+        return false;
+    }
+    return true;
+}
+
+void PCM::disableCounterHistory()
+{
+    if (history) delete history;
+    history = NULL;
 }
 
 CoreCounterState PCM::getCoreCounterState(uint32 core)
@@ -2549,6 +3878,38 @@ CoreCounterState PCM::getCoreCounterState(uint32 core)
     return result;
 }
 
+CoreCounterState PCM::getLocalCoreCounterState()
+{
+    uint32 core = 0;
+#ifdef PCM_USE_PERF
+    if (userRdpmc)
+    {
+        uint64 perfData[PERF_MAX_COUNTERS] = {0};
+        uint64 tsc = 0;
+        if (readUserPerfData(core, perfData, tsc))
+        {
+            CoreCounterState result;
+            result.InstRetiredAny = extractCoreFixedCounterValue(perfData[PERF_INST_RETIRED_ANY_POS]);
+            result.CpuClkUnhaltedThread = extractCoreFixedCounterValue(perfData[PERF_CPU_CLK_UNHALTED_THREAD_POS]);
+            result.CpuClkUnhaltedRef = extractCoreFixedCounterValue(perfData[PERF_CPU_CLK_UNHALTED_REF_POS]);
+            for (uint32 j = 0; j < PCM_MAX_CORE_GEN_COUNTERS; ++j)
+                result.Event[j] = extractCoreGenCounterValue(perfData[PERF_GEN_EVENT_0_POS + j]);
+            result.InvariantTSC = tsc;
+            return result;
+        }
+    }
+#endif
+    int32 os_id = 0;
+#ifdef __linux__
+    os_id = sched_getcpu();
+#elif defined(_MSC_VER)
+    os_id = GetCurrentProcessorNumber();
+#endif
+    const int32 index = getCoreIndex(os_id);
+    core = (index < 0) ? 0 : uint32(index);
+    return getCoreCounterState(core);
+}
+
 uint32 PCM::getNumCores()
 {
     return num_cores;
@@ -2579,23 +3940,25 @@ JKTUncorePowerState PCM::getJKTUncorePowerState(uint32 socket)
   JKTUncorePowerState result;
   if(jkt_uncore_pci && jkt_uncore_pci[socket])
   {
+    JKT_Uncore_Pci::Counters c;
+    jkt_uncore_pci[socket]->readCounters(c); // one pass over the PCI devices of the socket
     for(uint32 port=0;port<2;++port)
     {
-      result.QPIClocks[port] = jkt_uncore_pci[socket]->getQPIClocks(port);
-      result.QPIL0pTxCycles[port] = jkt_uncore_pci[socket]->getQPIL0pTxCycles(port);
-      result.QPIL1Cycles[port] = jkt_uncore_pci[socket]->getQPIL1Cycles(port);
+      result.QPIClocks[port] = c.qpi[port][3];
+      result.QPIL0pTxCycles[port] = c.qpi[port][0];
+      result.QPIL1Cycles[port] = c.qpi[port][2];
     }
     for(uint32 channel=0;channel<4;++channel)
     {
-      result.DRAMClocks[channel] = jkt_uncore_pci[socket]->getDRAMClocks(channel);
+      result.DRAMClocks[channel] = c.imc[channel][JKT_Uncore_Pci::Counters::IMC_FIXED];
       for(uint32 cnt=0;cnt<4;++cnt)
-	result.MCCounter[channel][cnt] = jkt_uncore_pci[socket]->getMCCounter(channel,cnt);
+	result.MCCounter[channel][cnt] = c.imc[channel][cnt];
     }
   }
   if(MSR)
   {
     uint32 refCore = socketRefCore[socket];
-    TemporalThreadAffinity tempThreadAffinity(refCore);
+    TemporalThreadAffinity tempThreadAffinity(topology[refCore].os_id);
     MSR[refCore]->read(PCU_MSR_PMON_CTR0,&(result.PCUCounter[0]));
     MSR[refCore]->read(PCU_MSR_PMON_CTR1,&(result.PCUCounter[1]));
     MSR[refCore]->read(PCU_MSR_PMON_CTR2,&(result.PCUCounter[2]));
@@ -3091,6 +4454,22 @@ void JKT_Uncore_Pci::unfreezeCounters()
 	}
 }
 
+void JKT_Uncore_Pci::readCounters(JKT_Uncore_Pci::Counters & counters)
+{
+    static const uint64 imcCounters[Counters::IMC_COUNTERS] = {
+        MC_CH_PCI_PMON_CTR0, MC_CH_PCI_PMON_CTR1, MC_CH_PCI_PMON_CTR2, MC_CH_PCI_PMON_CTR3, MC_CH_PCI_PMON_FIXED_CTR
+    };
+    static const uint64 qpiCounters[Counters::QPI_COUNTERS] = {
+        Q_P_PCI_PMON_CTR0, Q_P_PCI_PMON_CTR1, Q_P_PCI_PMON_CTR2, Q_P_PCI_PMON_CTR3
+    };
+
+    memset(&counters, 0, sizeof(counters));
+    for (uint32 i = 0; i < num_imc_channels && i < Counters::MAX_IMC_CHANNELS; ++i)
+        imcHandles[i]->readBatch64(imcCounters, counters.imc[i], Counters::IMC_COUNTERS);
+    for (uint32 i = 0; i < num_qpi_ports && i < Counters::MAX_QPI_PORTS; ++i)
+        if (qpiLLHandles[i]) qpiLLHandles[i]->readBatch64(qpiCounters, counters.qpi[i], Counters::QPI_COUNTERS);
+}
+
 uint64 JKT_Uncore_Pci::getQPIClocks(uint32 port)
 {
     uint64 res = 0;
@@ -3242,23 +4621,128 @@ uint64 JKT_Uncore_Pci::computeQPISpeed()
     return qpi_speed;
 }
 
+// one watchdog thread extends all registered counters
+struct WatchDogRegistry
+{
+    std::vector<CounterWidthExtender *> counters;
+#ifdef _MSC_VER
+    HANDLE mutex;
+    HANDLE thread;
+    WatchDogRegistry() : mutex(CreateMutex(NULL, FALSE, NULL)), thread(NULL) { }
+#else
+    pthread_mutex_t mutex;
+    bool started;
+    WatchDogRegistry() : started(false) { pthread_mutex_init(&mutex, NULL); }
+#endif
+};
+
+//! the detached watchdog thread outlives static destruction, so the registry is
+//! created once on first use and intentionally never destroyed
+static WatchDogRegistry & watchDogRegistry()
+{
+    static WatchDogRegistry * registry = new WatchDogRegistry();
+    return *registry;
+}
+
+static uint64 watchDogNowMs()
+{
+#ifdef _MSC_VER
+    return GetTickCount64();
+#elif defined(__linux__) || defined(__FreeBSD__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64(ts.tv_sec) * 1000ULL + uint64(ts.tv_nsec) / 1000000ULL;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return uint64(tv.tv_sec) * 1000ULL + uint64(tv.tv_usec) / 1000ULL;
+#endif
+}
+
+void CounterWidthExtender::registerCounter(CounterWidthExtender * ext)
+{
+    WatchDogRegistry & r = watchDogRegistry();
+#ifdef _MSC_VER
+    WaitForSingleObject(r.mutex, INFINITE);
+    ext->next_update_ms = watchDogNowMs() + ext->update_period_ms;
+    r.counters.push_back(ext);
+    if (r.thread == NULL)
+        r.thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)WatchDogProc, NULL, 0, NULL);
+    ReleaseMutex(r.mutex);
+#else
+    pthread_mutex_lock(&r.mutex);
+    ext->next_update_ms = watchDogNowMs() + ext->update_period_ms;
+    r.counters.push_back(ext);
+    if (!r.started)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, WatchDogProc, NULL) == 0)
+        {
+            pthread_detach(thread);
+            r.started = true;
+        }
+    }
+    pthread_mutex_unlock(&r.mutex);
+#endif
+}
+
+void CounterWidthExtender::unregisterCounter(CounterWidthExtender * ext)
+{
+    WatchDogRegistry & r = watchDogRegistry();
+#ifdef _MSC_VER
+    WaitForSingleObject(r.mutex, INFINITE);
+#else
+    pthread_mutex_lock(&r.mutex);
+#endif
+    // the watchdog uses the counters only while holding the mutex
+    r.counters.erase(std::remove(r.counters.begin(), r.counters.end(), ext), r.counters.end());
+#ifdef _MSC_VER
+    ReleaseMutex(r.mutex);
+#else
+    pthread_mutex_unlock(&r.mutex);
+#endif
+}
+
 #ifdef _MSC_VER
-DWORD WINAPI WatchDogProc(LPVOID state)
+DWORD WINAPI WatchDogProc(LPVOID /* state */)
 #else
-void * WatchDogProc(void * state)
+void * WatchDogProc(void * /* state */)
 #endif
 {
-    CounterWidthExtender * ext = (CounterWidthExtender * ) state;
+    WatchDogRegistry & r = watchDogRegistry();
     while(1)
     {
+        // wake up at least every second to pick up newly registered counters
+#ifdef _MSC_VER
+        WaitForSingleObject(r.mutex, INFINITE);
+#else
+        pthread_mutex_lock(&r.mutex);
+#endif
+        const uint64 now = watchDogNowMs();
+        uint64 next = now + 1000;
+        for (size_t i = 0; i < r.counters.size(); ++i)
+        {
+            CounterWidthExtender * ext = r.counters[i];
+            if (now >= ext->next_update_ms)
+            {
+                ext->update();
+                ext->next_update_ms = now + ext->update_period_ms;
+            }
+            next = (std::min)(next, ext->next_update_ms);
+        }
 #ifdef _MSC_VER
-		Sleep(10000);
+        ReleaseMutex(r.mutex);
+        Sleep((DWORD)(next - now));
 #else
-        sleep(10);
+        pthread_mutex_unlock(&r.mutex);
+        const uint64 sleep_ms = next - now;
+        struct timespec ts;
+        ts.tv_sec = sleep_ms / 1000;
+        ts.tv_nsec = (sleep_ms % 1000) * 1000000;
+        nanosleep(&ts, NULL);
 #endif
-        /* uint64 dummy = */ ext->read();
     }
-    return NULL;
+    return 0;
 }
 
 uint32 PCM::CX_MSR_PMON_CTRY(uint32 Cbo, uint32 Ctr) const
@@ -3319,7 +4803,7 @@ void PCM::programPCIeCounters(const PCM::PCIeEventCode event_)
     for (int32 i = 0; (i < num_sockets) && MSR; ++i)
     {
         uint32 refCore = socketRefCore[i];
-        TemporalThreadAffinity tempThreadAffinity(refCore); // speedup trick for Linux
+        TemporalThreadAffinity tempThreadAffinity(topology[refCore].os_id); // speedup trick for Linux
 
         for(uint32 cbo = 0; cbo < getMaxNumOfCBoxes(); ++cbo)
         {
@@ -3353,7 +4837,7 @@ PCIeCounterState PCM::getPCIeCounterState(const uint32 socket_)
     PCIeCounterState result;
 
     uint32 refCore = socketRefCore[socket_];
-    TemporalThreadAffinity tempThreadAffinity(refCore); // speedup trick for Linux
+    TemporalThreadAffinity tempThreadAffinity(topology[refCore].os_id); // speedup trick for Linux
 
     for(uint32 cbo=0; cbo < getMaxNumOfCBoxes(); ++cbo)
     {
@@ -39,6 +39,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #ifdef PCM_USE_PERF
 #include <linux/perf_event.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
 #include <errno.h>
 #define PCM_PERF_COUNT_HW_REF_CPU_CYCLES (9)
 #endif
@@ -52,12 +53,21 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #endif
 
 #include <limits>
+
+#define PCM_AGGREGATION_LEVELS (3) // see PCM::AggregationLevel
+
 class SystemCounterState;
 class SocketCounterState;
 class CoreCounterState;
+class CoreGroupCounterState;
 class BasicCounterState;
+class UncoreCounterState;
 class JKTUncorePowerState;
 class PCM;
+class CoreSamplerPool;
+class CounterHistory;
+struct CoreHotplugState;
+struct CounterSnapshot;
 
 /*
         CPU performance monitoring routines
@@ -70,8 +80,42 @@ struct INTELPCM_API TopologyEntry // decribes a core
     int32 os_id;
     int32 socket;
     int32 core_id;
+    int32 numa_node;    // NUMA node of the OS, -1 if unknown
+    int32 l3_id;        // lowest os_id sharing the L3 cache with this core, -1 if unknown
+    int32 thread_id;    // index among the SMT siblings of the physical core (0 for the first thread)
 
-    TopologyEntry() : os_id(-1), socket(-1), core_id(-1) { }
+    TopologyEntry() : os_id(-1), socket(-1), core_id(-1), numa_node(-1), l3_id(-1), thread_id(-1) { }
+};
+
+/*! \brief Invariant TSC and operating system clocks read at the same time (see PCM::calibrateTSC)
+
+    Converts the TSC values of the samples into the time of the OS clocks, e.g. to align the samples
+    with kernel traces that use CLOCK_MONOTONIC_RAW.
+*/
+struct INTELPCM_API TSCCalibration
+{
+    uint64 frequency;       // TSC ticks per second
+    uint64 tsc;             // TSC at the calibration
+    uint64 monotonicRaw;    // CLOCK_MONOTONIC_RAW in ns (QueryPerformanceCounter on Windows)
+    uint64 realtime;        // CLOCK_REALTIME in ns since the epoch
+
+    TSCCalibration() : frequency(1), tsc(0), monotonicRaw(0), realtime(0) { }
+
+    //! \brief Converts a number of TSC ticks into ns (without overflow)
+    uint64 ticksToNs(uint64 ticks) const
+    {
+        return (ticks / frequency) * 1000000000ULL + ((ticks % frequency) * 1000000000ULL) / frequency;
+    }
+    //! \brief Converts a TSC value into CLOCK_MONOTONIC_RAW ns
+    uint64 toMonotonicRaw(uint64 tsc_) const
+    {
+        return (tsc_ >= tsc) ? monotonicRaw + ticksToNs(tsc_ - tsc) : monotonicRaw - ticksToNs(tsc - tsc_);
+    }
+    //! \brief Converts a TSC value into CLOCK_REALTIME ns since the epoch
+    uint64 toRealtime(uint64 tsc_) const
+    {
+        return (tsc_ >= tsc) ? realtime + ticksToNs(tsc_ - tsc) : realtime - ticksToNs(tsc - tsc_);
+    }
 };
 
 //! Object to access uncore counters in a socket/processor with microarchitecture codename SandyBridge-EP
@@ -144,6 +188,27 @@ public:
     //! \brief Unfreezes event counting
     void unfreezeCounters();
 
+    //! \brief Raw values of all memory controller and QPI LL counters of the socket (see readCounters)
+    struct Counters
+    {
+        enum
+        {
+            MAX_IMC_CHANNELS = 4,
+            IMC_COUNTERS = 5,       // MC_CH_PCI_PMON_CTR0..3 and MC_CH_PCI_PMON_FIXED_CTR (DRAM clocks)
+            IMC_FIXED = 4,
+            MAX_QPI_PORTS = 2,
+            QPI_COUNTERS = 4        // Q_P_PCI_PMON_CTR0..3
+        };
+        uint64 imc[MAX_IMC_CHANNELS][IMC_COUNTERS];   // 0 for the channels that do not exist
+        uint64 qpi[MAX_QPI_PORTS][QPI_COUNTERS];
+    };
+    /*! \brief Reads all memory controller and QPI LL counters of the socket in one pass
+
+        With the memory mapped configuration space these are plain loads without system calls, so the values
+        are read closer together in time than with the getters above.
+    */
+    void readCounters(Counters & counters);
+
     //! \brief Measures/computes the maximum theoretical QPI link bandwidth speed in GByte/seconds
     uint64 computeQPISpeed();
 
@@ -181,6 +246,7 @@ template class INTELPCM_API std::allocator<char>;
 class INTELPCM_API PCM
 {
     friend class BasicCounterState;
+    friend class CoreSamplerPool;
     PCM();     // forbidden to call directly because it is a singleton
 
     const char * UnsupportedMessage;
@@ -204,12 +270,21 @@ class INTELPCM_API PCM
     int32 perfmon_version;
     int32 perfmon_config_anythread;
     uint64 nominal_frequency;
+    const char * nominalFrequencySource; // see getNominalFrequencySource
+    double initializationTime; // see getInitializationTime
     uint64 qpi_speed; // in GBytes/second
     int32 pkgThermalSpecPower, pkgMinimumPower, pkgMaximumPower;
 
-    std::vector<TopologyEntry> topology;
+    std::vector<TopologyEntry> topology;   // indexed by the core number of the PCM interfaces, see TopologyEntry::os_id
+    std::vector<int32> osIdToCore;          // OS CPU number -> index in topology, -1 if not in the topology
     std::string errorMessage;
 
+    //! index of the OS CPU in topology (e.g. of sched_getcpu()), -1 if it is not in the topology
+    int32 getCoreIndex(int32 os_id) const
+    {
+        return (os_id >= 0 && os_id < (int32)osIdToCore.size()) ? osIdToCore[os_id] : -1;
+    }
+
     static PCM * instance;
     MsrHandle ** MSR;
     JKT_Uncore_Pci ** jkt_uncore_pci;
@@ -232,11 +307,26 @@ public:
         INVALID_MODE                /*!< Non-programmed mode */
     };
 
+    //! How getAllCounterStates reads the per-core counters (parameter in the setSamplingMode() method)
+    enum SamplingMode {
+        SERIAL_SAMPLING = 0,        /*!< The calling thread visits the cores one after another (default) */
+        PER_CORE_SAMPLING = 1,      /*!< One persistent sampler thread pinned to each logical core, all cores are read at the same time */
+        PER_SOCKET_SAMPLING = 2     /*!< One persistent sampler thread per socket reading the cores of its socket, sockets are read at the same time */
+    };
+
+    //! How the on-core PMU is programmed and read (parameter in the setCorePMUAccess() method)
+    enum CorePMUAccess {
+        CORE_PMU_AUTO = 0,          /*!< Linux perf if the MSRs can not be written, direct MSR access otherwise (default) */
+        CORE_PMU_MSR = 1,           /*!< Direct programming of the PMU through the MSRs */
+        CORE_PMU_PERF = 2           /*!< Linux perf events (program() fails if Linux perf can not be used) */
+    };
+
 	enum PCMLine {
 		TLB_LINE = 0,				/*!< First line that collects TLB related values */
 		CACHE_LINE = 1,				/*!< Second line that collects cache related values */
 		COHERENCY_MEMORY_LINE = 2,	/*!< Last line that collects the new values (coherency+memory) */
-		PCM_LINES_MAX = 3
+		PCM_LINES_MAX = 3,
+		TLB_CACHE_LINE = 4			/*!< TLB and cache values in one pass: the default events in the counters 0-3, the four custom events in the counters 4-7 (needs 8 general purpose counters, see getMaxCustomCoreEvents()) */
 	};
 
     //! Return codes (e.g. for program(..) method)
@@ -277,7 +367,16 @@ public:
 
 private:
     ProgramMode mode;
-    CustomCoreEventDescription coreEventDesc[4];
+    SamplingMode samplingMode;
+    CorePMUAccess corePMUAccess;
+    CoreSamplerPool * samplerPool;
+    CounterHistory * history;
+    CoreHotplugState * hotplug;             // online state of the cores, see getAllCounterStates
+    uint32 programGeneration;               // incremented whenever the core counters are (re)programmed or released
+    CustomCoreEventDescription coreEventDesc[PCM_MAX_CORE_GEN_COUNTERS];
+    bool jktWorkaroundEnabled;
+    std::vector<uint64> coreEventSelect;    // PERFEVTSEL values written by program()/switchCoreEvents(), PCM_MAX_CORE_GEN_COUNTERS per core (empty with perf)
+    std::vector<uint64> coreFixedCtrl;      // IA32_CR_FIXED_CTR_CTRL values written by program()/switchCoreEvents(), one per core (empty with perf)
 
         #ifdef _MSC_VER
     HANDLE numInstancesSemaphore;     // global semaphore that counts the number of PCM instances on the system
@@ -287,11 +386,25 @@ private:
         #endif
 
     std::vector<uint32> socketRefCore;
+    uint32 aggregationLevels;                                       // see setAggregationLevels
+    std::vector<int32> coreGroup[PCM_AGGREGATION_LEVELS];           // per core: its group on each level
+    std::vector<int32> groupTopologyId[PCM_AGGREGATION_LEVELS];     // per group: see getGroupTopologyId
+    std::vector<uint32> groupSocket[PCM_AGGREGATION_LEVELS];        // per group: socket of its cores
+    void buildAggregationGroups();
+    void getAllCounterStates(SystemCounterState & systemState, std::vector<SocketCounterState> & socketStates, std::vector<CoreCounterState> & coreStates, std::vector<CoreGroupCounterState> * groupStates);
 
     bool canUsePerf;
+    bool userRdpmcRequested;
+    bool userRdpmc;
 #ifdef PCM_USE_PERF
     std::vector< std::vector<int> > perfEventHandle;
-    void readPerfData(uint32 core, std::vector<uint64> & data);
+    std::vector< std::vector<perf_event_mmap_page *> > perfEventPage; // control pages of the events for user space rdpmc
+    bool mapPerfEventPages();
+    bool readUserPerfData(uint32 & core, uint64 * data, uint64 & tsc); // false if an event is not on the counters or was multiplexed
+    bool perfEventsAvailable();
+    bool openPerfEvent(int32 core, int32 pos, perf_event_attr & e, const char * name);
+    void closePerfEvents();
+    bool readPerfData(uint32 core, uint64 * data);
 
     enum {
         PERF_INST_RETIRED_ANY_POS = 0,
@@ -300,7 +413,11 @@ private:
         PERF_GEN_EVENT_0_POS = 3,
         PERF_GEN_EVENT_1_POS = 4,
         PERF_GEN_EVENT_2_POS = 5,
-        PERF_GEN_EVENT_3_POS = 6
+        PERF_GEN_EVENT_3_POS = 6,
+        PERF_GEN_EVENT_4_POS = 7,
+        PERF_GEN_EVENT_5_POS = 8,
+        PERF_GEN_EVENT_6_POS = 9,
+        PERF_GEN_EVENT_7_POS = 10
     };
 
     enum {
@@ -308,6 +425,59 @@ private:
     };
 #endif
 
+    /*! \brief List of core MSRs read per snapshot by BasicCounterState::readAndAggregate
+
+        Built once per CPU model (and access method) by buildCoreReadPlan(), so that
+        each core is read with a single MsrHandle::readBatch call.
+    */
+    struct CoreReadPlan
+    {
+        enum Slot {
+            INST_RETIRED_ANY = 0,
+            CPU_CLK_UNHALTED_THREAD,
+            CPU_CLK_UNHALTED_REF,
+            PMC0,
+            PMC1,
+            PMC2,
+            PMC3,
+            PMC4,
+            PMC5,
+            PMC6,
+            PMC7,
+            INVARIANT_TSC,
+            CORE_C3_RESIDENCY,
+            CORE_C6_RESIDENCY,
+            CORE_C7_RESIDENCY,
+            THERM_STATUS,
+            MAX_SLOTS
+        };
+        uint64 msr[MAX_SLOTS];  // addresses to read, in plan order
+        int32 pos[MAX_SLOTS];   // index of each slot in msr[] or -1 if the slot is not read
+        uint32 size;
+
+        CoreReadPlan() : size(0)
+        {
+            for (int32 i = 0; i < MAX_SLOTS; ++i) pos[i] = -1;
+        }
+        void add(Slot slot, uint64 msr_number)
+        {
+            pos[slot] = size;
+            msr[size++] = msr_number;
+        }
+        uint64 get(Slot slot, const uint64 * values) const
+        {
+            return (pos[slot] < 0) ? 0ULL : values[pos[slot]];
+        }
+    };
+    CoreReadPlan coreReadPlan;
+    void buildCoreReadPlan();
+    void readCoreState(int32 core, CoreCounterState & coreState, UncoreCounterState & packageState);
+    void readOnlineCores();
+    void getOnlineCores(const std::string & mask, std::vector<char> & online) const;
+    void chooseSocketRefCores(const std::vector<char> & online);
+    void applyCoreHotplug(std::vector<CoreCounterState> & coreStates);
+    void reprogramCore(int32 core);
+
     bool PMUinUse();
     void cleanupPMU();
     bool decrementInstanceSemaphore(); // returns true if it was the last instance
@@ -322,12 +492,19 @@ private:
 
     void computeQPISpeedBeckton(int core_nr);
     void destroyMSR();
-    void computeNominalFrequency();
+    void openMSR();
+    bool computeNominalFrequency();
+    static uint64 calibrateNominalFrequency(uint32 ms);
     static bool isCPUModelSupported(int model_);
     bool checkModel();
     void programBecktonUncore(int core);
     void programNehalemEPUncore(int core);
     void enableJKTWorkaround(bool enable);
+    ErrorCode setCoreEvents(ProgramMode mode_, void * parameter_, PCMLine lineMode_); // fills coreEventDesc and core_gen_counter_num_used
+    bool coreEventsNeedJKTWorkaround() const;
+    static void setDefaultEventSelectFields(EventSelectRegister & event_select_reg, const CustomCoreEventDescription & desc);
+    static void setFixedCtrlFields(FixedEventControlRegister & ctrl_reg, PCM::ProgramMode mode_, const void * parameter_);
+    uint64 getCoreGlobalCtrlValue() const;
     template <class CounterStateType>
     void readAndAggregateUncoreMCCounters(const uint32 socket, CounterStateType & counterState);
     template <class CounterStateType>
@@ -335,6 +512,8 @@ private:
     template <class CounterStateType>
     void readPackageThermalHeadroom(const uint32 socket, CounterStateType & counterState);
     void readQPICounters(SystemCounterState & counterState);
+    template <class CounterStateType>
+    void readJKTUncoreCounters(const uint32 socket, CounterStateType & counterState, SystemCounterState & systemState);
 
     uint32 CX_MSR_PMON_CTRY(uint32 Cbo, uint32 Ctr) const;
     uint32 CX_MSR_PMON_BOX_FILTER(uint32 Cbo) const;
@@ -385,6 +564,19 @@ public:
     */
     ErrorCode program(ProgramMode mode_ = DEFAULT_EVENTS, void * parameter_ = NULL, PCMLine lineMode_= CACHE_LINE); // program counters and start counting
 
+    /*! \brief Switches the programmable core counters to another event set
+        \param mode_ mode of programming, see ProgramMode definition
+        \param parameter_ optional parameter for some of programming modes
+        \param lineMode_ event group, see PCMLine definition
+
+                Call this method instead of cleanup() + program() to rotate the event groups of a running session.
+                The PMU stays owned by this instance: only the PERFEVTSEL registers that differ from the current
+                event set are rewritten, the fixed counters and the uncore counters are not touched.
+                Must be called after a successful program(). With Linux perf (or if another PCM instance
+                programmed the PMU) it falls back to cleanup() + program().
+    */
+    ErrorCode switchCoreEvents(ProgramMode mode_ = DEFAULT_EVENTS, void * parameter_ = NULL, PCMLine lineMode_= CACHE_LINE);
+
     /*! \brief Programs uncore power/energy counters on microarchitecture codename SandyBridge-EP
         \param mc_profile profile for integrated memory controller PMU. See possible profile values in pcm-power.cpp example
         \param pcu_profile profile for power control unit PMU. See possible profile values in pcm-power.cpp example
@@ -425,15 +617,153 @@ public:
 */
     void resetPMU();
 
+    /*! \brief Tells if a core was online at the last getAllCounterStates call
+            \param core core id
+    */
+    bool isCoreOnline(uint32 core) const;
+
     /*! \brief Reads all counter states (including system, sockets and cores)
 
         \param systemState system counter state (return parameter)
         \param socketStates socket counter states (return parameter)
         \param coreStates core counter states (return parameter)
 
+        The states are zeroed in place and the vectors are resized only if their size does not match,
+        callers that reuse the same objects between calls cause no memory allocation.
+
+        Cores that go offline (CPU hotplug, on Linux the online mask is checked on every call) keep their last
+        counter values until they are back online, so the socket and system aggregates stay monotonic. A core
+        that comes back online is reprogrammed and its counters continue from the last values. The core deltas
+        of such intervals are not meaningful, see isCoreSampleValid.
     */
     void getAllCounterStates(SystemCounterState & systemState, std::vector<SocketCounterState> & socketStates, std::vector<CoreCounterState> & coreStates);
 
+    /*! \brief Reads all counter states into a reusable snapshot
+
+        Same as the getAllCounterStates method above, the snapshot is filled in place without memory allocation.
+
+        \param snapshot snapshot to fill (see CounterSnapshot)
+    */
+    void getAllCounterStates(CounterSnapshot & snapshot);
+
+    //! \brief Groups of cores the core states can be summed up into besides the sockets (see setAggregationLevels)
+    enum AggregationLevel
+    {
+        PHYSICAL_CORE_LEVEL = 0,    // the SMT siblings of a physical core
+        L3_DOMAIN_LEVEL = 1,        // the cores sharing an L3 cache (the socket if unknown)
+        NUMA_NODE_LEVEL = 2         // the cores of a NUMA node, e.g. a sub-NUMA cluster (the socket if unknown)
+    };
+
+    /*! \brief Selects the levels getAllCounterStates(CounterSnapshot &) sums the core states up into
+
+        The groups are derived from the topology once, the group states are summed up in the same pass as the
+        socket states from the core states already read (CounterSnapshot::groups). No level is computed by default.
+
+        \param levels bit mask, (1 << level) for each AggregationLevel to compute
+    */
+    void setAggregationLevels(uint32 levels) { aggregationLevels = levels & ((1U << PCM_AGGREGATION_LEVELS) - 1); }
+    //! \brief Levels selected with setAggregationLevels
+    uint32 getAggregationLevels() const { return aggregationLevels; }
+    //! \brief Name of a level ("physical_core", "l3_domain" or "numa_node")
+    static const char * getAggregationLevelName(AggregationLevel level);
+    /*! \brief Adds the levels of a comma separated list of level names (e.g. "l3_domain,numa_node") to a bit mask
+        \param list level names as returned by getAggregationLevelName
+        \param levels bit mask for setAggregationLevels, the bits of the listed levels are set
+        \return false if a name is unknown (reported on the standard error)
+    */
+    static bool parseAggregationLevels(const char * list, uint32 & levels);
+    //! \brief Number of groups on a level
+    uint32 getNumGroups(AggregationLevel level) const { return (uint32)groupSocket[level].size(); }
+    //! \brief Group of a core on a level
+    uint32 getGroupId(AggregationLevel level, uint32 core) const { return (uint32)coreGroup[level][core]; }
+    //! \brief core_id of the physical core, l3_id or NUMA node of a group (see TopologyEntry), -1 if unknown
+    int32 getGroupTopologyId(AggregationLevel level, uint32 group) const { return groupTopologyId[level][group]; }
+    //! \brief Socket of the cores of a group
+    uint32 getGroupSocket(AggregationLevel level, uint32 group) const { return groupSocket[level][group]; }
+
+    /*! \brief Keeps the counter deltas of the last seconds in memory (see counter_history.h)
+
+        From now on every getAllCounterStates(CounterSnapshot &) call adds the deltas to the previous call to the
+        history. Enable the history before the threads that read the counters are started.
+
+        \param retention seconds of history to keep
+        \return false if the history could not be created
+    */
+    bool enableCounterHistory(double retention);
+
+    //! \brief Stops recording and frees the history
+    void disableCounterHistory();
+
+    //! \brief Returns the history, NULL if it is not enabled
+    CounterHistory * getCounterHistory()
+    {
+        return history;
+    }
+
+    /*! \brief Returns the generation of the core counter programming
+
+        Incremented by program(), switchCoreEvents() and cleanup(): the deltas between counter states of
+        different generations are meaningless.
+    */
+    uint32 getProgramGeneration() const
+    {
+        return programGeneration;
+    }
+
+    /*! \brief Selects how getAllCounterStates reads the per-core counters
+
+        The parallel modes start persistent sampler threads which read their cores at the same time,
+        this reduces the snapshot latency and the time skew between cores on systems with many cores.
+        The parallel modes are implemented only for Linux, on other systems serial sampling is used.
+
+        \param mode_ sampling mode, see SamplingMode definition
+        \return true iff the requested mode is active
+    */
+    bool setSamplingMode(SamplingMode mode_);
+
+    //! \brief Returns the active sampling mode
+    SamplingMode getSamplingMode() const
+    {
+        return samplingMode;
+    }
+
+    /*! \brief Selects how the on-core PMU is programmed and read, takes effect with the next program() call
+
+        With Linux perf all fixed and general purpose counters of a core are read with a single grouped
+        read and no MSR write access is needed. Linux perf is available only if PCM is compiled with
+        PCM_USE_PERF (default on Linux).
+
+        \param access_ see CorePMUAccess definition
+    */
+    void setCorePMUAccess(CorePMUAccess access_)
+    {
+        corePMUAccess = access_;
+    }
+
+    //! \brief Returns true if the on-core PMU is programmed and read through Linux perf
+    bool usesPerf() const
+    {
+        return canUsePerf;
+    }
+
+    /*! \brief Enables reading the core counters from user space with the rdpmc instruction, takes effect with the next program() call
+
+        The control pages of the Linux perf events are mapped into the process, getLocalCoreCounterState()
+        then reads the counters of the current core without entering the kernel. Implies Linux perf
+        in the CORE_PMU_AUTO mode. The kernel must permit user space rdpmc
+        (/sys/bus/event_source/devices/cpu/rdpmc), otherwise the usual read path is used.
+    */
+    void setUserRdpmc(bool enable)
+    {
+        userRdpmcRequested = enable;
+    }
+
+    //! \brief Returns true if getLocalCoreCounterState() reads the counters with rdpmc
+    bool usesUserRdpmc() const
+    {
+        return userRdpmc;
+    }
+
 
     /*! \brief Reads the counter state of the system
 
@@ -460,6 +790,16 @@ public:
     */
     CoreCounterState getCoreCounterState(uint32 core);
 
+    /*! \brief Reads the counter state of the (logical) core the calling thread runs on
+
+        Meant for instrumenting short code regions: with setUserRdpmc() enabled the core PMU counters
+        and the invariant TSC are read with rdpmc/rdtscp in user space, C-state residencies and the
+        thermal headroom are not read then. Otherwise it is equivalent to getCoreCounterState() of the current core.
+
+            \return State of counters in the current core
+    */
+    CoreCounterState getLocalCoreCounterState();
+
     /*! \brief Reads number of logical cores in the system
             \return Number of logical cores in the system
     */
@@ -487,6 +827,16 @@ public:
     */
     uint64 getNominalFrequency(); // in Hz
 
+    /*! \brief Tells where the nominal core frequency comes from
+            \return CPUID leaf 0x15, MSR_PLATFORM_INFO, CPUID leaf 0x16, processor brand string or a (cached) calibration
+    */
+    const char * getNominalFrequencySource() const { return nominalFrequencySource; }
+
+    /*! \brief Time it took to create the instance (see getInstance)
+            \return seconds
+    */
+    double getInitializationTime() const { return initializationTime; }
+
     //! \brief Identifiers of supported CPU models
     enum SupportedCPUModels
     {
@@ -541,6 +891,25 @@ public:
         return 0;
     }
 
+    //! \brief Returns the number of general purpose core counters that can be programmed
+    //! \return 8 on the Intel(r) Core(tm) processors with Intel(r) Hyper-Threading off, 4 with it on, 2 on Intel(r) Atom(tm)
+    uint32 getMaxCustomCoreEvents() const
+    {
+        return (core_gen_counter_num_max < PCM_MAX_CORE_GEN_COUNTERS) ? core_gen_counter_num_max : PCM_MAX_CORE_GEN_COUNTERS;
+    }
+
+    //! \brief Returns the number of general purpose core counters used by the current programming
+    uint32 getNumCustomCoreEventsUsed() const
+    {
+        return core_gen_counter_num_used;
+    }
+
+    //! \brief Returns the event programmed in a general purpose core counter (below getNumCustomCoreEventsUsed())
+    CustomCoreEventDescription getCoreEventDescription(uint32 counter) const
+    {
+        return coreEventDesc[counter];
+    }
+
     //! \brief Returns the max number of instructions per cycle
     //! \return max number of instructions per cycle
     uint32 getMaxIPC() const
@@ -575,6 +944,16 @@ public:
     //! \return time counter value
     uint64 getTickCountRDTSCP(uint64 multiplier = 1000 /* ms */);
 
+    //! \brief Returns the invariant TSC of the current core (rdtscp)
+    uint64 getTSC();
+
+    /*! \brief Reads the TSC and the OS clocks at the same time
+
+        The TSC is read before and after the clocks, the tightest of a few attempts is kept.
+        \return the calibration, the frequency is the nominal frequency
+    */
+    TSCCalibration calibrateTSC();
+
 
     //! \brief Return QPI Link Speed in GBytes/second
     //! \warning Works only for Nehalem-EX (Xeon 7500) and Westmere-EX (Xeon E7) processors
@@ -698,6 +1077,8 @@ public:
 class BasicCounterState
 {
     friend class PCM;
+    friend class CoreCounterArrays;
+    friend struct CoreHotplugState;
     template <class CounterStateType>
     friend double getExecUsage(const CounterStateType & before, const CounterStateType & after);
     template <class CounterStateType>
@@ -766,60 +1147,40 @@ protected:
     uint64 InstRetiredAny;
     uint64 CpuClkUnhaltedThread;
     uint64 CpuClkUnhaltedRef;
+    // general purpose counters, the first four are also known by the names of the default events
     union {
-        uint64 L3Miss;
-        uint64 Event0;
-        uint64 ArchLLCMiss;
-    };
-    union {
-        uint64 L3UnsharedHit;
-        uint64 Event1;
-        uint64 ArchLLCRef;
-    };
-    union {
-        uint64 L2HitM;
-        uint64 Event2;
-    };
-    union {
-        uint64 L2Hit;
-        uint64 Event3;
+        uint64 Event[PCM_MAX_CORE_GEN_COUNTERS];
+        struct { uint64 Event0, Event1, Event2, Event3; };
+        struct { uint64 L3Miss, L3UnsharedHit, L2HitM, L2Hit; };
+        struct { uint64 ArchLLCMiss, ArchLLCRef; };
     };
     uint64 InvariantTSC; // invariant time stamp counter
     uint64 C3Residency;
     uint64 C6Residency;
     uint64 C7Residency;
     int32 ThermalHeadroom;
-    void readAndAggregate(MsrHandle *);
+    bool readAndAggregate(MsrHandle *);
 public:
     BasicCounterState() : 
       InstRetiredAny(0)
     , CpuClkUnhaltedThread(0)
     , CpuClkUnhaltedRef(0)
-    , L3Miss(0)
-    , L3UnsharedHit(0)
-    , L2HitM(0)
-    , L2Hit(0)
+    , Event()
     , InvariantTSC(0) 
     , C3Residency(0)
     , C6Residency(0)
     , C7Residency(0)
     , ThermalHeadroom(PCM_INVALID_THERMAL_HEADROOM)
-	, Event0(0)
-	, Event1(0)
-	, Event2(0)
-	, Event3(0)
     { }
-    virtual ~BasicCounterState() { }
+    // no virtual destructor: the states are plain values kept in large arrays, they are never deleted through a base pointer
 
     BasicCounterState & operator += (const BasicCounterState & o)
     {
         InstRetiredAny += o.InstRetiredAny;
         CpuClkUnhaltedThread += o.CpuClkUnhaltedThread;
         CpuClkUnhaltedRef += o.CpuClkUnhaltedRef;
-        Event0 += o.Event0;
-        Event1 += o.Event1;
-        Event2 += o.Event2;
-        Event3 += o.Event3;
+        for (int i = 0; i < PCM_MAX_CORE_GEN_COUNTERS; ++i)
+            Event[i] += o.Event[i];
         InvariantTSC += o.InvariantTSC;
         C3Residency += o.C3Residency;
         C6Residency += o.C6Residency;
@@ -1063,7 +1424,6 @@ public:
      , C6Residency(0)
      , C7Residency(0)
     { }
-    virtual ~UncoreCounterState() { }
 
     UncoreCounterState & operator += (const UncoreCounterState & o)
     {
@@ -1084,7 +1444,40 @@ class CoreCounterState : public BasicCounterState
 {
     friend class PCM;
 
+    bool Online;                // the counters could be read (false: they are the last values read)
+    uint32 OnlineGeneration;    // incremented each time the core comes back online
+
 public:
+    CoreCounterState() : Online(true), OnlineGeneration(0) { }
+
+    //! \brief false if the core was offline when the state was read
+    bool isOnline() const { return Online; }
+    //! \brief Number of times the core came back online since PCM was created
+    uint32 getOnlineGeneration() const { return OnlineGeneration; }
+};
+
+/*! \brief Tells if the core deltas between two states are meaningful
+
+    The core must have been online at both reads and must not have been offline in between.
+
+    \param before core counter state before the experiment
+    \param after core counter state after the experiment
+*/
+inline bool isCoreSampleValid(const CoreCounterState & before, const CoreCounterState & after)
+{
+    return before.isOnline() && after.isOnline() && before.getOnlineGeneration() == after.getOnlineGeneration();
+}
+
+//! \brief Counter state of a group of cores (see PCM::AggregationLevel)
+class CoreGroupCounterState : public BasicCounterState
+{
+    friend class PCM;
+
+protected:
+    void accumulateCoreState(const CoreCounterState & o)
+    {
+        BasicCounterState::operator += (o);
+    }
 };
 
 //! \brief Socket-wide counter state
@@ -1110,6 +1503,7 @@ public:
 class SystemCounterState : public BasicCounterState, public UncoreCounterState
 {
     friend class PCM;
+    friend class SharedSnapshotPublisher;
     std::vector<std::vector<uint64> > incomingQPIPackets;
     std::vector<std::vector<uint64> > outgoingQPIIdleFlits;
     std::vector<std::vector<uint64> > outgoingQPIDataNonDataFlits;
@@ -1145,6 +1539,57 @@ public:
         BasicCounterState::operator += (o);
         UncoreCounterState::operator += (o);
     }
+
+    //! \brief Zeroes the state in place, the QPI counter storage is kept (no memory allocation)
+    void reset()
+    {
+        static_cast<BasicCounterState &>(*this) = BasicCounterState();
+        static_cast<UncoreCounterState &>(*this) = UncoreCounterState();
+        for (size_t s = 0; s < incomingQPIPackets.size(); ++s)
+        {
+            std::fill(incomingQPIPackets[s].begin(), incomingQPIPackets[s].end(), 0);
+            std::fill(outgoingQPIIdleFlits[s].begin(), outgoingQPIIdleFlits[s].end(), 0);
+            std::fill(outgoingQPIDataNonDataFlits[s].begin(), outgoingQPIDataNonDataFlits[s].end(), 0);
+        }
+        uncoreTSC = 0;
+    }
+
+    //! \brief Copies the values of o in place, both states must be constructed for the same system (no memory allocation)
+    void copyFrom(const SystemCounterState & o)
+    {
+        static_cast<BasicCounterState &>(*this) = o;
+        static_cast<UncoreCounterState &>(*this) = o;
+        for (size_t s = 0; s < incomingQPIPackets.size(); ++s)
+        {
+            std::copy(o.incomingQPIPackets[s].begin(), o.incomingQPIPackets[s].end(), incomingQPIPackets[s].begin());
+            std::copy(o.outgoingQPIIdleFlits[s].begin(), o.outgoingQPIIdleFlits[s].end(), outgoingQPIIdleFlits[s].begin());
+            std::copy(o.outgoingQPIDataNonDataFlits[s].begin(), o.outgoingQPIDataNonDataFlits[s].end(), outgoingQPIDataNonDataFlits[s].begin());
+        }
+        uncoreTSC = o.uncoreTSC;
+    }
+};
+
+/*! \brief Counter states of the system, all sockets and all cores taken at one point in time
+
+    The storage is allocated once in the constructor, PCM::getAllCounterStates(CounterSnapshot &)
+    refills it in place. Keep the snapshots used for the before/after states of a measurement
+    alive between the measurements to avoid any memory allocation while sampling.
+*/
+struct CounterSnapshot
+{
+    SystemCounterState system;
+    std::vector<SocketCounterState> sockets;
+    std::vector<CoreCounterState> cores;
+    std::vector<CoreGroupCounterState> groups[PCM_AGGREGATION_LEVELS]; // per PCM::AggregationLevel, empty if not selected
+
+    CounterSnapshot() :
+        sockets(PCM::getInstance()->getNumSockets()),
+        cores(PCM::getInstance()->getNumCores())
+    {
+        PCM * m = PCM::getInstance();
+        for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+            if (m->getAggregationLevels() & (1U << l)) groups[l].resize(m->getNumGroups((PCM::AggregationLevel)l));
+    }
 };
 
 /*! \brief Reads the counter state of the system
@@ -1176,6 +1621,14 @@ INTELPCM_API SocketCounterState getSocketCounterState(uint32 socket);
 */
 INTELPCM_API CoreCounterState getCoreCounterState(uint32 core);
 
+/*! \brief Reads the counter state of the (logical) core the calling thread runs on
+
+    Helper function. Uses PCM object to access counters.
+
+    \return State of counters in the current core
+*/
+INTELPCM_API CoreCounterState getLocalCoreCounterState();
+
 
 /*! \brief Computes average number of retired instructions per core cycle (IPC)
 
@@ -1864,7 +2317,7 @@ uint64 getBytesWrittenToMC(const CounterStateType & before, const CounterStateTy
 
     Read number of events programmed with the \c CUSTOM_CORE_EVENTS
 
-    \param eventCounterNr Event/counter number (value from 0 to 3)
+    \param eventCounterNr Event/counter number (value from 0 to PCM::getMaxCustomCoreEvents() - 1)
     \param before CPU counter state before the experiment
     \param after CPU counter state after the experiment
     \return Number of bytes
@@ -1872,7 +2325,7 @@ uint64 getBytesWrittenToMC(const CounterStateType & before, const CounterStateTy
 template <class CounterStateType>
 uint64 getNumberOfCustomEvents(int32 eventCounterNr, const CounterStateType & before, const CounterStateType & after)
 {
-    return ((&after.Event0)[eventCounterNr] - (&before.Event0)[eventCounterNr]);
+    return after.Event[eventCounterNr] - before.Event[eventCounterNr];
 }
 
 /*! \brief Get estimation of QPI data traffic per incoming QPI link
@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "event_multiplexer.h"
+#include <algorithm>
+#include <math.h>
+
+EventMultiplexer::EventMultiplexer(PCM * m_) : m(m_), current(0), intervalSlices(0)
+{
+}
+
+uint32 EventMultiplexer::addGroup(const std::string & name, PCM::ProgramMode mode_, void * parameter_, PCM::PCMLine lineMode_, const std::vector<std::string> & eventNames)
+{
+    Group g;
+    g.name = name;
+    g.mode = mode_;
+    g.parameter = parameter_;
+    g.lineMode = lineMode_;
+    g.firstEvent = (uint32)events.size();
+    g.numEvents = (uint32)eventNames.size();
+    groups.push_back(g);
+
+    for (uint32 j = 0; j < eventNames.size(); ++j)
+    {
+        Event e;
+        e.name = eventNames[j];
+        e.group = (uint32)groups.size() - 1;
+        e.counter = j;
+        e.slices = 0;
+        e.sumRate = 0.;
+        e.sumRate2 = 0.;
+        e.systemEstimate = 0;
+        e.enabledRatio = 0.;
+        e.relativeError = -1.;
+        events.push_back(e);
+    }
+    return (uint32)groups.size() - 1;
+}
+
+PCM::ErrorCode EventMultiplexer::program(uint32 group, bool first)
+{
+    const Group & g = groups[group];
+    if (first)
+        return m->program(g.mode, g.parameter, g.lineMode);
+    return m->switchCoreEvents(g.mode, g.parameter, g.lineMode);
+}
+
+PCM::ErrorCode EventMultiplexer::start()
+{
+    if (groups.empty()) return PCM::UnknownError;
+
+    const size_t n = m->getNumCores() * events.size();
+    count.assign(n, 0);
+    enabled.assign(n, 0);
+    estimate.assign(n, 0);
+
+    current = 0;
+    const PCM::ErrorCode status = program(current, true);
+    if (status != PCM::Success) return status;
+
+    m->getAllCounterStates(sliceBefore);
+    intervalBefore = sliceBefore;
+    resetInterval();
+    return PCM::Success;
+}
+
+void EventMultiplexer::resetInterval()
+{
+    intervalSlices = 0;
+    for (size_t i = 0; i < count.size(); ++i)
+    {
+        count[i] = 0;
+        enabled[i] = 0;
+    }
+    for (size_t e = 0; e < events.size(); ++e)
+    {
+        events[e].slices = 0;
+        events[e].sumRate = 0.;
+        events[e].sumRate2 = 0.;
+    }
+}
+
+void EventMultiplexer::endSlice()
+{
+    m->getAllCounterStates(sliceAfter);
+
+    const Group & g = groups[current];
+    const uint32 numCores = m->getNumCores();
+    const size_t numEvents = events.size();
+    uint64 sliceTicks = 0;
+    ++intervalSlices;
+
+    for (uint32 e = g.firstEvent; e < g.firstEvent + g.numEvents; ++e)
+    {
+        uint64 systemCount = 0;
+        for (uint32 i = 0; i < numCores; ++i)
+        {
+            const uint64 c = getNumberOfCustomEvents(events[e].counter, sliceBefore.cores[i], sliceAfter.cores[i]);
+            // the invariant TSC is not read on Atom, the slices get equal weights then
+            uint64 ticks = getInvariantTSC(sliceBefore.cores[i], sliceAfter.cores[i]);
+            if (ticks == 0) ticks = 1;
+            count[i * numEvents + e] += c;
+            enabled[i * numEvents + e] += ticks;
+            systemCount += c;
+            if (i == 0) sliceTicks = ticks;
+        }
+        const double rate = double(systemCount) / double(sliceTicks);
+        events[e].sumRate += rate;
+        events[e].sumRate2 += rate * rate;
+        ++events[e].slices;
+    }
+}
+
+PCM::ErrorCode EventMultiplexer::rotate()
+{
+    endSlice();
+    intervalAfter = sliceAfter;
+
+    if (groups.size() > 1)
+    {
+        current = (current + 1) % (uint32)groups.size();
+        const PCM::ErrorCode status = program(current, false);
+        if (status != PCM::Success) return status;
+        m->getAllCounterStates(sliceBefore);
+    }
+    else
+        std::swap(sliceBefore, sliceAfter); // the same events keep counting
+    return PCM::Success;
+}
+
+PCM::ErrorCode EventMultiplexer::endInterval()
+{
+    const PCM::ErrorCode status = rotate();
+
+    const uint32 numCores = m->getNumCores();
+    const size_t numEvents = events.size();
+
+    for (uint32 e = 0; e < numEvents; ++e)
+    {
+        Event & ev = events[e];
+        double systemEstimate = 0., systemCount = 0., systemEnabled = 0., systemTicks = 0.;
+        for (uint32 i = 0; i < numCores; ++i)
+        {
+            uint64 ticks = getInvariantTSC(intervalBefore.cores[i], intervalAfter.cores[i]);
+            const size_t k = i * numEvents + e;
+            if (ticks == 0) ticks = intervalSlices; // Atom: the slice count is the time
+            // scale the count of the enabled time to the whole interval
+            const double scaled = enabled[k] ? double(count[k]) * double(ticks) / double(enabled[k]) : 0.;
+            estimate[k] = (uint64)(scaled + 0.5);
+            systemEstimate += scaled;
+            systemCount += double(count[k]);
+            systemEnabled += double(enabled[k]);
+            systemTicks += double(ticks);
+        }
+        ev.systemEstimate = (uint64)(systemEstimate + 0.5);
+        ev.enabledRatio = systemTicks > 0. ? (std::min)(1., systemEnabled / systemTicks) : 0.;
+
+        if (ev.enabledRatio >= 1.)
+            ev.relativeError = 0.;
+        else if (ev.slices == 0)
+            ev.relativeError = -1.;
+        else if (systemEstimate <= 0.)
+            ev.relativeError = 0.;
+        else if (ev.slices == 1)
+        {
+            // no spread from a single slice, counting (Poisson) error of the extrapolated part
+            ev.relativeError = (1. - ev.enabledRatio) / sqrt(systemCount);
+        }
+        else
+        {
+            // standard error of the mean rate, applied to the time in which the event was not counted
+            const double n = ev.slices;
+            const double mean = ev.sumRate / n;
+            const double variance = (std::max)(0., (ev.sumRate2 - n * mean * mean) / (n - 1.));
+            const double unmeasuredTicks = (systemTicks - systemEnabled) / numCores;
+            ev.relativeError = unmeasuredTicks * sqrt(variance / n) / systemEstimate;
+        }
+    }
+
+    intervalBefore = sliceBefore;
+    resetInterval();
+    return status;
+}
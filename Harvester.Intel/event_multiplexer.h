@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_EVENT_MULTIPLEXER_H
+#define CPUCounters_EVENT_MULTIPLEXER_H
+
+/*!     \file event_multiplexer.h
+        \brief Time-sliced multiplexing of core event groups with scaled full-interval estimates
+
+        The groups take turns on the general purpose counters, one group per sub-interval (slice).
+        At the end of the reporting interval the count of every event is scaled by the time the event
+        was counted: estimate = count * interval time / enabled time. The fixed counters and the uncore
+        counters are not multiplexed, they count during the whole interval.
+*/
+
+#include "cpucounters.h"
+#include <string>
+#include <vector>
+
+//! \brief Rotates named event groups on the core PMU within one reporting interval
+class EventMultiplexer
+{
+public:
+    EventMultiplexer(PCM * m_);
+
+    /*! \brief Adds a group of events counted together
+        \param name group name
+        \param mode_ mode of programming, see PCM::program
+        \param parameter_ parameter of the programming mode (must stay valid while the multiplexer is used)
+        \param lineMode_ event group of PCM, see PCM::PCMLine
+        \param eventNames names of the events in the general purpose counters 0, 1, ... of the group
+        \return index of the group
+    */
+    uint32 addGroup(const std::string & name, PCM::ProgramMode mode_, void * parameter_, PCM::PCMLine lineMode_, const std::vector<std::string> & eventNames);
+
+    //! \brief Programs the first group and starts the first slice and interval
+    PCM::ErrorCode start();
+
+    //! \brief Ends the current slice and switches the counters to the next group
+    PCM::ErrorCode rotate();
+
+    //! \brief Ends the current slice and the interval, computes the estimates and starts the next interval
+    PCM::ErrorCode endInterval();
+
+    uint32 getNumGroups() const { return (uint32)groups.size(); }
+    uint32 getNumEvents() const { return (uint32)events.size(); }
+    const std::string & getEventName(uint32 event) const { return events[event].name; }
+    const std::string & getEventGroupName(uint32 event) const { return groups[events[event].group].name; }
+
+    //! \brief Scaled number of events of the core in the last interval
+    uint64 getEstimate(uint32 core, uint32 event) const { return estimate[core * events.size() + event]; }
+    //! \brief Scaled number of events of all cores in the last interval
+    uint64 getSystemEstimate(uint32 event) const { return events[event].systemEstimate; }
+    //! \brief Fraction of the last interval the event was counted (1 if it was not multiplexed)
+    double getEnabledRatio(uint32 event) const { return events[event].enabledRatio; }
+    /*! \brief Error indicator of the system estimate of the last interval
+
+        Standard error of the extrapolated part relative to the estimate, computed from the spread of the
+        event rates over the slices in which the event was counted (the counting error if it was counted
+        in one slice only). 0 if the event was counted the whole interval, -1 if it was not counted.
+    */
+    double getRelativeError(uint32 event) const { return events[event].relativeError; }
+
+    //! \brief Counter states at the start and at the end of the last interval (for the fixed and uncore counters)
+    const CounterSnapshot & getIntervalBefore() const { return intervalBefore; }
+    const CounterSnapshot & getIntervalAfter() const { return intervalAfter; }
+
+private:
+    struct Group
+    {
+        std::string name;
+        PCM::ProgramMode mode;
+        void * parameter;
+        PCM::PCMLine lineMode;
+        uint32 firstEvent;
+        uint32 numEvents;
+    };
+    struct Event
+    {
+        std::string name;
+        uint32 group;
+        uint32 counter;         // general purpose counter of the event in its group
+        // per interval
+        uint32 slices;          // slices in which the event was counted
+        double sumRate;         // sum of the system event rates (events per TSC tick) over the slices
+        double sumRate2;        // sum of their squares
+        uint64 systemEstimate;
+        double enabledRatio;
+        double relativeError;
+    };
+
+    PCM * m;
+    std::vector<Group> groups;
+    std::vector<Event> events;
+    uint32 current;                 // group on the counters
+    uint32 intervalSlices;          // slices of the current interval
+    std::vector<uint64> count;      // numCores x numEvents, raw counts of the interval
+    std::vector<uint64> enabled;    // numCores x numEvents, TSC ticks the events were counted
+    std::vector<uint64> estimate;   // numCores x numEvents
+    CounterSnapshot sliceBefore, sliceAfter, intervalBefore, intervalAfter;
+
+    PCM::ErrorCode program(uint32 group, bool first);
+    void endSlice();
+    void resetInterval();
+
+    EventMultiplexer();                     // forbidden
+    EventMultiplexer(EventMultiplexer &);   // forbidden
+};
+
+#endif
@@ -35,7 +35,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 extern HMODULE hOpenLibSys;
 
 // here comes an implementatation for Windows
-MsrHandle::MsrHandle(uint32 cpu) : cpu_id(cpu)
+MsrHandle::MsrHandle(uint32 cpu, bool /* lazy */) : cpu_id(cpu)
 {
     hDriver = CreateFile(L"\\\\.\\RDMSR", GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
 
@@ -78,7 +78,7 @@ public:
 };
 #endif
 
-int32 MsrHandle::write(uint64 msr_number, uint64 value)
+int32 MsrHandle::deviceWrite(uint64 msr_number, uint64 value)
 {
 	if(hDriver != INVALID_HANDLE_VALUE)
 	{
@@ -106,7 +106,7 @@ int32 MsrHandle::write(uint64 msr_number, uint64 value)
 	return status?sizeof(uint64):0;
 }
 
-int32 MsrHandle::read(uint64 msr_number, uint64 * value)
+int32 MsrHandle::deviceRead(uint64 msr_number, uint64 * value)
 {
 	if(hDriver != INVALID_HANDLE_VALUE)
 	{
@@ -135,13 +135,44 @@ int32 MsrHandle::read(uint64 msr_number, uint64 * value)
 	return status?sizeof(uint64):0;
 }
 
+int32 MsrHandle::deviceReadBatch(const uint64 * msr_numbers, uint64 * values, size_t n)
+{
+	int32 result = 0;
+	if(hDriver != INVALID_HANDLE_VALUE)
+	{
+		for(size_t i = 0; i < n; ++i)
+		{
+			values[i] = 0;
+			result += deviceRead(msr_numbers[i], values + i);
+		}
+		return result;
+	}
+
+	#ifdef COMPILE_FOR_WINDOWS_7
+	ThreadGroupTempAffinity affinity(cpu_id); // set the affinity once for the whole batch
+	#endif
+	for(size_t i = 0; i < n; ++i)
+	{
+		cvt_ds cvt;
+		cvt.ui64 = 0;
+	#ifdef COMPILE_FOR_WINDOWS_7
+		BOOL status = Rdmsr((DWORD)msr_numbers[i], &(cvt.ui32.low), &(cvt.ui32.high));
+	#else
+		BOOL status = RdmsrTx((DWORD)msr_numbers[i], &(cvt.ui32.low), &(cvt.ui32.high), (1UL << cpu_id));
+	#endif
+		values[i] = status ? cvt.ui64 : 0;
+		if(status) result += sizeof(uint64);
+	}
+	return result;
+}
+
 #elif __APPLE__
 // OSX Version
 
 MSRAccessor * MsrHandle::driver = NULL;
 int MsrHandle::num_handles = 0;
 
-MsrHandle::MsrHandle(uint32 cpu)
+MsrHandle::MsrHandle(uint32 cpu, bool /* lazy */)
 {
     cpu_id = cpu; 
     if(!driver)
@@ -165,15 +196,26 @@ MsrHandle::~MsrHandle()
     }
 }
 
-int32 MsrHandle::write(uint64 msr_number, uint64 value)
+int32 MsrHandle::deviceWrite(uint64 msr_number, uint64 value)
 {
     return driver->write(cpu_id, msr_number, value);	
 }
 
-int32 MsrHandle::read(uint64 msr_number, uint64 * value){
+int32 MsrHandle::deviceRead(uint64 msr_number, uint64 * value){
     return driver->read(cpu_id, msr_number, value);
 }
 
+int32 MsrHandle::deviceReadBatch(const uint64 * msr_numbers, uint64 * values, size_t n)
+{
+    int32 result = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        values[i] = 0;
+        result += driver->read(cpu_id, msr_numbers[i], values + i);
+    }
+    return result;
+}
+
 int32 MsrHandle::buildTopology(uint32 num_cores, void* ptr){
     return driver->buildTopology(num_cores, ptr);
 }
@@ -194,11 +236,18 @@ uint32 MsrHandle::decrementNumInstances(){
 
 #include <sys/ioccom.h>
 #include <sys/cpuctl.h>
-MsrHandle::MsrHandle(uint32 cpu) : fd(-1), cpu_id(cpu)
+MsrHandle::MsrHandle(uint32 cpu, bool /* lazy */) : fd(-1), writable(true), cpu_id(cpu)
 {
+    if (!RegisterAccessBackend::get()->usesDevices()) return;
+
     char path[200];
     sprintf(path, "/dev/cpuctl%d", cpu);
     int handle = ::open(path, O_RDWR);
+    if (handle < 0)
+    { // reading is enough if the core PMU is accessed through other means
+      handle = ::open(path, O_RDONLY);
+      writable = false;
+    }
     if (handle < 0) throw std::exception();
     fd = handle;
 }
@@ -208,7 +257,7 @@ MsrHandle::~MsrHandle()
     if (fd >= 0) ::close(fd);
 }
 
-int32 MsrHandle::write(uint64 msr_number, uint64 value)
+int32 MsrHandle::deviceWrite(uint64 msr_number, uint64 value)
 {
     cpuctl_msr_args_t args;
 
@@ -217,7 +266,7 @@ int32 MsrHandle::write(uint64 msr_number, uint64 value)
     return ::ioctl(fd, CPUCTL_WRMSR, &args);
 }
 
-int32 MsrHandle::read(uint64 msr_number, uint64 * value)
+int32 MsrHandle::deviceRead(uint64 msr_number, uint64 * value)
 {
     cpuctl_msr_args_t args;
     int32 ret;
@@ -228,36 +277,134 @@ int32 MsrHandle::read(uint64 msr_number, uint64 * value)
     return ret;
 }
 
+int32 MsrHandle::deviceReadBatch(const uint64 * msr_numbers, uint64 * values, size_t n)
+{
+    cpuctl_msr_args_t args;
+    int32 result = 0;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        args.msr = msr_numbers[i];
+        if (::ioctl(fd, CPUCTL_RDMSR, &args) == 0)
+        {
+            values[i] = args.data;
+            result += sizeof(uint64);
+        }
+        else
+            values[i] = 0;
+    }
+    return result;
+}
+
 #else
 // here comes a Linux version
-MsrHandle::MsrHandle(uint32 cpu) : fd(-1), cpu_id(cpu)
+MsrHandle::MsrHandle(uint32 cpu, bool lazy) : device(-1), cpu_id(cpu)
+{
+    if (!lazy && !open()) throw std::exception();
+}
+
+bool MsrHandle::open()
 {
-    char * path = new char[200];
-    sprintf(path, "/dev/cpu/%d/msr", cpu);
+    if (getFd() >= 0 || !RegisterAccessBackend::get()->usesDevices()) return true;
+
+    char path[200];
+    bool writable_ = true;
+    sprintf(path, "/dev/cpu/%d/msr", cpu_id);
     int handle = ::open(path, O_RDWR);
     if(handle < 0)
     { // try Android msr device path
-      sprintf(path, "/dev/msr%d", cpu);
+      sprintf(path, "/dev/msr%d", cpu_id);
       handle = ::open(path, O_RDWR);
     }
-    delete[] path;
-    if (handle < 0) throw std::exception();
-    fd = handle;
+    if(handle < 0)
+    { // without raw MSR write access the core PMU can still be used through Linux perf
+      sprintf(path, "/dev/cpu/%d/msr", cpu_id);
+      handle = ::open(path, O_RDONLY);
+      writable_ = false;
+    }
+    if (handle < 0) return false;
+    int32 expected = -1;
+    if (!__atomic_compare_exchange_n(&device, &expected, (handle << 1) | (writable_ ? 1 : 0), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ::close(handle); // opened by another thread meanwhile
+    return true;
 }
 
 MsrHandle::~MsrHandle()
 {
+    const int32 fd = getFd();
     if (fd >= 0) ::close(fd);
 }
 
-int32 MsrHandle::write(uint64 msr_number, uint64 value)
+int32 MsrHandle::deviceWrite(uint64 msr_number, uint64 value)
 {
-    return ::pwrite(fd, (const void *)&value, sizeof(uint64), msr_number);
+    if (getFd() < 0 && !open()) return -1;
+    return ::pwrite(getFd(), (const void *)&value, sizeof(uint64), msr_number);
 }
 
-int32 MsrHandle::read(uint64 msr_number, uint64 * value)
+int32 MsrHandle::deviceRead(uint64 msr_number, uint64 * value)
 {
-    return ::pread(fd, (void *)value, sizeof(uint64), msr_number);
+    if (getFd() < 0 && !open()) return -1;
+    return ::pread(getFd(), (void *)value, sizeof(uint64), msr_number);
+}
+
+int32 MsrHandle::deviceReadBatch(const uint64 * msr_numbers, uint64 * values, size_t n)
+{
+    // the msr driver can only return one register per call (the offset selects the register),
+    // so the batch is a tight pread loop on the already open descriptor
+    if (getFd() < 0) open(); // if it fails all values are set to 0 below
+    const int32 fd = getFd();
+    int32 result = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (::pread(fd, (void *)(values + i), sizeof(uint64), msr_numbers[i]) == sizeof(uint64))
+            result += sizeof(uint64);
+        else
+            values[i] = 0;
+    }
+    return result;
 }
 
 #endif
+
+// common part: all accesses go through the active register access backend
+
+int32 MsrHandle::read(uint64 msr_number, uint64 * value)
+{
+    RegisterAccess a(RegisterAccess::MSR_READ, cpu_id, msr_number, 0);
+    const int32 result = RegisterAccessBackend::get()->access(this, a);
+    if (result > 0) *value = a.value[0]; // a failed read leaves the value of the caller
+    return result;
+}
+
+int32 MsrHandle::write(uint64 msr_number, uint64 value)
+{
+    RegisterAccess a(RegisterAccess::MSR_WRITE, cpu_id, msr_number, value);
+    return RegisterAccessBackend::get()->access(this, a);
+}
+
+int32 MsrHandle::readBatch(const uint64 * msr_numbers, uint64 * values, size_t n)
+{
+    if (RegisterAccessBackend::get()->passThrough()) return deviceReadBatch(msr_numbers, values, n);
+
+    int32 result = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        values[i] = 0;
+        const int32 r = read(msr_numbers[i], values + i);
+        if (r > 0) result += r;
+    }
+    return result;
+}
+
+int32 MsrHandle::deviceAccess(RegisterAccess & a)
+{
+    switch (a.type)
+    {
+    case RegisterAccess::MSR_READ:
+        return deviceRead(a.address, &a.value[0]);
+    case RegisterAccess::MSR_WRITE:
+        return deviceWrite(a.address, a.value[0]);
+    default:
+        return -1;
+    }
+}
@@ -23,6 +23,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 #include "types.h"
+#include "register_backend.h"
 
 #ifdef _MSC_VER
 #include "windows.h"
@@ -31,25 +32,74 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #endif
 
 
-class MsrHandle
+class MsrHandle : public RegisterDevice
 {
 #ifdef _MSC_VER
     HANDLE hDriver;
 #elif __APPLE__
     static MSRAccessor* driver;
     static int num_handles;
+#elif defined(__linux__)
+    // (descriptor << 1) | writable bit, -1 until the device is open. Set once by a CAS, so a thread
+    // that sees the descriptor also sees its access mode (the device is opened lazily by any thread)
+    volatile int32 device;
+    int32 getFd() const
+    {
+        const int32 d = __atomic_load_n(&device, __ATOMIC_ACQUIRE);
+        return d < 0 ? -1 : (d >> 1);
+    }
 #else
     int32 fd;
+    bool writable; // false if the device could only be opened read-only
 #endif
     uint32 cpu_id;
     MsrHandle();            // forbidden
     MsrHandle(MsrHandle &); // forbidden
 
+    // access to the device, used by the register access backend
+    int32 deviceRead(uint64 msr_number, uint64 * value);
+    int32 deviceWrite(uint64 msr_number, uint64 value);
+    int32 deviceReadBatch(const uint64 * msr_numbers, uint64 * values, size_t n);
+
 public:
-    MsrHandle(uint32 cpu);
+    /*! \brief Creates the handle of a core
+
+        \param cpu OS id of the core
+        \param lazy do not open the device now but on the first access or open() (Linux), the other
+               systems always open it right away
+        throws std::exception if the device can not be opened (not lazy)
+    */
+    MsrHandle(uint32 cpu, bool lazy = false);
+    //! \brief Opens the device if it is not open yet \return false if it can not be opened
+#ifdef __linux__
+    bool open();
+#else
+    bool open() { return true; }
+#endif
     int32 read(uint64 msr_number, uint64 * value);
     int32 write(uint64 msr_number, uint64 value);
+    /*! \brief Reads several model specific registers of this core in one pass
+
+        \param msr_numbers array of n register addresses
+        \param values array of n values to fill, registers that could not be read are set to 0
+        \param n number of registers
+        \return number of bytes read in total (n * sizeof(uint64) if all reads succeeded)
+    */
+    int32 readBatch(const uint64 * msr_numbers, uint64 * values, size_t n);
+    int32 deviceAccess(RegisterAccess & a);
     uint32 getCoreId() { return cpu_id; }
+    //! \brief false if the register values can be read but not written (no raw MSR write access)
+#if defined(_MSC_VER) || defined(__APPLE__)
+    bool isWritable() const { return true; }
+#elif defined(__linux__)
+    bool isWritable() const
+    {
+        const int32 d = __atomic_load_n(&device, __ATOMIC_ACQUIRE);
+        return d < 0 || (d & 1);
+    }
+#else
+    bool isWritable() const { return writable; }
+#endif
 #ifdef __APPLE__
     int32 buildTopology(uint32 num_cores, void*);
     uint32 getNumInstances();
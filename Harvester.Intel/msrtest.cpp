@@ -16,6 +16,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <iostream>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include "msr.h"
 
 #define NUM_CORES 16 
@@ -30,7 +31,7 @@ int main()
     for (i = 0; i < NUM_CORES; ++i)
     {
         cpu_msr[i] = new MsrHandle(i);
-        assert(cpu_msr >= 0);
+        assert(cpu_msr[i]);
 
         FixedEventControlRegister ctrl_reg;
         res = cpu_msr[i]->read(IA32_CR_FIXED_CTR_CTRL, &ctrl_reg.value);
@@ -82,6 +83,28 @@ int main()
         res = cpu_msr[i]->read(CPU_CLK_UNHALTED_REF_ADDR, &counters_after[i][2]);
         assert(res >= 0);
     }
+
+    // compare the cost of one read per register with one batch per core
+    const uint64 fixed_counters[3] = { INST_RETIRED_ANY_ADDR, CPU_CLK_UNHALTED_THREAD_ADDR, CPU_CLK_UNHALTED_REF_ADDR };
+    uint64 scratch[3];
+    const uint32 iterations = 1000;
+    timeval start, end;
+    gettimeofday(&start, NULL);
+    for (uint32 it = 0; it < iterations; ++it)
+        for (i = 0; i < NUM_CORES; ++i)
+            for (uint32 r = 0; r < 3; ++r)
+                cpu_msr[i]->read(fixed_counters[r], &scratch[r]);
+    gettimeofday(&end, NULL);
+    double single_us = double(end.tv_sec - start.tv_sec) * 1e6 + double(end.tv_usec - start.tv_usec);
+    gettimeofday(&start, NULL);
+    for (uint32 it = 0; it < iterations; ++it)
+        for (i = 0; i < NUM_CORES; ++i)
+            cpu_msr[i]->readBatch(fixed_counters, scratch, 3);
+    gettimeofday(&end, NULL);
+    double batch_us = double(end.tv_sec - start.tv_sec) * 1e6 + double(end.tv_usec - start.tv_usec);
+    std::cout << "Per core snapshot of 3 registers: " << single_us / (iterations * NUM_CORES) << " us with read(), "
+              << batch_us / (iterations * NUM_CORES) << " us with readBatch()" << std::endl;
+
     for (i = 0; i < NUM_CORES; ++i)
         delete cpu_msr[i];
     for (i = 0; i < NUM_CORES; ++i)
@@ -31,6 +31,75 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <errno.h>
 #endif
 
+#ifdef __linux__
+#include <map>
+#include <pthread.h>
+#endif
+
+// common part: all accesses go through the active register access backend
+
+template <class HandleType>
+int32 pciDeviceAccess(HandleType & h, RegisterAccess & a)
+{
+    switch (a.type)
+    {
+    case RegisterAccess::PCI_READ32:
+    {
+        uint32 value = (uint32)a.value[0];
+        const int32 result = h.deviceRead32(a.address, &value);
+        a.value[0] = value;
+        return result;
+    }
+    case RegisterAccess::PCI_WRITE32:
+        return h.deviceWrite32(a.address, (uint32)a.value[0]);
+    case RegisterAccess::PCI_READ64:
+        return h.deviceRead64(a.address, &a.value[0]);
+    case RegisterAccess::PCI_WRITE64:
+        return h.deviceWrite64(a.address, a.value[0]);
+    default:
+        return -1;
+    }
+}
+
+template <class HandleType>
+int32 pciRead32(HandleType * h, uint64 unit, uint64 offset, uint32 * value)
+{
+    RegisterAccess a(RegisterAccess::PCI_READ32, unit, offset, *value);
+    const int32 result = RegisterAccessBackend::get()->access(h, a);
+    *value = (uint32)a.value[0];
+    return result;
+}
+
+template <class HandleType>
+int32 pciRead64(HandleType * h, uint64 unit, uint64 offset, uint64 * value)
+{
+    RegisterAccess a(RegisterAccess::PCI_READ64, unit, offset, *value);
+    const int32 result = RegisterAccessBackend::get()->access(h, a);
+    *value = a.value[0];
+    return result;
+}
+
+template <class HandleType>
+int32 pciWrite(HandleType * h, RegisterAccess::Type type, uint64 unit, uint64 offset, uint64 value)
+{
+    RegisterAccess a(type, unit, offset, value);
+    return RegisterAccessBackend::get()->access(h, a);
+}
+
+// one backend access per register (recorded and replayed like single reads)
+template <class HandleType>
+int32 pciReadBatch64(HandleType * h, const uint64 * offsets, uint64 * values, size_t n)
+{
+    int32 result = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        values[i] = 0;
+        const int32 r = h->read64(offsets[i], values + i);
+        if (r > 0) result += r;
+    }
+    return result;
+}
+
 #ifdef _MSC_VER
 
 #include <windows.h>
@@ -73,7 +142,7 @@ bool PciHandle::exists(uint32 bus_, uint32 device_, uint32 function_)
     return true;
 }
 
-int32 PciHandle::read32(uint64 offset, uint32 * value)
+int32 PciHandle::deviceRead32(uint64 offset, uint32 * value)
 {
 	if(hDriver != INVALID_HANDLE_VALUE)
 	{
@@ -103,7 +172,7 @@ int32 PciHandle::read32(uint64 offset, uint32 * value)
 	return 0;
 }
 
-int32 PciHandle::write32(uint64 offset, uint32 value)
+int32 PciHandle::deviceWrite32(uint64 offset, uint32 value)
 {
 	if(hDriver != INVALID_HANDLE_VALUE)
 	{
@@ -128,7 +197,7 @@ int32 PciHandle::write32(uint64 offset, uint32 value)
 	return (WritePciConfigDwordEx(pciAddress,(DWORD)offset,value))?sizeof(uint32):0;
 }
 
-int32 PciHandle::read64(uint64 offset, uint64 * value)
+int32 PciHandle::deviceRead64(uint64 offset, uint64 * value)
 {
 	if(hDriver != INVALID_HANDLE_VALUE)
 	{
@@ -163,7 +232,7 @@ int32 PciHandle::read64(uint64 offset, uint64 * value)
 	return 0;
 }
 
-int32 PciHandle::write64(uint64 offset, uint64 value)
+int32 PciHandle::deviceWrite64(uint64 offset, uint64 value)
 {
 	if(hDriver != INVALID_HANDLE_VALUE)
 	{
@@ -216,28 +285,28 @@ bool PciHandle::exists(uint32 bus_, uint32 device_, uint32 function_)
     return false;
 }
 
-int32 PciHandle::read32(uint64 offset, uint32 * value)
+int32 PciHandle::deviceRead32(uint64 offset, uint32 * value)
 {
     fprintf(stderr, "Attempting to use PciHandle on OS X, this is not supported.\n");
     assert(0 == 1);
     return -1;
 }
 
-int32 PciHandle::write32(uint64 offset, uint32 value)
+int32 PciHandle::deviceWrite32(uint64 offset, uint32 value)
 {
     fprintf(stderr, "Attempting to use PciHandle on OS X, this is not supported.\n");
     assert(0 == 1);
     return -1;
 }
 
-int32 PciHandle::read64(uint64 offset, uint64 * value)
+int32 PciHandle::deviceRead64(uint64 offset, uint64 * value)
 {
     fprintf(stderr, "Attempting to use PciHandle on OS X, this is not supported.\n");
     assert(0 == 1);
     return -1;
 }
 
-int32 PciHandle::write64(uint64 offset, uint64 value)
+int32 PciHandle::deviceWrite64(uint64 offset, uint64 value)
 {
     fprintf(stderr, "Attempting to use PciHandle on OS X, this is not supported.\n");
     assert(0 == 1);
@@ -304,7 +373,7 @@ bool PciHandle::exists(uint32 bus_, uint32 device_, uint32 function_)
     return false; 
 }
 
-int32 PciHandle::read32(uint64 offset, uint32 * value)
+int32 PciHandle::deviceRead32(uint64 offset, uint32 * value)
 {
     struct pci_io pi;
     int ret;
@@ -323,7 +392,7 @@ int32 PciHandle::read32(uint64 offset, uint32 * value)
     return ret;
 }
 
-int32 PciHandle::write32(uint64 offset, uint32 value)
+int32 PciHandle::deviceWrite32(uint64 offset, uint32 value)
 {
     struct pci_io pi;
 
@@ -338,7 +407,7 @@ int32 PciHandle::write32(uint64 offset, uint32 value)
     return ioctl(fd, PCIOCWRITE, &pi);
 }
 
-int32 PciHandle::read64(uint64 offset, uint64 * value)
+int32 PciHandle::deviceRead64(uint64 offset, uint64 * value)
 {
     struct pci_io pi;
     int32 ret;
@@ -364,7 +433,7 @@ int32 PciHandle::read64(uint64 offset, uint64 * value)
     return 0;
 }
 
-int32 PciHandle::write64(uint64 offset, uint64 value)
+int32 PciHandle::deviceWrite64(uint64 offset, uint64 value)
 {
     struct pci_io pi;
     int32 ret;
@@ -410,6 +479,8 @@ PciHandle::PciHandle(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 functi
        throw std::exception();
    }
 
+    if (!RegisterAccessBackend::get()->usesDevices()) return;
+
     std::ostringstream path(std::ostringstream::out);
 
     path << std::hex << "/proc/bus/pci/" << std::setw(2) << std::setfill('0') << bus << "/" << std::setw(2) << std::setfill('0') << device << "." << function;
@@ -426,6 +497,8 @@ PciHandle::PciHandle(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 functi
 
 bool PciHandle::exists(uint32 bus_, uint32 device_, uint32 function_)
 {
+    if (!RegisterAccessBackend::get()->usesDevices()) return true;
+
     std::ostringstream path(std::ostringstream::out);
 
     path << std::hex << "/proc/bus/pci/" << std::setw(2) << std::setfill('0') << bus_ << "/" << std::setw(2) << std::setfill('0') << device_ << "." << function_;
@@ -439,22 +512,22 @@ bool PciHandle::exists(uint32 bus_, uint32 device_, uint32 function_)
     return true;
 }
 
-int32 PciHandle::read32(uint64 offset, uint32 * value)
+int32 PciHandle::deviceRead32(uint64 offset, uint32 * value)
 {
     return ::pread(fd, (void *)value, sizeof(uint32), offset); 
 }
 
-int32 PciHandle::write32(uint64 offset, uint32 value)
+int32 PciHandle::deviceWrite32(uint64 offset, uint32 value)
 {
     return ::pwrite(fd, (const void *)&value, sizeof(uint32), offset);
 }
 
-int32 PciHandle::read64(uint64 offset, uint64 * value)
+int32 PciHandle::deviceRead64(uint64 offset, uint64 * value)
 {
     return ::pread(fd, (void *)value, sizeof(uint64), offset);
 }
 
-int32 PciHandle::write64(uint64 offset, uint64 value)
+int32 PciHandle::deviceWrite64(uint64 offset, uint64 value)
 {
     return ::pwrite(fd, (const void *)&value, sizeof(uint64), offset);
 }
@@ -473,6 +546,8 @@ PciHandleM::PciHandleM(uint32 bus_, uint32 device_, uint32 function_) :
     function(function_),
     base_addr(0)
 {
+    if (!RegisterAccessBackend::get()->usesDevices()) return;
+
     int handle = ::open("/dev/mem", O_RDWR);
     if (handle < 0) throw std::exception();
     fd = handle;
@@ -515,6 +590,8 @@ PciHandleM::PciHandleM(uint32 bus_, uint32 device_, uint32 function_) :
 
 bool PciHandleM::exists(uint32 /* bus_*/, uint32 /* device_ */, uint32 /* function_ */)
 {
+    if (!RegisterAccessBackend::get()->usesDevices()) return true;
+
     int handle = ::open("/dev/mem", O_RDWR);
 
     if (handle < 0) return false;
@@ -530,22 +607,22 @@ bool PciHandleM::exists(uint32 /* bus_*/, uint32 /* device_ */, uint32 /* functi
     return true;
 }
 
-int32 PciHandleM::read32(uint64 offset, uint32 * value)
+int32 PciHandleM::deviceRead32(uint64 offset, uint32 * value)
 {
     return ::pread(fd, (void *)value, sizeof(uint32), offset + base_addr);
 }
 
-int32 PciHandleM::write32(uint64 offset, uint32 value)
+int32 PciHandleM::deviceWrite32(uint64 offset, uint32 value)
 {
     return ::pwrite(fd, (const void *)&value, sizeof(uint32), offset + base_addr);
 }
 
-int32 PciHandleM::read64(uint64 offset, uint64 * value)
+int32 PciHandleM::deviceRead64(uint64 offset, uint64 * value)
 {
     return ::pread(fd, (void *)value, sizeof(uint64), offset + base_addr);
 }
 
-int32 PciHandleM::write64(uint64 offset, uint64 value)
+int32 PciHandleM::deviceWrite64(uint64 offset, uint64 value)
 {
     return ::pwrite(fd, (const void *)&value, sizeof(uint64), offset + base_addr);
 }
@@ -559,6 +636,21 @@ PciHandleM::~PciHandleM()
 
 // mmaped I/O version
 
+/* The ECAM window of a whole bus (1 MB: 32 devices x 8 functions x 4 KB) is mapped once and shared by
+   the handles of all functions on the bus, /dev/mem is opened once for all windows. */
+#define PCM_PCI_BUS_WINDOW (1024 * 1024)
+
+struct PciBusWindow
+{
+    uint64 base;    // physical address
+    char * addr;
+    uint32 refs;
+};
+
+static pthread_mutex_t pciWindowsMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<uint64, PciBusWindow> * pciWindows = NULL;   // key: RegisterAccess::pciUnit(groupnr, bus, 0, 0)
+static int pciMemFd = -1;                                   // /dev/mem while a window is mapped
+
 uint64 read_base_addr(int mcfg_handle, uint32 group_, uint32 bus)
 {
     MCFGRecord record;
@@ -583,27 +675,19 @@ uint64 read_base_addr(int mcfg_handle, uint32 group_, uint32 bus)
     return record.baseAddress;
 }
 
-PciHandleMM::PciHandleMM(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 function_) :
-    fd(-1),
-    mmapAddr(NULL),
-    bus(bus_),
-    device(device_),
-    function(function_),
-    base_addr(0)
+// physical address of the ECAM window of a bus, throws std::exception if it is not described in the MCFG table
+static uint64 readBusBase(uint32 groupnr, uint32 bus)
 {
-    int handle = ::open("/dev/mem", O_RDWR);
-    if (handle < 0) throw std::exception();
-    fd = handle;
-
+    uint64 base = 0;
     int mcfg_handle = ::open("/sys/firmware/acpi/tables/MCFG", O_RDONLY);
 
     if (mcfg_handle < 0) throw std::exception();
 
-    if(groupnr_ == 0)
+    if(groupnr == 0)
     {
-        base_addr = read_base_addr(mcfg_handle, 0, bus);
+        base = read_base_addr(mcfg_handle, 0, bus);
     }
-    else if(groupnr_ >= 0x1000)
+    else if(groupnr >= 0x1000)
     {
         // for SGI UV2
         MCFGHeader header;
@@ -615,12 +699,12 @@ PciHandleMM::PciHandleMM(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 fu
             ::read(mcfg_handle, (void *)&record, sizeof(MCFGRecord));
             if(record.PCISegmentGroupNumber == 0x1000)
             {
-                base_addr = record.baseAddress + (groupnr_ - 0x1000)*(0x4000000);
+                base = record.baseAddress + (groupnr - 0x1000)*(0x4000000);
                 break;
             }
         }
 
-        if(base_addr == 0)
+        if(base == 0)
         {
             std::cout << "ERROR: PCI Segment 0x1000 not found." << std::endl;
             throw std::exception();
@@ -628,27 +712,74 @@ PciHandleMM::PciHandleMM(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 fu
 
     } else
     {
-        std::cout << "ERROR: Unsupported PCI segment group number "<< groupnr_ << std::endl;
+        std::cout << "ERROR: Unsupported PCI segment group number "<< groupnr << std::endl;
         throw std::exception();
     }
 
-    // std::cout << "DEBUG: PCI config base addr: 0x"<< std::hex << base_addr<< " for groupnr " << std::dec << groupnr_ << std::endl;
+    // std::cout << "DEBUG: PCI config base addr: 0x"<< std::hex << base<< " for groupnr " << std::dec << groupnr << std::endl;
 
     ::close(mcfg_handle);
 
-    base_addr += (bus * 1024 * 1024 + device * 32 * 1024 + function * 4 * 1024);
-    
-    mmapAddr = (char*) mmap(NULL, 4096, PROT_READ| PROT_WRITE, MAP_SHARED , fd, base_addr);
-    
-    if(mmapAddr == MAP_FAILED)
+    return base + uint64(bus) * PCM_PCI_BUS_WINDOW;
+}
+
+PciHandleMM::PciHandleMM(uint32 groupnr_, uint32 bus_, uint32 device_, uint32 function_) :
+    window(RegisterAccess::pciUnit(groupnr_, bus_, 0, 0)),
+    mmapAddr(NULL),
+    groupnr(groupnr_),
+    bus(bus_),
+    device(device_),
+    function(function_),
+    base_addr(0)
+{
+    if (!RegisterAccessBackend::get()->usesDevices()) return;
+
+    pthread_mutex_lock(&pciWindowsMutex);
+    if (pciWindows == NULL) pciWindows = new std::map<uint64, PciBusWindow>(); // never freed: handles may outlive the static objects
+    std::map<uint64, PciBusWindow>::iterator w = pciWindows->find(window);
+    if (w == pciWindows->end())
     {
-      std::cout << "mmap failed: errno is "<< errno<<  std::endl;
-      throw std::exception();
+        PciBusWindow busWindow;
+        busWindow.refs = 0;
+        try
+        {
+            if (pciMemFd < 0) pciMemFd = ::open("/dev/mem", O_RDWR);
+            if (pciMemFd < 0) throw std::exception();
+            busWindow.base = readBusBase(groupnr, bus);
+            busWindow.addr = (char *)mmap(NULL, PCM_PCI_BUS_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, pciMemFd, busWindow.base);
+            if (busWindow.addr == MAP_FAILED)
+            {
+                std::cout << "mmap failed: errno is " << errno << std::endl;
+                throw std::exception();
+            }
+        }
+        catch (...)
+        {
+            if (pciWindows->empty() && pciMemFd >= 0)
+            {
+                ::close(pciMemFd);
+                pciMemFd = -1;
+            }
+            pthread_mutex_unlock(&pciWindowsMutex);
+            throw;
+        }
+        w = pciWindows->insert(std::make_pair(window, busWindow)).first;
     }
+    ++w->second.refs;
+    const uint64 offset = device * 32 * 1024 + function * 4 * 1024;
+    base_addr = w->second.base + offset;
+    mmapAddr = w->second.addr + offset;
+    pthread_mutex_unlock(&pciWindowsMutex);
 }
 
 bool PciHandleMM::exists(uint32 bus_, uint32 device_, uint32 function_)
 {
+    if (!RegisterAccessBackend::get()->usesDevices()) return true;
+    pthread_mutex_lock(&pciWindowsMutex);
+    const bool mapped = (pciMemFd >= 0);
+    pthread_mutex_unlock(&pciWindowsMutex);
+    if (mapped) return true; // a window is mapped already
+
     int handle = ::open("/dev/mem", O_RDWR);
 
     if (handle < 0) return false;
@@ -664,39 +795,150 @@ bool PciHandleMM::exists(uint32 bus_, uint32 device_, uint32 function_)
     return true;
 }
 
-int32 PciHandleMM::read32(uint64 offset, uint32 * value)
+int32 PciHandleMM::deviceRead32(uint64 offset, uint32 * value)
 {
     *value = *((uint32*)(mmapAddr+offset));
 
     return sizeof(uint32);
 }
 
-int32 PciHandleMM::write32(uint64 offset, uint32 value)
+int32 PciHandleMM::deviceWrite32(uint64 offset, uint32 value)
 {
     *((uint32*)(mmapAddr+offset)) = value;
 
     return sizeof(uint32);
 }
 
-int32 PciHandleMM::read64(uint64 offset, uint64 * value)
+int32 PciHandleMM::deviceRead64(uint64 offset, uint64 * value)
 {
     *value = *((uint64*)(mmapAddr+offset));
 
     return sizeof(uint64);
 }
 
-int32 PciHandleMM::write64(uint64 offset, uint64 value)
+int32 PciHandleMM::deviceWrite64(uint64 offset, uint64 value)
 {
     *((uint64*)(mmapAddr+offset)) = value;
 
     return sizeof(uint64);
 }
 
+int32 PciHandleMM::readBatch64(const uint64 * offsets, uint64 * values, size_t n)
+{
+    if (mmapAddr == NULL || !RegisterAccessBackend::get()->passThrough()) return pciReadBatch64(this, offsets, values, n);
+
+    // plain loads from the mapped window, no system call
+    for (size_t i = 0; i < n; ++i)
+        values[i] = *((volatile uint64 *)(mmapAddr + offsets[i]));
+    return int32(n * sizeof(uint64));
+}
+
 PciHandleMM::~PciHandleMM()
 {
-    if (mmapAddr) munmap(mmapAddr, 4096);
-    if (fd >= 0) ::close(fd);
+    if (mmapAddr == NULL) return;
+    pthread_mutex_lock(&pciWindowsMutex);
+    std::map<uint64, PciBusWindow>::iterator w = pciWindows->find(window);
+    if (w != pciWindows->end() && --w->second.refs == 0)
+    {
+        munmap(w->second.addr, PCM_PCI_BUS_WINDOW);
+        pciWindows->erase(w);
+        if (pciWindows->empty())
+        {
+            ::close(pciMemFd);
+            pciMemFd = -1;
+        }
+    }
+    pthread_mutex_unlock(&pciWindowsMutex);
 }
 
 
+#ifndef PCM_USE_PCI_MM_LINUX
+
+int32 PciHandleM::read32(uint64 offset, uint32 * value)
+{
+    return pciRead32(this, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandleM::write32(uint64 offset, uint32 value)
+{
+    return pciWrite(this, RegisterAccess::PCI_WRITE32, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandleM::read64(uint64 offset, uint64 * value)
+{
+    return pciRead64(this, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandleM::write64(uint64 offset, uint64 value)
+{
+    return pciWrite(this, RegisterAccess::PCI_WRITE64, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandleM::deviceAccess(RegisterAccess & a)
+{
+    return pciDeviceAccess(*this, a);
+}
+
+int32 PciHandleM::readBatch64(const uint64 * offsets, uint64 * values, size_t n)
+{
+    return pciReadBatch64(this, offsets, values, n);
+}
+
+#endif // PCM_USE_PCI_MM_LINUX
+
+int32 PciHandleMM::read32(uint64 offset, uint32 * value)
+{
+    return pciRead32(this, RegisterAccess::pciUnit(groupnr, bus, device, function), offset, value);
+}
+
+int32 PciHandleMM::write32(uint64 offset, uint32 value)
+{
+    return pciWrite(this, RegisterAccess::PCI_WRITE32, RegisterAccess::pciUnit(groupnr, bus, device, function), offset, value);
+}
+
+int32 PciHandleMM::read64(uint64 offset, uint64 * value)
+{
+    return pciRead64(this, RegisterAccess::pciUnit(groupnr, bus, device, function), offset, value);
+}
+
+int32 PciHandleMM::write64(uint64 offset, uint64 value)
+{
+    return pciWrite(this, RegisterAccess::PCI_WRITE64, RegisterAccess::pciUnit(groupnr, bus, device, function), offset, value);
+}
+
+int32 PciHandleMM::deviceAccess(RegisterAccess & a)
+{
+    return pciDeviceAccess(*this, a);
+}
+
 #endif
+
+int32 PciHandle::read32(uint64 offset, uint32 * value)
+{
+    return pciRead32(this, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandle::write32(uint64 offset, uint32 value)
+{
+    return pciWrite(this, RegisterAccess::PCI_WRITE32, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandle::read64(uint64 offset, uint64 * value)
+{
+    return pciRead64(this, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandle::write64(uint64 offset, uint64 value)
+{
+    return pciWrite(this, RegisterAccess::PCI_WRITE64, RegisterAccess::pciUnit(0, bus, device, function), offset, value);
+}
+
+int32 PciHandle::deviceAccess(RegisterAccess & a)
+{
+    return pciDeviceAccess(*this, a);
+}
+
+int32 PciHandle::readBatch64(const uint64 * offsets, uint64 * values, size_t n)
+{
+    return pciReadBatch64(this, offsets, values, n);
+}
@@ -24,6 +24,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 #include "types.h"
+#include "register_backend.h"
 
 #ifdef _MSC_VER
 #include "windows.h"
@@ -34,7 +35,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 
 #define PCM_USE_PCI_MM_LINUX
 
-class PciHandle
+class PciHandle : public RegisterDevice
 {
 #ifdef _MSC_VER
     HANDLE hDriver;
@@ -63,6 +64,16 @@ public:
     int32 read64(uint64 offset, uint64 * value);
     int32 write64(uint64 offset, uint64 value);
 
+    //! \brief Reads several 64-bit registers of the function \return bytes read
+    int32 readBatch64(const uint64 * offsets, uint64 * values, size_t n);
+
+    // direct access to the device, used by the register access backend
+    int32 deviceRead32(uint64 offset, uint32 * value);
+    int32 deviceWrite32(uint64 offset, uint32 value);
+    int32 deviceRead64(uint64 offset, uint64 * value);
+    int32 deviceWrite64(uint64 offset, uint64 value);
+    int32 deviceAccess(RegisterAccess & a);
+
     virtual ~PciHandle();
 };
 
@@ -76,7 +87,7 @@ typedef PciHandle PciHandleM;
 #else
 
 // read/write PCI config space using physical memory
-class PciHandleM
+class PciHandleM : public RegisterDevice
 {
 #ifdef _MSC_VER
 
@@ -103,17 +114,28 @@ public:
     int32 read64(uint64 offset, uint64 * value);
     int32 write64(uint64 offset, uint64 value);
 
+    //! \brief Reads several 64-bit registers of the function \return bytes read
+    int32 readBatch64(const uint64 * offsets, uint64 * values, size_t n);
+
+    // direct access to the device, used by the register access backend
+    int32 deviceRead32(uint64 offset, uint32 * value);
+    int32 deviceWrite32(uint64 offset, uint32 value);
+    int32 deviceRead64(uint64 offset, uint64 * value);
+    int32 deviceWrite64(uint64 offset, uint64 value);
+    int32 deviceAccess(RegisterAccess & a);
+
     virtual ~PciHandleM();
 };
 
 #ifndef _MSC_VER
 
 // read/write PCI config space using physical memory using mmaped file I/O
-class PciHandleMM
+class PciHandleMM : public RegisterDevice
 {
-    int32 fd;
-    char * mmapAddr;
+    uint64 window;      // key of the shared bus window
+    char * mmapAddr;    // configuration space of the function within the window
 
+    uint32 groupnr;
     uint32 bus;
     uint32 device;
     uint32 function;
@@ -133,6 +155,16 @@ public:
     int32 read64(uint64 offset, uint64 * value);
     int32 write64(uint64 offset, uint64 value);
 
+    //! \brief Reads several 64-bit registers of the function \return bytes read
+    int32 readBatch64(const uint64 * offsets, uint64 * values, size_t n);
+
+    // direct access to the device, used by the register access backend
+    int32 deviceRead32(uint64 offset, uint32 * value);
+    int32 deviceWrite32(uint64 offset, uint32 value);
+    int32 deviceRead64(uint64 offset, uint64 * value);
+    int32 deviceWrite64(uint64 offset, uint64 value);
+    int32 deviceAccess(RegisterAccess & a);
+
     virtual ~PciHandleMM();
 };
 
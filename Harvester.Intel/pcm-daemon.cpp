@@ -0,0 +1,179 @@
+/*
+   Copyright (c) 2009-2013, Intel Corporation
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*!     \file pcm-daemon.cpp
+  \brief Owns the PMU and publishes the counter snapshots into shared memory for other processes (see shared_snapshot.h)
+  */
+#define HACK_TO_REMOVE_DUPLICATE_ERROR
+#include <iostream>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "cpucounters.h"
+#include "shared_snapshot.h"
+#include "utils.h"
+
+using namespace std;
+
+void print_help(const char * prog_name)
+{
+    cout << endl;
+    cout << " Usage: " << prog_name << " <delay> [--name=<shm name>] [--history=<n>]" << endl;
+    cout << "        " << prog_name << " --client [--name=<shm name>]" << endl;
+    cout << endl;
+    cout << " <delay> is the sampling period in seconds (default 1), sub-second periods are supported" << endl;
+    cout << " --name => POSIX shared memory object (default " << PCM_SHARED_SNAPSHOT_NAME << ")" << endl;
+    cout << " --history => number of snapshots kept in the ring, 1 to " << PCM_SHARED_SNAPSHOT_MAX_HISTORY << " (default " << PCM_SHARED_SNAPSHOT_HISTORY << ")" << endl;
+    cout << " --client => reads the snapshots of a running daemon and prints the system IPC and memory traffic" << endl;
+    cout << endl;
+}
+
+SharedSnapshotPublisher * publisher = NULL;
+
+void remove_segment()
+{
+    delete publisher; // unlinks the segment
+    publisher = NULL;
+}
+
+int run_client(const char * name)
+{
+    SharedSnapshotReader * reader = NULL;
+    try
+    {
+        reader = new SharedSnapshotReader(name);
+    }
+    catch (...)
+    {
+        return -1;
+    }
+
+    cout << "Reading the snapshots of process " << reader->getPublisherPid() << ": " << reader->getNumCores() << " cores, "
+         << reader->getNumSockets() << " sockets, period " << reader->getPeriod() << " s" << endl;
+
+    SharedCounterSnapshot before, after;
+    while (!reader->readLatest(before))
+    {
+        if (!reader->isPublisherAlive())
+        {
+            cerr << "The publisher process " << reader->getPublisherPid() << " is not running" << endl;
+            return -1;
+        }
+        MySleepMs(100);
+    }
+    const int poll_ms = (std::max)(1, (int)(reader->getPeriod() * 250.));
+
+    while (true)
+    {
+        // the data is copied from the mapped segment, only the polling sleeps
+        if (reader->getEpoch() == before.epoch || !reader->readLatest(after))
+        {
+            if (!reader->isPublisherAlive())
+            {
+                cerr << "The publisher process " << reader->getPublisherPid() << " is not running" << endl;
+                return -1;
+            }
+            MySleepMs(poll_ms);
+            continue;
+        }
+        if (after.epoch != before.epoch + 1)
+            cout << "missed " << (after.epoch - before.epoch - 1) << " snapshot(s)" << endl;
+        cout << "epoch " << after.epoch <<
+            "; IPC " << getIPC(before.system, after.system) <<
+            "; MC read " << getBytesReadFromMC(before.system, after.system) / (1024 * 1024) << " MB" <<
+            "; MC written " << getBytesWrittenToMC(before.system, after.system) / (1024 * 1024) << " MB" <<
+            "; interval " << double(after.timestamp - before.timestamp) / 1e6 << " ms" << endl;
+        std::swap(before, after);
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    double delay = 1.;
+    uint32 history = PCM_SHARED_SNAPSHOT_HISTORY;
+    const char * name = PCM_SHARED_SNAPSHOT_NAME;
+    bool client = false;
+
+    for (int l = 1; l < argc; ++l)
+    {
+        if (strcmp(argv[l], "--help") == 0 || strcmp(argv[l], "-h") == 0)
+        {
+            print_help(argv[0]);
+            return 0;
+        }
+        else if (strncmp(argv[l], "--name=", 7) == 0)
+            name = argv[l] + 7;
+        else if (strncmp(argv[l], "--history=", 10) == 0)
+        {
+            const char * value = argv[l] + 10;
+            char * end = NULL;
+            const unsigned long n = (*value >= '0' && *value <= '9') ? strtoul(value, &end, 10) : 0; // strtoul accepts a sign
+            if (end == NULL || *end != '\0' || n == 0 || n > PCM_SHARED_SNAPSHOT_MAX_HISTORY)
+            {
+                print_help(argv[0]);
+                return -1;
+            }
+            history = (uint32)n;
+        }
+        else if (strcmp(argv[l], "--client") == 0)
+            client = true;
+        else if (atof(argv[l]) > 0)
+            delay = atof(argv[l]);
+        else
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if (client) return run_client(name);
+
+    signal(SIGINT, cleanup);
+    signal(SIGTERM, cleanup);
+
+    PCM * m = PCM::getInstance();
+    PCM::ErrorCode status = m->program();
+    if (status != PCM::Success)
+    {
+        cerr << "Access to Intel(r) Performance Counter Monitor has denied (error code " << status << ")." << endl;
+        return -1;
+    }
+
+    try
+    {
+        publisher = new SharedSnapshotPublisher(name, history, delay);
+    }
+    catch (...)
+    {
+        m->cleanup();
+        return -1;
+    }
+    atexit(remove_segment); // the cleanup signal handler calls exit()
+
+    cout << "Publishing counter snapshots every " << delay << " s into " << name << " (" << history << " snapshots kept)" << endl;
+
+    CounterSnapshot snapshot;
+    SamplingScheduler scheduler(delay);
+    while (true)
+    {
+        m->getAllCounterStates(snapshot);
+        publisher->publish(snapshot);
+        scheduler.wait();
+        if (scheduler.getLastMissedDeadlines()) scheduler.report(cerr);
+    }
+    return 0;
+}
@@ -0,0 +1,402 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*!     \file pcm-exporter.cpp
+        \brief Serves the counters of the last sampling period over HTTP on localhost in the OpenMetrics text format (Prometheus)
+
+        The metric and label names are formatted once at startup, a scrape copies the states of the last period
+        and appends the values to a buffer that keeps its memory between the scrapes.
+*/
+#define HACK_TO_REMOVE_DUPLICATE_ERROR
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpuasynchcounter.h"
+#include "sensor_server.h"
+
+#define PCM_EXPORTER_PORT (9738)
+
+using namespace std;
+
+// adapts the integer metrics to the value type of the tables
+template <class State, class T, T func(const State &, const State &)>
+double toDouble(const State & before, const State & after)
+{
+    return double(func(before, after));
+}
+
+//! \brief A metric family with one sample per core, socket or for the system
+template <class State>
+struct MetricFamily
+{
+    const char * name;
+    const char * help;
+    double (*value)(const State & before, const State & after);
+    bool (*valid)(const State & before, const State & after); // NULL if the metric is always available
+};
+
+// the thermal sensor is not available on all processors (and never for the system)
+template <class State>
+bool thermalHeadroomValid(const State & before, const State & after)
+{
+    return getThermalHeadroom(before, after) != PCM_INVALID_THERMAL_HEADROOM;
+}
+
+static const MetricFamily<CoreCounterState> coreMetrics[] =
+{
+    { "pcm_core_ipc", "Instructions retired per core cycle", getIPC<CoreCounterState>, NULL },
+    { "pcm_core_frequency_hertz", "Average core frequency while not halted", getAverageFrequency<CoreCounterState>, NULL },
+    { "pcm_core_l2_cache_hit_ratio", "L2 cache hit ratio", getL2CacheHitRatio<CoreCounterState>, NULL },
+    { "pcm_core_l3_cache_hit_ratio", "L3 cache hit ratio", getL3CacheHitRatio<CoreCounterState>, NULL },
+    { "pcm_core_l2_cache_misses", "L2 cache misses in the sampling period", toDouble<CoreCounterState, uint64, getL2CacheMisses<CoreCounterState> >, NULL },
+    { "pcm_core_l3_cache_misses", "L3 cache misses in the sampling period", toDouble<CoreCounterState, uint64, getL3CacheMisses<CoreCounterState> >, NULL },
+    { "pcm_core_c0_residency_ratio", "Core C0-state residency", getCoreC0Residency<CoreCounterState>, NULL },
+    { "pcm_core_c3_residency_ratio", "Core C3-state residency", getCoreC3Residency<CoreCounterState>, NULL },
+    { "pcm_core_c6_residency_ratio", "Core C6-state residency", getCoreC6Residency<CoreCounterState>, NULL },
+    { "pcm_core_c7_residency_ratio", "Core C7-state residency", getCoreC7Residency<CoreCounterState>, NULL },
+    { "pcm_core_thermal_headroom_celsius", "Distance to the TjMax temperature", toDouble<CoreCounterState, int32, getThermalHeadroom<CoreCounterState> >, thermalHeadroomValid<CoreCounterState> }
+};
+
+static const MetricFamily<SocketCounterState> socketMetrics[] =
+{
+    { "pcm_socket_ipc", "Instructions retired per core cycle", getIPC<SocketCounterState>, NULL },
+    { "pcm_socket_frequency_hertz", "Average core frequency while not halted", getAverageFrequency<SocketCounterState>, NULL },
+    { "pcm_socket_l2_cache_hit_ratio", "L2 cache hit ratio", getL2CacheHitRatio<SocketCounterState>, NULL },
+    { "pcm_socket_l3_cache_hit_ratio", "L3 cache hit ratio", getL3CacheHitRatio<SocketCounterState>, NULL },
+    { "pcm_socket_l2_cache_misses", "L2 cache misses in the sampling period", toDouble<SocketCounterState, uint64, getL2CacheMisses<SocketCounterState> >, NULL },
+    { "pcm_socket_l3_cache_misses", "L3 cache misses in the sampling period", toDouble<SocketCounterState, uint64, getL3CacheMisses<SocketCounterState> >, NULL },
+    { "pcm_socket_mc_read_bytes", "Bytes read from the memory controller in the sampling period", toDouble<SocketCounterState, uint64, getBytesReadFromMC<SocketCounterState> >, NULL },
+    { "pcm_socket_mc_written_bytes", "Bytes written to the memory controller in the sampling period", toDouble<SocketCounterState, uint64, getBytesWrittenToMC<SocketCounterState> >, NULL },
+    { "pcm_socket_c0_residency_ratio", "Core C0-state residency", getCoreC0Residency<SocketCounterState>, NULL },
+    { "pcm_socket_c3_residency_ratio", "Core C3-state residency", getCoreC3Residency<SocketCounterState>, NULL },
+    { "pcm_socket_c6_residency_ratio", "Core C6-state residency", getCoreC6Residency<SocketCounterState>, NULL },
+    { "pcm_socket_c7_residency_ratio", "Core C7-state residency", getCoreC7Residency<SocketCounterState>, NULL },
+    { "pcm_socket_package_c2_residency_ratio", "Package C2-state residency", getPackageC2Residency<SocketCounterState>, NULL },
+    { "pcm_socket_package_c3_residency_ratio", "Package C3-state residency", getPackageC3Residency<SocketCounterState>, NULL },
+    { "pcm_socket_package_c6_residency_ratio", "Package C6-state residency", getPackageC6Residency<SocketCounterState>, NULL },
+    { "pcm_socket_package_c7_residency_ratio", "Package C7-state residency", getPackageC7Residency<SocketCounterState>, NULL },
+    { "pcm_socket_package_energy_joules", "Energy consumed by the package in the sampling period", getConsumedJoules<SocketCounterState>, NULL },
+    { "pcm_socket_dram_energy_joules", "Energy consumed by the DRAM in the sampling period", getDRAMConsumedJoules<SocketCounterState>, NULL },
+    { "pcm_socket_thermal_headroom_celsius", "Distance to the TjMax temperature", toDouble<SocketCounterState, int32, getThermalHeadroom<SocketCounterState> >, thermalHeadroomValid<SocketCounterState> }
+};
+
+static const MetricFamily<SystemCounterState> systemMetrics[] =
+{
+    { "pcm_system_ipc", "Instructions retired per core cycle", getIPC<SystemCounterState>, NULL },
+    { "pcm_system_frequency_hertz", "Average core frequency while not halted", getAverageFrequency<SystemCounterState>, NULL },
+    { "pcm_system_l2_cache_hit_ratio", "L2 cache hit ratio", getL2CacheHitRatio<SystemCounterState>, NULL },
+    { "pcm_system_l3_cache_hit_ratio", "L3 cache hit ratio", getL3CacheHitRatio<SystemCounterState>, NULL },
+    { "pcm_system_l2_cache_misses", "L2 cache misses in the sampling period", toDouble<SystemCounterState, uint64, getL2CacheMisses<SystemCounterState> >, NULL },
+    { "pcm_system_l3_cache_misses", "L3 cache misses in the sampling period", toDouble<SystemCounterState, uint64, getL3CacheMisses<SystemCounterState> >, NULL },
+    { "pcm_system_qpi_incoming_bytes", "Bytes received on all QPI links in the sampling period", toDouble<SystemCounterState, uint64, getAllIncomingQPILinkBytes>, NULL },
+    { "pcm_system_package_energy_joules", "Energy consumed by the packages in the sampling period", getConsumedJoules<SystemCounterState>, NULL },
+    { "pcm_system_dram_energy_joules", "Energy consumed by the DRAM in the sampling period", getDRAMConsumedJoules<SystemCounterState>, NULL }
+};
+
+// named pcm_<level>_<suffix> per selected PCM::AggregationLevel
+static const MetricFamily<CoreGroupCounterState> groupMetrics[] =
+{
+    { "ipc", "Instructions retired per core cycle", getIPC<CoreGroupCounterState>, NULL },
+    { "frequency_hertz", "Average core frequency while not halted", getAverageFrequency<CoreGroupCounterState>, NULL },
+    { "l2_cache_misses", "L2 cache misses in the sampling period", toDouble<CoreGroupCounterState, uint64, getL2CacheMisses<CoreGroupCounterState> >, NULL },
+    { "l3_cache_misses", "L3 cache misses in the sampling period", toDouble<CoreGroupCounterState, uint64, getL3CacheMisses<CoreGroupCounterState> >, NULL },
+    { "c0_residency_ratio", "Core C0-state residency", getCoreC0Residency<CoreGroupCounterState>, NULL }
+};
+
+#define PCM_EXPORTER_QPI_METRIC "pcm_qpi_incoming_bytes"
+
+// appends a value in the OpenMetrics number format, without going through printf for the common cases
+static void appendValue(string & out, double value)
+{
+    if (value != value)
+    {
+        out += "NaN";
+        return;
+    }
+    if (value < 0)
+    {
+        out += '-';
+        value = -value;
+    }
+    else if (value > 1.7976931348623157e308)
+        out += '+';
+    if (value > 1e18)
+    {
+        if (value > 1.7976931348623157e308)
+            out += "Inf";
+        else
+        {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.17g", value);
+            out += buffer;
+        }
+        return;
+    }
+    uint64 integer = uint64(value);
+    uint64 fraction = uint64((value - double(integer)) * 1e6 + 0.5); // 6 decimals
+    if (fraction >= 1000000)
+    {
+        ++integer;
+        fraction = 0;
+    }
+    char digits[32];
+    int n = 0;
+    do {
+        digits[n++] = char('0' + integer % 10);
+        integer /= 10;
+    } while (integer);
+    while (n) out += digits[--n];
+    if (fraction)
+    {
+        int width = 6;
+        while (fraction % 10 == 0)
+        {
+            fraction /= 10;
+            --width;
+        }
+        out += '.';
+        for (int d = width - 1; d >= 0; --d)
+        {
+            digits[d] = char('0' + fraction % 10);
+            fraction /= 10;
+        }
+        out.append(digits, width);
+    }
+}
+
+//! \brief Renders the states of the last period in the OpenMetrics text format
+class OpenMetricsRenderer
+{
+    AsynchronCounterState & counters;
+    vector<string> coreLabels, socketLabels, qpiLabels; // "{...} " per core, socket and QPI link
+    vector<uint32> qpiSocket, qpiLink;
+    vector<string> groupNames[PCM_AGGREGATION_LEVELS];    // of the groupMetrics families
+    vector<string> groupLabels[PCM_AGGREGATION_LEVELS];   // "{...} " per group
+    CounterSnapshot before, after;
+    string body;
+
+    template <class State>
+    static void appendHeader(string & out, const MetricFamily<State> & family)
+    {
+        out += "# TYPE ";
+        out += family.name;
+        out += " gauge\n# HELP ";
+        out += family.name;
+        out += ' ';
+        out += family.help;
+        out += '\n';
+    }
+
+    // the core series are left out for the periods in which the core was (partly) offline
+    template <class State>
+    static bool sampleValid(const State &, const State &) { return true; }
+    static bool sampleValid(const CoreCounterState & b, const CoreCounterState & a) { return isCoreSampleValid(b, a); }
+
+    template <class State>
+    void appendFamily(const MetricFamily<State> & family, const vector<State> & b, const vector<State> & a, const vector<string> & labels)
+    {
+        appendHeader(body, family);
+        for (size_t i = 0; i < labels.size(); ++i)
+        {
+            if (!sampleValid(b[i], a[i]) || (family.valid && !family.valid(b[i], a[i]))) continue;
+            body += family.name;
+            body += labels[i];
+            appendValue(body, family.value(b[i], a[i]));
+            body += '\n';
+        }
+    }
+
+public:
+    OpenMetricsRenderer(AsynchronCounterState & counters_) : counters(counters_)
+    {
+        for (uint32 i = 0; i < counters.getNumCores(); ++i)
+        {
+            ostringstream l;
+            l << "{socket=\"" << counters.getSocketId(i) << "\",core=\"" << i << "\"} ";
+            coreLabels.push_back(l.str());
+        }
+        for (uint32 s = 0; s < counters.getNumSockets(); ++s)
+        {
+            ostringstream l;
+            l << "{socket=\"" << s << "\"} ";
+            socketLabels.push_back(l.str());
+            for (uint32 q = 0; q < counters.getQPILinksPerSocket(); ++q)
+            {
+                ostringstream ql;
+                ql << "{socket=\"" << s << "\",link=\"" << q << "\"} ";
+                qpiLabels.push_back(ql.str());
+                qpiSocket.push_back(s);
+                qpiLink.push_back(q);
+            }
+        }
+        PCM * m = PCM::getInstance();
+        for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+        {
+            if ((m->getAggregationLevels() & (1U << l)) == 0) continue;
+            const PCM::AggregationLevel level = (PCM::AggregationLevel)l;
+            for (size_t f = 0; f < sizeof(groupMetrics) / sizeof(groupMetrics[0]); ++f)
+                groupNames[l].push_back(string("pcm_") + PCM::getAggregationLevelName(level) + '_' + groupMetrics[f].name);
+            for (uint32 g = 0; g < m->getNumGroups(level); ++g)
+            {
+                const int32 id = m->getGroupTopologyId(level, g);
+                ostringstream gl;
+                if (level == PCM::PHYSICAL_CORE_LEVEL)
+                    gl << "{socket=\"" << m->getGroupSocket(level, g) << "\",core=\"" << id << "\"} ";
+                else if (level == PCM::L3_DOMAIN_LEVEL)
+                    gl << "{socket=\"" << m->getGroupSocket(level, g) << "\",l3=\"" << id << "\"} ";
+                else if (id >= 0)
+                    gl << "{node=\"" << id << "\"} ";
+                else
+                    gl << "{socket=\"" << m->getGroupSocket(level, g) << "\"} "; // no NUMA information: one group per socket
+                groupLabels[l].push_back(gl.str());
+            }
+        }
+    }
+
+    const string & render()
+    {
+        counters.getStates(before, after);
+        body.clear(); // keeps the capacity of the previous scrape
+
+        for (size_t f = 0; f < sizeof(coreMetrics) / sizeof(coreMetrics[0]); ++f)
+            appendFamily(coreMetrics[f], before.cores, after.cores, coreLabels);
+        for (size_t f = 0; f < sizeof(socketMetrics) / sizeof(socketMetrics[0]); ++f)
+            appendFamily(socketMetrics[f], before.sockets, after.sockets, socketLabels);
+        for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+        {
+            if (groupLabels[l].empty() || before.groups[l].size() != groupLabels[l].size() || after.groups[l].size() != groupLabels[l].size()) continue;
+            for (size_t f = 0; f < groupNames[l].size(); ++f)
+            {
+                MetricFamily<CoreGroupCounterState> family = groupMetrics[f];
+                family.name = groupNames[l][f].c_str();
+                appendFamily(family, before.groups[l], after.groups[l], groupLabels[l]);
+            }
+        }
+        for (size_t f = 0; f < sizeof(systemMetrics) / sizeof(systemMetrics[0]); ++f)
+        {
+            appendHeader(body, systemMetrics[f]);
+            body += systemMetrics[f].name;
+            body += ' ';
+            appendValue(body, systemMetrics[f].value(before.system, after.system));
+            body += '\n';
+        }
+        if (!qpiLabels.empty())
+        {
+            body += "# TYPE " PCM_EXPORTER_QPI_METRIC " gauge\n# HELP " PCM_EXPORTER_QPI_METRIC " Bytes received on a QPI link in the sampling period\n";
+            for (size_t i = 0; i < qpiLabels.size(); ++i)
+            {
+                body += PCM_EXPORTER_QPI_METRIC;
+                body += qpiLabels[i];
+                appendValue(body, double(getIncomingQPILinkBytes(qpiSocket[i], qpiLink[i], before.system, after.system)));
+                body += '\n';
+            }
+        }
+        body += "# EOF\n";
+        return body;
+    }
+};
+
+// HTTP/1.x: the session holds the request line, the reply is sent after the empty line that ends the headers
+bool serve_line(const string & line, string & session, string & reply, void * context)
+{
+    if (session.empty())
+    {
+        session = line.empty() ? " " : line;
+        return true;
+    }
+    if (!line.empty()) return true; // a header
+
+    ostringstream header;
+    if (session.compare(0, 13, "GET /metrics ") == 0 || session.compare(0, 13, "GET /metrics?") == 0)
+    {
+        const string & body = ((OpenMetricsRenderer *)context)->render();
+        header << "HTTP/1.1 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n";
+        header << "Content-Length: " << body.size() << "\r\nConnection: close\r\n\r\n";
+        reply += header.str();
+        reply += body;
+    }
+    else
+    {
+        const char * body = "Not found, the metrics are at /metrics\n";
+        header << "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n";
+        header << "Content-Length: " << strlen(body) << "\r\nConnection: close\r\n\r\n";
+        reply += header.str();
+        reply += body;
+    }
+    return false;
+}
+
+void print_help(const char * prog_name)
+{
+    cout << endl;
+    cout << " Usage: " << prog_name << " [--port=<port>] [--period=<seconds>] [--aggregate=<levels>]" << endl;
+    cout << endl;
+    cout << " Serves the core, socket and system metrics of the last sampling period at http://127.0.0.1:<port>/metrics" << endl;
+    cout << " in the OpenMetrics text format" << endl;
+    cout << " --port=<port>      => TCP port on the loopback interface (default " << PCM_EXPORTER_PORT << ")" << endl;
+    cout << " --period=<seconds> => sampling period (default " << DELAY << ")" << endl;
+    cout << " --aggregate=<levels> => also serve the cores summed up per group, <levels> is a comma separated list of" << endl;
+    cout << "                         physical_core, l3_domain, numa_node (pcm_<level>_* metrics)" << endl;
+    cout << endl;
+}
+
+int main(int argc, char * argv[])
+{
+    int port = PCM_EXPORTER_PORT;
+    double period = DELAY;
+    uint32 aggregation = 0; // PCM::AggregationLevel bits
+    for (int l = 1; l < argc; ++l)
+    {
+        if (strncmp(argv[l], "--port=", 7) == 0)
+            port = atoi(argv[l] + 7);
+        else if (strncmp(argv[l], "--period=", 9) == 0)
+            period = atof(argv[l] + 9);
+        else if (strncmp(argv[l], "--aggregate=", 12) == 0)
+        {
+            if (!PCM::parseAggregationLevels(argv[l] + 12, aggregation))
+            {
+                print_help(argv[0]);
+                return -1;
+            }
+        }
+        else
+        {
+            print_help(argv[0]);
+            return strcmp(argv[l], "--help") == 0 ? 0 : -1;
+        }
+    }
+    if (port <= 0 || port > 65535 || period <= 0)
+    {
+        print_help(argv[0]);
+        return -1;
+    }
+
+    PCM::getInstance()->setAggregationLevels(aggregation); // before the snapshots are allocated
+    AsynchronCounterState counters(period);
+    OpenMetricsRenderer renderer(counters);
+    try
+    {
+        SensorServer server(port, string(), serve_line, &renderer);
+        cerr << "Serving the metrics at http://127.0.0.1:" << port << "/metrics" << endl;
+        server.run();
+    }
+    catch (...)
+    {
+        return -1;
+    }
+    return -1;
+}
@@ -47,6 +47,7 @@ void print_help(char * prog_name)
 #endif
     cout << " Example: " << prog_name << " \"sleep 1\"" << endl;
     cout << " Example: " << prog_name << " 1" << endl;
+    cout << " Example: " << prog_name << " 0.01   (delay in seconds, sub-second delays are supported)" << endl;
     cout << endl;
 }
 
@@ -131,7 +132,7 @@ void display_bandwidth(float *iMC_Rd_socket_chan, float *iMC_Wr_socket_chan, flo
 
 const uint32 max_sockets = 4;
 
-void calculate_bandwidth(PCM *m, const JKTUncorePowerState uncState1[], const JKTUncorePowerState uncState2[], uint64 elapsedTime)
+void calculate_bandwidth(PCM *m, const JKTUncorePowerState uncState1[], const JKTUncorePowerState uncState2[], double elapsedTime)
 {
     const uint32 num_imc_channels = 4;
     float iMC_Rd_socket_chan[max_sockets][num_imc_channels];
@@ -200,7 +201,7 @@ int main(int argc, char * argv[])
     signal(SIGTERM, cleanup);
 #endif
 
-    int delay = 1;
+    double delay = 1;
     char * sysCmd = NULL;
 
     if (argc >= 2)
@@ -234,7 +235,7 @@ int main(int argc, char * argv[])
         }
 #endif
 
-        delay = atoi(argv[1]);
+        delay = atof(argv[1]);
         if (delay <= 0)
         {
             sysCmd = argv[1];
@@ -300,34 +301,30 @@ int main(int argc, char * argv[])
 
     cout << "Update every "<<delay<<" seconds"<< endl;
 
-    BeforeTime = m->getTickCount();
+    // the samples are taken on absolute deadlines, the console output does not delay the next sample
+    SamplingScheduler scheduler(delay);
+
+    BeforeTime = m->getTickCount(1000000ULL);
     for(uint32 i=0; i<m->getNumSockets(); ++i)
         BeforeState[i] = m->getJKTUncorePowerState(i); 
+    scheduler.start();
 
     while(1)
     {
-#ifdef _MSC_VER
-        int delay_ms = delay * 1000;
-        // compensate slow Windows console output
-        if(AfterTime) delay_ms -= (int)(m->getTickCount() - BeforeTime);
-        if(delay_ms < 0) delay_ms = 0;
-#else
-        int delay_ms = delay * 1000;
-#endif
-
         if(sysCmd)
             MySystem(sysCmd);
         else
-            MySleepMs(delay_ms);
+            scheduler.wait();
 
-        AfterTime = m->getTickCount();
+        AfterTime = m->getTickCount(1000000ULL);
         for(uint32 i=0; i<m->getNumSockets(); ++i)
             AfterState[i] = m->getJKTUncorePowerState(i);
 
-        cout << "Time elapsed: "<<dec<<fixed<<AfterTime-BeforeTime<<" ms\n";
-        cout << "Called sleep function for "<<dec<<fixed<<delay_ms<<" ms\n";
+        const double elapsed_ms = double(AfterTime-BeforeTime) / 1000.;
+        cout << "Time elapsed: "<<dec<<fixed<<setprecision(3)<<elapsed_ms<<" ms\n";
+        if(!sysCmd) scheduler.report(cout);
 
-        calculate_bandwidth(m,BeforeState,AfterState,AfterTime-BeforeTime);
+        calculate_bandwidth(m,BeforeState,AfterState,elapsed_ms);
 
         swap(BeforeTime, AfterTime);
         swap(BeforeState, AfterState);
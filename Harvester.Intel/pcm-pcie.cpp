@@ -59,7 +59,7 @@ uint32 num_events = (sizeof(PCIeEvents_t)/sizeof(uint64));
 using namespace std;
 
 const uint32 max_sockets = 4;
-void getPCIeEvents(PCM *m, PCM::PCIeEventCode opcode, uint32 delay_ms, PCIeEvents_t *sample);
+void getPCIeEvents(PCM *m, PCM::PCIeEventCode opcode, SamplingScheduler & scheduler, PCIeEvents_t *sample);
 
 void print_events()
 {
@@ -78,7 +78,7 @@ void print_events()
 void print_usage(const char * progname)
 {
     cout << "\nUsage "<<progname<<" (delay in seconds) [-C] [-B]\n\n";
-    cout << "  <delay>        - delay in seconds between updates\n";
+    cout << "  <delay>        - delay in seconds between updates (e.g. 0.5)\n";
     cout << "  -C             - output in csv format (optional)\n";
     cout << "  -B             - Estimate PCIe B/W (B/s) by multiplying the number of transfers by the cache line size (64 bytes). Overestimates the bandwidth under traffic with many partial cache line transfers.\n\n";
     print_events();
@@ -116,7 +116,7 @@ int main(int argc, char * argv[])
     signal(SIGTERM, cleanup);
 #endif
 
-    uint32 delay = -1;
+    double delay = -1;
     bool csv = false;
     bool print_bandwidth = false;
 
@@ -145,8 +145,8 @@ int main(int argc, char * argv[])
          return -1;
      }
 
-     delay = atoi(argv[optind]);
-     delay = (delay<0)?1:delay;
+     delay = atof(argv[optind]);
+     delay = (delay<=0)?1:delay;
 
 #ifdef _MSC_VER
     // WARNING: This driver code (msr.sys) is only for testing purposes, not for production use
@@ -206,10 +206,10 @@ int main(int argc, char * argv[])
 #define NUM_SAMPLES (1)
 
     uint32 i;
-    uint32 delay_ms = delay * 1000 / num_events / NUM_SAMPLES;
-    delay_ms * num_events * NUM_SAMPLES < delay * 1000 ? delay_ms += 1 : delay_ms = delay_ms; //Adjust the sleep if it's less than delay time
+    // each event is counted for an equal share of the delay, on absolute deadlines
+    SamplingScheduler scheduler(delay / num_events / NUM_SAMPLES);
     PCIeEvents_t sample[max_sockets];
-    printf("delay_ms:%u\n",delay_ms);
+    printf("delay_ms:%.3f\n",double(scheduler.getPeriodNs())/1e6);
     
     while(1)
     {
@@ -218,14 +218,15 @@ int main(int argc, char * argv[])
 
         for(i=0;i<NUM_SAMPLES;i++)
         {
-            getPCIeEvents(m, m->PCIePRd, delay_ms, sample);
-            getPCIeEvents(m, m->PCIeRdCur, delay_ms, sample);
-            getPCIeEvents(m, m->PCIeNSRd, delay_ms, sample);
-            getPCIeEvents(m, m->PCIeWiLF, delay_ms, sample);
-            getPCIeEvents(m, m->PCIeItoM, delay_ms, sample);
-            getPCIeEvents(m, m->PCIeNSWr, delay_ms, sample);
-            getPCIeEvents(m, m->PCIeNSWrF, delay_ms, sample);
+            getPCIeEvents(m, m->PCIePRd, scheduler, sample);
+            getPCIeEvents(m, m->PCIeRdCur, scheduler, sample);
+            getPCIeEvents(m, m->PCIeNSRd, scheduler, sample);
+            getPCIeEvents(m, m->PCIeWiLF, scheduler, sample);
+            getPCIeEvents(m, m->PCIeItoM, scheduler, sample);
+            getPCIeEvents(m, m->PCIeNSWr, scheduler, sample);
+            getPCIeEvents(m, m->PCIeNSWrF, scheduler, sample);
         }
+        if(!csv) scheduler.report(cout);
         
         if(csv)
             if(print_bandwidth)
@@ -304,7 +305,7 @@ int main(int argc, char * argv[])
     return 0;
 }
 
-void getPCIeEvents(PCM *m, PCM::PCIeEventCode opcode, uint32 delay_ms, PCIeEvents_t *sample)
+void getPCIeEvents(PCM *m, PCM::PCIeEventCode opcode, SamplingScheduler & scheduler, PCIeEvents_t *sample)
 {
     PCIeCounterState * before = new PCIeCounterState[m->getNumSockets()];
     PCIeCounterState * after = new PCIeCounterState[m->getNumSockets()];
@@ -313,7 +314,7 @@ void getPCIeEvents(PCM *m, PCM::PCIeEventCode opcode, uint32 delay_ms, PCIeEvent
     m->programPCIeCounters(opcode);
     for(i=0; i<m->getNumSockets(); ++i)
         before[i] = m->getPCIeCounterState(i);
-    MySleepUs(delay_ms*1000);
+    scheduler.wait();
     for(i=0; i<m->getNumSockets(); ++i)
         after[i] = m->getPCIeCounterState(i);
 
@@ -83,7 +83,7 @@ int freq_band[3];
 void print_usage(const char * progname)
 {
 	  std::cout << "\nUsage "<<progname<<" (delay | \"external_program\") [-m imc_profile] [-p pcu_profile] [-a freq_band0] [-b freq_band1] [-c freq_band2]\n\n";
-      std::cout << "  <delay>            - delay in seconds between updates. Either delay or \"external program\" parameters must be supplied\n";
+      std::cout << "  <delay>            - delay in seconds between updates (e.g. 0.5). Either delay or \"external program\" parameters must be supplied\n";
 	  std::cout << "  \"external_program\" - start external program and print the performance metrics for the execution at the end\n";
       std::cout << "  <imc_profile>      - profile (counter group) for IMC PMU. Possible values are: 0,1,2,3,4,-1 \n";
 	  std::cout << "                       profile  0 - rank 0 and rank 1 residencies (default) \n";
@@ -115,7 +115,7 @@ int main(int argc, char * argv[])
     
     int imc_profile = 0;
     int pcu_profile = 0;
-    int delay = -1;
+    double delay = -1;
 	char * ext_program = NULL;
 
 	freq_band[0] = default_freq_band[0];
@@ -155,7 +155,7 @@ int main(int argc, char * argv[])
 		 return -1;
 	 }
 
-    delay = atoi(argv[optind]);
+    delay = atof(argv[optind]);
 	if(delay == 0) 
 		ext_program = argv[optind];
 	else
@@ -214,34 +214,29 @@ int main(int argc, char * argv[])
 
     uint32 i = 0;
 
-	BeforeTime = m->getTickCount();
+	// the samples are taken on absolute deadlines, the console output does not delay the next sample
+	SamplingScheduler scheduler(delay);
+
+	BeforeTime = m->getTickCount(1000000ULL);
     for(i=0; i<m->getNumSockets(); ++i)
       BeforeState[i] = m->getJKTUncorePowerState(i); 
+	scheduler.start();
  
     while(1)
     {
       std::cout << "----------------------------------------------------------------------------------------------"<<std::endl;
-      
-	  #ifdef _MSC_VER
-	  int delay_ms = delay * 1000;
-	  // compensate slow Windows console output
-	  if(AfterTime) delay_ms -= (int)(m->getTickCount() - BeforeTime);
-	  if(delay_ms < 0) delay_ms = 0;
-      #else
-	  int delay_ms = delay * 1000;
-      #endif
 
 	  if(ext_program)
 		MySystem(ext_program);
 	  else
-		MySleepMs(delay_ms);
+		scheduler.wait();
 
-	  AfterTime = m->getTickCount();
+	  AfterTime = m->getTickCount(1000000ULL);
       for(i=0; i<m->getNumSockets(); ++i)
         AfterState[i] = m->getJKTUncorePowerState(i);
      
-	  std::cout << "Time elapsed: "<<AfterTime-BeforeTime<<" ms\n";
-	  std::cout << "Called sleep function for "<<delay_ms<<" ms\n";
+	  std::cout << "Time elapsed: "<<double(AfterTime-BeforeTime)/1000.<<" ms\n";
+	  if(!ext_program) scheduler.report(std::cout);
       for(uint32 socket=0;socket<m->getNumSockets();++socket)
       {
 	for(uint32 port=0;port<2;++port)
@@ -343,13 +338,13 @@ int main(int argc, char * argv[])
         std::cout << "S"<<socket
               << "; Consumed energy units: "<< getConsumedEnergy(BeforeState[socket],AfterState[socket])
               << "; Consumed Joules: "<< getConsumedJoules(BeforeState[socket],AfterState[socket])
-			  << "; Watts: "<< 1000.*getConsumedJoules(BeforeState[socket],AfterState[socket])/double(AfterTime-BeforeTime)
+			  << "; Watts: "<< 1000000.*getConsumedJoules(BeforeState[socket],AfterState[socket])/double(AfterTime-BeforeTime)
               << "; Thermal headroom below TjMax: " << AfterState[socket].getPackageThermalHeadroom()
               << "\n";
         std::cout << "S"<<socket
               << "; Consumed DRAM energy units: "<< getDRAMConsumedEnergy(BeforeState[socket],AfterState[socket])
               << "; Consumed DRAM Joules: "<< getDRAMConsumedJoules(BeforeState[socket],AfterState[socket])
-                          << "; DRAM Watts: "<< 1000.*getDRAMConsumedJoules(BeforeState[socket],AfterState[socket])/double(AfterTime-BeforeTime)
+                          << "; DRAM Watts: "<< 1000000.*getDRAMConsumedJoules(BeforeState[socket],AfterState[socket])/double(AfterTime-BeforeTime)
               << "\n";
 
 
@@ -26,85 +26,212 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <string.h>
+#include <stdlib.h>
 #include "cpuasynchcounter.h"
+#include "counter_history.h"
+#include "counter_arrays.h"
+#include "sensor_server.h"
+
+#define HISTORY (15 * 60) // seconds of counter history kept for the History/ sensors and the history command
 
 using namespace std;
 
-int main()
+// history averages are reported over these periods (in minutes)
+static const uint32 historyPeriods[] = { 1, 5, 15 };
+
+// adds the system wide totals of a history sample
+void sum_history_sample(const CounterHistorySample & sample, uint64 & instructions, uint64 & cycles, uint64 & mcBytes)
 {
-    AsynchronCounterState counters;
+    const uint32 numCores = uint32(sample.cores.size() / sample.getCoreColumns());
+    const uint32 numSockets = uint32(sample.sockets.size() / CounterHistorySample::SOCKET_COLUMNS);
+    for (uint32 c = 0; c < numCores; ++c)
+    {
+        instructions += sample.getCore(c, CounterHistorySample::INSTRUCTIONS);
+        cycles += sample.getCore(c, CounterHistorySample::CYCLES);
+    }
+    for (uint32 so = 0; so < numSockets; ++so)
+        mcBytes += sample.getSocket(so, CounterHistorySample::MC_READ_BYTES) + sample.getSocket(so, CounterHistorySample::MC_WRITTEN_BYTES);
+}
 
-    cout << "CPU counter sensor "<< INTEL_PCM_VERSION << endl;
-    cout << "(C) 2010,2012 Intel Corp." << endl;
-    cout << "ksysguardd 1.2.0" << endl;
-    cout << "ksysguardd> ";
+// system wide totals of the last seconds of the counter history, false if there is no history
+bool get_history_totals(double seconds, uint64 & instructions, uint64 & cycles, uint64 & mcBytes, double & duration)
+{
+    PCM * m = PCM::getInstance();
+    CounterHistory * history = m->getCounterHistory();
+    if (!history) return false;
+
+    static vector<CounterHistorySample> samples; // reused between the calls
+    const TSCCalibration & calibration = history->getCalibration();
+    const uint64 now = m->getTSC();
+    const uint64 span = uint64(seconds * double(calibration.frequency));
+    // a single bucket: one sample per programming generation
+    history->query(now > span ? now - span : 0, now, span ? span : 1, samples);
+
+    instructions = cycles = mcBytes = 0;
+    uint64 ticks = 0;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const CounterHistorySample & sample = samples[i];
+        sum_history_sample(sample, instructions, cycles, mcBytes);
+        ticks += sample.end - sample.start;
+    }
+    duration = double(ticks) / double(calibration.frequency);
+    return ticks != 0;
+}
 
-    while (1)
+// prints the system wide totals of the last seconds, summed up into buckets of the given length
+void print_history(double seconds, double bucketSeconds, ostream & out)
+{
+    PCM * m = PCM::getInstance();
+    CounterHistory * history = m->getCounterHistory();
+    if (!history) return;
+
+    vector<CounterHistorySample> samples;
+    const TSCCalibration & calibration = history->getCalibration();
+    const uint64 now = m->getTSC();
+    const uint64 span = uint64(seconds * double(calibration.frequency));
+    history->query(now > span ? now - span : 0, now, uint64(bucketSeconds * double(calibration.frequency)), samples);
+
+    out << "START_NS;END_NS;SAMPLES;INSTRUCTIONS;CYCLES;MC_BYTES" << endl;
+    for (size_t i = 0; i < samples.size(); ++i)
     {
-        string s;
-        cin >> s;
+        const CounterHistorySample & sample = samples[i];
+        uint64 instructions = 0, cycles = 0, mcBytes = 0;
+        sum_history_sample(sample, instructions, cycles, mcBytes);
+        out << calibration.toMonotonicRaw(sample.start) << ';' << calibration.toMonotonicRaw(sample.end) << ';' << sample.samples << ';'
+             << instructions << ';' << cycles << ';' << mcBytes << endl;
+    }
+}
+
+// Per-core metrics of the last period, computed for all cores in one pass (see counter_arrays.h)
+// whenever a new period was published. The C-state residencies and the temperature are not covered
+// by the kernels and are still read with the per-core getters.
+class CoreMetricCache
+{
+    uint64 epoch;
+    bool valid;
+    bool atom;
+    CounterSnapshot before, after;
+    CoreCounterArrays b, a, delta;
+    CoreMetricArrays metrics;
+
+public:
+    CoreMetricCache() : epoch(0), valid(false), atom(PCM::getInstance()->getCPUModel() == PCM::ATOM) { }
+
+    void update(AsynchronCounterState & counters)
+    {
+        const uint64 current = counters.getEpoch();
+        if (valid && current == epoch) return;
+        counters.getStates(before, after);
+        b.load(before.cores);
+        a.load(after.cores);
+        delta.computeDelta(b, a);
+        metrics.compute(delta, atom);
+        epoch = current;
+        valid = true;
+    }
 
+    double get(CoreMetricArrays::Metric m, uint32 core) const { return metrics[m][core]; }
+
+    // getAverageFrequency
+    double getFrequency(uint32 core) const
+    {
+        const uint64 tsc = delta[CoreCounterArrays::INVARIANT_TSC][core];
+        if (tsc == 0) return -1;
+        return double(PCM::getInstance()->getNominalFrequency()) * double(delta[CoreCounterArrays::CPU_CLK_UNHALTED_THREAD][core]) / double(tsc);
+    }
+    // getL2CacheMisses
+    uint64 getL2CacheMisses(uint32 core) const
+    {
+        if (atom) return delta[CoreCounterArrays::EVENT0][core];
+        return delta[CoreCounterArrays::EVENT0][core] + delta[CoreCounterArrays::EVENT1][core] + delta[CoreCounterArrays::EVENT2][core];
+    }
+    // getL3CacheMisses
+    uint64 getL3CacheMisses(uint32 core) const
+    {
+        return atom ? 0 : delta[CoreCounterArrays::EVENT0][core];
+    }
+};
+
+// answers one ksysguardd command, the arguments of a command are read from args
+// returns false if the client asked to quit
+bool process_command(AsynchronCounterState & counters, const string & s, istream & args, ostream & out)
+{
         // list counters
         if (s == "monitors") {
             for (uint32 i = 0; i < counters.getNumCores(); ++i) {
                 for (uint32 a = 0; a < counters.getNumSockets(); ++a)
                     if (a == counters.getSocketId(i)) {
-                        cout << "Socket" << a << "/CPU" << i << "/Frequency\tfloat" << endl;
-                        cout << "Socket" << a << "/CPU" << i << "/IPC\tfloat" << endl;
-                        cout << "Socket" << a << "/CPU" << i << "/L2CacheHitRatio\tfloat" << endl;
-                        cout << "Socket" << a << "/CPU" << i << "/L3CacheHitRatio\tfloat" << endl;
-                        cout << "Socket" << a << "/CPU" << i << "/L2CacheMisses\tinteger" << endl;
-                        cout << "Socket" << a << "/CPU" << i << "/L3CacheMisses\tinteger" << endl;
-			cout << "Socket" << a << "/CPU" << i << "/CoreC0StateResidency\tfloat" << endl;
-			cout << "Socket" << a << "/CPU" << i << "/CoreC3StateResidency\tfloat" << endl;
-			cout << "Socket" << a << "/CPU" << i << "/CoreC6StateResidency\tfloat" << endl;
-			cout << "Socket" << a << "/CPU" << i << "/CoreC7StateResidency\tfloat" << endl;
-			cout << "Socket" << a << "/CPU" << i << "/ThermalHeadroom\tinteger" << endl;
+                        out << "Socket" << a << "/CPU" << i << "/Frequency\tfloat" << endl;
+                        out << "Socket" << a << "/CPU" << i << "/IPC\tfloat" << endl;
+                        out << "Socket" << a << "/CPU" << i << "/L2CacheHitRatio\tfloat" << endl;
+                        out << "Socket" << a << "/CPU" << i << "/L3CacheHitRatio\tfloat" << endl;
+                        out << "Socket" << a << "/CPU" << i << "/L2CacheMisses\tinteger" << endl;
+                        out << "Socket" << a << "/CPU" << i << "/L3CacheMisses\tinteger" << endl;
+			out << "Socket" << a << "/CPU" << i << "/CoreC0StateResidency\tfloat" << endl;
+			out << "Socket" << a << "/CPU" << i << "/CoreC3StateResidency\tfloat" << endl;
+			out << "Socket" << a << "/CPU" << i << "/CoreC6StateResidency\tfloat" << endl;
+			out << "Socket" << a << "/CPU" << i << "/CoreC7StateResidency\tfloat" << endl;
+			out << "Socket" << a << "/CPU" << i << "/ThermalHeadroom\tinteger" << endl;
                     }
             }
             for (uint32 a = 0; a < counters.getNumSockets(); ++a) {
-                cout << "Socket" << a << "/BytesReadFromMC\tfloat" << endl;
-                cout << "Socket" << a << "/BytesWrittenToMC\tfloat" << endl;
-                cout << "Socket" << a << "/Frequency\tfloat" << endl;
-                cout << "Socket" << a << "/IPC\tfloat" << endl;
-                cout << "Socket" << a << "/L2CacheHitRatio\tfloat" << endl;
-                cout << "Socket" << a << "/L3CacheHitRatio\tfloat" << endl;
-                cout << "Socket" << a << "/L2CacheMisses\tinteger" << endl;
-                cout << "Socket" << a << "/L3CacheMisses\tinteger" << endl;
-		cout << "Socket" << a << "/CoreC0StateResidency\tfloat" << endl;
-		cout << "Socket" << a << "/CoreC3StateResidency\tfloat" << endl;
-		cout << "Socket" << a << "/CoreC6StateResidency\tfloat" << endl;
-		cout << "Socket" << a << "/CoreC7StateResidency\tfloat" << endl;
-		cout << "Socket" << a << "/PackageC2StateResidency\tfloat" << endl;		
-		cout << "Socket" << a << "/PackageC3StateResidency\tfloat" << endl;		
-		cout << "Socket" << a << "/PackageC6StateResidency\tfloat" << endl;		
-		cout << "Socket" << a << "/PackageC7StateResidency\tfloat" << endl;		
-		cout << "Socket" << a << "/ThermalHeadroom\tinteger" << endl;
-		cout << "Socket" << a << "/CPUEnergy\tfloat" << endl;
-		cout << "Socket" << a << "/DRAMEnergy\tfloat" << endl;
+                out << "Socket" << a << "/BytesReadFromMC\tfloat" << endl;
+                out << "Socket" << a << "/BytesWrittenToMC\tfloat" << endl;
+                out << "Socket" << a << "/Frequency\tfloat" << endl;
+                out << "Socket" << a << "/IPC\tfloat" << endl;
+                out << "Socket" << a << "/L2CacheHitRatio\tfloat" << endl;
+                out << "Socket" << a << "/L3CacheHitRatio\tfloat" << endl;
+                out << "Socket" << a << "/L2CacheMisses\tinteger" << endl;
+                out << "Socket" << a << "/L3CacheMisses\tinteger" << endl;
+		out << "Socket" << a << "/CoreC0StateResidency\tfloat" << endl;
+		out << "Socket" << a << "/CoreC3StateResidency\tfloat" << endl;
+		out << "Socket" << a << "/CoreC6StateResidency\tfloat" << endl;
+		out << "Socket" << a << "/CoreC7StateResidency\tfloat" << endl;
+		out << "Socket" << a << "/PackageC2StateResidency\tfloat" << endl;		
+		out << "Socket" << a << "/PackageC3StateResidency\tfloat" << endl;		
+		out << "Socket" << a << "/PackageC6StateResidency\tfloat" << endl;		
+		out << "Socket" << a << "/PackageC7StateResidency\tfloat" << endl;		
+		out << "Socket" << a << "/ThermalHeadroom\tinteger" << endl;
+		out << "Socket" << a << "/CPUEnergy\tfloat" << endl;
+		out << "Socket" << a << "/DRAMEnergy\tfloat" << endl;
             }
             for (uint32 a = 0; a < counters.getNumSockets(); ++a) {
                 for (uint32 l = 0; l < counters.getQPILinksPerSocket(); ++l)
-                    cout << "Socket" << a << "/BytesIncomingToQPI" << l << "\tfloat" << endl;
-            }
-
-            cout << "QPI_Traffic\tfloat" << endl;
-            cout << "Frequency\tfloat" << endl;
-            cout << "IPC\tfloat" << endl;       //double check output
-            cout << "L2CacheHitRatio\tfloat" << endl;
-            cout << "L3CacheHitRatio\tfloat" << endl;
-            cout << "L2CacheMisses\tinteger" << endl;
-            cout << "L3CacheMisses\tinteger" << endl;
-	    cout << "CoreC0StateResidency\tfloat" << endl;
-            cout << "CoreC3StateResidency\tfloat" << endl;
-            cout << "CoreC6StateResidency\tfloat" << endl;
-            cout << "CoreC7StateResidency\tfloat" << endl;
-            cout << "PackageC2StateResidency\tfloat" << endl;	    
-            cout << "PackageC3StateResidency\tfloat" << endl;	    
-            cout << "PackageC6StateResidency\tfloat" << endl;	    
-            cout << "PackageC7StateResidency\tfloat" << endl;	    
-	    cout << "CPUEnergy\tfloat" << endl;
-            cout << "DRAMEnergy\tfloat" << endl;
+                    out << "Socket" << a << "/BytesIncomingToQPI" << l << "\tfloat" << endl;
+            }
+
+            out << "QPI_Traffic\tfloat" << endl;
+            out << "Frequency\tfloat" << endl;
+            out << "IPC\tfloat" << endl;       //double check output
+            out << "L2CacheHitRatio\tfloat" << endl;
+            out << "L3CacheHitRatio\tfloat" << endl;
+            out << "L2CacheMisses\tinteger" << endl;
+            out << "L3CacheMisses\tinteger" << endl;
+	    out << "CoreC0StateResidency\tfloat" << endl;
+            out << "CoreC3StateResidency\tfloat" << endl;
+            out << "CoreC6StateResidency\tfloat" << endl;
+            out << "CoreC7StateResidency\tfloat" << endl;
+            out << "PackageC2StateResidency\tfloat" << endl;	    
+            out << "PackageC3StateResidency\tfloat" << endl;	    
+            out << "PackageC6StateResidency\tfloat" << endl;	    
+            out << "PackageC7StateResidency\tfloat" << endl;	    
+	    out << "CPUEnergy\tfloat" << endl;
+            out << "DRAMEnergy\tfloat" << endl;
+            for (uint32 p = 0; p < sizeof(historyPeriods) / sizeof(historyPeriods[0]); ++p) {
+                out << "History/IPC" << historyPeriods[p] << "min\tfloat" << endl;
+                out << "History/MemoryBandwidth" << historyPeriods[p] << "min\tfloat" << endl;
+            }
+            out << "History/Samples\tinteger" << endl;
+            out << "History/MemoryUsage\tinteger" << endl;
+        }
+
+        // print the counter history: history <seconds> <bucket seconds>
+        if (s == "history") {
+            double seconds = 60, bucket = 1;
+            args >> seconds >> bucket;
+            print_history(seconds, bucket, out);
         }
 
         // provide metadata
@@ -116,42 +243,42 @@ int main()
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/Frequency?";
                     if (s == c.str()) {
-                        cout << "FREQ. CPU" << i << "\t\t\tMHz" << endl;
+                        out << "FREQ. CPU" << i << "\t\t\tMHz" << endl;
                     }
 		  }
 		  {
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/ThermalHeadroom?";
                     if (s == c.str()) {
-                        cout << "Temperature reading in 1 degree Celsius relative to the TjMax temperature (thermal headroom) for CPU" << i << "\t\t\t°C" << endl;
+                        out << "Temperature reading in 1 degree Celsius relative to the TjMax temperature (thermal headroom) for CPU" << i << "\t\t\t°C" << endl;
                     }
 		  }
 		  {
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/CoreC0StateResidency?";
                     if (s == c.str()) {
-                        cout << "core C0-state residency for CPU" << i << "\t\t\t%" << endl;
+                        out << "core C0-state residency for CPU" << i << "\t\t\t%" << endl;
                     }
 		  }		  
 		  {
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/CoreC3StateResidency?";
                     if (s == c.str()) {
-                        cout << "core C3-state residency for CPU" << i << "\t\t\t%" << endl;
+                        out << "core C3-state residency for CPU" << i << "\t\t\t%" << endl;
                     }
 		  }
 		  {
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/CoreC6StateResidency?";
                     if (s == c.str()) {
-                        cout << "core C6-state residency for CPU" << i << "\t\t\t%" << endl;
+                        out << "core C6-state residency for CPU" << i << "\t\t\t%" << endl;
                     }
 		  }
 		  {
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/CoreC7StateResidency?";
                     if (s == c.str()) {
-                        cout << "core C7-state residency for CPU" << i << "\t\t\t%" << endl;
+                        out << "core C7-state residency for CPU" << i << "\t\t\t%" << endl;
                     }
 		  }		  
                 }
@@ -162,8 +289,8 @@ int main()
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/IPC?";
                     if (s == c.str()) {
-                        cout << "IPC CPU" << i << "\t0\t\t" << endl;
-                        //cout << "CPU" << i << "\tInstructions per Cycle\t0\t1\t " << endl;
+                        out << "IPC CPU" << i << "\t0\t\t" << endl;
+                        //out << "CPU" << i << "\tInstructions per Cycle\t0\t1\t " << endl;
                     }
                 }
         }
@@ -173,8 +300,8 @@ int main()
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/L2CacheHitRatio?";
                     if (s == c.str()) {
-                        cout << "L2 Cache Hit Ratio CPU" << i << "\t0\t\t" << endl;
-                        //   cout << "CPU" << i << "\tL2 Cache Hit Ratio\t0\t1\t " << endl;
+                        out << "L2 Cache Hit Ratio CPU" << i << "\t0\t\t" << endl;
+                        //   out << "CPU" << i << "\tL2 Cache Hit Ratio\t0\t1\t " << endl;
                     }
                 }
         }
@@ -184,7 +311,7 @@ int main()
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/L3CacheHitRatio?";
                     if (s == c.str()) {
-                        cout << "L3 Cache Hit Ratio CPU" << i << "\t0\t\t " << endl;
+                        out << "L3 Cache Hit Ratio CPU" << i << "\t0\t\t " << endl;
                     }
                 }
         }
@@ -194,8 +321,8 @@ int main()
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/L2CacheMisses?";
                     if (s == c.str()) {
-                        cout << "L2 Cache Misses CPU" << i << "\t0\t\t " << endl;
-                        //cout << "CPU" << i << "\tL2 Cache Misses\t0\t1\t " << endl;
+                        out << "L2 Cache Misses CPU" << i << "\t0\t\t " << endl;
+                        //out << "CPU" << i << "\tL2 Cache Misses\t0\t1\t " << endl;
                     }
                 }
         }
@@ -205,8 +332,8 @@ int main()
                     stringstream c;
                     c << "Socket" << a << "/CPU" << i << "/L3CacheMisses?";
                     if (s == c.str()) {
-                        cout << "L3 Cache Misses CPU" << i << "\t0\t\t " << endl;
-                        //cout << "CPU" << i << "\tL3 Cache Misses\t0\t1\t " << endl;
+                        out << "L3 Cache Misses CPU" << i << "\t0\t\t " << endl;
+                        //out << "CPU" << i << "\tL3 Cache Misses\t0\t1\t " << endl;
                     }
                 }
         }
@@ -214,92 +341,92 @@ int main()
             stringstream c;
             c << "Socket" << i << "/BytesReadFromMC?";
             if (s == c.str()) {
-                cout << "read from MC Socket" << i << "\t0\t\tGB" << endl;
+                out << "read from MC Socket" << i << "\t0\t\tGB" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/DRAMEnergy?";
             if (s == c.str()) {
-                cout << "Energy consumed by DRAM on socket " << i << "\t0\t\tJoule" << endl;
+                out << "Energy consumed by DRAM on socket " << i << "\t0\t\tJoule" << endl;
             }
         }        
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/CPUEnergy?";
             if (s == c.str()) {
-                cout << "Energy consumed by CPU package " << i << "\t0\t\tJoule" << endl;
+                out << "Energy consumed by CPU package " << i << "\t0\t\tJoule" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/ThermalHeadroom?";
             if (s == c.str()) {
-                cout << "Temperature reading in 1 degree Celsius relative to the TjMax temperature (thermal headroom) for CPU package " << i << "\t0\t\t°C" << endl;
+                out << "Temperature reading in 1 degree Celsius relative to the TjMax temperature (thermal headroom) for CPU package " << i << "\t0\t\t°C" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/CoreC0StateResidency?";
             if (s == c.str()) {
-                cout << "core C0-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "core C0-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/CoreC3StateResidency?";
             if (s == c.str()) {
-                cout << "core C3-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "core C3-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/CoreC6StateResidency?";
             if (s == c.str()) {
-                cout << "core C6-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "core C6-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }        
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/CoreC7StateResidency?";
             if (s == c.str()) {
-                cout << "core C7-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "core C7-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/PackageC2StateResidency?";
             if (s == c.str()) {
-                cout << "package C2-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "package C2-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/PackageC3StateResidency?";
             if (s == c.str()) {
-                cout << "package C3-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "package C3-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }        
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/PackageC6StateResidency?";
             if (s == c.str()) {
-                cout << "package C6-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "package C6-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }        
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/PackageC7StateResidency?";
             if (s == c.str()) {
-                cout << "package C7-state residency for CPU package " << i << "\t0\t\t%" << endl;
+                out << "package C7-state residency for CPU package " << i << "\t0\t\t%" << endl;
             }
         }        
         for (uint32 i = 0; i < counters.getNumSockets(); ++i) {
             stringstream c;
             c << "Socket" << i << "/BytesWrittenToMC?";
             if (s == c.str()) {
-                cout << "written to MC Socket" << i << "\t0\t\tGB" << endl;
-                //cout << "CPU" << i << "\tBytes written to memory channel\t0\t1\t GB" << endl;
+                out << "written to MC Socket" << i << "\t0\t\tGB" << endl;
+                //out << "CPU" << i << "\tBytes written to memory channel\t0\t1\t GB" << endl;
             }
         }
 
@@ -308,8 +435,8 @@ int main()
                 stringstream c;
                 c << "Socket" << i << "/BytesIncomingToQPI" << l << "?";
                 if (s == c.str()) {
-                    //cout << "Socket" << i << "\tBytes incoming to QPI link\t" << l<< "\t\t GB" << endl;
-                    cout << "incoming to Socket" << i << " QPI Link" << l << "\t0\t\tGB" << endl;
+                    //out << "Socket" << i << "\tBytes incoming to QPI link\t" << l<< "\t\t GB" << endl;
+                    out << "incoming to Socket" << i << " QPI Link" << l << "\t0\t\tGB" << endl;
                 }
             }
         }
@@ -318,7 +445,7 @@ int main()
             stringstream c;
             c << "QPI_Traffic?";
             if (s == c.str()) {
-                cout << "Traffic on all QPIs\t0\t\tGB" << endl;
+                out << "Traffic on all QPIs\t0\t\tGB" << endl;
             }
         }
 
@@ -326,7 +453,7 @@ int main()
             stringstream c;
             c << "Socket" << i << "/Frequency?";
             if (s == c.str()) {
-                cout << "Socket" << i << " Frequency\t0\t\tMHz" << endl;
+                out << "Socket" << i << " Frequency\t0\t\tMHz" << endl;
             }
         }
 
@@ -334,7 +461,7 @@ int main()
             stringstream c;
             c << "Socket" << i << "/IPC?";
             if (s == c.str()) {
-                cout << "Socket" << i << " IPC\t0\t\t" << endl;
+                out << "Socket" << i << " IPC\t0\t\t" << endl;
             }
         }
 
@@ -342,7 +469,7 @@ int main()
             stringstream c;
             c << "Socket" << i << "/L2CacheHitRatio?";
             if (s == c.str()) {
-                cout << "Socket" << i << " L2 Cache Hit Ratio\t0\t\t" << endl;
+                out << "Socket" << i << " L2 Cache Hit Ratio\t0\t\t" << endl;
             }
         }
 
@@ -350,7 +477,7 @@ int main()
             stringstream c;
             c << "Socket" << i << "/L3CacheHitRatio?";
             if (s == c.str()) {
-                cout << "Socket" << i << " L3 Cache Hit Ratio\t0\t\t" << endl;
+                out << "Socket" << i << " L3 Cache Hit Ratio\t0\t\t" << endl;
             }
         }
 
@@ -358,7 +485,7 @@ int main()
             stringstream c;
             c << "Socket" << i << "/L2CacheMisses?";
             if (s == c.str()) {
-                cout << "Socket" << i << " L2 Cache Misses\t0\t\t" << endl;
+                out << "Socket" << i << " L2 Cache Misses\t0\t\t" << endl;
             }
         }
 
@@ -366,7 +493,7 @@ int main()
             stringstream c;
             c << "Socket" << i << "/L3CacheMisses?";
             if (s == c.str()) {
-                cout << "Socket" << i << " L3 Cache Misses\t0\t\t" << endl;
+                out << "Socket" << i << " L3 Cache Misses\t0\t\t" << endl;
             }
         }
 
@@ -374,7 +501,7 @@ int main()
             stringstream c;
             c << "Frequency?";
             if (s == c.str()) {
-                cout << "Frequency system wide\t0\t\tMhz" << endl;
+                out << "Frequency system wide\t0\t\tMhz" << endl;
             }
         }
 
@@ -382,7 +509,7 @@ int main()
             stringstream c;
             c << "IPC?";
             if (s == c.str()) {
-                cout << "IPC system wide\t0\t\t" << endl;
+                out << "IPC system wide\t0\t\t" << endl;
             }
         }
 
@@ -390,7 +517,7 @@ int main()
             stringstream c;
             c << "L2CacheHitRatio?";
             if (s == c.str()) {
-                cout << "System wide L2 Cache Hit Ratio\t0\t\t" << endl;
+                out << "System wide L2 Cache Hit Ratio\t0\t\t" << endl;
             }
         }
 
@@ -398,7 +525,7 @@ int main()
             stringstream c;
             c << "L3CacheHitRatio?";
             if (s == c.str()) {
-                cout << "System wide L3 Cache Hit Ratio\t0\t\t" << endl;
+                out << "System wide L3 Cache Hit Ratio\t0\t\t" << endl;
             }
         }
 
@@ -406,7 +533,7 @@ int main()
             stringstream c;
             c << "L2CacheMisses?";
             if (s == c.str()) {
-                cout << "System wide L2 Cache Misses\t0\t\t" << endl;
+                out << "System wide L2 Cache Misses\t0\t\t" << endl;
             }
         }
 
@@ -414,7 +541,7 @@ int main()
             stringstream c;
             c << "L3CacheMisses?";
             if (s == c.str()) {
-                cout << "System wide L3 Cache Misses\t0\t\t" << endl;
+                out << "System wide L3 Cache Misses\t0\t\t" << endl;
             }
         }
 
@@ -422,7 +549,7 @@ int main()
             stringstream c;
             c << "L3CacheMisses?";
             if (s == c.str()) {
-                cout << "System wide L3 Cache Misses\t0\t\t" << endl;
+                out << "System wide L3 Cache Misses\t0\t\t" << endl;
             }
         }
         
@@ -430,73 +557,96 @@ int main()
             stringstream c;
             c << "DRAMEnergy?";
             if (s == c.str()) {
-                cout << "System wide energy consumed by DRAM \t0\t\tJoule" << endl;
+                out << "System wide energy consumed by DRAM \t0\t\tJoule" << endl;
             }
         }        
         {
             stringstream c;
             c << "CPUEnergy?";
             if (s == c.str()) {
-                cout << "System wide energy consumed by CPU packages \t0\t\tJoule" << endl;
+                out << "System wide energy consumed by CPU packages \t0\t\tJoule" << endl;
             }
         }
         {
             stringstream c;
             c << "CoreC0StateResidency?";
             if (s == c.str()) {
-                cout << "System wide core C0-state residency \t0\t\t%" << endl;
+                out << "System wide core C0-state residency \t0\t\t%" << endl;
             }
         }
         {
             stringstream c;
             c << "CoreC3StateResidency?";
             if (s == c.str()) {
-                cout << "System wide core C3-state residency \t0\t\t%" << endl;
+                out << "System wide core C3-state residency \t0\t\t%" << endl;
             }
         }
         {
             stringstream c;
             c << "CoreC6StateResidency?";
             if (s == c.str()) {
-                cout << "System wide core C6-state residency \t0\t\t%" << endl;
+                out << "System wide core C6-state residency \t0\t\t%" << endl;
             }
         }        
         {
             stringstream c;
             c << "CoreC7StateResidency?";
             if (s == c.str()) {
-                cout << "System wide core C7-state residency \t0\t\t%" << endl;
+                out << "System wide core C7-state residency \t0\t\t%" << endl;
             }
         }
         {
             stringstream c;
             c  << "PackageC2StateResidency?";
             if (s == c.str()) {
-                cout << "System wide package C2-state residency \t0\t\t%" << endl;
+                out << "System wide package C2-state residency \t0\t\t%" << endl;
             }
         }
         {
             stringstream c;
             c  << "PackageC3StateResidency?";
             if (s == c.str()) {
-                cout << "System wide package C3-state residency \t0\t\t%" << endl;
+                out << "System wide package C3-state residency \t0\t\t%" << endl;
             }
         }
         {
             stringstream c;
             c  << "PackageC6StateResidency?";
             if (s == c.str()) {
-                cout << "System wide package C6-state residency \t0\t\t%" << endl;
+                out << "System wide package C6-state residency \t0\t\t%" << endl;
             }
         }
         {
             stringstream c;
             c  << "PackageC7StateResidency?";
             if (s == c.str()) {
-                cout << "System wide package C7-state residency \t0\t\t%" << endl;
+                out << "System wide package C7-state residency \t0\t\t%" << endl;
             }
         }        
 
+        for (uint32 p = 0; p < sizeof(historyPeriods) / sizeof(historyPeriods[0]); ++p) {
+            {
+                stringstream c;
+                c << "History/IPC" << historyPeriods[p] << "min?";
+                if (s == c.str()) {
+                    out << "IPC system wide, average of the last " << historyPeriods[p] << " min\t0\t\t" << endl;
+                }
+            }
+            {
+                stringstream c;
+                c << "History/MemoryBandwidth" << historyPeriods[p] << "min?";
+                if (s == c.str()) {
+                    out << "Memory controller traffic system wide, average of the last " << historyPeriods[p] << " min\t0\t\tGB/s" << endl;
+                }
+            }
+        }
+        if (s == "History/Samples?") {
+            out << "Samples in the counter history\t0\t\t" << endl;
+        }
+        if (s == "History/MemoryUsage?") {
+            out << "Memory used by the counter history\t0\t\tKB" << endl;
+        }
+
         // sensors
 
 #define OUTPUT_CORE_METRIC(name,function) \
@@ -506,17 +656,19 @@ int main()
                     stringstream c; \
                     c << "Socket" << a << "/CPU" << i << name; \
                     if (s == c.str()) { \
-                        cout << function << endl; \
+                        out << function << endl; \
                     } \
                 } \
         }
         
-        OUTPUT_CORE_METRIC("/Frequency", (counters.get<double, ::getAverageFrequency>(i) / 1000000 ) )
-	OUTPUT_CORE_METRIC("/IPC", (counters.get<double, ::getIPC>(i) ) )
-	OUTPUT_CORE_METRIC("/L2CacheHitRatio", (counters.get<double, ::getL2CacheHitRatio>(i) ) )
-	OUTPUT_CORE_METRIC("/L3CacheHitRatio", (counters.get<double, ::getL3CacheHitRatio>(i) ) )
-        OUTPUT_CORE_METRIC("/L2CacheMisses", (counters.get<uint64, ::getL2CacheMisses>(i) / 1000000) )
-        OUTPUT_CORE_METRIC("/L3CacheMisses", (counters.get<uint64, ::getL3CacheMisses>(i) / 1000000) )
+        static CoreMetricCache coreMetrics; // created on the first command, after the PCM instance
+        coreMetrics.update(counters);
+        OUTPUT_CORE_METRIC("/Frequency", (coreMetrics.getFrequency(i) / 1000000 ) )
+	OUTPUT_CORE_METRIC("/IPC", (coreMetrics.get(CoreMetricArrays::IPC, i) ) )
+	OUTPUT_CORE_METRIC("/L2CacheHitRatio", (coreMetrics.get(CoreMetricArrays::L2_HIT_RATIO, i) ) )
+	OUTPUT_CORE_METRIC("/L3CacheHitRatio", (coreMetrics.get(CoreMetricArrays::L3_HIT_RATIO, i) ) )
+        OUTPUT_CORE_METRIC("/L2CacheMisses", (coreMetrics.getL2CacheMisses(i) / 1000000) )
+        OUTPUT_CORE_METRIC("/L3CacheMisses", (coreMetrics.getL3CacheMisses(i) / 1000000) )
         OUTPUT_CORE_METRIC("/CoreC0StateResidency", (counters.get<double, ::getCoreC0Residency>(i)*100.) )
         OUTPUT_CORE_METRIC("/CoreC3StateResidency", (counters.get<double, ::getCoreC3Residency>(i)*100.) )
         OUTPUT_CORE_METRIC("/CoreC6StateResidency", (counters.get<double, ::getCoreC6Residency>(i)*100.) )
@@ -528,7 +680,7 @@ int main()
             stringstream c; \
             c << "Socket" << i << name; \
             if (s == c.str()) { \
-                cout << function << endl; \
+                out << function << endl; \
             } \
         }
         
@@ -557,7 +709,7 @@ int main()
                 stringstream c;
                 c << "Socket" << i << "/BytesIncomingToQPI" << l;
                 if (s == c.str()) {
-                    cout << double(counters.getSocket<uint64, ::getIncomingQPILinkBytes>(i, l)) / 1024 / 1024 / 1024 << endl;
+                    out << double(counters.getSocket<uint64, ::getIncomingQPILinkBytes>(i, l)) / 1024 / 1024 / 1024 << endl;
                 }
             }
         }
@@ -567,7 +719,7 @@ int main()
             stringstream c; \
             c << name; \
             if (s == c.str()) { \
-                cout << function << endl; \
+                out << function << endl; \
             } \
         }
         
@@ -589,11 +741,144 @@ int main()
 	OUTPUT_SYSTEM_METRIC("L3CacheMisses", (double(counters.getSystem<uint64, ::getL3CacheMisses>())) )
 	OUTPUT_SYSTEM_METRIC("QPI_Traffic", (double(counters.getSystem<uint64, ::getAllIncomingQPILinkBytes>()) / 1024 / 1024 / 1024) )
 
+        for (uint32 p = 0; p < sizeof(historyPeriods) / sizeof(historyPeriods[0]); ++p) {
+            stringstream ipc, bw;
+            ipc << "History/IPC" << historyPeriods[p] << "min";
+            bw << "History/MemoryBandwidth" << historyPeriods[p] << "min";
+            if (s == ipc.str() || s == bw.str()) {
+                uint64 instructions = 0, cycles = 0, mcBytes = 0;
+                double duration = 0;
+                if (!get_history_totals(historyPeriods[p] * 60., instructions, cycles, mcBytes, duration))
+                    out << 0 << endl;
+                else if (s == ipc.str())
+                    out << (cycles ? double(instructions) / double(cycles) : 0.) << endl;
+                else
+                    out << double(mcBytes) / duration / 1024 / 1024 / 1024 << endl;
+            }
+        }
+        if (s == "History/Samples") {
+            CounterHistory * history = PCM::getInstance()->getCounterHistory();
+            out << (history ? history->getNumSamples() : 0) << endl;
+        }
+        if (s == "History/MemoryUsage") {
+            CounterHistory * history = PCM::getInstance()->getCounterHistory();
+            out << (history ? history->getMemoryUsage() / 1024 : 0) << endl;
+        }
+        // batched query: get <monitor> <monitor> ... answers one line per monitor (empty if unknown)
+        if (s == "get") {
+            string line, name;
+            getline(args, line);
+            istringstream names(line);
+            while (names >> name) {
+                istringstream none;
+                ostringstream value;
+                process_command(counters, name, none, value);
+                if (value.str().empty())
+                    out << endl;
+                else
+                    out << value.str();
+            }
+        }
+
         // exit
         if (s == "quit" || s == "exit") {
-            break;
+            return false;
+        }
+
+        return true;
+}
+
+// serves the clients of the --server mode
+struct ServerContext
+{
+    AsynchronCounterState * counters;
+    ostringstream reply;
+};
+
+bool serve_line(const string & line, string & /* session */, string & reply, void * context)
+{
+    ServerContext * c = (ServerContext *)context;
+    istringstream in(line);
+    string s;
+    bool open = true;
+    c->reply.str("");
+    while (open && in >> s)
+        open = process_command(*c->counters, s, in, c->reply);
+    reply += c->reply.str();
+    if (open) reply += "ksysguardd> ";
+    return open;
+}
+
+void print_help(const char * prog_name)
+{
+    cout << endl;
+    cout << " Usage: " << prog_name << " [--server=<socket> [--server-mode=<mode>]]" << endl;
+    cout << endl;
+    cout << " Without options the ksysguardd protocol is served on stdin/stdout" << endl;
+    cout << " --server=<socket> => serves any number of clients on a Unix domain socket (Linux only)," << endl;
+    cout << "                      \"get <monitor> <monitor> ...\" answers many monitors with one line each" << endl;
+    cout << " --server-mode=<mode> => octal permissions of the socket file, regardless of the umask" << endl;
+    cout << "                         (default 600: only the user running the sensor can connect)" << endl;
+    cout << endl;
+}
+
+int main(int argc, char * argv[])
+{
+    const char * socketPath = NULL;
+    unsigned long socketMode = 0600;
+    for (int l = 1; l < argc; ++l)
+    {
+        if (strncmp(argv[l], "--server=", 9) == 0)
+            socketPath = argv[l] + 9;
+        else if (strncmp(argv[l], "--server-mode=", 14) == 0)
+        {
+            char * end = NULL;
+            socketMode = strtoul(argv[l] + 14, &end, 8);
+            if (end == argv[l] + 14 || *end != '\0' || socketMode > 0777)
+            {
+                print_help(argv[0]);
+                return -1;
+            }
         }
+        else
+        {
+            print_help(argv[0]);
+            return strcmp(argv[l], "--help") == 0 ? 0 : -1;
+        }
+    }
+
+    AsynchronCounterState counters(DELAY, HISTORY);
+
+    stringstream greeting;
+    greeting << "CPU counter sensor "<< INTEL_PCM_VERSION << endl;
+    greeting << "(C) 2010,2012 Intel Corp." << endl;
+    greeting << "ksysguardd 1.2.0" << endl;
+    greeting << "ksysguardd> ";
+
+    if (socketPath)
+    {
+        ServerContext context;
+        context.counters = &counters;
+        try
+        {
+            SensorServer server(socketPath, (unsigned)socketMode, greeting.str(), serve_line, &context);
+            server.run();
+        }
+        catch (...)
+        {
+            return -1;
+        }
+        return -1;
+    }
+
+    cout << greeting.str();
+
+    while (1)
+    {
+        string s;
+        if (!(cin >> s)) break;
 
+        if (!process_command(counters, s, cin, cout)) break;
 
         cout << "ksysguardd> ";
     }
@@ -0,0 +1,116 @@
+/*
+   Copyright (c) 2009-2013, Intel Corporation
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*!     \file pcm-trace.cpp
+  \brief Converts a binary counter trace written by pcm.x --trace (see counter_trace.h) into ';' separated text
+  */
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include "counter_trace.h"
+
+using namespace std;
+
+void print_help(const char * prog_name)
+{
+    cout << endl;
+    cout << " Usage: " << prog_name << " <trace file> [--info]" << endl;
+    cout << endl;
+    cout << " Prints one line per interval with the counter deltas, the first line names the columns" << endl;
+    cout << " The intervals start and end in CLOCK_MONOTONIC_RAW nanoseconds" << endl;
+    cout << " --info => prints only the topology and the programmed events" << endl;
+    cout << endl;
+}
+
+void print_info(const CounterTraceReader & reader, ostream & out)
+{
+    const CounterTraceHeader & h = reader.getHeader();
+    out << "Trace of " << h.numCores << " cores, " << h.numSockets << " sockets, " << h.qpiLinksPerSocket << " QPI links per socket, CPU model "
+        << h.cpuModel << ", nominal frequency " << h.nominalFrequency / 1000000 << " MHz" << endl;
+    out << "TSC " << h.calibration.tsc << " at CLOCK_MONOTONIC_RAW " << h.calibration.monotonicRaw << " ns and CLOCK_REALTIME "
+        << h.calibration.realtime << " ns, " << h.calibration.frequency << " TSC ticks per second" << endl;
+    for (size_t l = 0; l < reader.getLines().size(); ++l)
+    {
+        const CounterTraceLine & line = reader.getLines()[l];
+        out << "Line " << line.line << " (" << line.name << "):";
+        for (size_t e = 0; e < line.events.size(); ++e)
+            out << " EVENT" << e << "=0x" << hex << line.events[e].event_number << "/0x" << line.events[e].umask_value << dec;
+        out << endl;
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    const char * path = NULL;
+    bool info = false;
+
+    for (int l = 1; l < argc; ++l)
+    {
+        if (strcmp(argv[l], "--help") == 0 || strcmp(argv[l], "-h") == 0)
+        {
+            print_help(argv[0]);
+            return 0;
+        }
+        else if (strcmp(argv[l], "--info") == 0)
+            info = true;
+        else
+            path = argv[l];
+    }
+    if (!path)
+    {
+        print_help(argv[0]);
+        return -1;
+    }
+
+    CounterTraceReader * reader = NULL;
+    try
+    {
+        reader = new CounterTraceReader(path);
+    }
+    catch (...)
+    {
+        return -1;
+    }
+
+    CounterTraceRow row;
+    if (info)
+    {
+        // the line records are read together with the rows
+        while (reader->next(row)) ;
+        print_info(*reader, cout);
+    }
+    else
+    {
+        // the start and the duration in TSC ticks are printed as the start and the end in CLOCK_MONOTONIC_RAW
+        const CounterTraceHeader & h = reader->getHeader();
+        cout << "START_NS;END_NS";
+        for (uint32 c = 2; c < h.getNumColumns(); ++c)
+            cout << ';' << reader->getColumnName(c);
+        cout << '\n';
+
+        while (reader->next(row))
+        {
+            cout << h.calibration.toMonotonicRaw(row.start) << ';' << h.calibration.toMonotonicRaw(row.end) << ';' << row.line;
+            for (size_t i = 0; i < row.cores.size(); ++i) cout << ';' << row.cores[i];
+            for (size_t i = 0; i < row.sockets.size(); ++i) cout << ';' << row.sockets[i];
+            for (size_t i = 0; i < row.qpi.size(); ++i) cout << ';' << row.qpi[i];
+            cout << '\n';
+        }
+        cout << flush;
+    }
+
+    const bool corrupt = reader->isCorrupt();
+    if (corrupt) cerr << path << " is truncated or corrupt, the rows after the last complete chunk are lost" << endl;
+    delete reader;
+    return corrupt ? -1 : 0;
+}
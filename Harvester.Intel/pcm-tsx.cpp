@@ -89,7 +89,7 @@ TSXEvent eventDefinition[] = {
 void print_usage(const char * progname)
 {
       std::cout << "\nUsage "<<progname<<" (delay | \"external_program\") [-C] [-e event1 ] [-e event2 ] [-e event3 ] [-e event4 ]\n\n";
-      std::cout << "  <delay>            - delay in seconds between updates. Either delay or \"external program\" parameters must be supplied\n";
+      std::cout << "  <delay>            - delay in seconds between updates (e.g. 0.5). Either delay or \"external program\" parameters must be supplied\n";
       std::cout << "  \"external_program\" - start external program and print the performance metrics for the execution at the end\n";
       std::cout << "  -C             - output in csv format (optional)\n";
       std::cout << "  -e eventX      - monitor custom TSX event (up to 4) - optional. List of supported events: \n\n";
@@ -199,7 +199,7 @@ int main(int argc, char * argv[])
     signal(SIGTERM, cleanup);
 #endif
 
-    int delay = -1;
+    double delay = -1;
     char * ext_program = NULL;
     std::vector<int> events;
     int cur_event;
@@ -241,7 +241,7 @@ int main(int argc, char * argv[])
          return -1;
      }
 
-     delay = atoi(argv[optind]);
+     delay = atof(argv[optind]);
      if(delay == 0)
          ext_program = argv[optind];
      else
@@ -328,33 +328,29 @@ int main(int argc, char * argv[])
     std::vector<SocketCounterState> DummySocketStates;
     cout << "Update every "<<delay<<" seconds"<< endl;
 
-    BeforeTime = m->getTickCount();
+    // the samples are taken on absolute deadlines, the console output does not delay the next sample
+    SamplingScheduler scheduler(delay);
+
+    BeforeTime = m->getTickCount(1000000ULL);
     m->getAllCounterStates(SysBeforeState, DummySocketStates, BeforeState);
 
     std::cout.precision(2);
     std::cout << std::fixed; 
 
+    scheduler.start();
+
     while(1)
     {
-#ifdef _MSC_VER
-        int delay_ms = delay * 1000;
-        // compensate slow Windows console output
-        if(AfterTime) delay_ms -= (int)(m->getTickCount() - BeforeTime);
-        if(delay_ms < 0) delay_ms = 0;
-#else
-        int delay_ms = delay * 1000;
-#endif
-
         if(ext_program)
             MySystem(ext_program);
         else
-            MySleepMs(delay_ms);
+            scheduler.wait();
 
-        AfterTime = m->getTickCount();
+        AfterTime = m->getTickCount(1000000ULL);
         m->getAllCounterStates(SysAfterState, DummySocketStates, AfterState);
 
-        cout << "Time elapsed: "<<dec<<fixed<<AfterTime-BeforeTime<<" ms\n";
-        //cout << "Called sleep function for "<<dec<<fixed<<delay_ms<<" ms\n";
+        cout << "Time elapsed: "<<dec<<fixed<<double(AfterTime-BeforeTime)/1000.<<" ms\n";
+        if(!ext_program) scheduler.report(cout);
 
         if(events.empty())
         {
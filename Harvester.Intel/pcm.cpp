@@ -38,6 +38,10 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <string>
 #include <assert.h>
 #include "cpucounters.h"
+#include "counter_arrays.h"
+#include "event_multiplexer.h"
+#include "counter_trace.h"
+#include "async_writer.h"
 #include "utils.h"
 
 #define SIZE (10000000)
@@ -74,7 +78,20 @@ void print_help(char * prog_name)
 	cout << " -ns or --nosockets or /ns => hides socket related output" << endl;
 	cout << " -nsys or --nosystem or /nsys => hides system related output" << endl;
 	cout << " -csv or /csv => print compact csv format" << endl;
+	cout << " --sampling=core|socket|serial => read the cores with one sampler thread per core," << endl;
+	cout << "                                  one per socket or serially from the main thread (default)" << endl;
+	cout << " --perf or --noperf => always or never use Linux perf for the core counters" << endl;
+	cout << "                       (default: only if the MSRs can not be written)" << endl;
+	cout << " --mux=<slice> => one MUX line per interval: the TLB, CACHE and COHERENCY_MEMORY events" << endl;
+	cout << "                  take turns every <slice> milliseconds, the counts are scaled to the interval" << endl;
+	cout << " --trace=<file> => write the exact counter deltas of every interval into a compact binary trace" << endl;
+	cout << "                   instead of output.csv (pcm-trace.x converts it back to text)" << endl;
+	cout << " --aggregate=<levels> => also print the cores summed up per physical core, L3 domain or NUMA node," << endl;
+	cout << "                         <levels> is a comma separated list of physical_core, l3_domain, numa_node" << endl;
+	cout << " output.csv starts with a BEGIN line and a CLOCK;<TSC frequency>;<TSC>;<CLOCK_MONOTONIC_RAW ns>;<CLOCK_REALTIME ns>" << endl;
+	cout << " line, read at the same time: the rows end with their interval in CLOCK_MONOTONIC_RAW ns" << endl;
 	cout << " Example:  pcm.x 1 -nc -ns " << endl;
+	cout << " <delay> is the sampling period in milliseconds (default 25), e.g. 0.5 for 500 microseconds" << endl;
 	cout << endl;
 }
 
@@ -278,36 +295,38 @@ void print_csv(PCM * m,
 }
 
 
-void print_harvester(PCM * m, PCM::PCMLine tlbMode, uint64 duration,
+TSCCalibration calibration; // taken once at the start, printed in the CLOCK line
+
+// First fields of a row: the local time of the end of the interval (h:m:s:ms) and the duration in microseconds
+void print_row_time(uint64 start, uint64 end)
+{
+	const uint64 realtime = calibration.toRealtime(end);
+	const time_t t = (time_t)(realtime / 1000000000ULL);
+	tm *tt = localtime(&t);
+	cout << "\n" << tt->tm_hour << ':' << tt->tm_min << ':' << tt->tm_sec << ':' << (realtime / 1000000ULL) % 1000 <<
+		';' << calibration.ticksToNs(end - start) / 1000 << ';';
+}
+
+// Last fields of a row: the start and the end of the interval in CLOCK_MONOTONIC_RAW nanoseconds
+void print_row_timestamps(uint64 start, uint64 end)
+{
+	cout << ';' << calibration.toMonotonicRaw(start) << ';' << calibration.toMonotonicRaw(end);
+}
+
+// start and end are the invariant TSC when the counters were read
+void print_harvester(PCM * m, PCM::PCMLine tlbMode, uint64 start, uint64 end,
 	const std::vector<CoreCounterState> & cstates1,
 	const std::vector<CoreCounterState> & cstates2,
 	const std::vector<SocketCounterState> & sktstate1,
 	const std::vector<SocketCounterState> & sktstate2,
 	const SystemCounterState& sstate1,
 	const SystemCounterState& sstate2,
-	const int cpu_model
+	const int cpu_model,
+	const CoreCounterArrays::Counter tlbEvent = CoreCounterArrays::EVENT0 // EVENT4 in the TLB_CACHE_LINE mode
 	)
 {
-	time_t t = time(NULL);
-	tm *tt = localtime(&t);
 	cout.precision(3);
-
-	long ctime = clock();
-	if (prevs != tt->tm_sec){
-		milli = 0;
-		if (prevs != -1)
-			start = true;
-	}
-	else{
-		milli += ctime - prevc;
-	}
-	prevs = tt->tm_sec;
-	prevc = ctime;
-
-	if (!start)
-		return;
-
-	cout << "\n" << tt->tm_hour << ':' << tt->tm_min << ':' << tt->tm_sec << ':' << milli << ';' << duration << ';';
+	print_row_time(start, end);
 	switch (tlbMode)
 	{
 		case PCM::PCMLine::TLB_LINE:
@@ -324,6 +343,23 @@ void print_harvester(PCM * m, PCM::PCMLine tlbMode, uint64 duration,
 			exit(1);
 	}
 
+	// Deltas and metrics of all cores in one pass (the arrays are reused between the intervals)
+	static CoreCounterArrays before, after, delta;
+	static CoreMetricArrays metrics;
+	const bool atom = (cpu_model == PCM::ATOM);
+	before.load(cstates1);
+	after.load(cstates2);
+	delta.computeDelta(before, after);
+	metrics.compute(delta, atom, tlbEvent);
+
+	const uint64 * cycles = delta[CoreCounterArrays::CPU_CLK_UNHALTED_THREAD];
+	const uint64 * event0 = delta[CoreCounterArrays::EVENT0];
+	const uint64 * event1 = delta[CoreCounterArrays::EVENT1];
+	const uint64 * event2 = delta[CoreCounterArrays::EVENT2];
+	const uint64 * event3 = delta[CoreCounterArrays::EVENT3];
+	const uint64 * tlbMisses = delta[tlbEvent];
+	const double * ipc = metrics[CoreMetricArrays::IPC];
+
 	// For each core we have
 	for (uint32 i = 0; i < m->getNumCores(); ++i)
 	{
@@ -332,30 +368,30 @@ void print_harvester(PCM * m, PCM::PCMLine tlbMode, uint64 duration,
 			case PCM::PCMLine::TLB_LINE:
 			{
 				// Get our TLB misses
-				cout << ';' << getIPC(cstates1[i], cstates2[i]) <<
-					';' << getCycles(cstates1[i], cstates2[i]) <<
-					';' << getEvent0(cstates1[i], cstates2[i]) <<
-					';' << getCyclesLostDueTLBMisses(cstates1[i], cstates2[i]);
+				cout << ';' << ipc[i] <<
+					';' << cycles[i] <<
+					';' << (atom ? 0 : tlbMisses[i]) <<
+					';' << metrics[CoreMetricArrays::CYCLES_LOST_TLB_MISSES][i];
 				break;
 			}
 			case PCM::PCMLine::CACHE_LINE:
 			{
 				// Default events we need to get per core
-				cout << ';' << getIPC(cstates1[i], cstates2[i]) <<
-					';' << getCycles(cstates1[i], cstates2[i]) <<
-					';' << getL3CacheMisses(cstates1[i], cstates2[i]) <<
-					';' << getL2CacheMisses(cstates1[i], cstates2[i]) <<
-					';' << getL3CacheHits(cstates1[i], cstates2[i]) <<
-					';' << getL2CacheHits(cstates1[i], cstates2[i]) <<
-					';' << getCyclesLostDueL3CacheMisses(cstates1[i], cstates2[i]) <<
-					';' << getCyclesLostDueL2CacheMisses(cstates1[i], cstates2[i]);
+				cout << ';' << ipc[i] <<
+					';' << cycles[i] <<
+					';' << (atom ? 0 : event0[i]) <<                          // L3 misses
+					';' << (atom ? event0[i] : event2[i] + event1[i] + event0[i]) <<  // L2 misses
+					';' << (atom ? 0 : event2[i] + event1[i]) <<              // L3 hits
+					';' << (atom ? event1[i] - event0[i] : event3[i]) <<      // L2 hits
+					';' << metrics[CoreMetricArrays::CYCLES_LOST_L3_MISSES][i] <<
+					';' << metrics[CoreMetricArrays::CYCLES_LOST_L2_MISSES][i];
 				break;
 			}
 			case PCM::PCMLine::COHERENCY_MEMORY_LINE:
 			{
-				cout<< ';' << getL2CoherencyMisses(cstates1[i], cstates2[i]) <<
-					';' << getL1CoherencyMisses(cstates1[i], cstates2[i]) <<
-					';' << getDRAMBandwidthInBytes(cstates1[i], cstates2[i])
+				cout<< ';' << (atom ? (uint64)-1 : event0[i]) <<           // L2 coherency misses
+					';' << (atom ? (uint64)-1 : event1[i]) <<               // L1 coherency misses
+					';' << (atom ? (uint64)-1 : event2[i] * 16)             // DRAM bandwidth in bytes
 					//<< ';' // For debug; printing an extra semicolon to mark end of data associated to one core; will break harvester reading stuff
 					;
 				break;
@@ -374,6 +410,138 @@ void print_harvester(PCM * m, PCM::PCMLine tlbMode, uint64 duration,
 			';' << getAllIncomingQPILinkBytes(sstate1, sstate2) <<
 			';' << getAllOutgoingQPILinkBytes(sstate1, sstate2);
 	}
+	print_row_timestamps(start, end);
+}
+
+
+// One line per interval with the scaled estimates of all multiplexed events
+void print_multiplexed(PCM * m, const EventMultiplexer & mux, uint64 start, uint64 end, const int cpu_model)
+{
+	cout.precision(3);
+	print_row_time(start, end);
+	cout << "MUX";
+
+	// the fixed counters count the whole interval
+	const CounterSnapshot & before = mux.getIntervalBefore();
+	const CounterSnapshot & after = mux.getIntervalAfter();
+	for (uint32 i = 0; i < m->getNumCores(); ++i)
+	{
+		cout << ';' << getIPC(before.cores[i], after.cores[i]) <<
+			';' << getCycles(before.cores[i], after.cores[i]);
+		for (uint32 e = 0; e < mux.getNumEvents(); ++e)
+			cout << ';' << mux.getEstimate(i, e);
+	}
+	// fraction of the interval each event was counted and the relative error of its estimate
+	for (uint32 e = 0; e < mux.getNumEvents(); ++e)
+		cout << ';' << mux.getEnabledRatio(e) << ';' << mux.getRelativeError(e);
+	if (cpu_model != PCM::ATOM)
+	{
+		cout << ';' << getBytesReadFromMC(before.system, after.system) <<
+			';' << getBytesWrittenToMC(before.system, after.system) <<
+			';' << getAllIncomingQPILinkBytes(before.system, after.system) <<
+			';' << getAllOutgoingQPILinkBytes(before.system, after.system);
+	}
+	print_row_timestamps(start, end);
+}
+
+
+const char * line_name(PCM::PCMLine line)
+{
+	switch (line)
+	{
+		case PCM::PCMLine::TLB_LINE: return "TLB";
+		case PCM::PCMLine::CACHE_LINE: return "CACHE";
+		case PCM::PCMLine::COHERENCY_MEMORY_LINE: return "COHERENCY_MEMORY";
+		case PCM::PCMLine::TLB_CACHE_LINE: return "TLB_CACHE";
+		default: return "UNKNOWN";
+	}
+}
+
+// Row tag of an aggregation level
+const char * level_tag(PCM::AggregationLevel level)
+{
+	switch (level)
+	{
+		case PCM::PHYSICAL_CORE_LEVEL: return "PHYSICAL_CORE";
+		case PCM::L3_DOMAIN_LEVEL: return "L3_DOMAIN";
+		case PCM::NUMA_NODE_LEVEL: return "NUMA_NODE";
+		default: return "UNKNOWN";
+	}
+}
+
+// One GROUPS line per selected level: <topology id>@S<socket> of every group, in the order of the group columns
+void print_groups_header(PCM * m)
+{
+	for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+	{
+		if ((m->getAggregationLevels() & (1U << l)) == 0) continue;
+		const PCM::AggregationLevel level = (PCM::AggregationLevel)l;
+		cout << "\nGROUPS;" << level_tag(level);
+		for (uint32 g = 0; g < m->getNumGroups(level); ++g)
+			cout << ';' << m->getGroupTopologyId(level, g) << "@S" << m->getGroupSocket(level, g);
+	}
+}
+
+// One row per selected level with IPC, instructions, cycles and the first four events of every group
+void print_groups(PCM * m, const SnapshotRecord & r)
+{
+	cout.precision(3);
+	for (uint32 l = 0; l < PCM_AGGREGATION_LEVELS; ++l)
+	{
+		const std::vector<CoreGroupCounterState> & before = r.before.groups[l], & after = r.after.groups[l];
+		if (before.empty() || before.size() != after.size()) continue;
+		print_row_time(r.start, r.end);
+		cout << level_tag((PCM::AggregationLevel)l);
+		for (uint32 g = 0; g < before.size(); ++g)
+		{
+			cout << ';' << getIPC(before[g], after[g]) <<
+				';' << getInstructionsRetired(before[g], after[g]) <<
+				';' << getCycles(before[g], after[g]);
+			for (int32 e = 0; e < 4; ++e)
+				cout << ';' << getNumberOfCustomEvents(e, before[g], after[g]);
+		}
+		print_row_timestamps(r.start, r.end);
+	}
+}
+
+CounterTraceWriter * trace = NULL;
+AsyncSnapshotWriter * writer = NULL;
+// filled by the sampling thread when a line is programmed the first time, before its first record is published
+CounterTraceLine traceLines[PCM::PCMLine::TLB_CACHE_LINE + 1];
+
+void close_trace()
+{
+	delete trace; // writes the buffered intervals
+	trace = NULL;
+}
+
+void close_writer()
+{
+	delete writer; // writes the queued records
+	writer = NULL;
+}
+
+// Formats one interval, called in the writer thread
+void write_record(const SnapshotRecord & r, void * context)
+{
+	PCM * m = (PCM *)context;
+	if (trace)
+	{
+		// the exact deltas of the interval, the metrics are computed when the trace is read
+		trace->describeLine(traceLines[r.line]);
+		trace->write(r.line, r.start, r.end, r.before, r.after);
+		return;
+	}
+	const int cpu_model = m->getCPUModel();
+	if (r.line == PCM::PCMLine::TLB_CACHE_LINE)
+	{
+		// both lines are counted in the same interval
+		print_harvester(m, PCM::PCMLine::TLB_LINE, r.start, r.end, r.before.cores, r.after.cores, r.before.sockets, r.after.sockets, r.before.system, r.after.system, cpu_model, CoreCounterArrays::EVENT4);
+		print_harvester(m, PCM::PCMLine::CACHE_LINE, r.start, r.end, r.before.cores, r.after.cores, r.before.sockets, r.after.sockets, r.before.system, r.after.system, cpu_model);
+	}
+	else
+		print_harvester(m, (PCM::PCMLine)r.line, r.start, r.end, r.before.cores, r.after.cores, r.before.sockets, r.after.sockets, r.before.system, r.after.system, cpu_model);
+	print_groups(m, r);
 }
 
 
@@ -425,7 +593,7 @@ int main(int argc, char * argv[])
 	signal(SIGTERM, cleanup);
 #endif
 
-	int delay = 25;
+	double delay = 25; // in ms
 
 	char * sysCmd = NULL;
 	bool show_core_output = true;
@@ -433,6 +601,11 @@ int main(int argc, char * argv[])
 	bool show_system_output = true;
 	bool csv_output = true;
 	bool disable_JKT_workaround = false; // as per http://software.intel.com/en-us/articles/performance-impact-when-sampling-certain-llc-events-on-snb-ep-with-vtune
+	PCM::SamplingMode sampling_mode = PCM::SERIAL_SAMPLING;
+	PCM::CorePMUAccess core_pmu_access = PCM::CORE_PMU_AUTO;
+	double muxSlice = 0; // in ms, 0: rotate the lines, one per interval
+	const char * traceFile = NULL;
+	uint32 aggregation = 0; // PCM::AggregationLevel bits
 
 
 	if (argc >= 2)
@@ -490,6 +663,42 @@ int main(int argc, char * argv[])
 				{
 					disable_JKT_workaround = true;
 				}
+				if (strcmp(argv[l], "--sampling=serial") == 0)
+				{
+					sampling_mode = PCM::SERIAL_SAMPLING;
+				}
+				if (strcmp(argv[l], "--sampling=socket") == 0)
+				{
+					sampling_mode = PCM::PER_SOCKET_SAMPLING;
+				}
+				if (strcmp(argv[l], "--sampling=core") == 0)
+				{
+					sampling_mode = PCM::PER_CORE_SAMPLING;
+				}
+				if (strcmp(argv[l], "--perf") == 0)
+				{
+					core_pmu_access = PCM::CORE_PMU_PERF;
+				}
+				if (strcmp(argv[l], "--noperf") == 0)
+				{
+					core_pmu_access = PCM::CORE_PMU_MSR;
+				}
+				if (strncmp(argv[l], "--mux=", 6) == 0)
+				{
+					muxSlice = atof(argv[l] + 6);
+				}
+				if (strncmp(argv[l], "--trace=", 8) == 0)
+				{
+					traceFile = argv[l] + 8;
+				}
+				if (strncmp(argv[l], "--aggregate=", 12) == 0)
+				{
+					if (!PCM::parseAggregationLevels(argv[l] + 12, aggregation))
+					{
+						print_help(argv[0]);
+						return -1;
+					}
+				}
 			}
 		}
 
@@ -515,7 +724,7 @@ int main(int argc, char * argv[])
 		}
 #endif
 
-		delay = atoi(argv[1]);
+		delay = atof(argv[1]);
 		if (delay <= 0)
 		{
 			sysCmd = argv[1];
@@ -540,6 +749,9 @@ int main(int argc, char * argv[])
 
 	PCM * m = PCM::getInstance();
 	if (disable_JKT_workaround) m->disableJKTWorkaround();
+	m->setSamplingMode(sampling_mode);
+	m->setCorePMUAccess(core_pmu_access);
+	m->setAggregationLevels(aggregation); // before the snapshots are allocated
 	/*switch (status)
 	{
 	case PCM::Success:
@@ -564,13 +776,11 @@ int main(int argc, char * argv[])
 	}*/
 
 	cout << "\nDetected " << m->getCPUBrandString() << " \"Intel(r) microarchitecture codename " << m->getUArchCodename() << "\"" << endl;
+	cout << "Initialization took " << m->getInitializationTime() * 1000. << " ms" << endl;
 
 
 	const int cpu_model = m->getCPUModel();
 
-	uint64 TimeBeforeSleep = 0;
-	uint64 TimeAfterSleep = 0;
-
 	// TLB
 	PCM::CustomCoreEventDescription descr[4];
 	PCM::CustomCoreEventDescription newDescr[3];
@@ -596,51 +806,184 @@ int main(int argc, char * argv[])
 	PCM::PCMLine tlbMode = PCM::PCMLine::TLB_LINE;
 	cout << "\n";
 
+	// With 8 general purpose counters (Intel(r) Hyper-Threading off) the TLB and the cache events
+	// are counted in the same interval and both lines are printed from it
+	const bool tlbCacheLine = (cpu_model != PCM::ATOM) && (m->getMaxCustomCoreEvents() >= 8);
+
 	freopen("output.csv", "w", stdout);
-	cout << "BEGIN";
-	while (1)
+
+	// TSC frequency, TSC, CLOCK_MONOTONIC_RAW and CLOCK_REALTIME (ns) read at the same time: converts the
+	// TSC into the time of the OS clocks (the rows end with the start and the end of their interval in
+	// CLOCK_MONOTONIC_RAW ns)
+	calibration = m->calibrateTSC();
+	cout << "BEGIN\nCLOCK;" << calibration.frequency << ';' << calibration.tsc << ';' << calibration.monotonicRaw << ';' << calibration.realtime;
+
+	if (muxSlice > 0 && !sysCmd)
 	{
-		// Fresh containers
-		std::vector<CoreCounterState> cstates1, cstates2;
-		std::vector<SocketCounterState> sktstate1, sktstate2;
-		SystemCounterState sstate1, sstate2;
+		// The groups take turns every muxSlice ms within one interval, all events are estimated for every interval
+		EventMultiplexer mux(m);
+		const bool atom = (cpu_model == PCM::ATOM);
+		std::vector<std::string> names;
+		names.push_back("DTLB_LOAD_MISSES_WALK_COMPLETE");
+		names.push_back("DTLB_MISSES_ANY");
+		if (!atom)
+		{
+			names.push_back("MEM_LOAD_RETIRED_DTLB_MISS");
+			names.push_back("MEM_STORE_RETIRED_DTLB_MISS");
+		}
+		mux.addGroup("TLB", PCM::ProgramMode::CUSTOM_CORE_EVENTS, descr, PCM::PCMLine::TLB_LINE, names);
+		names.clear();
+		if (atom)
+		{
+			names.push_back("ARCH_LLC_MISS");
+			names.push_back("ARCH_LLC_REFERENCE");
+		}
+		else
+		{
+			names.push_back("L3_MISS");
+			names.push_back("L3_UNSHARED_HIT");
+			names.push_back("L2_HITM");
+			names.push_back("L2_HIT");
+		}
+		mux.addGroup("CACHE", PCM::ProgramMode::DEFAULT_EVENTS, NULL, PCM::PCMLine::CACHE_LINE, names);
+		if (!atom)
+		{
+			names.clear();
+			names.push_back("L2_CACHE_LINE_INVALIDATION");
+			names.push_back("L1_CACHE_LINE_INVALIDATION");
+			names.push_back("REMOTELY_HOMED_RETIRED_MEM_LOAD_INSTRUCTIONS");
+			mux.addGroup("COHERENCY_MEMORY", PCM::ProgramMode::CUSTOM_CORE_EVENTS, newDescr, PCM::PCMLine::COHERENCY_MEMORY_LINE, names);
+		}
+
+		cout << "\nMUX_EVENTS";
+		for (uint32 e = 0; e < mux.getNumEvents(); ++e)
+			cout << ';' << mux.getEventGroupName(e) << '.' << mux.getEventName(e);
+
+		const uint32 slicesPerInterval = (std::max)(1U, (uint32)(delay / muxSlice + 0.5));
+		if (slicesPerInterval < mux.getNumGroups())
+			cerr << "Warning: " << slicesPerInterval << " slices per interval, some of the " << mux.getNumGroups() << " event groups are not counted in every interval" << endl;
 
+		if (traceFile)
+			cerr << "Warning: --trace is not supported with --mux, writing output.csv" << endl;
+
+		PCM::ErrorCode status = mux.start();
+		SamplingScheduler scheduler(muxSlice / 1000.);
+		while (status == PCM::Success)
+		{
+			const uint64 start = m->getTSC();
+			for (uint32 s = 1; s <= slicesPerInterval && status == PCM::Success; ++s)
+			{
+				scheduler.wait();
+				if (scheduler.getLastMissedDeadlines()) scheduler.report(cerr);
+				status = (s < slicesPerInterval) ? mux.rotate() : mux.endInterval();
+			}
+			const uint64 end = m->getTSC();
+			if (status == PCM::Success)
+				print_multiplexed(m, mux, start, end, cpu_model);
+		}
+		cerr << "Access to Intel(r) Performance Counter Monitor has denied (error code " << status << ")." << endl;
+		return -1;
+	}
+
+	if (!traceFile) print_groups_header(m);
+
+	// The counters are read into the slots of the writer ring, these are used only if the ring is full
+	CounterSnapshot spareBefore, spareAfter;
+
+	// One sample per period on absolute deadlines: programming the PMU and printing do not shift the samples
+	SamplingScheduler scheduler(delay / 1000.);
+
+	// The PMU is programmed once and kept for the whole session, the following rounds only switch
+	// the general purpose counters to the events of the next line
+	bool programmed = false;
+
+	if (traceFile)
+	{
+		try
+		{
+			trace = new CounterTraceWriter(m, traceFile, calibration);
+		}
+		catch (...)
+		{
+			return -1;
+		}
+		atexit(close_trace); // the cleanup signal handler calls exit()
+	}
+
+	// Formatting and output run in the writer thread, the sampling thread never waits for them
+	try
+	{
+		writer = new AsyncSnapshotWriter(write_record, m);
+	}
+	catch (...)
+	{
+		return -1;
+	}
+	atexit(close_writer); // runs before close_trace
+
+	while (1)
+	{
 		// Whether we should collect tlb or default
+		PCM::ErrorCode (PCM::*programLine)(PCM::ProgramMode, void *, PCM::PCMLine) = programmed ? &PCM::switchCoreEvents : &PCM::program;
 		PCM::ErrorCode status;
-		if (tlbMode == PCM::PCMLine::TLB_LINE)
-			status = m->program(PCM::ProgramMode::CUSTOM_CORE_EVENTS, &descr, PCM::PCMLine::TLB_LINE);
+		if (tlbMode == PCM::PCMLine::TLB_LINE && tlbCacheLine)
+			status = (m->*programLine)(PCM::ProgramMode::CUSTOM_CORE_EVENTS, &descr, PCM::PCMLine::TLB_CACHE_LINE);
+		else if (tlbMode == PCM::PCMLine::TLB_LINE)
+			status = (m->*programLine)(PCM::ProgramMode::CUSTOM_CORE_EVENTS, &descr, PCM::PCMLine::TLB_LINE);
 		else if( tlbMode == PCM::PCMLine::CACHE_LINE)
-			status = m->program();
+			status = (m->*programLine)(PCM::ProgramMode::DEFAULT_EVENTS, NULL, PCM::PCMLine::CACHE_LINE);
 		else if (tlbMode == PCM::PCMLine::COHERENCY_MEMORY_LINE)
-			status = m->program(PCM::ProgramMode::CUSTOM_CORE_EVENTS, &newDescr, PCM::PCMLine::COHERENCY_MEMORY_LINE);
+			status = (m->*programLine)(PCM::ProgramMode::CUSTOM_CORE_EVENTS, &newDescr, PCM::PCMLine::COHERENCY_MEMORY_LINE);
 		else
 		{
 			cout << "\nTrying to access a PCMLine enum ("<<tlbMode<<") that I don't know about. Exiting.";
 			exit(1);
 		}
+		if (status != PCM::Success)
+		{
+			cerr << "Access to Intel(r) Performance Counter Monitor has denied (error code " << status << ")." << endl;
+			return -1;
+		}
+		programmed = true;
+		const PCM::PCMLine programmedLine = (tlbMode == PCM::PCMLine::TLB_LINE && tlbCacheLine) ? PCM::PCMLine::TLB_CACHE_LINE : tlbMode;
+		if (trace && traceLines[programmedLine].name.empty())
+			traceLines[programmedLine] = CounterTraceWriter::getProgrammedLine(m, programmedLine, line_name(programmedLine));
+
+		// NULL if the writer is behind: the interval is still measured but not written
+		SnapshotRecord * record = writer->acquire();
+		CounterSnapshot & before = record ? record->before : spareBefore;
+		CounterSnapshot & after = record ? record->after : spareAfter;
 		
 		// Get the counters (t0)
-		m->getAllCounterStates(sstate1, sktstate1, cstates1);
-		TimeBeforeSleep = m->getTickCountRDTSCP(1000000);
+		m->getAllCounterStates(before);
+		const uint64 start = m->getTSC();
 
-		// Sleep (ms.)
+		// Wait for the next deadline
 		if (sysCmd) MySystem(sysCmd);
-		else MySleepMs(delay);
+		else
+		{
+			scheduler.wait();
+			if (scheduler.getLastMissedDeadlines()) scheduler.report(cerr);
+		}
 
 		// Get the counter states (t1)
-		m->getAllCounterStates(sstate2, sktstate2, cstates2);
+		m->getAllCounterStates(after);
 
-		// Get the duration of our sampling
-		TimeAfterSleep = m->getTickCountRDTSCP(1000000);
-		auto duration = (TimeAfterSleep - TimeBeforeSleep);
+		// The interval in TSC ticks, the writer converts it into the time of the OS clocks
+		const uint64 end = m->getTSC();
 
-		print_harvester(m, tlbMode, duration, cstates1, cstates2, sktstate1, sktstate2, sstate1, sstate2, cpu_model);
+		if (record)
+		{
+			record->line = programmedLine;
+			record->start = start;
+			record->end = end;
+			writer->publish();
+		}
+		if (programmedLine == PCM::PCMLine::TLB_CACHE_LINE)
+			tlbMode = PCM::PCMLine::CACHE_LINE; // counted in the same interval
 		//if (tlbMode)
 		//	print_test(m, cstates1, cstates2, sktstate1, sktstate2, sstate1, sstate2, cpu_model);
 
-		// Cleanup the PMU
-		m->cleanup();
-
 		// Switch the mode (round-roblin)
 		tlbMode = (PCM::PCMLine)( (tlbMode+1)%(PCM::PCMLine::PCM_LINES_MAX) );
 		if (sysCmd)
@@ -135,6 +135,14 @@ void measure(DS & ds, size_t repeat, size_t nelements)
     cout << "CPU cycles: " << getCycles(before_sstate, after_sstate) / 1000000 << "mln" << std::endl;
 
     cout << "Instructions per cycle: " << getCoreIPC(before_sstate, after_sstate) << std::endl;
+
+    // fine-grained measurement of a single search on the current core (user space rdpmc if available)
+    CoreCounterState before_cstate = getLocalCoreCounterState();
+    std::find(ds.begin(), ds.end(), nelements);
+    CoreCounterState after_cstate = getLocalCoreCounterState();
+
+    cout << "Single search: " << getInstructionsRetired(before_cstate, after_cstate) << " instructions, "
+         << getCycles(before_cstate, after_cstate) << " cycles" << std::endl;
 }
 
 #if 0
@@ -170,6 +178,8 @@ int main(int argc, char * argv[])
         return -1;
     }
 
+    m->setUserRdpmc(true);
+
     if(m->program() != PCM::Success){ 
 	cout << "Program was not successful..." << endl;
 	delete m;
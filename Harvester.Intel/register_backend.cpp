@@ -0,0 +1,386 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <iostream>
+#include "register_backend.h"
+#include "cpucounters.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+static const char * registerAccessTypeNames[RegisterAccess::NUM_TYPES] = {
+    "MSR_READ",
+    "MSR_WRITE",
+    "PCI_READ32",
+    "PCI_WRITE32",
+    "PCI_READ64",
+    "PCI_WRITE64",
+    "MMIO_READ32",
+    "MMIO_READ64",
+    "CPUID"
+};
+
+const char * RegisterAccess::typeName(RegisterAccess::Type type_)
+{
+    return registerAccessTypeNames[type_];
+}
+
+bool RegisterAccess::parseTypeName(const char * name, RegisterAccess::Type & type_)
+{
+    for (int i = 0; i < NUM_TYPES; ++i)
+    {
+        if (strcmp(name, registerAccessTypeNames[i]) == 0)
+        {
+            type_ = (Type)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the read type that observes the effect of a write type
+static RegisterAccess::Type readTypeOf(RegisterAccess::Type type_)
+{
+    switch (type_)
+    {
+    case RegisterAccess::MSR_WRITE:
+        return RegisterAccess::MSR_READ;
+    case RegisterAccess::PCI_WRITE32:
+        return RegisterAccess::PCI_READ32;
+    case RegisterAccess::PCI_WRITE64:
+        return RegisterAccess::PCI_READ64;
+    default:
+        return type_;
+    }
+}
+
+static bool isWrite(RegisterAccess::Type type_)
+{
+    return readTypeOf(type_) != type_;
+}
+
+// size of a successful access as returned by the Linux device handles
+static int32 accessSize(RegisterAccess::Type type_)
+{
+    switch (type_)
+    {
+    case RegisterAccess::PCI_READ32:
+    case RegisterAccess::PCI_WRITE32:
+    case RegisterAccess::MMIO_READ32:
+        return sizeof(uint32);
+    case RegisterAccess::CPUID:
+        return 0;
+    default:
+        return sizeof(uint64);
+    }
+}
+
+class BackendMutex
+{
+#ifdef _MSC_VER
+    HANDLE mutex;
+#else
+    pthread_mutex_t mutex;
+#endif
+    BackendMutex(const BackendMutex &); // forbidden
+public:
+    BackendMutex()
+    {
+#ifdef _MSC_VER
+        mutex = CreateMutex(NULL, FALSE, NULL);
+#else
+        pthread_mutex_init(&mutex, NULL);
+#endif
+    }
+    ~BackendMutex()
+    {
+#ifdef _MSC_VER
+        CloseHandle(mutex);
+#else
+        pthread_mutex_destroy(&mutex);
+#endif
+    }
+    void lock()
+    {
+#ifdef _MSC_VER
+        WaitForSingleObject(mutex, INFINITE);
+#else
+        pthread_mutex_lock(&mutex);
+#endif
+    }
+    void unlock()
+    {
+#ifdef _MSC_VER
+        ReleaseMutex(mutex);
+#else
+        pthread_mutex_unlock(&mutex);
+#endif
+    }
+};
+
+// ---------------------------------------------------------------------------
+// backend selection
+
+RegisterAccessBackend * RegisterAccessBackend::active = NULL;
+
+// the backends are never deleted: threads that outlive main (the counter watchdog, samplers)
+// may still access the registers during the static destruction
+static RegisterAccessBackend * deviceBackend()
+{
+    static RegisterAccessBackend * backend = new DeviceRegisterAccessBackend();
+    return backend;
+}
+
+static RegisterAccessBackend * environmentBackend = NULL;
+
+// flushes the recording on exit, the later accesses go to the devices unrecorded
+// (a replay stays active: the process must not touch the real devices)
+static void finishEnvironmentBackend()
+{
+    environmentBackend->endSample();
+    if (environmentBackend->usesDevices() && RegisterAccessBackend::get() == environmentBackend) RegisterAccessBackend::set(NULL);
+}
+
+void RegisterAccessBackend::set(RegisterAccessBackend * backend)
+{
+    active = backend ? backend : deviceBackend();
+}
+
+void RegisterAccessBackend::init()
+{
+    active = deviceBackend();
+    const char * env = getenv("PCM_REGISTER_BACKEND");
+    if (!env || !*env) return;
+    try
+    {
+        if (strncmp(env, "record:", 7) == 0)
+            environmentBackend = new RecordingRegisterAccessBackend(env + 7);
+        else if (strncmp(env, "replay:", 7) == 0)
+            environmentBackend = new ReplayRegisterAccessBackend(env + 7);
+        else
+            std::cerr << "Unknown PCM_REGISTER_BACKEND value '" << env << "', using the devices." << std::endl;
+    }
+    catch (...)
+    {
+        std::cerr << "Can not initialize the register access backend '" << env << "', using the devices." << std::endl;
+    }
+    if (environmentBackend)
+    {
+        active = environmentBackend;
+        atexit(finishEnvironmentBackend);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// recording backend
+
+struct RecordingRegisterAccessBackend::Impl
+{
+    FILE * file;
+    uint64 start;
+    BackendMutex mutex;
+
+    static uint64 now() // in ns
+    {
+#ifdef _MSC_VER
+        LARGE_INTEGER freq, count;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&count);
+        return uint64(double(count.QuadPart) * 1e9 / double(freq.QuadPart));
+#else
+        struct timeval tp;
+        gettimeofday(&tp, NULL);
+        return uint64(tp.tv_sec) * 1000000000ULL + uint64(tp.tv_usec) * 1000ULL;
+#endif
+    }
+};
+
+RecordingRegisterAccessBackend::RecordingRegisterAccessBackend(const char * path) : impl(new Impl)
+{
+    impl->file = fopen(path, "w");
+    if (!impl->file)
+    {
+        delete impl;
+        std::cerr << "Can not create the register access recording " << path << std::endl;
+        throw std::exception();
+    }
+    impl->start = Impl::now();
+}
+
+RecordingRegisterAccessBackend::~RecordingRegisterAccessBackend()
+{
+    fclose(impl->file);
+    delete impl;
+}
+
+int32 RecordingRegisterAccessBackend::access(RegisterDevice * device, RegisterAccess & a)
+{
+    const int32 result = device->deviceAccess(a);
+    const uint64 t = Impl::now() - impl->start;
+
+    impl->mutex.lock();
+    fprintf(impl->file, "%llu %s %llx %llx %llx %llx %d\n", t, RegisterAccess::typeName(a.type),
+            a.unit, a.address, a.value[0], a.value[1], result);
+    impl->mutex.unlock();
+    return result;
+}
+
+void RecordingRegisterAccessBackend::endSample()
+{
+    impl->mutex.lock();
+    fflush(impl->file); // keep the recording usable if the process is killed
+    impl->mutex.unlock();
+}
+
+void RecordingRegisterAccessBackend::writeTopology(const std::vector<TopologyEntry> & topology)
+{
+    impl->mutex.lock();
+    for (size_t i = 0; i < topology.size(); ++i)
+        fprintf(impl->file, "0 TOPOLOGY %d %d %d %d %d %d\n", topology[i].os_id, topology[i].socket, topology[i].core_id,
+                topology[i].numa_node, topology[i].l3_id, topology[i].thread_id);
+    fflush(impl->file);
+    impl->mutex.unlock();
+}
+
+// ---------------------------------------------------------------------------
+// replay backend
+
+struct ReplayRegisterAccessBackend::Impl
+{
+    struct Key
+    {
+        int32 type;
+        uint64 unit, address;
+        Key(int32 type_, uint64 unit_, uint64 address_) : type(type_), unit(unit_), address(address_) { }
+        bool operator < (const Key & o) const
+        {
+            if (type != o.type) return type < o.type;
+            if (unit != o.unit) return unit < o.unit;
+            return address < o.address;
+        }
+    };
+    struct Sample
+    {
+        uint64 value[2];
+        int32 result;
+    };
+    struct Register
+    {
+        std::vector<Sample> samples;
+        size_t next;
+        Register() : next(0) { }
+    };
+
+    std::map<Key, Register> recorded;
+    std::map<Key, uint64> written;
+    std::vector<TopologyEntry> topology;
+    BackendMutex mutex;
+};
+
+ReplayRegisterAccessBackend::ReplayRegisterAccessBackend(const char * path) : impl(new Impl)
+{
+    FILE * file = fopen(path, "r");
+    if (!file)
+    {
+        delete impl;
+        std::cerr << "Can not open the register access recording " << path << std::endl;
+        throw std::exception();
+    }
+    char line[256];
+    char name[32];
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned long long t = 0, unit = 0, address = 0, value0 = 0, value1 = 0;
+        int result = 0;
+        if (sscanf(line, "%llu %31s", &t, name) != 2) continue;
+
+        if (strcmp(name, "TOPOLOGY") == 0)
+        {
+            TopologyEntry entry;
+            // older recordings have no NUMA node, L3 and thread ids
+            if (sscanf(line, "%llu %31s %d %d %d %d %d %d", &t, name, &entry.os_id, &entry.socket, &entry.core_id,
+                       &entry.numa_node, &entry.l3_id, &entry.thread_id) >= 5)
+                impl->topology.push_back(entry);
+            continue;
+        }
+        RegisterAccess::Type type_;
+        if (!RegisterAccess::parseTypeName(name, type_)) continue;
+        if (isWrite(type_)) continue; // writes are not replayed, the recording only documents them
+        if (sscanf(line, "%llu %31s %llx %llx %llx %llx %d", &t, name, &unit, &address, &value0, &value1, &result) != 7) continue;
+
+        Impl::Sample sample;
+        sample.value[0] = value0;
+        sample.value[1] = value1;
+        sample.result = result;
+        impl->recorded[Impl::Key(type_, unit, address)].samples.push_back(sample);
+    }
+    fclose(file);
+}
+
+ReplayRegisterAccessBackend::~ReplayRegisterAccessBackend()
+{
+    delete impl;
+}
+
+int32 ReplayRegisterAccessBackend::access(RegisterDevice * /* device */, RegisterAccess & a)
+{
+    const Impl::Key key(readTypeOf(a.type), a.unit, a.address);
+    int32 result = accessSize(a.type);
+
+    impl->mutex.lock();
+    if (isWrite(a.type))
+    {
+        impl->written[key] = a.value[0];
+    }
+    else
+    {
+        std::map<Impl::Key, Impl::Register>::iterator r = impl->recorded.find(key);
+        std::map<Impl::Key, uint64>::const_iterator w = impl->written.find(key);
+        if (r != impl->recorded.end())
+        {
+            Impl::Register & reg = r->second;
+            const Impl::Sample & sample = reg.samples[reg.next];
+            if (reg.next + 1 < reg.samples.size()) ++reg.next;
+            a.value[0] = sample.value[0];
+            a.value[1] = sample.value[1];
+            result = sample.result;
+        }
+        else if (w != impl->written.end())
+        {
+            a.value[0] = w->second;
+            a.value[1] = 0;
+        }
+        else
+        {
+            a.value[0] = 0;
+            a.value[1] = 0;
+        }
+    }
+    impl->mutex.unlock();
+    return result;
+}
+
+bool ReplayRegisterAccessBackend::readTopology(std::vector<TopologyEntry> & topology)
+{
+    if (impl->topology.empty()) return false;
+    topology = impl->topology;
+    return true;
+}
@@ -0,0 +1,185 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_REGISTER_BACKEND_H
+#define CPUCounters_REGISTER_BACKEND_H
+
+/*!     \file register_backend.h
+        \brief Pluggable access to hardware registers (MSRs, PCI configuration space, memory mapped I/O, CPUID)
+
+        All register accesses of MsrHandle, PciHandle/PciHandleM/PciHandleMM, ClientBW and the CPUID
+        instruction go through the active backend:
+          - the device backend (default) accesses the real devices
+          - the recording backend accesses the real devices and logs every access with a timestamp to a file
+          - the replay backend serves all accesses from such a file, no device is opened (Linux)
+
+        The backend is selected with the PCM_REGISTER_BACKEND environment variable
+        ("record:<file>" or "replay:<file>") or with RegisterAccessBackend::set().
+*/
+
+#include "types.h"
+#include <vector>
+
+struct TopologyEntry;
+
+//! \brief Description of a single register access
+struct RegisterAccess
+{
+    enum Type {
+        MSR_READ = 0,
+        MSR_WRITE,
+        PCI_READ32,
+        PCI_WRITE32,
+        PCI_READ64,
+        PCI_WRITE64,
+        MMIO_READ32,
+        MMIO_READ64,
+        CPUID,
+        NUM_TYPES
+    };
+
+    Type type;
+    uint64 unit;        // core for MSR and CPUID, RegisterAccess::pciUnit() for PCI, physical base address for MMIO
+    uint64 address;     // register address or offset, leaf for CPUID
+    uint64 value[2];    // value read or written; CPUID: eax | ebx << 32, ecx | edx << 32
+
+    RegisterAccess(Type type_, uint64 unit_, uint64 address_, uint64 value_ = 0) :
+        type(type_), unit(unit_), address(address_)
+    {
+        value[0] = value_;
+        value[1] = 0;
+    }
+
+    static uint64 pciUnit(uint32 groupnr, uint32 bus, uint32 device, uint32 function)
+    {
+        return (uint64(groupnr) << 16) | (bus << 8) | (device << 3) | function;
+    }
+
+    static const char * typeName(Type type_);
+    static bool parseTypeName(const char * name, Type & type_);
+};
+
+//! \brief Object that can perform a register access on the real hardware (implemented by the register handles)
+class RegisterDevice
+{
+public:
+    //! \return the result of the underlying device call (as returned by the read/write methods of the handle)
+    virtual int32 deviceAccess(RegisterAccess & a) = 0;
+    virtual ~RegisterDevice() { }
+};
+
+//! \brief Backend through which all register accesses are performed
+class RegisterAccessBackend
+{
+public:
+    /*! \brief Performs a register access
+        \param device handle that can do the access on the real hardware (may be unused by the backend)
+        \param a access description, the values read are returned in a.value
+        \return result of the access as returned by the device handles
+    */
+    virtual int32 access(RegisterDevice * device, RegisterAccess & a) = 0;
+
+    //! \brief false if the backend does not need the hardware devices (handles do not open them)
+    virtual bool usesDevices() const { return true; }
+
+    //! \brief true if the accesses go straight to the devices (handles may use their own batched paths)
+    virtual bool passThrough() const { return false; }
+
+    //! \brief Fills the CPU topology if the backend provides it \return false if the topology must be read from the OS
+    virtual bool readTopology(std::vector<TopologyEntry> & /* topology */) { return false; }
+
+    //! \brief Notifies the backend about the topology read from the OS
+    virtual void writeTopology(const std::vector<TopologyEntry> & /* topology */) { }
+
+    //! \brief Called after all counters of a sample were read (e.g. to flush buffered output)
+    virtual void endSample() { }
+
+    virtual ~RegisterAccessBackend() { }
+
+    //! \brief Returns the active backend (created from PCM_REGISTER_BACKEND on the first call)
+    static RegisterAccessBackend * get()
+    {
+        if (!active) init();
+        return active;
+    }
+
+    /*! \brief Sets the active backend, must be called before the PCM instance is created
+        \param backend new backend (owned by the caller) or NULL to return to the device backend
+    */
+    static void set(RegisterAccessBackend * backend);
+
+private:
+    static RegisterAccessBackend * active;
+    static void init();
+};
+
+//! \brief Accesses the real devices
+class DeviceRegisterAccessBackend : public RegisterAccessBackend
+{
+public:
+    int32 access(RegisterDevice * device, RegisterAccess & a)
+    {
+        return device->deviceAccess(a);
+    }
+    bool passThrough() const { return true; }
+};
+
+/*! \brief Accesses the real devices and logs every access to a text file
+
+    One access per line: "<ns since start> <type> <unit> <address> <value0> <value1> <result>",
+    unit, address and values in hex. The CPU topology is logged as
+    "0 TOPOLOGY <os_id> <socket> <core_id> <numa_node> <l3_id> <thread_id>" lines. The file is flushed
+    after every sample (see endSample) and when the backend is destroyed.
+*/
+class RecordingRegisterAccessBackend : public RegisterAccessBackend
+{
+    struct Impl;
+    Impl * impl;
+
+    RecordingRegisterAccessBackend();                                    // forbidden
+    RecordingRegisterAccessBackend(const RecordingRegisterAccessBackend &); // forbidden
+
+public:
+    //! throws std::exception if the file can not be created
+    RecordingRegisterAccessBackend(const char * path);
+    ~RecordingRegisterAccessBackend();
+    int32 access(RegisterDevice * device, RegisterAccess & a);
+    void writeTopology(const std::vector<TopologyEntry> & topology);
+    void endSample();
+};
+
+/*! \brief Serves register accesses from a file written by RecordingRegisterAccessBackend
+
+    Replay is deterministic: reads of a register return the recorded values of that register in the
+    recorded order, the last value is repeated when the recording is exhausted. Registers that were
+    never recorded return the last value written to them or 0 (simulated registers). Writes succeed
+    and do not touch any device.
+*/
+class ReplayRegisterAccessBackend : public RegisterAccessBackend
+{
+    struct Impl;
+    Impl * impl;
+
+    ReplayRegisterAccessBackend();                                 // forbidden
+    ReplayRegisterAccessBackend(const ReplayRegisterAccessBackend &); // forbidden
+
+public:
+    //! throws std::exception if the file can not be read
+    ReplayRegisterAccessBackend(const char * path);
+    ~ReplayRegisterAccessBackend();
+    int32 access(RegisterDevice * device, RegisterAccess & a);
+    bool usesDevices() const { return false; }
+    bool readTopology(std::vector<TopologyEntry> & topology);
+};
+
+#endif
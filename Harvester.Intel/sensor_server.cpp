@@ -0,0 +1,305 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "sensor_server.h"
+#include <iostream>
+#include <exception>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sstream>
+
+#define PCM_SENSOR_SERVER_EVENTS (64)   // epoll events handled per wakeup
+#define PCM_SENSOR_SERVER_READ (4096)   // bytes read per recv call
+
+static bool setNonBlocking(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+SensorServer::SensorServer(const char * path_, unsigned mode_, const std::string & greeting_, Handler handler_, void * context_) :
+    path(path_),
+    mode(mode_ & 0777),
+    greeting(greeting_),
+    handler(handler_),
+    context(context_),
+    listenFd(-1),
+    epollFd(-1)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Invalid socket path " << path << std::endl;
+        throw std::exception();
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str()); // left over by a previous instance
+    listen((struct sockaddr *)&address, sizeof(address), path);
+}
+
+SensorServer::SensorServer(int port, const std::string & greeting_, Handler handler_, void * context_) :
+    mode(0),
+    greeting(greeting_),
+    handler(handler_),
+    context(context_),
+    listenFd(-1),
+    epollFd(-1)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::ostringstream name;
+    name << "127.0.0.1:" << port;
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    if (listenFd >= 0) setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    listen((struct sockaddr *)&address, sizeof(address), name.str());
+}
+
+void SensorServer::listen(struct sockaddr * address, unsigned length, const std::string & name)
+{
+    if (listenFd < 0)
+    {
+        std::cerr << "Can not create a socket: " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+    // the socket file is created without more permissions than requested, then set to them exactly
+    const mode_t oldMask = path.empty() ? 0 : umask(~mode & 0777);
+    const bool bound = (bind(listenFd, address, length) == 0);
+    if (!path.empty()) umask(oldMask);
+    if (!bound || (!path.empty() && chmod(path.c_str(), mode) != 0) || ::listen(listenFd, SOMAXCONN) != 0 || !setNonBlocking(listenFd))
+    {
+        std::cerr << "Can not listen on " << name << ": " << strerror(errno) << std::endl;
+        ::close(listenFd);
+        if (bound && !path.empty()) unlink(path.c_str());
+        throw std::exception();
+    }
+
+    epollFd = epoll_create(PCM_SENSOR_SERVER_EVENTS);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0)
+    {
+        std::cerr << "Can not create the epoll instance: " << strerror(errno) << std::endl;
+        if (epollFd >= 0) ::close(epollFd);
+        ::close(listenFd);
+        if (!path.empty()) unlink(path.c_str());
+        throw std::exception();
+    }
+}
+
+SensorServer::~SensorServer()
+{
+    while (!clients.empty()) close(clients.begin()->first);
+    ::close(epollFd);
+    ::close(listenFd);
+    if (!path.empty()) unlink(path.c_str());
+}
+
+void SensorServer::run()
+{
+    struct epoll_event events[PCM_SENSOR_SERVER_EVENTS];
+    while (true)
+    {
+        const int n = epoll_wait(epollFd, events, PCM_SENSOR_SERVER_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            return;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == listenFd)
+            {
+                accept();
+                continue;
+            }
+            std::map<int, Client>::iterator c = clients.find(fd);
+            if (c == clients.end()) continue; // closed while handling an earlier event
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close(fd);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) receive(fd, c->second);
+            else if (events[i].events & EPOLLOUT) send(fd, c->second);
+        }
+    }
+}
+
+void SensorServer::accept()
+{
+    while (true)
+    {
+        const int fd = ::accept(listenFd, NULL, NULL);
+        if (fd < 0) return; // EAGAIN: no more pending connections
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (!setNonBlocking(fd) || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            ::close(fd);
+            continue;
+        }
+        Client & client = clients[fd];
+        client.out = greeting;
+        send(fd, client);
+    }
+}
+
+void SensorServer::receive(int fd, Client & client)
+{
+    char buffer[PCM_SENSOR_SERVER_READ];
+    while (!client.closing)
+    {
+        const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            close(fd);
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        client.in.append(buffer, size_t(n));
+
+        // answer the complete lines as they arrive, the replies of a batch of lines are sent together
+        size_t begin = 0, end;
+        while (!client.closing && (end = client.in.find('\n', begin)) != std::string::npos)
+        {
+            size_t length = end - begin;
+            if (length && client.in[end - 1] == '\r') --length;
+            if (!handler(client.in.substr(begin, length), client.session, client.out, context)) client.closing = true;
+            begin = end + 1;
+        }
+        client.in.erase(0, begin);
+        // a client that streams faster than it reads (or without line ends) must not grow the buffers
+        if (client.in.size() > PCM_SENSOR_SERVER_MAX_LINE || client.out.size() - client.sent > PCM_SENSOR_SERVER_MAX_BACKLOG)
+        {
+            close(fd);
+            return;
+        }
+    }
+    send(fd, client);
+}
+
+void SensorServer::send(int fd, Client & client)
+{
+    while (client.sent < client.out.size())
+    {
+        const ssize_t n = ::send(fd, client.out.data() + client.sent, client.out.size() - client.sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            close(fd);
+            return;
+        }
+        client.sent += size_t(n);
+    }
+    if (client.sent == client.out.size())
+    {
+        client.out.clear();
+        client.sent = 0;
+        if (client.closing)
+        {
+            close(fd);
+            return;
+        }
+    }
+    else if (client.out.size() - client.sent > PCM_SENSOR_SERVER_MAX_BACKLOG)
+    {
+        close(fd); // the client does not read its replies
+        return;
+    }
+
+    // wait for EPOLLOUT only while replies are pending
+    const bool writing = !client.out.empty();
+    if (writing != client.writing)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = writing ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+        client.writing = writing;
+    }
+}
+
+void SensorServer::close(int fd)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    ::close(fd);
+    clients.erase(fd);
+}
+
+#else
+
+SensorServer::SensorServer(const char * path_, unsigned mode_, const std::string & greeting_, Handler handler_, void * context_) :
+    path(path_),
+    mode(mode_ & 0777),
+    greeting(greeting_),
+    handler(handler_),
+    context(context_),
+    listenFd(-1),
+    epollFd(-1)
+{
+    std::cerr << "The sensor server is implemented only for Linux" << std::endl;
+    throw std::exception();
+}
+
+SensorServer::SensorServer(int, const std::string & greeting_, Handler handler_, void * context_) :
+    mode(0),
+    greeting(greeting_),
+    handler(handler_),
+    context(context_),
+    listenFd(-1),
+    epollFd(-1)
+{
+    std::cerr << "The sensor server is implemented only for Linux" << std::endl;
+    throw std::exception();
+}
+
+SensorServer::~SensorServer() { }
+void SensorServer::run() { }
+void SensorServer::listen(struct sockaddr *, unsigned, const std::string &) { }
+void SensorServer::accept() { }
+void SensorServer::receive(int, Client &) { }
+void SensorServer::send(int, Client &) { }
+void SensorServer::close(int) { }
+
+#endif
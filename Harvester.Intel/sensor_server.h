@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_SENSOR_SERVER_H
+#define CPUCounters_SENSOR_SERVER_H
+
+/*!     \file sensor_server.h
+        \brief Line based request/reply server on a Unix domain socket or a localhost TCP port
+        (used by pcm-sensor --server and pcm-exporter)
+
+        One thread serves all clients with epoll and non-blocking sockets. Every complete line received from
+        a client is passed to the handler, the reply is queued and written as fast as the client reads it.
+        A client that sends a line longer than PCM_SENSOR_SERVER_MAX_LINE or does not read more than
+        PCM_SENSOR_SERVER_MAX_BACKLOG bytes of replies is disconnected. Implemented only for Linux.
+*/
+
+#include <string>
+#include <map>
+
+struct sockaddr;
+
+#define PCM_SENSOR_SERVER_MAX_LINE (64 * 1024)
+#define PCM_SENSOR_SERVER_MAX_BACKLOG (4 * 1024 * 1024)
+
+class SensorServer
+{
+public:
+    /*! \brief Answers one line of a client
+        \param line the line without the line end
+        \param session state of the connection kept between the lines, empty for a new client
+        \param reply the answer is appended to it
+        \param context passed to the constructor
+        \return false to close the connection after the reply is sent
+    */
+    typedef bool (*Handler)(const std::string & line, std::string & session, std::string & reply, void * context);
+
+    /*! \brief Creates the socket (an existing socket file is replaced)
+        \param path_ file name of the socket
+        \param mode_ permissions of the socket file (e.g. 0600: only the owner can connect), set regardless of the umask
+        \param greeting_ sent to every new client
+        \param handler_ called for every line
+        \param context_ passed to the handler
+        throws std::exception if the socket can not be created
+    */
+    SensorServer(const char * path_, unsigned mode_, const std::string & greeting_, Handler handler_, void * context_);
+
+    /*! \brief Listens on a TCP port of the loopback interface (127.0.0.1)
+        \param port TCP port
+        \param greeting_ sent to every new client
+        \param handler_ called for every line
+        \param context_ passed to the handler
+        throws std::exception if the port can not be bound
+    */
+    SensorServer(int port, const std::string & greeting_, Handler handler_, void * context_);
+    //! \brief Disconnects the clients and removes the socket file (if any)
+    ~SensorServer();
+
+    //! \brief Serves the clients, returns only on an error
+    void run();
+
+private:
+    struct Client
+    {
+        std::string in, out;    // received bytes not yet processed, reply bytes not yet sent
+        std::string session;    // see Handler
+        size_t sent;            // bytes of out already sent
+        bool closing;           // close once out is sent
+        bool writing;           // waiting for EPOLLOUT
+        Client() : sent(0), closing(false), writing(false) { }
+    };
+
+    std::string path;           // empty for TCP
+    unsigned mode;              // permissions of the socket file
+    std::string greeting;
+    Handler handler;
+    void * context;
+    int listenFd;
+    int epollFd;
+    std::map<int, Client> clients;
+
+    void listen(struct sockaddr * address, unsigned length, const std::string & name);
+    void accept();
+    void receive(int fd, Client & client);
+    void send(int fd, Client & client);
+    void close(int fd);
+
+    SensorServer();                 // forbidden
+    SensorServer(SensorServer &);   // forbidden
+};
+
+#endif
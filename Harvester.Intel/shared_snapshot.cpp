@@ -0,0 +1,341 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "shared_snapshot.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+
+#define PCM_SHARED_SNAPSHOT_MAGIC (0x50434d534e415053ULL) // "PCMSNAPS"
+#define PCM_SHARED_SNAPSHOT_VERSION (1)
+#define PCM_CACHE_LINE (64)
+#define PCM_SHARED_SNAPSHOT_SPINS (1024)            // busy retries of a reader before it yields the CPU
+#define PCM_SHARED_SNAPSHOT_MAX_RETRIES (1 << 20)   // retries of a reader before it gives up
+
+// at the start of the segment
+struct SharedSnapshotHeader
+{
+    uint64 magic;
+    uint32 version;
+    // sizes of the state classes: the readers must be built with the same layout
+    uint32 coreStateSize, socketStateSize, basicStateSize, uncoreStateSize;
+    uint32 numCores, numSockets, qpiLinksPerSocket, historySize;
+    int32 cpuModel;
+    int32 publisherPid;
+    uint64 nominalFrequency;
+    double period;
+    char padding[PCM_CACHE_LINE];   // keeps the epoch on its own cache line
+    volatile uint64 epoch;          // epoch of the latest complete snapshot
+};
+
+// at the start of every slot, followed by the states
+struct SharedSnapshotSlot
+{
+    volatile uint64 seq;    // odd while the slot is written
+    uint64 epoch;
+    uint64 timestamp;
+};
+
+static uint64 roundUp(uint64 value)
+{
+    return (value + PCM_CACHE_LINE - 1) & ~(uint64)(PCM_CACHE_LINE - 1);
+}
+
+SharedSnapshotLayout::SharedSnapshotLayout(uint32 numCores_, uint32 numSockets_, uint32 qpiLinksPerSocket_, uint32 historySize_) :
+    numCores(numCores_), numSockets(numSockets_), qpiLinksPerSocket(qpiLinksPerSocket_), historySize(historySize_)
+{
+    coresOffset = roundUp(sizeof(SharedSnapshotSlot));
+    socketsOffset = roundUp(coresOffset + numCores * sizeof(CoreCounterState));
+    systemBasicOffset = roundUp(socketsOffset + numSockets * sizeof(SocketCounterState));
+    systemUncoreOffset = roundUp(systemBasicOffset + sizeof(BasicCounterState));
+    qpiOffset = roundUp(systemUncoreOffset + sizeof(UncoreCounterState));
+    slotSize = roundUp(qpiOffset + 3 * numSockets * qpiLinksPerSocket * sizeof(uint64));
+    slotsOffset = roundUp(sizeof(SharedSnapshotHeader));
+    segmentSize = slotsOffset + historySize * slotSize;
+}
+
+static bool isProcessAlive(int32 pid)
+{
+    // EPERM: the process exists but belongs to another user
+    return pid > 0 && (kill((pid_t)pid, 0) == 0 || errno == EPERM);
+}
+
+static uint64 monotonicNs()
+{
+#ifdef __APPLE__
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return uint64(tv.tv_sec) * 1000000000ULL + uint64(tv.tv_usec) * 1000ULL;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64(ts.tv_sec) * 1000000000ULL + uint64(ts.tv_nsec);
+#endif
+}
+
+SharedSnapshotPublisher::SharedSnapshotPublisher(const char * name_, uint32 historySize, double period) :
+    name(name_),
+    layout(PCM::getInstance()->getNumCores(), PCM::getInstance()->getNumSockets(), (uint32)PCM::getInstance()->getQPILinksPerSocket(), historySize ? historySize : 1),
+    base(NULL)
+{
+    PCM * m = PCM::getInstance();
+
+    // remove the segment of a previous publisher only if that publisher is gone
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd >= 0)
+    {
+        int32 pid = 0;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64)st.st_size >= sizeof(SharedSnapshotHeader))
+        {
+            void * mem = mmap(NULL, sizeof(SharedSnapshotHeader), PROT_READ, MAP_SHARED, fd, 0);
+            if (mem != MAP_FAILED)
+            {
+                const SharedSnapshotHeader * header = (const SharedSnapshotHeader *)mem;
+                if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == PCM_SHARED_SNAPSHOT_MAGIC)
+                    pid = header->publisherPid;
+                munmap(mem, sizeof(SharedSnapshotHeader));
+            }
+        }
+        close(fd);
+        if (pid != (int32)getpid() && isProcessAlive(pid))
+        {
+            std::cerr << "PCM Error: shared memory segment " << name << " is published by the running process " << pid << std::endl;
+            throw std::exception();
+        }
+        shm_unlink(name.c_str());
+    }
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+    {
+        std::cerr << "PCM Error: can not create shared memory segment " << name << std::endl;
+        throw std::exception();
+    }
+    if (ftruncate(fd, layout.segmentSize) != 0)
+    {
+        std::cerr << "PCM Error: can not resize shared memory segment " << name << std::endl;
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::exception();
+    }
+    void * mem = mmap(NULL, layout.segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        std::cerr << "PCM Error: can not map shared memory segment " << name << std::endl;
+        shm_unlink(name.c_str());
+        throw std::exception();
+    }
+    base = (char *)mem; // zero-filled by ftruncate
+
+    SharedSnapshotHeader * header = (SharedSnapshotHeader *)base;
+    header->version = PCM_SHARED_SNAPSHOT_VERSION;
+    header->coreStateSize = sizeof(CoreCounterState);
+    header->socketStateSize = sizeof(SocketCounterState);
+    header->basicStateSize = sizeof(BasicCounterState);
+    header->uncoreStateSize = sizeof(UncoreCounterState);
+    header->numCores = layout.numCores;
+    header->numSockets = layout.numSockets;
+    header->qpiLinksPerSocket = layout.qpiLinksPerSocket;
+    header->historySize = layout.historySize;
+    header->cpuModel = m->getCPUModel();
+    header->publisherPid = (int32)getpid();
+    header->nominalFrequency = m->getNominalFrequency();
+    header->period = period;
+    header->epoch = 0;
+    // the readers check the magic last
+    __atomic_store_n(&header->magic, PCM_SHARED_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+}
+
+SharedSnapshotPublisher::~SharedSnapshotPublisher()
+{
+    if (base) munmap(base, layout.segmentSize);
+    shm_unlink(name.c_str());
+}
+
+void SharedSnapshotPublisher::publish(const CounterSnapshot & snapshot)
+{
+    SharedSnapshotHeader * header = (SharedSnapshotHeader *)base;
+    const uint64 epoch = header->epoch + 1;
+    char * slotBase = base + layout.slotsOffset + ((epoch - 1) % layout.historySize) * layout.slotSize;
+    SharedSnapshotSlot * slot = (SharedSnapshotSlot *)slotBase;
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->epoch = epoch;
+    slot->timestamp = monotonicNs();
+    memcpy(slotBase + layout.coresOffset, &snapshot.cores[0], layout.numCores * sizeof(CoreCounterState));
+    memcpy(slotBase + layout.socketsOffset, &snapshot.sockets[0], layout.numSockets * sizeof(SocketCounterState));
+    memcpy(slotBase + layout.systemBasicOffset, static_cast<const BasicCounterState *>(&snapshot.system), sizeof(BasicCounterState));
+    memcpy(slotBase + layout.systemUncoreOffset, static_cast<const UncoreCounterState *>(&snapshot.system), sizeof(UncoreCounterState));
+    uint64 * qpi = (uint64 *)(slotBase + layout.qpiOffset);
+    const uint32 links = layout.numSockets * layout.qpiLinksPerSocket;
+    for (uint32 s = 0; s < layout.numSockets; ++s)
+    {
+        for (uint32 l = 0; l < layout.qpiLinksPerSocket; ++l)
+        {
+            const uint32 i = s * layout.qpiLinksPerSocket + l;
+            qpi[i] = snapshot.system.incomingQPIPackets[s][l];
+            qpi[links + i] = snapshot.system.outgoingQPIDataNonDataFlits[s][l];
+            qpi[2 * links + i] = snapshot.system.outgoingQPIIdleFlits[s][l];
+        }
+    }
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->epoch, epoch, __ATOMIC_RELEASE);
+}
+
+SharedSnapshotReader::SharedSnapshotReader(const char * name) : layout(NULL), base(NULL), size(0)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        std::cerr << "PCM Error: shared memory segment " << name << " does not exist (is pcm-daemon.x running?)" << std::endl;
+        throw std::exception();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64)st.st_size < sizeof(SharedSnapshotHeader))
+    {
+        close(fd);
+        std::cerr << "PCM Error: shared memory segment " << name << " is not initialized" << std::endl;
+        throw std::exception();
+    }
+    size = st.st_size;
+    void * mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        std::cerr << "PCM Error: can not map shared memory segment " << name << std::endl;
+        throw std::exception();
+    }
+    base = (const char *)mem;
+
+    const SharedSnapshotHeader * header = (const SharedSnapshotHeader *)base;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != PCM_SHARED_SNAPSHOT_MAGIC
+        || header->version != PCM_SHARED_SNAPSHOT_VERSION
+        || header->coreStateSize != sizeof(CoreCounterState)
+        || header->socketStateSize != sizeof(SocketCounterState)
+        || header->basicStateSize != sizeof(BasicCounterState)
+        || header->uncoreStateSize != sizeof(UncoreCounterState))
+    {
+        munmap((void *)base, size);
+        std::cerr << "PCM Error: shared memory segment " << name << " was created by an incompatible version of PCM" << std::endl;
+        throw std::exception();
+    }
+    layout = new SharedSnapshotLayout(header->numCores, header->numSockets, header->qpiLinksPerSocket, header->historySize);
+    if (layout->segmentSize > size)
+    {
+        delete layout;
+        munmap((void *)base, size);
+        std::cerr << "PCM Error: shared memory segment " << name << " is truncated" << std::endl;
+        throw std::exception();
+    }
+}
+
+SharedSnapshotReader::~SharedSnapshotReader()
+{
+    delete layout;
+    munmap((void *)base, size);
+}
+
+int32 SharedSnapshotReader::getCPUModel() const { return ((const SharedSnapshotHeader *)base)->cpuModel; }
+uint64 SharedSnapshotReader::getNominalFrequency() const { return ((const SharedSnapshotHeader *)base)->nominalFrequency; }
+double SharedSnapshotReader::getPeriod() const { return ((const SharedSnapshotHeader *)base)->period; }
+int32 SharedSnapshotReader::getPublisherPid() const { return ((const SharedSnapshotHeader *)base)->publisherPid; }
+bool SharedSnapshotReader::isPublisherAlive() const { return isProcessAlive(getPublisherPid()); }
+
+bool SharedSnapshotReader::backOff(uint32 & retries) const
+{
+    ++retries;
+    if (retries % PCM_SHARED_SNAPSHOT_SPINS)
+    {
+        __asm__ __volatile__ ("pause" ::: "memory");
+        return true;
+    }
+    // the publisher may have been preempted while writing: let it run, but not forever
+    if (retries >= PCM_SHARED_SNAPSHOT_MAX_RETRIES || !isPublisherAlive()) return false;
+    sched_yield();
+    return true;
+}
+
+uint64 SharedSnapshotReader::getEpoch() const
+{
+    return __atomic_load_n(&((const SharedSnapshotHeader *)base)->epoch, __ATOMIC_ACQUIRE);
+}
+
+bool SharedSnapshotReader::read(uint64 epoch, SharedCounterSnapshot & snapshot) const
+{
+    const uint64 latest = getEpoch();
+    if (epoch == 0 || epoch > latest || latest - epoch >= layout->historySize) return false;
+
+    const char * slotBase = base + layout->slotsOffset + ((epoch - 1) % layout->historySize) * layout->slotSize;
+    const SharedSnapshotSlot * slot = (const SharedSnapshotSlot *)slotBase;
+    const uint32 links = layout->numSockets * layout->qpiLinksPerSocket;
+
+    snapshot.cores.resize(layout->numCores);
+    snapshot.sockets.resize(layout->numSockets);
+    snapshot.incomingQPIPackets.resize(links);
+    snapshot.outgoingQPIDataNonDataFlits.resize(links);
+    snapshot.outgoingQPIIdleFlits.resize(links);
+
+    uint32 retries = 0;
+    while (true)
+    {
+        const uint64 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) // being written, takes a few microseconds
+        {
+            if (!backOff(retries)) return false;
+            continue;
+        }
+
+        snapshot.epoch = slot->epoch;
+        snapshot.timestamp = slot->timestamp;
+        memcpy(&snapshot.cores[0], slotBase + layout->coresOffset, layout->numCores * sizeof(CoreCounterState));
+        memcpy(&snapshot.sockets[0], slotBase + layout->socketsOffset, layout->numSockets * sizeof(SocketCounterState));
+        memcpy(static_cast<BasicCounterState *>(&snapshot.system), slotBase + layout->systemBasicOffset, sizeof(BasicCounterState));
+        memcpy(static_cast<UncoreCounterState *>(&snapshot.system), slotBase + layout->systemUncoreOffset, sizeof(UncoreCounterState));
+        if (links)
+        {
+            const uint64 * qpi = (const uint64 *)(slotBase + layout->qpiOffset);
+            memcpy(&snapshot.incomingQPIPackets[0], qpi, links * sizeof(uint64));
+            memcpy(&snapshot.outgoingQPIDataNonDataFlits[0], qpi + links, links * sizeof(uint64));
+            memcpy(&snapshot.outgoingQPIIdleFlits[0], qpi + 2 * links, links * sizeof(uint64));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) break;
+        if (!backOff(retries)) return false;
+    }
+    return snapshot.epoch == epoch; // false if the slot was reused for a newer snapshot meanwhile
+}
+
+bool SharedSnapshotReader::readLatest(SharedCounterSnapshot & snapshot) const
+{
+    uint32 retries = 0;
+    while (true)
+    {
+        const uint64 epoch = getEpoch();
+        if (epoch == 0) return false;
+        if (read(epoch, snapshot)) return true;
+        if (!backOff(retries)) return false;
+    }
+}
@@ -0,0 +1,130 @@
+/*
+Copyright (c) 2009-2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUCounters_SHARED_SNAPSHOT_H
+#define CPUCounters_SHARED_SNAPSHOT_H
+
+/*!     \file shared_snapshot.h
+        \brief Publishing of counter snapshots in POSIX shared memory
+
+        One process (pcm-daemon.x) owns the PMU and publishes every snapshot into a ring of slots in a
+        shared memory segment. Each slot is protected by a sequence counter (seqlock), readers in other
+        processes map the segment read-only and copy the snapshots without any system call and without
+        blocking the publisher.
+
+        The readers do not need a PCM instance: the system-wide core and uncore counters are returned
+        as a SocketCounterState, which works with the same metric functions (getIPC, getBytesReadFromMC, ...).
+*/
+
+#ifndef _MSC_VER
+
+#include "cpucounters.h"
+#include <string>
+#include <vector>
+
+#define PCM_SHARED_SNAPSHOT_NAME "/pcm-snapshots"
+#define PCM_SHARED_SNAPSHOT_HISTORY (64)
+#define PCM_SHARED_SNAPSHOT_MAX_HISTORY (4096) // the segment size grows with it (one slot per snapshot)
+
+//! \brief Snapshot copied out of the shared memory segment
+struct SharedCounterSnapshot
+{
+    uint64 epoch;           // 1 for the first published snapshot
+    uint64 timestamp;       // CLOCK_MONOTONIC time of the snapshot in nanoseconds
+    SocketCounterState system;      // core and uncore counters of the whole system
+    std::vector<SocketCounterState> sockets;
+    std::vector<CoreCounterState> cores;
+    std::vector<uint64> incomingQPIPackets;             // [socket * links + link]
+    std::vector<uint64> outgoingQPIDataNonDataFlits;    // [socket * links + link]
+    std::vector<uint64> outgoingQPIIdleFlits;           // [socket * links + link]
+};
+
+//! \brief Layout of the segment, shared by the publisher and the readers
+struct SharedSnapshotLayout
+{
+    uint32 numCores, numSockets, qpiLinksPerSocket, historySize;
+    uint64 coresOffset, socketsOffset, systemBasicOffset, systemUncoreOffset, qpiOffset; // within a slot
+    uint64 slotSize;        // bytes per slot, a multiple of the cache line
+    uint64 slotsOffset;     // offset of the first slot in the segment
+    uint64 segmentSize;
+
+    SharedSnapshotLayout(uint32 numCores_, uint32 numSockets_, uint32 qpiLinksPerSocket_, uint32 historySize_);
+};
+
+//! \brief Publishes snapshots into a shared memory segment (one publisher per segment)
+class SharedSnapshotPublisher
+{
+public:
+    /*! \brief Creates the segment, replaces the segment of a publisher that is no longer running
+        \param name POSIX shared memory object name
+        \param historySize number of snapshots kept in the ring
+        \param period sampling period in seconds (informational, for the readers)
+        throws std::exception if the segment can not be created or another publisher is running
+    */
+    SharedSnapshotPublisher(const char * name = PCM_SHARED_SNAPSHOT_NAME, uint32 historySize = PCM_SHARED_SNAPSHOT_HISTORY, double period = 1.);
+    ~SharedSnapshotPublisher(); // unmaps and removes the segment
+
+    //! \brief Copies the snapshot into the next slot of the ring and makes it the latest one
+    void publish(const CounterSnapshot & snapshot);
+
+private:
+    std::string name;
+    SharedSnapshotLayout layout;
+    char * base;
+
+    SharedSnapshotPublisher(SharedSnapshotPublisher &); // forbidden
+};
+
+//! \brief Reads the snapshots of a publisher in another process
+class SharedSnapshotReader
+{
+public:
+    //! throws std::exception if the segment does not exist or was created by an incompatible build
+    SharedSnapshotReader(const char * name = PCM_SHARED_SNAPSHOT_NAME);
+    ~SharedSnapshotReader();
+
+    uint32 getNumCores() const { return layout->numCores; }
+    uint32 getNumSockets() const { return layout->numSockets; }
+    uint32 getQPILinksPerSocket() const { return layout->qpiLinksPerSocket; }
+    uint32 getHistorySize() const { return layout->historySize; }
+    int32 getCPUModel() const;
+    uint64 getNominalFrequency() const;
+    double getPeriod() const;       // sampling period of the publisher in seconds
+    int32 getPublisherPid() const;
+    bool isPublisherAlive() const;
+
+    //! \brief Epoch of the latest published snapshot, 0 if none was published yet
+    uint64 getEpoch() const;
+
+    /*! \brief Copies the snapshot with the given epoch
+        \return false if it was not published yet, was already overwritten in the ring
+                or if the publisher died (or stalls) while writing it
+    */
+    bool read(uint64 epoch, SharedCounterSnapshot & snapshot) const;
+    //! \brief Copies the latest snapshot, false if none was published yet or the publisher died while writing it
+    bool readLatest(SharedCounterSnapshot & snapshot) const;
+
+private:
+    SharedSnapshotLayout * layout;
+    const char * base;
+    uint64 size;
+
+    // waits before the next retry of a read, false if the reader should give up
+    bool backOff(uint32 & retries) const;
+
+    SharedSnapshotReader(SharedSnapshotReader &); // forbidden
+};
+
+#endif // _MSC_VER
+
+#endif
@@ -51,7 +51,10 @@ typedef signed int int32;
 #define IA32_PERFEVTSEL2_ADDR           (IA32_PERFEVTSEL0_ADDR + 2)
 #define IA32_PERFEVTSEL3_ADDR           (IA32_PERFEVTSEL0_ADDR + 3)
 
-#define PERF_MAX_COUNTERS               (7)
+// max number of general purpose core counters supported (8 per core with Intel(r) Hyper-Threading off)
+#define PCM_MAX_CORE_GEN_COUNTERS       (8)
+
+#define PERF_MAX_COUNTERS               (3 + PCM_MAX_CORE_GEN_COUNTERS)
 
 #define IA32_DEBUGCTL                   (0x1D9)
 
@@ -20,6 +20,12 @@ CT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
 #define PCM_UTILS_HEADER
 
 #include <stdio.h>
+#ifndef _MSC_VER
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/time.h>
+#endif
 
 #ifdef _MSC_VER
 BOOL cleanup(DWORD)
@@ -65,7 +71,10 @@ void MySleepMs(int delay_ms)
 #ifdef _MSC_VER
     if(delay_ms) Sleep(delay_ms);
 #else
-    ::sleep(delay_ms/1000);
+    struct timespec req, rem;
+    req.tv_sec = delay_ms / 1000;
+    req.tv_nsec = (delay_ms % 1000) * 1000000L;
+    while (::nanosleep(&req, &rem) == -1 && errno == EINTR) req = rem;
 #endif
 }
 
@@ -78,6 +87,129 @@ void MySleepUs(int delay_us)
 #endif
 }
 
+/*! \brief Periodic sampling on absolute deadlines
+
+    The deadlines are start() + k * period, so the time spent reading and printing the
+    counters does not shift the following samples (as sleeping for the period would).
+    A sample taken after its deadline is counted as missed, the next deadline stays on the grid.
+*/
+class SamplingScheduler
+{
+    uint64 period;          // in ns
+    uint64 deadline;        // next deadline, in ns
+    uint64 lastSample;      // time of the last sample, in ns
+    uint64 interval;        // time between the last two samples, in ns
+    uint64 missed;          // missed deadlines since start()
+    uint64 lastMissed;      // deadlines missed by the last sample
+
+    SamplingScheduler(const SamplingScheduler &); // forbidden
+    SamplingScheduler & operator = (const SamplingScheduler &); // forbidden
+
+    static void sleepUntil(uint64 t)
+    {
+#if defined(__linux__) || defined(__FreeBSD__)
+        struct timespec ts;
+        ts.tv_sec = t / 1000000000ULL;
+        ts.tv_nsec = t % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#elif defined(_MSC_VER)
+        uint64 cur = now();
+        // Sleep() has a granularity of about 1 ms, the rest is waited for in a loop
+        if (t > cur + 2000000ULL) Sleep(DWORD((t - cur) / 1000000ULL - 1));
+        while (now() < t) YieldProcessor();
+#else
+        for (uint64 cur = now(); cur < t; cur = now())
+        {
+            struct timespec ts;
+            ts.tv_sec = (t - cur) / 1000000000ULL;
+            ts.tv_nsec = (t - cur) % 1000000000ULL;
+            ::nanosleep(&ts, NULL);
+        }
+#endif
+    }
+
+public:
+    //! \param period_s sampling period in seconds (e.g. 0.0005 for 500 microseconds)
+    SamplingScheduler(double period_s) : deadline(0), lastSample(0), interval(0), missed(0), lastMissed(0)
+    {
+        period = (period_s > 0) ? uint64(period_s * 1e9 + 0.5) : 0;
+        if (period == 0) period = 1;
+    }
+
+    //! \brief Current time of the monotonic clock in ns
+    static uint64 now()
+    {
+#ifdef _MSC_VER
+        LARGE_INTEGER freq, count;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&count);
+        return uint64(double(count.QuadPart) * 1e9 / double(freq.QuadPart));
+#elif defined(__APPLE__)
+        struct timeval tp;
+        gettimeofday(&tp, NULL);
+        return uint64(tp.tv_sec) * 1000000000ULL + uint64(tp.tv_usec) * 1000ULL;
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64(ts.tv_sec) * 1000000000ULL + uint64(ts.tv_nsec);
+#endif
+    }
+
+    //! \brief Sets the time of the first sample (now), the first deadline is one period later
+    void start()
+    {
+        lastSample = now();
+        deadline = lastSample + period;
+        interval = 0;
+        missed = 0;
+        lastMissed = 0;
+    }
+
+    //! \brief Waits for the next deadline (returns immediately if it has passed already)
+    void wait()
+    {
+        if (deadline == 0) start();
+        uint64 t = now();
+        lastMissed = 0;
+        if (t < deadline)
+        {
+            sleepUntil(deadline);
+            t = now();
+            deadline += period;
+        }
+        else
+        {
+            // late: sample right now and continue with the first deadline in the future
+            const uint64 late = (t - deadline) / period + 1;
+            lastMissed = late;
+            missed += late;
+            deadline += late * period;
+        }
+        interval = t - lastSample;
+        lastSample = t;
+    }
+
+    uint64 getPeriodNs() const { return period; }
+    //! \brief Time between the last two samples in ns
+    uint64 getIntervalNs() const { return interval; }
+    //! \brief Number of deadlines missed by the last sample
+    uint64 getLastMissedDeadlines() const { return lastMissed; }
+    //! \brief Number of deadlines missed since start()
+    uint64 getMissedDeadlines() const { return missed; }
+
+    //! \brief Prints the actual and the requested interval of the last sample and the missed deadlines
+    void report(std::ostream & out) const
+    {
+        const std::streamsize p = out.precision(3);
+        const std::ios::fmtflags f = out.setf(std::ios::fixed, std::ios::floatfield);
+        out << "Sample interval: " << double(interval) / 1e6 << " ms (requested " << double(period) / 1e6 << " ms)";
+        if (lastMissed) out << "; missed " << lastMissed << " deadline(s), " << missed << " in total";
+        out << "\n";
+        out.precision(p);
+        out.setf(f, std::ios::floatfield);
+    }
+};
+
 int MySystem(char * sysCmd)
 {
     std::cout << "\n Executing \"";
@@ -32,6 +32,12 @@ DWORD WINAPI WatchDogProc(LPVOID state);
 void * WatchDogProc(void * state);
 #endif
 
+/*! \brief Extends a 32-bit counter to 64 bits
+
+    One watchdog thread (WatchDogProc) serves all extenders: it reads every registered counter often enough
+    that the counter can not wrap twice between two reads (a quarter of the wrap time at the maximum rate).
+    Only the watchdog writes the extended value, read() is wait-free: an atomic 64-bit load plus the raw read.
+*/
 class CounterWidthExtender
 {
 public:
@@ -43,15 +49,29 @@ public:
 
    struct MsrHandleCounter : public AbstractRawCounter
    {
-      MsrHandle * msr;
+      MsrHandle * volatile msr; // replaced by setMsr while the watchdog may read the counter
       uint64 msr_addr;
       MsrHandleCounter(MsrHandle * msr_, uint64 msr_addr_): msr(msr_), msr_addr(msr_addr_) {}
       uint64 operator() ()
       {
          uint64 value = 0;
-         msr->read(msr_addr,&value);
+#ifdef _MSC_VER
+         MsrHandle * handle = msr; // aligned pointer loads are atomic, volatile reads have acquire semantics
+#else
+         MsrHandle * handle = __atomic_load_n(&msr, __ATOMIC_ACQUIRE);
+#endif
+         handle->read(msr_addr,&value);
          return value;
       } 
+      //! \brief Reads the counter through another handle (e.g. another core of the same package)
+      void setMsr(MsrHandle * msr_)
+      {
+#ifdef _MSC_VER
+         InterlockedExchangePointer((PVOID volatile *)&msr, msr_);
+#else
+         __atomic_store_n(&msr, msr_, __ATOMIC_RELEASE);
+#endif
+      }
    };
 
    struct ClientImcReadsCounter : public AbstractRawCounter
@@ -69,84 +89,90 @@ public:
    };
 
 private:
-
 #ifdef _MSC_VER
-	HANDLE UpdateThread;
-	HANDLE CounterMutex;
+    friend DWORD WINAPI WatchDogProc(LPVOID state);
 #else
-    pthread_t UpdateThread;
-    pthread_mutex_t CounterMutex;
+    friend void * WatchDogProc(void * state);
 #endif
 
     AbstractRawCounter * raw_counter;
-    uint64 extended_value;
-    uint64 last_raw_value;
+    // the low 32 bits are always the last raw value seen by the watchdog, written only by the watchdog
+    volatile uint64 extended_value;
+    uint64 update_period_ms;    // watchdog period of this counter
+    uint64 next_update_ms;      // accessed by the watchdog (under its mutex) only
 
     CounterWidthExtender(); // forbidden
     CounterWidthExtender(CounterWidthExtender&); // forbidden
 
-    uint64 internal_read()
+    static void registerCounter(CounterWidthExtender * ext);
+    static void unregisterCounter(CounterWidthExtender * ext);
+
+    uint64 loadExtended() const
     {
-		if (this==NULL) return 0; // to make security check happy
-		uint64 result = 0, new_raw_value = 0;
-#ifdef _MSC_VER
-	 WaitForSingleObject(CounterMutex,INFINITE);
+#if defined(_MSC_VER) && !defined(_M_X64)
+        return (uint64)InterlockedCompareExchange64((volatile LONGLONG *)&extended_value, 0, 0);
+#elif defined(_MSC_VER)
+        return extended_value; // aligned 64-bit loads are atomic on x64, volatile reads have acquire semantics
 #else
-	 pthread_mutex_lock(&CounterMutex);
+        return __atomic_load_n(&extended_value, __ATOMIC_ACQUIRE);
 #endif
-         new_raw_value = (*raw_counter)();
-	 if(new_raw_value < last_raw_value)
-         {
-                extended_value += ((1ULL<<32ULL)-last_raw_value) + new_raw_value;
-         }
-	 else
-	 {
-		extended_value += (new_raw_value-last_raw_value);
-         }
-
-         last_raw_value = new_raw_value;
-
-         result = extended_value;	
+    }
+
+    void storeExtended(uint64 value)
+    {
 #ifdef _MSC_VER
-	 ReleaseMutex(CounterMutex);
+        InterlockedExchange64((volatile LONGLONG *)&extended_value, (LONGLONG)value);
 #else
-	 pthread_mutex_unlock(&CounterMutex);
+        __atomic_store_n(&extended_value, value, __ATOMIC_RELEASE);
 #endif
-         return result;
     }
 
-public:
-    CounterWidthExtender(AbstractRawCounter * raw_counter_): raw_counter(raw_counter_) 
+    // extended value at the time of the raw read, correct while the counter did not wrap twice since the last update
+    uint64 internal_read()
     {
-        last_raw_value = (*raw_counter)();
-        extended_value = last_raw_value;
+        if (this==NULL) return 0; // to make security check happy
+        const uint64 last = loadExtended(); // load before the raw read: the raw value is never older
+        const uint64 new_raw_value = (*raw_counter)();
+        return last + ((new_raw_value - last) & 0xffffffffULL);
+    }
 
-#ifdef _MSC_VER
-		CounterMutex = CreateMutex(NULL,FALSE,NULL);
-		UpdateThread = CreateThread(NULL,0,(LPTHREAD_START_ROUTINE)WatchDogProc,this,0,NULL);
-#else
-        pthread_mutex_init(&CounterMutex, NULL);
-        pthread_create(&UpdateThread, NULL, WatchDogProc, this);
-#endif
+    // called by the watchdog only
+    void update()
+    {
+        storeExtended(internal_read());
+    }
+
+public:
+    /*! \brief Starts extending the counter
+        \param raw_counter_ 32-bit counter (deleted by the extender)
+        \param maxIncrementsPerSecond maximum rate of the counter (e.g. maximum power / energy unit),
+               0 if unknown: the counter is then extended every 10 seconds
+    */
+    CounterWidthExtender(AbstractRawCounter * raw_counter_, double maxIncrementsPerSecond = 0.): raw_counter(raw_counter_) 
+    {
+        extended_value = (*raw_counter)() & 0xffffffffULL;
+        update_period_ms = 10000;
+        if (maxIncrementsPerSecond > 0.)
+        {
+            const double period_ms = 1000. * 4294967296. / maxIncrementsPerSecond / 4.;
+            update_period_ms = (period_ms < 10.) ? 10 : ((period_ms > 3600000.) ? 3600000 : (uint64)period_ms);
+        }
+        next_update_ms = 0;
+        registerCounter(this);
     }
     ~CounterWidthExtender()
     {
-#ifdef _MSC_VER
-		TerminateThread(UpdateThread,0);
-		CloseHandle(UpdateThread);
-		CloseHandle(CounterMutex);
-#else
-        pthread_cancel(UpdateThread);
-        pthread_mutex_destroy(&CounterMutex);
-#endif
+        unregisterCounter(this);
         if(raw_counter) delete raw_counter;
     }
     
     uint64 read() // read extended value
     {
-	return internal_read();
+        return internal_read();
     }
-};
 
+    uint64 getUpdatePeriodMs() const { return update_period_ms; }
+    AbstractRawCounter * getRawCounter() { return raw_counter; }
+};
 
 #endif
@@ -60,7 +60,7 @@ namespace Diagnostics.Tracing
                 while ((text = reader.ReadLine()) != null)
                 {
                     // Parse one line
-                    if (text.StartsWith("BEGIN"))
+                    if (text.StartsWith("BEGIN") || text.StartsWith("CLOCK"))
                         continue;
                     var line = text.Split(';');
                     if (line.Length < 3)